@@ -0,0 +1,225 @@
+#include "Autotune.h"
+#include "Benchmark.h"
+#include "cl_helper.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <unordered_map>
+#include <algorithm>
+#include <math.h>
+#include <ctype.h>
+#include <string.h>
+
+bool autotuneEnabled = true;
+
+// Work-group shapes tried for both kernels. 0x0 is the driver's choice, which is what the kernels used before tuning.
+const autotune::LocalSize autotuneLocalSizes[] = {
+	{ 0, 0 }, { 8, 8 }, { 16, 4 }, { 4, 16 }, { 32, 2 }, { 2, 32 }, { 64, 1 }, { 16, 8 }, { 8, 16 }, { 32, 4 }, { 16, 16 }, { 32, 8 }
+};
+
+// No flags, mad, mad with finite maths, mad with unsafe and finite maths, and fast relaxed maths (which implies the others)
+const cl_uint autotuneMathFlagSets[] = { 0, 1, 1 | 4, 1 | 2 | 4, 8 };
+
+std::string _autotune_deviceString(cl_device_info info) {
+	size_t size = 0;
+	clGetDeviceInfo(cl::device, info, 0, NULL, &size);
+	std::string value(size, '\0');
+	if (size > 0) clGetDeviceInfo(cl::device, info, size, &value[0], NULL);
+	value.erase(std::find(value.begin(), value.end(), '\0'), value.end());
+	return value;
+}
+
+// FNV-1a 64 of the build options without the maths flags the tuner chooses
+cl_ulong _autotune_buildKey() {
+	std::string options = cl::getBuildOptions();
+	for (const char* flag : AUTOTUNE_MATH_OPTIONS) {
+		size_t position;
+		while ((position = options.find(flag)) != std::string::npos) options.erase(position, strlen(flag));
+	}
+	cl_ulong hash = 14695981039346656037ULL;
+	for (char c : options) {
+		hash ^= (unsigned char)c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+std::string _autotune_localSizeString(const autotune::LocalSize& size) {
+	if (size.x == 0) return "driver";
+	return std::to_string(size.x) + "x" + std::to_string(size.y);
+}
+
+// Throws std::exception for a value that isn't a number
+autotune::LocalSize _autotune_parseLocalSize(const std::string& value) {
+	autotune::LocalSize size = { 0, 0 };
+	size_t separator = value.find('x');
+	if (separator == std::string::npos) return size;
+	size.x = std::stoul(value.substr(0, separator));
+	size.y = std::stoul(value.substr(separator + 1));
+	return size;
+}
+
+std::string _autotune_mathFlagsString(cl_uint flags) {
+	const char* names[] = AUTOTUNE_MATH_FLAGS;
+	std::string out;
+	for (int i = 0; i < AUTOTUNE_MATH_FLAG_COUNT; ++i) {
+		if (flags & (1 << i)) out += (out.empty() ? "" : "+") + std::string(names[i]);
+	}
+	return out.empty() ? "none" : out;
+}
+
+// Median frame time after the warm-up frames, negative if a frame failed
+double _autotune_time(std::function<double()>& renderFrame, int frames) {
+	std::vector<double> samples;
+	for (int i = 0; i < AUTOTUNE_WARMUP_FRAMES + frames; ++i) {
+		double ms = renderFrame();
+		if (ms < 0.0) return -1.0;
+		if (i >= AUTOTUNE_WARMUP_FRAMES) samples.push_back(ms);
+	}
+	return benchmark::summarise(samples).median;
+}
+
+// Times every shape that fits kernel and leaves it on the fastest. Returns its frame time, negative if no shape ran.
+double _autotune_tuneKernel(CLKernel* kernel, std::function<double()>& renderFrame, int frames, const std::string& label, autotune::LocalSize* best) {
+	double bestMs = -1.0;
+	for (const autotune::LocalSize& size : autotuneLocalSizes) {
+		if (!kernel->fitsLocalSize(size.x, size.y)) continue;
+		kernel->setLocalSize(size.x, size.y);
+		double ms = _autotune_time(renderFrame, frames);
+		std::cout << std::setw(40) << label + " " + kernel->getKernelName() + " " + _autotune_localSizeString(size) << ": ";
+		if (ms < 0.0) {
+			std::cout << "failed" << std::endl;
+			continue;
+		}
+		std::cout << ms << "ms" << std::endl;
+		if (bestMs < 0.0 || ms < bestMs) {
+			bestMs = ms;
+			*best = size;
+		}
+	}
+	kernel->setLocalSize(best->x, best->y);
+	return bestMs;
+}
+
+namespace autotune {
+
+	void setEnabled(bool enabled) {
+		autotuneEnabled = enabled;
+	}
+
+	bool isEnabled() {
+		return autotuneEnabled;
+	}
+
+	std::string getPath() {
+		std::string name = _autotune_deviceString(CL_DEVICE_NAME) + "_" + _autotune_deviceString(CL_DRIVER_VERSION);
+		for (char& c : name) {
+			if (!isalnum((unsigned char)c) && c != '.') c = '_';
+		}
+		std::ostringstream build;
+		build << std::hex << std::setw(16) << std::setfill('0') << _autotune_buildKey();
+		return TUNING_FILE_PREFIX + name + "_" + build.str() + TUNING_FILE_EXTENSION;
+	}
+
+	bool load(Tuning* tuning) {
+		std::unordered_map<std::string, std::string> values;
+		loadConfigFromFile(getPath(), values);
+		if (values.empty()) return false;
+
+		// A hand-edited or truncated file is ignored rather than stopping every startup
+		try {
+			tuning->trace = _autotune_parseLocalSize(values["traceLocalSize"]);
+			tuning->resolve = _autotune_parseLocalSize(values["resolveLocalSize"]);
+			tuning->frameMs = values.count("frameMs") ? std::stod(values["frameMs"]) : 0.0;
+		} catch (const std::exception&) {
+			std::cout << "Ignoring tuning file " << getPath() << ", it has an invalid value." << std::endl;
+			return false;
+		}
+
+		const char* names[] = AUTOTUNE_MATH_FLAGS;
+		tuning->mathFlags = 0;
+		for (int i = 0; i < AUTOTUNE_MATH_FLAG_COUNT; ++i) {
+			if (values[names[i]] == "true") tuning->mathFlags |= 1 << i;
+		}
+		touchCacheFile(TUNING_INDEX, getPath(), TUNING_MAX_FILES);
+		return true;
+	}
+
+	bool save(const Tuning& tuning, const std::string& scene) {
+		const std::string path = getPath();
+		std::ofstream file(path);
+		if (!file) {
+			std::cout << "Could not open " << path << " for writing." << std::endl;
+			return false;
+		}
+
+		const char* names[] = AUTOTUNE_MATH_FLAGS;
+		file << "# Written by --autotune for " << _autotune_deviceString(CL_DEVICE_NAME) << " (driver " << _autotune_deviceString(CL_DRIVER_VERSION) << ") on scene " << scene << std::endl;
+		file << "traceLocalSize=" << tuning.trace.x << "x" << tuning.trace.y << std::endl;
+		file << "resolveLocalSize=" << tuning.resolve.x << "x" << tuning.resolve.y << std::endl;
+		for (int i = 0; i < AUTOTUNE_MATH_FLAG_COUNT; ++i) {
+			file << names[i] << "=" << ((tuning.mathFlags & (1 << i)) ? "true" : "false") << std::endl;
+		}
+		file << "frameMs=" << tuning.frameMs << std::endl;
+
+		std::cout << "Wrote tuning file " << path << std::endl;
+		touchCacheFile(TUNING_INDEX, path, TUNING_MAX_FILES);
+		return true;
+	}
+
+	void setMathFlags(cl_uint flags) {
+		const char* names[] = AUTOTUNE_MATH_FLAGS;
+		for (int i = 0; i < AUTOTUNE_MATH_FLAG_COUNT; ++i) {
+			cl::config[names[i]] = (flags & (1 << i)) ? "true" : "false";
+		}
+	}
+
+	bool run(const std::vector<std::string>& sources, CLKernel* trace, CLKernel* resolve, std::function<double()> renderFrame, int frames, Tuning* best) {
+		const char* names[] = AUTOTUNE_MATH_FLAGS;
+
+		// The hand-set flags of config.ini are tried too, and put back afterwards
+		std::vector<cl_uint> flagSets(std::begin(autotuneMathFlagSets), std::end(autotuneMathFlagSets));
+		cl_uint configFlags = 0;
+		for (int i = 0; i < AUTOTUNE_MATH_FLAG_COUNT; ++i) {
+			if (cl::getConfigBool(names[i])) configFlags |= 1 << i;
+		}
+		if (std::find(flagSets.begin(), flagSets.end(), configFlags) == flagSets.end()) flagSets.push_back(configFlags);
+
+		bool found = false;
+		for (cl_uint flags : flagSets) {
+			const std::string label = _autotune_mathFlagsString(flags);
+			setMathFlags(flags);
+
+			bool cached;
+			std::string error;
+			cl_program program = cl::buildProgram(sources, cl::getBuildOptions(), &cached, &error);
+			if (program == nullptr) {
+				std::cout << "Could not build the kernels with " << label << ", skipping: " << error << std::endl;
+				continue;
+			}
+			// The kernels keep the program alive
+			bool created = trace->setProgram(program) && resolve->setProgram(program);
+			clReleaseProgram(program);
+			if (!created) continue;
+
+			Tuning tuning = { { 0, 0 }, { 0, 0 }, flags, 0.0 };
+			resolve->setLocalSize(0, 0);
+			if (_autotune_tuneKernel(trace, renderFrame, frames, label, &tuning.trace) < 0.0) continue;
+			tuning.frameMs = _autotune_tuneKernel(resolve, renderFrame, frames, label, &tuning.resolve);
+			if (tuning.frameMs < 0.0) continue;
+
+			if (!found || tuning.frameMs < best->frameMs) *best = tuning;
+			found = true;
+		}
+		setMathFlags(configFlags);
+
+		if (!found) {
+			std::cout << "No configuration could be timed." << std::endl;
+			return false;
+		}
+		std::cout << "Fastest: " << _autotune_mathFlagsString(best->mathFlags) << ", " << trace->getKernelName() << " " << _autotune_localSizeString(best->trace)
+			<< ", " << resolve->getKernelName() << " " << _autotune_localSizeString(best->resolve) << " at " << best->frameMs << "ms per frame" << std::endl;
+		return true;
+	}
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include "CLKernel.h"
+
+#define TUNING_FILE_PREFIX ("tuning_")
+#define TUNING_FILE_EXTENSION (".ini")
+// Tuning files kept, one per device, driver and build. The least recently used are deleted beyond it.
+#define TUNING_MAX_FILES (16)
+#define TUNING_INDEX ("tuning_index.txt")
+#define AUTOTUNE_FRAMES (10)
+#define AUTOTUNE_WARMUP_FRAMES (2)
+
+// Maths build flags the tuner switches, as config.ini keys. A Tuning's mathFlags has bit i set when AUTOTUNE_MATH_FLAGS[i] is enabled.
+#define AUTOTUNE_MATH_FLAG_COUNT (4)
+#define AUTOTUNE_MATH_FLAGS { "enableMad", "enableUnsafeMaths", "finiteMathsOnly", "fastRelaxedMaths" }
+// The build options those keys add, left out of the tuning file's build key
+#define AUTOTUNE_MATH_OPTIONS { "-cl-mad-enable ", "-cl-unsafe-math-optimizations ", "-cl-finite-math-only ", "-cl-fast-relaxed-math " }
+
+/**
+	Auto-tuner for the work-group shapes of RARTrace and ResolveImage and the maths build flags.
+	For each flag combination the program is built (through the program cache) and every work-group shape that fits the kernel is timed over whole frames,
+	first for the trace with the driver's choice for the resolve and then for the resolve with the winning trace shape.
+	The fastest combination is written to a tuning file per device and build, tuning_<device>_<driver>_<build>.ini, which normal startup loads in place of the config.ini flags.
+	The build part hashes the build options other than the maths flags, so a scene, --stage-local or --morton-dispatch that changes the kernels needs its own tuning.
+	The shapes are timed on the generic kernels. CLKernel drops a shape that doesn't fit the scene-specialised kernels once they are swapped in.
+	Tiles are enqueued with a global offset and size that need not be multiples of the shape, which OpenCL 2.0 allows.
+*/
+namespace autotune {
+
+	struct LocalSize {
+		size_t x, y; // 0 lets the driver choose
+	};
+
+	struct Tuning {
+		LocalSize trace;
+		LocalSize resolve;
+		cl_uint mathFlags;
+		double frameMs; // Median of the winning configuration
+	};
+
+	// Enabled by default. Disabled by --no-tuning or disableTuning in config.ini.
+	void setEnabled(bool enabled);
+	bool isEnabled();
+
+	// The tuning file of the selected device and the current build options
+	std::string getPath();
+
+	// Reads the tuning file of the device. Returns false if there is none.
+	bool load(Tuning* tuning);
+
+	bool save(const Tuning& tuning, const std::string& scene);
+
+	// Sets the maths flag keys of cl::config, which getBuildOptions reads
+	void setMathFlags(cl_uint flags);
+
+	/**
+		Runs the tuner. renderFrame renders and waits for one frame with the current kernels and returns its milliseconds, or a negative value if it failed.
+		trace and resolve are left on the program of the last combination tried, so the caller should exit or rebuild afterwards.
+	*/
+	bool run(const std::vector<std::string>& sources, CLKernel* trace, CLKernel* resolve, std::function<double()> renderFrame, int frames, Tuning* best);
+
+}
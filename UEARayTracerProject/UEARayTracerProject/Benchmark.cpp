@@ -0,0 +1,303 @@
+#include "Benchmark.h"
+#include "cl_helper.h"
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+struct SweepConfig {
+	std::string backend;
+	int spheres;
+	std::string material;
+	int triangles;
+	int gridDepth;
+	int bounces;
+	int width, height;
+	bool stageLocal;
+	bool mortonDispatch;
+};
+
+std::string _benchmark_trim(std::string value) {
+	value.erase(0, value.find_first_not_of(" \t"));
+	value.erase(value.find_last_not_of(" \t\r") + 1);
+	return value;
+}
+
+std::vector<std::string> _benchmark_split(const std::string& value) {
+	std::vector<std::string> out;
+	std::istringstream stream(value);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		item = _benchmark_trim(item);
+		if (!item.empty()) out.push_back(item);
+	}
+	return out;
+}
+
+std::vector<std::string> _benchmark_getList(std::unordered_map<std::string, std::string>& sweep, const std::string& key, const std::string& defaultValue) {
+	std::vector<std::string> values = _benchmark_split(sweep.count(key) ? sweep[key] : defaultValue);
+	if (values.empty()) values.push_back(defaultValue);
+	return values;
+}
+
+// Nearest-rank percentile of sorted samples
+double _benchmark_percentile(const std::vector<double>& sorted, double percentile) {
+	size_t rank = (size_t)ceil(percentile / 100.0 * sorted.size());
+	return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+}
+
+std::string _benchmark_summaryCSV(const benchmark::Summary& s) {
+	std::ostringstream out;
+	if (s.count == 0) return ",,,,,";
+	out << s.mean << "," << s.median << "," << s.p95 << "," << s.p99 << "," << s.min << "," << s.max;
+	return out.str();
+}
+
+// Quoted JSON string with quotes, backslashes and control characters escaped
+std::string _benchmark_jsonString(const std::string& value) {
+	std::ostringstream out;
+	out << "\"";
+	for (char c : value) {
+		if (c == '"' || c == '\\') out << '\\' << c;
+		else if ((unsigned char)c < 0x20) out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec << std::setfill(' ');
+		else out << c;
+	}
+	out << "\"";
+	return out.str();
+}
+
+std::string _benchmark_summaryJSON(const benchmark::Summary& s) {
+	std::ostringstream out;
+	if (s.count == 0) return "null";
+	out << "{\"count\": " << s.count << ", \"mean\": " << s.mean << ", \"median\": " << s.median << ", \"p95\": " << s.p95 << ", \"p99\": " << s.p99
+		<< ", \"min\": " << s.min << ", \"max\": " << s.max << "}";
+	return out.str();
+}
+
+// The kernel report is already a JSON array, so it is embedded as is. The CPU backend doesn't write one.
+std::string _benchmark_readKernelReport(const std::string& path) {
+	std::ifstream file(path);
+	if (!file) return "null";
+	std::string report, line;
+	while (std::getline(file, line)) report += _benchmark_trim(line);
+	return report.empty() ? "null" : report;
+}
+
+std::string _benchmark_buildCommand(const std::string& executable, const SweepConfig& c, int warmup, int repetitions, const std::string& statsPath, const std::string& kernelReportPath, const std::string& extraArgs) {
+	std::ostringstream command;
+	command << "\"" << executable << "\" --headless"
+		<< " --backend " << c.backend
+		<< " --scene sweep"
+		<< " --spheres " << c.spheres
+		<< " --material " << c.material
+		<< " --triangles " << c.triangles
+		<< " --grid-depth " << c.gridDepth
+		<< " --bounces " << c.bounces
+		<< " --width " << c.width
+		<< " --height " << c.height
+		<< " --frames " << warmup + repetitions
+		<< " --warmup " << warmup
+		<< " --stats \"" << statsPath << "\"";
+	if (c.backend == "cl") command << " --kernel-report \"" << kernelReportPath << "\"";
+	if (c.backend == "cl" && c.stageLocal) command << " --stage-local";
+	if (c.backend == "cl" && c.mortonDispatch) command << " --morton-dispatch";
+	if (!extraArgs.empty()) command << " " << extraArgs;
+#ifdef _WIN32
+	// cmd.exe strips the outer quotes of a command line that starts with a quote
+	return "\"" + command.str() + "\"";
+#else
+	return command.str();
+#endif
+}
+
+namespace benchmark {
+
+	Summary summarise(std::vector<double> samples) {
+		Summary s = {};
+		s.count = samples.size();
+		if (samples.empty()) return s;
+
+		std::sort(samples.begin(), samples.end());
+		s.mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+		size_t mid = samples.size() / 2;
+		s.median = samples.size() % 2 ? samples[mid] : (samples[mid - 1] + samples[mid]) * 0.5;
+		s.p95 = _benchmark_percentile(samples, 95.0);
+		s.p99 = _benchmark_percentile(samples, 99.0);
+		s.min = samples.front();
+		s.max = samples.back();
+		return s;
+	}
+
+	bool writeFrameTimes(const std::string& path, const FrameTimes& times) {
+		std::ofstream file(path);
+		if (!file) {
+			std::cout << "Could not open " << path << " for writing." << std::endl;
+			return false;
+		}
+		file << "frame_ms,trace_ms,image_ms" << std::endl;
+		for (size_t i = 0; i < times.frame.size(); ++i) {
+			file << times.frame[i] << ",";
+			if (i < times.trace.size()) file << times.trace[i];
+			file << ",";
+			if (i < times.image.size()) file << times.image[i];
+			file << std::endl;
+		}
+		return true;
+	}
+
+	bool readFrameTimes(const std::string& path, FrameTimes* times) {
+		std::ifstream file(path);
+		if (!file) return false;
+
+		std::string line;
+		std::getline(file, line); // Header
+		while (std::getline(file, line)) {
+			std::vector<std::string> fields;
+			std::istringstream stream(line);
+			std::string field;
+			while (std::getline(stream, field, ',')) fields.push_back(field);
+			fields.resize(3);
+
+			if (fields[0].empty()) continue;
+			try {
+				times->frame.push_back(std::stod(fields[0]));
+				if (!fields[1].empty()) times->trace.push_back(std::stod(fields[1]));
+				if (!fields[2].empty()) times->image.push_back(std::stod(fields[2]));
+			} catch (const std::exception&) {
+				std::cout << "Invalid frame time in " << path << std::endl;
+				return false;
+			}
+		}
+		return !times->frame.empty();
+	}
+
+	bool runSweep(const std::string& executable, const std::string& sweepFile) {
+		std::unordered_map<std::string, std::string> sweep;
+		loadConfigFromFile(sweepFile, sweep);
+		if (sweep.empty()) {
+			std::cout << "Could not read sweep file " << sweepFile << std::endl;
+			return false;
+		}
+
+		const std::vector<std::string> backends = _benchmark_getList(sweep, "backend", "cl");
+		const std::vector<std::string> spheres = _benchmark_getList(sweep, "spheres", "300");
+		const std::vector<std::string> materials = _benchmark_getList(sweep, "material", "refractive");
+		const std::vector<std::string> triangles = _benchmark_getList(sweep, "triangles", "0");
+		const std::vector<std::string> gridDepths = _benchmark_getList(sweep, "gridDepth", "4");
+		const std::vector<std::string> bounces = _benchmark_getList(sweep, "bounces", "2");
+		const std::vector<std::string> resolutions = _benchmark_getList(sweep, "resolution", "1280x720");
+		const std::vector<std::string> stageLocals = _benchmark_getList(sweep, "stageLocal", "off");
+		const std::vector<std::string> dispatches = _benchmark_getList(sweep, "dispatch", "rows");
+		int warmup = 0;
+		int repetitions = 0;
+		const std::string output = _benchmark_getList(sweep, "output", "benchmark_results")[0];
+		const std::string extraArgs = _benchmark_trim(sweep.count("extraArgs") ? sweep["extraArgs"] : "");
+		const std::string statsPath = output + "_frames.csv";
+		const std::string kernelReportPath = output + "_kernels.json";
+
+		// Expand the cartesian product of every parameter list
+		std::vector<SweepConfig> configs;
+		try {
+			warmup = std::stoi(_benchmark_getList(sweep, "warmup", "10")[0]);
+			repetitions = std::stoi(_benchmark_getList(sweep, "repetitions", "100")[0]);
+			for (auto& backend : backends)
+				for (auto& resolution : resolutions)
+					for (auto& bounce : bounces)
+						for (auto& gridDepth : gridDepths)
+							for (auto& triangleCount : triangles)
+								for (auto& material : materials)
+									for (auto& sphereCount : spheres)
+										for (auto& stageLocal : stageLocals)
+											for (auto& dispatch : dispatches) {
+												// Local staging and Morton dispatch only change the OpenCL kernels, so the CPU runs would be duplicates
+												if (backend == "cpu" && (stageLocal == "on" || dispatch == "morton")) continue;
+												SweepConfig c;
+												c.backend = backend;
+												c.spheres = std::stoi(sphereCount);
+												c.material = material;
+												c.triangles = std::stoi(triangleCount);
+												c.gridDepth = std::stoi(gridDepth);
+												c.bounces = std::stoi(bounce);
+												c.stageLocal = stageLocal == "on";
+												c.mortonDispatch = dispatch == "morton";
+												const size_t separator = resolution.find('x');
+												if (separator == std::string::npos) {
+													std::cout << "Invalid resolution in sweep: " << resolution << std::endl;
+													return false;
+												}
+												c.width = std::stoi(resolution.substr(0, separator));
+												c.height = std::stoi(resolution.substr(separator + 1));
+												configs.push_back(c);
+											}
+		} catch (const std::exception&) {
+			std::cout << "Invalid number in sweep file " << sweepFile << std::endl;
+			return false;
+		}
+
+		std::cout << "Benchmark sweep: " << configs.size() << " configurations, " << warmup << " warm-up frames and " << repetitions << " measured frames each." << std::endl;
+
+		std::ofstream csv(output + ".csv");
+		if (!csv) {
+			std::cout << "Could not open " << output << ".csv for writing." << std::endl;
+			return false;
+		}
+		csv << std::setprecision(6);
+		csv << "backend,spheres,material,triangles,grid_depth,bounces,width,height,stage_local,dispatch,warmup,repetitions,status";
+		for (const char* series : { "frame", "trace", "image" }) {
+			for (const char* stat : { "mean", "median", "p95", "p99", "min", "max" }) {
+				csv << "," << series << "_" << stat << "_ms";
+			}
+		}
+		csv << std::endl;
+
+		std::ostringstream json;
+		json << std::setprecision(6);
+		json << "{" << std::endl << "\t\"warmup\": " << warmup << "," << std::endl << "\t\"repetitions\": " << repetitions << "," << std::endl << "\t\"results\": [" << std::endl;
+
+		int failures = 0;
+		for (size_t i = 0; i < configs.size(); ++i) {
+			const SweepConfig& c = configs[i];
+			std::cout << "[" << i + 1 << "/" << configs.size() << "] " << c.backend << " spheres=" << c.spheres << " material=" << c.material << " triangles=" << c.triangles
+				<< " gridDepth=" << c.gridDepth << " bounces=" << c.bounces << " " << c.width << "x" << c.height << (c.stageLocal ? " stageLocal" : "") << (c.mortonDispatch ? " morton" : "") << std::endl;
+
+			remove(statsPath.c_str());
+			remove(kernelReportPath.c_str());
+			int exitCode = system(_benchmark_buildCommand(executable, c, warmup, repetitions, statsPath, kernelReportPath, extraArgs).c_str());
+
+			FrameTimes times;
+			bool ok = exitCode == 0 && readFrameTimes(statsPath, &times);
+			if (!ok) {
+				std::cout << "Configuration failed (exit code " << exitCode << ")." << std::endl;
+				failures++;
+			}
+
+			Summary frame = summarise(times.frame), trace = summarise(times.trace), image = summarise(times.image);
+			if (ok) std::cout << "\tframe median " << frame.median << "ms, p95 " << frame.p95 << "ms, p99 " << frame.p99 << "ms" << std::endl;
+
+			csv << c.backend << "," << c.spheres << "," << c.material << "," << c.triangles << "," << c.gridDepth << "," << c.bounces << "," << c.width << "," << c.height << "," << (c.stageLocal ? "on" : "off") << "," << (c.mortonDispatch ? "morton" : "rows") << ","
+				<< warmup << "," << repetitions << "," << (ok ? "ok" : "failed") << ","
+				<< _benchmark_summaryCSV(frame) << "," << _benchmark_summaryCSV(trace) << "," << _benchmark_summaryCSV(image) << std::endl;
+
+			json << "\t\t{\"backend\": " << _benchmark_jsonString(c.backend) << ", \"spheres\": " << c.spheres << ", \"material\": " << _benchmark_jsonString(c.material) << ", \"triangles\": " << c.triangles
+				<< ", \"gridDepth\": " << c.gridDepth << ", \"bounces\": " << c.bounces << ", \"width\": " << c.width << ", \"height\": " << c.height << ", \"stageLocal\": " << (c.stageLocal ? "true" : "false") << ", \"dispatch\": \"" << (c.mortonDispatch ? "morton" : "rows") << "\""
+				<< ", \"status\": \"" << (ok ? "ok" : "failed") << "\", \"frame\": " << _benchmark_summaryJSON(frame) << ", \"trace\": " << _benchmark_summaryJSON(trace)
+				<< ", \"image\": " << _benchmark_summaryJSON(image) << ", \"kernels\": " << _benchmark_readKernelReport(kernelReportPath) << "}" << (i + 1 < configs.size() ? "," : "") << std::endl;
+		}
+		remove(statsPath.c_str());
+		remove(kernelReportPath.c_str());
+
+		json << "\t]" << std::endl << "}" << std::endl;
+		std::ofstream jsonFile(output + ".json");
+		jsonFile << json.str();
+
+		std::cout << "Wrote " << output << ".csv and " << output << ".json (" << failures << " failed configurations)." << std::endl;
+		return failures == 0;
+	}
+
+}
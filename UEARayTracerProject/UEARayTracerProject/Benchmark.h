@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#define BENCHMARK_SWEEP_FILE ("benchmark.ini")
+
+namespace benchmark {
+
+	// Per-frame timings in milliseconds. trace and image stay empty for the CPU backend as it doesn't split the frame.
+	struct FrameTimes {
+		std::vector<double> frame;
+		std::vector<double> trace;
+		std::vector<double> image;
+	};
+
+	struct Summary {
+		size_t count;
+		double mean;
+		double median;
+		double p95;
+		double p99;
+		double min;
+		double max;
+	};
+
+	Summary summarise(std::vector<double> samples);
+
+	bool writeFrameTimes(const std::string& path, const FrameTimes& times);
+
+	bool readFrameTimes(const std::string& path, FrameTimes* times);
+
+	/**
+		Runs every combination of the parameter lists declared in a sweep file (same key=value format as config.ini).
+		Each configuration runs in a fresh headless process of executable, as the grid depth is baked into the kernel build and the world can't be rebuilt in place.
+		One row per configuration is written to <output>.csv as it finishes and everything to <output>.json at the end.
+		OpenCL configurations also record the kernel resource report of their build in <output>.json.
+	*/
+	bool runSweep(const std::string& executable, const std::string& sweepFile);
+
+}
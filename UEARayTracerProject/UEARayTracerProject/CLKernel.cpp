@@ -1,19 +1,101 @@
 #include "CLKernel.h"
 #include <iomanip>
+#include <fstream>
+#include <algorithm>
 
 void CLKernel::display_kernel_info() {
 	// Get kernel info
-	size_t workgroup_size, pref_workgroup_multiple;
-	cl_ulong private_mem_size, local_mem_size;
+	size_t workgroup_size = 0, pref_workgroup_multiple = 0;
+	cl_ulong private_mem_size = 0, local_mem_size = 0;
 	clGetKernelWorkGroupInfo(getKernel(), cl::device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
 	clGetKernelWorkGroupInfo(getKernel(), cl::device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(size_t), &pref_workgroup_multiple, NULL);
 	clGetKernelWorkGroupInfo(getKernel(), cl::device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, NULL);
 	clGetKernelWorkGroupInfo(getKernel(), cl::device, CL_KERNEL_PRIVATE_MEM_SIZE, sizeof(cl_ulong), &private_mem_size, NULL);
 
+	resources.workGroupSize = workgroup_size;
+	resources.preferredMultiple = pref_workgroup_multiple;
+	resources.localMemSize = local_mem_size;
+	resources.privateMemSize = private_mem_size;
+	resources.localMemGroups = local_mem_size > 0 ? (size_t)(cl::device_info.local_mem_size / local_mem_size) : 0;
+
+	// Drivers lower CL_KERNEL_WORK_GROUP_SIZE below the device maximum when a kernel needs too many registers,
+	// so the ratio of the two is the best portable estimate of register pressure. Local memory can limit it further.
+	double occupancy = cl::device_info.max_work_group_size > 0 ? (double)workgroup_size / cl::device_info.max_work_group_size : 0.0;
+	if (local_mem_size > 0) {
+		occupancy = std::min(occupancy, (double)(resources.localMemGroups * workgroup_size) / cl::device_info.max_work_group_size);
+	}
+	resources.occupancy = std::min(occupancy, 1.0);
+	resources.spills = private_mem_size > KERNEL_PRIVATE_MEM_WARNING;
+
 	std::cout << "Kernel " << getKernelName() << ":" << std::endl;
 	std::cout << std::setw(48) << "CL_KERNEL_WORK_GROUP_SIZE" << std::setw(8) << workgroup_size << std::endl;
 	std::cout << std::setw(48) << "CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE" << std::setw(8) << pref_workgroup_multiple << std::endl;
 	std::cout << std::setw(48) << "CL_KERNEL_LOCAL_MEM_SIZE" << std::setw(8) << local_mem_size << std::endl;
 	std::cout << std::setw(48) << "CL_KERNEL_PRIVATE_MEM_SIZE" << std::setw(8) << private_mem_size << std::endl;
+	if (local_mem_size > 0) std::cout << std::setw(48) << "Work-groups per compute unit (local memory)" << std::setw(8) << resources.localMemGroups << std::endl;
+	std::cout << std::setw(48) << "Estimated occupancy" << std::setw(7) << (int)(resources.occupancy * 100.0 + 0.5) << "%" << std::endl;
+
+	if (resources.spills) {
+		std::cout << "Warning: " << getKernelName() << " uses " << private_mem_size << " bytes of private memory per work item, which is likely spilled to global memory "
+			<< "(" << private_mem_size * workgroup_size * cl::device_info.max_compute_units / 1024 << " KB across one work-group per compute unit)." << std::endl;
+	}
+	if (workgroup_size < cl::device_info.max_work_group_size) {
+		std::cout << "Warning: " << getKernelName() << " is limited to work-groups of " << workgroup_size << " of the device's " << cl::device_info.max_work_group_size << " work items." << std::endl;
+	}
+	if (local_mem_size > 0 && resources.localMemGroups == 0) {
+		std::cout << "Warning: " << getKernelName() << " needs more local memory than a compute unit has." << std::endl;
+	}
+}
+
+bool CLKernel::setProgram(cl_program program) {
+	cl_int err;
+	cl_kernel swapped = clCreateKernel(program, getKernelName().c_str(), &err);
+	if (err != CL_SUCCESS) {
+		std::cout << "Kernel creation error on '" << getKernelName() << "': " << cl::getErrorString(err) << std::endl;
+		return false;
+	}
+	if (kernel != nullptr) clReleaseKernel(kernel);
+	kernel = swapped;
+	setArgs();
+	display_kernel_info();
+	// A different build can need more registers or local memory and lower the work-group size
+	if (getLocalSize() != NULL) setLocalSize(localSize[0], localSize[1]);
+	return true;
+}
+
+bool CLKernel::fitsLocalSize(size_t x, size_t y) {
+	if (x == 0 || y == 0) return true;
+	return x * y <= resources.workGroupSize && x <= cl::device_info.max_work_item_sizes[0] && y <= cl::device_info.max_work_item_sizes[1];
+}
+
+bool CLKernel::setLocalSize(size_t x, size_t y) {
+	if (kernel != nullptr && !fitsLocalSize(x, y)) {
+		std::cout << "Work-groups of " << x << "x" << y << " don't fit " << getKernelName() << " (at most " << resources.workGroupSize << " work items), the driver chooses instead." << std::endl;
+		localSize[0] = 0;
+		localSize[1] = 0;
+		return false;
+	}
+	localSize[0] = x;
+	localSize[1] = y;
+	return true;
+}
+
+bool writeKernelReport(const std::string& path, CLKernel** kernels, size_t count) {
+	std::ofstream file(path);
+	if (!file) {
+		std::cout << "Could not open " << path << " for writing." << std::endl;
+		return false;
+	}
+
+	file << "[" << std::endl;
+	for (size_t i = 0; i < count; ++i) {
+		const KernelResources& r = kernels[i]->getResources();
+		file << "\t{\"kernel\": \"" << kernels[i]->getKernelName() << "\", \"workGroupSize\": " << r.workGroupSize << ", \"preferredMultiple\": " << r.preferredMultiple
+			<< ", \"localMemSize\": " << r.localMemSize << ", \"privateMemSize\": " << r.privateMemSize << ", \"localMemGroups\": " << r.localMemGroups
+			<< ", \"occupancy\": " << r.occupancy << ", \"spills\": " << (r.spills ? "true" : "false") << "}" << (i + 1 < count ? "," : "") << std::endl;
+	}
+	file << "]" << std::endl;
 
+	std::cout << "Wrote kernel resource report to " << path << std::endl;
+	return true;
 }
@@ -3,25 +3,59 @@
 #include <string>
 #include <iostream>
 #include "cl_helper.h"
+#include "cl_profiler.h"
+#include "cl_memory.h"
 #include "World.h"
 
+// Private memory per work item above which a kernel is reported as spilling
+#define KERNEL_PRIVATE_MEM_WARNING (1024)
+#define KERNEL_REPORT_FILE ("kernel_report.json")
+
+struct KernelResources {
+	size_t workGroupSize;
+	size_t preferredMultiple;
+	cl_ulong localMemSize;
+	cl_ulong privateMemSize;
+	// Work-groups that fit in the local memory of one compute unit, 0 when the kernel uses none
+	size_t localMemGroups;
+	// Estimated fraction of the device work-group capacity the kernel can keep resident, 0 to 1
+	double occupancy;
+	bool spills;
+};
+
 class CLKernel {
 
 	const std::string kernelName;
 
 	cl_kernel kernel;
 
+	KernelResources resources;
+
+	// Work-group shape, 0 lets the driver choose (see Autotune.h)
+	size_t localSize[2] = { 0, 0 };
+
 	void display_kernel_info();
 
 public:
 	inline CLKernel() : kernelName("INVALID") { };
-	inline CLKernel(std::string name) : kernelName(name) { kernel = nullptr; };
+	inline CLKernel(std::string name) : kernelName(name), resources() { kernel = nullptr; };
 	inline ~CLKernel() {}
 
 	inline std::string getKernelName() { return kernelName; }
 
 	inline cl_kernel getKernel() { return kernel; }
 
+	inline const KernelResources& getResources() { return resources; }
+
+	// Whether an x by y work-group fits the kernel as built and the device
+	bool fitsLocalSize(size_t x, size_t y);
+
+	// Sets the work-group shape. A shape that doesn't fit the kernel falls back to the driver's choice and returns false. Checked again when the kernel is created or replaced.
+	bool setLocalSize(size_t x, size_t y);
+
+	// The local size to enqueue with, NULL when the driver chooses
+	inline const size_t* getLocalSize() { return localSize[0] > 0 && localSize[1] > 0 ? localSize : NULL; }
+
 	inline bool createKernel() {
 		kernel = cl::createKernel(getKernelName().c_str());
 		if (kernel == nullptr) {
@@ -29,11 +63,21 @@ public:
 			return false;
 		}
 		display_kernel_info();
+		if (getLocalSize() != NULL) setLocalSize(localSize[0], localSize[1]);
 		return true;
 	}
 
+	/**
+		Replaces the kernel with the one of the same name in program, e.g. a scene-specialised build, and sets its arguments again.
+		The old kernel is released, commands already enqueued with it still run. The work-group shape is checked again against the new kernel.
+	*/
+	bool setProgram(cl_program program);
+
 	virtual void create() = 0;
 
+	// Sets the arguments that stay the same between frames. Called by create() and setProgram().
+	virtual void setArgs() {}
+
 	virtual cl_event update() = 0;
 
 	virtual cl_event queue(cl_uint num_events, cl_event* wait_events) = 0;
@@ -41,3 +85,6 @@ public:
 	virtual void destroy() = 0;
 };
 
+// Writes the resources of every created kernel as a JSON array
+bool writeKernelReport(const std::string& path, CLKernel** kernels, size_t count);
+
@@ -0,0 +1,25 @@
+#pragma once
+
+// Host copies of cl_kernels/defines.h for the CPU tracer sources. Not included from headers as PI/HPI clash with main.cpp.
+#define PI (3.14159265359f)
+#define HPI (1.57079632679f)
+#define TURN_FRACTION (1.61803398875f)
+#define EPSILON (0.05f)
+#define AIR_REFRACTIVE_INDEX (1.0f)
+#define MAX_VALUE (0xFFFFFFFF)
+#define SPHERE_TYPE (0)
+#define TRIANGLE_TYPE (1)
+#define ROOT_TYPE (0)
+#define REFLECT_TYPE (1)
+#define REFRACT_TYPE (2)
+#define SHADOW_TYPE (3)
+#define NUM_SHADOW_RAYS (1)
+#define SHADOW_RAY_DIST (0.1f)
+#define BVH_PLANE_COUNT (7)
+#define LOD_BOUNCE_BIAS (1)
+#define LOD_SHADOW_BIAS (1)
+#define AMBIENT_STRENGTH (0.2f)
+#define SPECULAR_STRENGTH (0.3f)
+#define DAYLIGHT_COSINE_STRENGTH (0.7f)
+#define DAYLIGHT_SHADOW_STRENGTH (0.7f)
+#define MAX_RESULT_TREE_STACK (256)
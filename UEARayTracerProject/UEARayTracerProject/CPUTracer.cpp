@@ -0,0 +1,841 @@
+#include "CPUTracer.h"
+#include "CPUDefines.h"
+#include "PacketTracer.h"
+#include "ImageResolverKernel.h"
+#include "Timeline.h"
+#include <SOIL.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <math.h>
+#include <string.h>
+
+const cl_float3 daylight_direction = { SQRT33, -SQRT33, SQRT33 };
+
+inline cl_float3 _cpu_normalize(cl_float3 v) {
+	return _world_normalise(v);
+}
+
+inline cl_float3 _cpu_cross(cl_float3 a, cl_float3 b) {
+	return _world_cross(a, b);
+}
+
+inline cl_float3 _cpu_floor(cl_float3 v) {
+	return { floorf(v.x), floorf(v.y), floorf(v.z) };
+}
+
+inline cl_float3 _cpu_fabs(cl_float3 v) {
+	return { fabsf(v.x), fabsf(v.y), fabsf(v.z) };
+}
+
+inline cl_float3 _cpu_mix(cl_float3 a, cl_float3 b, float t) {
+	return a + (b - a) * t;
+}
+
+inline float _cpu_mix(float a, float b, float t) {
+	return a + (b - a) * t;
+}
+
+inline float _cpu_clamp(float v, float lo, float hi) {
+	return std::min(std::max(v, lo), hi);
+}
+
+inline void _cpu_swap(float* a, float* b) {
+	float temp = *a;
+	*a = *b;
+	*b = temp;
+}
+
+cl_float3 _cpu_getReflectDirection(cl_float3 direction_in, cl_float3 normal) {
+	return direction_in - 2.0f * _world_dot(direction_in, normal) * normal;
+}
+
+cl_float3 _cpu_getRefractDirection(cl_float3 direction_in, cl_float3 normal, float from_index, float to_index) {
+	float n = from_index / to_index;
+	float cosI = -_world_dot(normal, direction_in);
+	float sinT2 = n * n * (1.0f - cosI * cosI);
+	if (sinT2 > 1.0f) {
+		return direction_in;
+	}
+	float cosT = sqrtf(1.0f - sinT2);
+	return n * direction_in + (n * cosI - cosT) * normal;
+}
+
+unsigned int _cpu_getTriangleGridOffset(cl_float3 cellindex, int rowCount) {
+	return (unsigned int)(cellindex.x * SQ(rowCount) + cellindex.y * rowCount + cellindex.z);
+}
+
+// Same slots as the kernels (see RayTree), ray types without one give an index past the end of every tree
+int _cpu_rar_getChild(int index, cl_uint slot) {
+	return slot == RAY_SLOT_NONE ? INT_MAX : getRayTree().children * index + slot;
+}
+
+int _cpu_rar_getReflectChild(int index) {
+	return _cpu_rar_getChild(index, getRayTree().reflectSlot);
+}
+
+int _cpu_rar_getRefractChild(int index) {
+	return _cpu_rar_getChild(index, getRayTree().refractSlot);
+}
+
+int _cpu_rar_getShadowChild(int index) {
+	return _cpu_rar_getChild(index, getRayTree().shadowSlot);
+}
+
+// Writes to the same row as the image resolver kernel (flipped)
+void _cpu_writePixel(unsigned char* output, int width, int height, int x, int y, cl_float3 colour) {
+	unsigned char* pixel = output + ((size_t)(height - y - 1) * width + x) * 4;
+	pixel[0] = (unsigned char)(_cpu_clamp(colour.x, 0.0f, 1.0f) * 255.0f + 0.5f);
+	pixel[1] = (unsigned char)(_cpu_clamp(colour.y, 0.0f, 1.0f) * 255.0f + 0.5f);
+	pixel[2] = (unsigned char)(_cpu_clamp(colour.z, 0.0f, 1.0f) * 255.0f + 0.5f);
+	pixel[3] = 255;
+}
+
+namespace cpu {
+
+	int rar_getNumRays(int bounces) {
+		return getRayTreeSize(bounces);
+	}
+
+	Ray generateEyeRay(const RayConfig* config, int x, int y) {
+		// Normalised coordinates
+		float nx = 2.0f * (((float)(x) / config->width) - 0.5f) * config->aspect;
+		float ny = 2.0f * (((float)(y) / config->height) - 0.5f);
+		float nz = config->screenDistance;
+
+		cl_float3 coord = { nx, ny * cosf(config->pitch) + nz * -sinf(config->pitch), nz * cosf(config->pitch) + ny * sinf(config->pitch) };
+		coord = { coord.x * cosf(config->yaw) + coord.z * sinf(config->yaw), coord.y, coord.z * cosf(config->yaw) + coord.x * -sinf(config->yaw) };
+
+		Ray output;
+		output.origin = coord + config->camera;
+		output.direction = _cpu_normalize(output.origin - config->camera);
+		return output;
+	}
+
+	bool sphere_intersect(const Ray* ray, const Sphere* sphere, float* minT, float* maxT) {
+		cl_float3 vec_raysphere = ray->origin - sphere->position;
+
+		// at^2 + bt + c = 0
+		float a = 1.0f;
+		float b = 2.0f * _world_dot(ray->direction, vec_raysphere);
+		float c = _world_dot(vec_raysphere, vec_raysphere) - SQ(sphere->radius);
+
+		float discriminant = SQ(b) - 4 * a * c;
+		if (discriminant < 0) return false;
+
+		float dsqrt = sqrtf(discriminant);
+		*minT = (-b - dsqrt) / 2.0f;
+		*maxT = (-b + dsqrt) / 2.0f;
+		if (*minT > *maxT) {
+			_cpu_swap(minT, maxT);
+		}
+
+		// Epsilon (Make sure ray from a sphere doesn't intersect itself)
+		if (*minT < EPSILON) {
+			*minT = *maxT;
+		}
+
+		// If intersect is behind origin, it doesn't intersect;
+		if (*maxT < EPSILON) return false;
+
+		return true;
+	}
+
+	bool triangle_intersect(const Ray* ray, const Triangle* triangle, const cl_float3* vertices, cl_float2* barycentric, float* T) {
+		cl_float3 v0 = vertices[triangle->face.x];
+		cl_float3 edge1 = vertices[triangle->face.y] - v0;
+		cl_float3 edge2 = vertices[triangle->face.z] - v0;
+		cl_float3 h = _cpu_cross(ray->direction, edge2);
+		float a = _world_dot(edge1, h);
+
+		if (a > -EPSILON && a < EPSILON) {
+			return false; // Ray is parallel to triangle
+		}
+
+		float f = 1.0f / a;
+		cl_float3 s = ray->origin - v0;
+		float u = f * _world_dot(s, h);
+		if (u < 0.0f || u > 1.0f) {
+			return false;
+		}
+
+		cl_float3 q = _cpu_cross(s, edge1);
+		float v = f * _world_dot(ray->direction, q);
+		if (v < 0.0f || u + v > 1.0f) {
+			return false;
+		}
+
+		// Compute t
+		float t = f * _world_dot(edge2, q);
+		if (t < EPSILON) {
+			return false;
+		}
+
+		*T = t;
+		*barycentric = { u, v };
+
+		return true;
+	}
+
+	cl_float3 triangle_normal(const WorldPack* pack, const Triangle* triangle, cl_float2 barycentric) {
+		cl_uint n0 = pack->normals[triangle->face.x];
+		cl_uint n1 = pack->normals[triangle->face.y];
+		cl_uint n2 = pack->normals[triangle->face.z];
+		if (n0 == NORMAL_NONE || n1 == NORMAL_NONE || n2 == NORMAL_NONE) {
+			cl_float3 v0 = pack->vertices[triangle->face.x];
+			return _cpu_normalize(_cpu_cross(pack->vertices[triangle->face.y] - v0, pack->vertices[triangle->face.z] - v0));
+		}
+		return _cpu_normalize((1.0f - barycentric.x - barycentric.y) * _world_decodeNormal(n0) + barycentric.x * _world_decodeNormal(n1) + barycentric.y * _world_decodeNormal(n2));
+	}
+
+	bool bvh_plane_intersect(const ModelStruct* model, const float* planeDotOrigin, const float* planeDotDirection, float* tNear, float* tFar, cl_uint* planeIndex) {
+		for (cl_uint plane_i = 0; plane_i < BVH_PLANE_COUNT; ++plane_i) {
+			float tNearPlane = (model->bounds[plane_i].x - planeDotOrigin[plane_i]) / planeDotDirection[plane_i];
+			float tFarPlane = (model->bounds[plane_i].y - planeDotOrigin[plane_i]) / planeDotDirection[plane_i];
+			if (planeDotDirection[plane_i] < 0.0f) {
+				_cpu_swap(&tNearPlane, &tFarPlane);
+			}
+
+			if (tNearPlane > *tNear) *tNear = tNearPlane, *planeIndex = plane_i;
+			if (tFarPlane < *tFar) *tFar = tFarPlane;
+			if (*tNear > *tFar) return false;
+		}
+		return true;
+	}
+
+	bool bvh_contains(const ModelStruct* model, const float* planeDotPoint) {
+		for (cl_uint plane_i = 0; plane_i < BVH_PLANE_COUNT; ++plane_i) {
+			if (planeDotPoint[plane_i] < model->bounds[plane_i].x - EPSILON || planeDotPoint[plane_i] > model->bounds[plane_i].y + EPSILON) return false;
+		}
+		return true;
+	}
+
+	cl_uint model_selectLod(const ModelStruct* model, bool inside, cl_uint rayType, cl_uint bounce) {
+		cl_uint level = model->lodLevel;
+		if (!inside) level += bounce * LOD_BOUNCE_BIAS + (rayType == SHADOW_TYPE ? LOD_SHADOW_BIAS : 0);
+		return std::min(level, model->lodCount - 1);
+	}
+
+	bool model_intersect(const WorldPack* pack, const Ray* ray, unsigned char modelIndex, cl_uint level, float* closest_T, int* closest_I, cl_float2* closest_UV) {
+		float T = *closest_T;
+
+		const ModelStruct* model = pack->models + modelIndex;
+		const cl_uint gridOffset = getModelGridOffset(model, level);
+		const cl_uint countOffset = getModelCountOffset(model, level);
+
+		// Step through model grid
+		cl_float3 gridmin = { model->bounds[0].x, model->bounds[1].x, model->bounds[2].x };
+		cl_float3 gridmax = { model->bounds[0].y, model->bounds[1].y, model->bounds[2].y };
+
+		const int rowCount = getGridCellRowCount();
+		cl_float3 cellSize = (gridmax - gridmin) * (1.0f / rowCount);
+		cl_float3 rayStart = ray->origin + ray->direction * T;
+		cl_float3 dda_origin = rayStart - gridmin;
+
+		cl_float3 step = {
+			ray->direction.x < 0.0f ? -1.0f : 1.0f,
+			ray->direction.y < 0.0f ? -1.0f : 1.0f,
+			ray->direction.z < 0.0f ? -1.0f : 1.0f
+		};
+		if (ray->direction.x == 0.0f) step.x = 0.0f;
+		if (ray->direction.y == 0.0f) step.y = 0.0f;
+		if (ray->direction.z == 0.0f) step.z = 0.0f;
+
+		dda_origin = dda_origin + step * EPSILON;
+
+		cl_float3 invdir = { 1.0f / ray->direction.x, 1.0f / ray->direction.y, 1.0f / ray->direction.z };
+		if (ray->direction.x == 0.0f) invdir.x = MAX_VALUE;
+		if (ray->direction.y == 0.0f) invdir.y = MAX_VALUE;
+		if (ray->direction.z == 0.0f) invdir.z = MAX_VALUE;
+
+		cl_float3 deltaT = _cpu_fabs(cellSize * invdir);
+
+		cl_float3 currentV = _cpu_floor(dda_origin / cellSize);
+		cl_float3 cellBoundaryOffset = { (float)(ray->direction.x > 0.0f), (float)(ray->direction.y > 0.0f), (float)(ray->direction.z > 0.0f) };
+		cl_float3 cellBoundary = (currentV + cellBoundaryOffset) * cellSize + gridmin;
+		cl_float3 Tv = (cellBoundary - ray->origin) / ray->direction;
+		if (ray->direction.x == 0.0f) Tv.x = 9999.0f;
+		if (ray->direction.y == 0.0f) Tv.y = 9999.0f;
+		if (ray->direction.z == 0.0f) Tv.z = 9999.0f;
+		int max_step = 1000;
+
+		bool hasIntersect = false;
+		float closest_triangle_T = MAX_VALUE;
+		while (
+			currentV.x >= 0 && currentV.x < rowCount &&
+			currentV.y >= 0 && currentV.y < rowCount &&
+			currentV.z >= 0 && currentV.z < rowCount &&
+			max_step > 0
+			) {
+			max_step--;
+			unsigned int celloffset = _cpu_getTriangleGridOffset(currentV, rowCount);
+
+			for (unsigned int i = 0; i < pack->triangleCountGrid[countOffset + celloffset]; ++i) {
+				unsigned int tri_i = pack->grid[gridOffset + (celloffset * GRID_MAX_TRIANGLES_PER_CELL) + i];
+				const Triangle* triangle = pack->triangles + tri_i;
+
+				cl_float2 barycentric;
+				float T;
+
+				if (!triangle_intersect(ray, triangle, pack->vertices, &barycentric, &T)) continue;
+
+				if (T < closest_triangle_T) {
+					closest_triangle_T = T;
+					*closest_T = T;
+					*closest_I = tri_i;
+					*closest_UV = barycentric;
+				}
+
+				hasIntersect = true;
+			}
+
+			cl_float3 incr = {
+				(float)((Tv.x <= Tv.y) && (Tv.x <= Tv.z)),
+				(float)((Tv.y <= Tv.x) && (Tv.y <= Tv.z)),
+				(float)((Tv.z <= Tv.x) && (Tv.z <= Tv.y)),
+			};
+
+			Tv = Tv + incr * deltaT;
+			currentV = currentV + incr * step;
+		}
+		return hasIntersect;
+	}
+
+	float fresnel(cl_float3 in, cl_float3 normal, float fromIOR, float toIOR) {
+		float cosI = _world_dot(in, normal);
+		float etaI = fromIOR;
+		float etaT = toIOR;
+		if (cosI > 0.0f) {
+			_cpu_swap(&etaI, &etaT);
+		}
+		float n = etaI / etaT;
+		float sinT2 = SQ(n) * std::max(0.0f, 1.0f - SQ(cosI));
+		if (sinT2 > 1.0f) return 1.0f; // Total internal reflection
+		float cosT = sqrtf(1.0f - sinT2);
+		cosI = fabsf(cosI);
+		float Rs = ((etaT * cosI) - (etaI * cosT)) / ((etaT * cosI) + (etaI * cosT));
+		float Rp = ((etaI * cosI) - (etaT * cosT)) / ((etaI * cosI) + (etaT * cosT));
+		return (SQ(Rs) + SQ(Rp)) / 2.0f;
+	}
+
+	cl_float3 phong(const TraceResult* trace, const Material* material) {
+		float intensity = _cpu_clamp(_world_dot(trace->normal, -daylight_direction), AMBIENT_STRENGTH, 1.0f);
+		cl_float3 diffuse = intensity * material->diffuse;
+
+		//  Blinn-Phong Half Vector
+		cl_float3 H = _cpu_normalize(daylight_direction + trace->ray.direction);
+
+		// specular intensity
+		intensity = powf(_cpu_clamp(_world_dot(-trace->normal, H), 0.0f, 1.0f), material->specular) * SPECULAR_STRENGTH;
+		cl_float3 specular = { intensity, intensity, intensity };
+
+		return diffuse + specular;
+	}
+
+	cl_float3 skybox_cubemap(const SkyboxData* skybox, cl_float3 dir) {
+		const int skybox_img_size = skybox->width * skybox->height * 3;
+		int face = 0;
+
+		cl_float3 absDir = _cpu_fabs(dir);
+		bool polarity[3] = { dir.x > 0, dir.y > 0, dir.z > 0 };
+
+		float maxAxis = 1.0f, uc = 0.0f, vc = 0.0f;
+
+		if (polarity[0] && absDir.x >= absDir.y && absDir.x >= absDir.z) {
+			maxAxis = absDir.x; uc = -dir.z; vc = dir.y; face = 0;
+		}
+		if (!polarity[0] && absDir.x >= absDir.y && absDir.x >= absDir.z) {
+			maxAxis = absDir.x; uc = dir.z; vc = dir.y; face = 1;
+		}
+		if (polarity[1] && absDir.y >= absDir.x && absDir.y >= absDir.z) {
+			maxAxis = absDir.y; uc = dir.x; vc = -dir.z; face = 2;
+		}
+		if (!polarity[1] && absDir.y >= absDir.x && absDir.y >= absDir.z) {
+			maxAxis = absDir.y; uc = dir.x; vc = dir.z; face = 3;
+		}
+		if (polarity[2] && absDir.z >= absDir.x && absDir.z >= absDir.y) {
+			maxAxis = absDir.z; uc = -dir.x; vc = dir.y; face = 5;
+		}
+		if (!polarity[2] && absDir.z >= absDir.x && absDir.z >= absDir.y) {
+			maxAxis = absDir.z; uc = dir.x; vc = dir.y; face = 4;
+		}
+
+		float u = 0.5f * (uc / maxAxis + 1.0f);
+		float v = 0.5f * (vc / maxAxis + 1.0f);
+
+		int data_offset = skybox_img_size * face;
+
+		// Clamped as the host has no out of bounds reads to fall back on
+		int x = std::min(std::max((int)(u * skybox->width), 0), skybox->width - 1);
+		int y = std::min(std::max((int)(v * skybox->height), 0), skybox->height - 1);
+
+		int pixelOffset = (y * skybox->width + x) * 3;
+
+		return {
+			skybox->data[data_offset + pixelOffset + 0] / 255.0f,
+			skybox->data[data_offset + pixelOffset + 1] / 255.0f,
+			skybox->data[data_offset + pixelOffset + 2] / 255.0f
+		};
+	}
+
+	void local_trace(const WorldPack* pack, const Ray* ray, TraceResult* result) {
+		result->hasTraced = true;
+		// Sphere intersection
+		float closest_T = MAX_VALUE;
+		float closest_T2 = 0;
+		int closest_i = -1;
+		int closest_type = -1;
+		cl_float2 closest_UV = { 0.0f, 0.0f };
+		for (cl_uint i = 0; i < pack->world->numSpheres; ++i) {
+			const Sphere* sphere = &pack->spheres[i];
+
+			cl_float3 vec_raysphere = ray->origin - sphere->position;
+			float dot_raysphere = _world_dot(_cpu_normalize(vec_raysphere), ray->direction);
+
+			// If sphere is behind origin and origin is outside, skip
+			if (-dot_raysphere < 0.0f && SQ(sphere->radius) < _world_dot(vec_raysphere, vec_raysphere)) continue;
+
+			float minT, maxT;
+			if (!sphere_intersect(ray, sphere, &minT, &maxT)) continue;
+
+			if (minT < closest_T) {
+				closest_T = minT;
+				closest_T2 = maxT;
+				closest_i = i;
+				closest_type = SPHERE_TYPE;
+			}
+		}
+
+		float planeDotRayOrigin[BVH_PLANE_COUNT];
+		float planeDotRayDirection[BVH_PLANE_COUNT];
+		for (int plane_i = 0; plane_i < BVH_PLANE_COUNT; ++plane_i) {
+			planeDotRayOrigin[plane_i] = _world_dot(ray->origin, BVH_PlaneNormals[plane_i]);
+			planeDotRayDirection[plane_i] = _world_dot(ray->direction, BVH_PlaneNormals[plane_i]);
+		}
+
+		// Model intersections
+		char closest_model = -1;
+		float closest_model_T = MAX_VALUE;
+		for (cl_uint i = 0; i < pack->world->numModels; ++i) {
+			const ModelStruct* model = pack->models + i;
+
+			float tnear = -MAX_VALUE;
+			float tfar = MAX_VALUE;
+			cl_uint planeIndex = -1;
+
+			if (bvh_plane_intersect(model, planeDotRayOrigin, planeDotRayDirection, &tnear, &tfar, &planeIndex)) {
+				if (tnear < closest_model_T) {
+					closest_model_T = tnear;
+					closest_model = i;
+				}
+			}
+		}
+
+		// If model bounding volume intersect
+		if (closest_model_T < closest_T) {
+			float model_T = closest_model_T;
+			int tri_i;
+			const bool inside = bvh_contains(pack->models + closest_model, planeDotRayOrigin);
+			cl_uint level = model_selectLod(pack->models + closest_model, inside, result->rayType, result->bounce);
+			if (model_intersect(pack, ray, closest_model, level, &model_T, &tri_i, &closest_UV)) {
+				closest_T = model_T;
+				closest_T2 = closest_T;
+				closest_i = tri_i;
+				closest_type = TRIANGLE_TYPE;
+			}
+		}
+
+		// If no intersect, stop
+		if (closest_i < 0) {
+			result->hasIntersect = false;
+			return;
+		}
+
+		fill_hit(pack, ray, closest_type, closest_i, closest_T, closest_T2, closest_UV, result);
+	}
+
+	void fill_hit(const WorldPack* pack, const Ray* ray, int objectType, int objectIndex, float T, float T2, cl_float2 barycentric, TraceResult* result) {
+		result->hasIntersect = true;
+		result->T = T;
+		result->T2 = T2;
+		result->intersect = ray->origin + ray->direction * result->T;
+		result->objectIndex = objectIndex;
+		result->objectType = objectType;
+
+		if (result->objectType == SPHERE_TYPE) {
+			result->normal = _cpu_normalize(result->intersect - pack->spheres[result->objectIndex].position);
+			result->material = pack->spheres[result->objectIndex].material;
+		} else if (result->objectType == TRIANGLE_TYPE) {
+			result->normal = triangle_normal(pack, pack->triangles + objectIndex, barycentric);
+			result->material = pack->triangles[result->objectIndex].materialIndex;
+		}
+		result->cosine = fabsf(_world_dot(ray->direction, result->normal));
+	}
+
+	void trace_pixel(const RayConfig* config, const WorldPack* pack, int x, int y, TraceResult* results, int numRays) {
+		// Equivalent of ResetRays
+		for (int i = 0; i < numRays; ++i) results[i].hasTraced = false;
+
+		results->bounce = 0;
+		results->rayType = ROOT_TYPE;
+		results->ray = generateEyeRay(config, x, y);
+
+		trace_tree(config, pack, results, false);
+	}
+
+	void trace_tree(const RayConfig* config, const WorldPack* pack, TraceResult* results, bool rootTraced) {
+		TraceResult* baseResult = results;
+
+		int queueTail = 0;
+		int offsets[MAX_RESULT_TREE_STACK];
+		offsets[queueTail] = 0;
+
+		for (int i = 0; i <= queueTail && queueTail < MAX_RESULT_TREE_STACK - (int)getRayTree().children; ++i) {
+			int rayOffset = offsets[i];
+			TraceResult* result = baseResult + rayOffset;
+			Ray r = result->ray;
+			if (i > 0 || !rootTraced) local_trace(pack, &r, result);
+
+			// If is shadow ray, cast multiple rays to find softness
+			if (result->rayType == SHADOW_TYPE) {
+				Ray softShadowRay;
+				softShadowRay.origin = r.origin;
+				cl_float3 axis = fabsf(r.direction.x) > 0.1f ? cl_float3{ 0.0f, 1.0f, 0.0f } : cl_float3{ 1.0f, 0.0f, 0.0f };
+				cl_float3 u = _cpu_normalize(_cpu_cross(axis, r.direction));
+				cl_float3 v = _cpu_cross(r.direction, u);
+				int numHit = result->hasIntersect;
+				for (int s = 0; s < NUM_SHADOW_RAYS; ++s) {
+					float dist = powf(s / (NUM_SHADOW_RAYS - 1.0f), 0.5f) * SHADOW_RAY_DIST;
+					float angle = 2.0f * PI * TURN_FRACTION * s;
+					float sx = dist * cosf(angle);
+					float sy = dist * sinf(angle);
+					softShadowRay.direction = _cpu_normalize(dist * sx * u + dist * sy * v + r.direction);
+
+					TraceResult shadowResult;
+					shadowResult.rayType = SHADOW_TYPE;
+					shadowResult.bounce = result->bounce;
+					local_trace(pack, &softShadowRay, &shadowResult);
+					if (shadowResult.hasIntersect) numHit++;
+				}
+
+				result->shadowSoftness = 1.0f - powf((float)numHit / (float)(NUM_SHADOW_RAYS + 1), 8.0f);
+			}
+
+			if (result->bounce >= config->bounces) continue;
+
+			if (!result->hasIntersect || result->rayType == SHADOW_TYPE) continue;
+
+			TraceResult localResult = *result;
+			const Material* material = pack->materials + localResult.material;
+
+			// Add reflective ray
+			if (getRayTree().reflectSlot != RAY_SLOT_NONE && material->reflectivity > EPSILON) {
+				queueTail++;
+				offsets[queueTail] = _cpu_rar_getReflectChild(rayOffset);
+				TraceResult* child = baseResult + offsets[queueTail];
+				child->ray.origin = localResult.intersect;
+				child->ray.direction = _cpu_getReflectDirection(r.direction, localResult.normal);
+				child->bounce = localResult.bounce + 1;
+				child->rayType = REFLECT_TYPE;
+			}
+
+			// Add refractive ray
+			if (getRayTree().refractSlot != RAY_SLOT_NONE && material->opacity < 1.0f - EPSILON) {
+				queueTail++;
+				offsets[queueTail] = _cpu_rar_getRefractChild(rayOffset);
+				TraceResult* child = baseResult + offsets[queueTail];
+				if (localResult.objectType == SPHERE_TYPE) {
+					const Sphere* sphere = pack->spheres + localResult.objectIndex;
+					cl_float3 internal_direction = _cpu_getRefractDirection(r.direction, localResult.normal, AIR_REFRACTIVE_INDEX, material->refractiveIndex);
+					float internal_theta = fabsf(_world_dot(internal_direction, localResult.normal));
+					float internal_length = sinf(internal_theta * HPI) * sphere->radius * 2.0f;
+
+					child->ray.origin = localResult.intersect + internal_direction * internal_length;
+
+					cl_float3 exit_normal = _cpu_normalize(child->ray.origin - sphere->position);
+					child->ray.direction = _cpu_getRefractDirection(internal_direction, -exit_normal, material->refractiveIndex, AIR_REFRACTIVE_INDEX);
+				} else {
+					child->ray.origin = localResult.intersect;
+					cl_float3 refractNormal = -localResult.normal;
+					if (_world_dot(r.direction, refractNormal) > 0) refractNormal = -refractNormal;
+					child->ray.direction = _cpu_getRefractDirection(r.direction, refractNormal, 1.0f, material->refractiveIndex);
+				}
+				child->bounce = localResult.bounce + 1;
+				child->rayType = REFRACT_TYPE;
+			}
+
+			// Add shadow ray
+			if (getRayTree().shadowSlot != RAY_SLOT_NONE && material->opacity > EPSILON) {
+				queueTail++;
+				offsets[queueTail] = _cpu_rar_getShadowChild(rayOffset);
+				TraceResult* child = baseResult + offsets[queueTail];
+				child->ray.origin = localResult.intersect;
+				child->ray.direction = -daylight_direction;
+				child->bounce = localResult.bounce + 1;
+				child->rayType = SHADOW_TYPE;
+			}
+		}
+	}
+
+	cl_float3 _cpu_resolveNode(const WorldPack* pack, const SkyboxData* skybox, const TraceResult* results, int numRays, int index) {
+		const TraceResult* result = results + index;
+		if (!result->hasIntersect) {
+			return skybox_cubemap(skybox, result->ray.direction);
+		}
+
+		const Material objectMaterial = pack->materials[result->material];
+		float kr = fresnel(result->ray.direction, result->normal, AIR_REFRACTIVE_INDEX, objectMaterial.refractiveIndex);
+
+		// Calculate emission
+		cl_float3 transmission = phong(result, &objectMaterial);
+		int refractChild = _cpu_rar_getRefractChild(index);
+		if (refractChild < numRays && results[refractChild].hasTraced) {
+			transmission = _cpu_mix(_cpu_resolveNode(pack, skybox, results, numRays, refractChild), transmission, objectMaterial.opacity);
+		}
+
+		// Calculate reflection
+		cl_float3 reflection = transmission;
+		int reflectChild = _cpu_rar_getReflectChild(index);
+		if (reflectChild < numRays && results[reflectChild].hasTraced) {
+			reflection = _cpu_resolveNode(pack, skybox, results, numRays, reflectChild);
+		}
+
+		// Transform kr based on opacity
+		kr = _cpu_mix(kr, 1.0f - kr, objectMaterial.opacity);
+
+		cl_float3 out = transmission * (1.0f - kr) + reflection * kr;
+
+		// Calculate shadows
+		int shadowChild = _cpu_rar_getShadowChild(index);
+		if (shadowChild < numRays) {
+			const TraceResult* shadowResult = results + shadowChild;
+			if (shadowResult->hasTraced && shadowResult->hasIntersect) {
+				out = out * (1.0f - (DAYLIGHT_SHADOW_STRENGTH * (1.0f - shadowResult->shadowSoftness) * pack->materials[shadowResult->material].opacity));
+			}
+		}
+
+		return out;
+	}
+
+	cl_float3 resolve_pixel(const WorldPack* pack, const SkyboxData* skybox, const TraceResult* results, int numRays) {
+		return _cpu_resolveNode(pack, skybox, results, numRays, 0);
+	}
+
+}
+
+CPUTracer::CPUTracer() {
+}
+
+CPUTracer::~CPUTracer() {
+	destroy();
+}
+
+cpu::WorldPack CPUTracer::getWorldPack() {
+	cpu::WorldPack pack;
+	pack.world = &world->getStruct();
+	pack.vertices = world->getVertexBuffer().empty() ? nullptr : &world->getVertexBuffer()[0];
+	pack.normals = world->getNormals().empty() ? nullptr : &world->getNormals()[0];
+	pack.materials = world->getMaterialBuffer().empty() ? nullptr : &world->getMaterialBuffer()[0];
+	pack.spheres = world->getSpheres().empty() ? nullptr : &world->getSpheres()[0];
+	pack.triangles = world->getTriangles().empty() ? nullptr : &world->getTriangles()[0];
+	pack.models = world->getModels().empty() ? nullptr : &world->getModels()[0];
+	pack.grid = world->getTriangleGrid().empty() ? nullptr : &world->getTriangleGrid()[0];
+	pack.triangleCountGrid = world->getTriangleCountGrid().empty() ? nullptr : &world->getTriangleCountGrid()[0];
+	return pack;
+}
+
+void CPUTracer::create() {
+	pool.start(numThreads);
+	std::cout << "CPU tracer using " << pool.getThreadCount() << " threads." << std::endl;
+
+	const int numRays = cpu::rar_getNumRays(config->bounces);
+	scratch.resize(pool.getThreadCount());
+	for (auto it = scratch.begin(); it != scratch.end(); ++it) {
+		it->resize(numRays);
+	}
+
+	// Load skybox into one contiguous array like the kernel skybox buffer
+	int skyboxWidth = 0, skyboxHeight = 0;
+	_image_loadSkyboxTexture(skyboxImages, &skyboxWidth, &skyboxHeight);
+	size_t rgbsize = (size_t)skyboxWidth * skyboxHeight * 3;
+	skybox.resize(std::max(rgbsize * 6, (size_t)3), 0);
+	for (int i = 0; i < 6; ++i) {
+		if (skyboxImages[i] != nullptr) memcpy(&skybox[i * rgbsize], skyboxImages[i], rgbsize);
+	}
+	skyboxData.data = &skybox[0];
+
+	cl::memory::trackHost(MEMORY_RAYS, "CPU Tracer Scratch", scratch.size() * numRays * sizeof(TraceResult));
+	cl::memory::trackHost(MEMORY_SKYBOX, "CPU Tracer Skybox", skybox.size());
+	skyboxData.width = std::max(skyboxWidth, 1);
+	skyboxData.height = std::max(skyboxHeight, 1);
+}
+
+void CPUTracer::render(unsigned char* output) {
+	auto start = std::chrono::steady_clock::now();
+
+	const int width = (int)config->width;
+	const int height = (int)config->height;
+	const int tilesX = (width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+	const int tilesY = (height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+
+	// Copy so the render doesn't race with camera input
+	const RayConfig frameConfig = *config;
+	world->selectLods(frameConfig.camera);
+	const cpu::WorldPack pack = getWorldPack();
+
+	pool.run(tilesX * tilesY, [&](unsigned int tile, unsigned int worker) {
+		timeline::Scope scope("Tile");
+		TraceResult* results = &scratch[worker][0];
+		const int x0 = (tile % tilesX) * CPU_TILE_SIZE;
+		const int y0 = (tile / tilesX) * CPU_TILE_SIZE;
+		const int x1 = std::min(x0 + CPU_TILE_SIZE, width);
+		const int y1 = std::min(y0 + CPU_TILE_SIZE, height);
+		if (usePackets) {
+			renderTilePackets(&frameConfig, &pack, results, x0, y0, x1, y1, output);
+		} else {
+			renderTilePixels(&frameConfig, &pack, results, x0, y0, x1, y1, output);
+		}
+	});
+
+	lastFrameTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void CPUTracer::renderTilePixels(const RayConfig* frameConfig, const cpu::WorldPack* pack, TraceResult* results, int x0, int y0, int x1, int y1, unsigned char* output) {
+	const int numRays = cpu::rar_getNumRays(frameConfig->bounces);
+	for (int y = y0; y < y1; ++y) {
+		for (int x = x0; x < x1; ++x) {
+			cpu::trace_pixel(frameConfig, pack, x, y, results, numRays);
+			_cpu_writePixel(output, (int)frameConfig->width, (int)frameConfig->height, x, y, cpu::resolve_pixel(pack, &skyboxData, results, numRays));
+		}
+	}
+}
+
+void CPUTracer::renderTilePackets(const RayConfig* frameConfig, const cpu::WorldPack* pack, TraceResult* results, int x0, int y0, int x1, int y1, unsigned char* output) {
+	const int numRays = cpu::rar_getNumRays(frameConfig->bounces);
+	Ray rays[PACKET_SIZE];
+	cpu::PacketHit hit;
+	for (int py = y0; py < y1; py += PACKET_HEIGHT) {
+		for (int px = x0; px < x1; px += PACKET_WIDTH) {
+			// Lanes past the tile edge trace a valid ray but are never written
+			for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+				rays[lane] = cpu::generateEyeRay(frameConfig, px + lane % PACKET_WIDTH, py + lane / PACKET_WIDTH);
+			}
+			cpu::trace_packet(pack, rays, &hit);
+
+			for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+				const int x = px + lane % PACKET_WIDTH;
+				const int y = py + lane / PACKET_WIDTH;
+				if (x >= x1 || y >= y1) continue;
+
+				// Set up the root like trace_pixel, then trace the secondary rays one by one
+				for (int i = 0; i < numRays; ++i) results[i].hasTraced = false;
+				results->bounce = 0;
+				results->rayType = ROOT_TYPE;
+				results->ray = rays[lane];
+				results->hasTraced = true;
+				results->hasIntersect = false;
+				if (hit.objectIndex[lane] >= 0) {
+					cpu::fill_hit(pack, &rays[lane], hit.objectType[lane], hit.objectIndex[lane], hit.T[lane], hit.T2[lane], { hit.u[lane], hit.v[lane] }, results);
+				}
+				cpu::trace_tree(frameConfig, pack, results, true);
+
+				_cpu_writePixel(output, (int)frameConfig->width, (int)frameConfig->height, x, y, cpu::resolve_pixel(pack, &skyboxData, results, numRays));
+			}
+		}
+	}
+}
+
+void CPUTracer::benchmarkPrimaryRays() {
+	const int width = (int)config->width;
+	const int height = (int)config->height;
+	const unsigned int rowPackets = (width + PACKET_WIDTH - 1) / PACKET_WIDTH;
+	const unsigned int numPackets = rowPackets * ((height + PACKET_HEIGHT - 1) / PACKET_HEIGHT);
+	const RayConfig frameConfig = *config;
+	const cpu::WorldPack pack = getWorldPack();
+
+	// Hit object per pixel for both methods so they can be checked against each other
+	std::vector<int> scalarHits((size_t)width * height), packetHits((size_t)width * height);
+
+	auto start = std::chrono::steady_clock::now();
+	pool.run(height, [&](unsigned int y, unsigned int) {
+		TraceResult result;
+		result.rayType = ROOT_TYPE;
+		result.bounce = 0;
+		for (int x = 0; x < width; ++x) {
+			Ray ray = cpu::generateEyeRay(&frameConfig, x, y);
+			cpu::local_trace(&pack, &ray, &result);
+			scalarHits[(size_t)y * width + x] = result.hasIntersect ? (int)(result.objectIndex * 2 + result.objectType) : -1;
+		}
+	});
+	double scalarTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	pool.run(numPackets, [&](unsigned int packet, unsigned int) {
+		const int px = (packet % rowPackets) * PACKET_WIDTH;
+		const int py = (packet / rowPackets) * PACKET_HEIGHT;
+		Ray rays[PACKET_SIZE];
+		for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+			rays[lane] = cpu::generateEyeRay(&frameConfig, px + lane % PACKET_WIDTH, py + lane / PACKET_WIDTH);
+		}
+		cpu::PacketHit hit;
+		cpu::trace_packet(&pack, rays, &hit);
+		for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+			const int x = px + lane % PACKET_WIDTH;
+			const int y = py + lane / PACKET_WIDTH;
+			if (x >= width || y >= height) continue;
+			packetHits[(size_t)y * width + x] = hit.objectIndex[lane] >= 0 ? hit.objectIndex[lane] * 2 + hit.objectType[lane] : -1;
+		}
+	});
+	double packetTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t mismatches = 0;
+	for (size_t i = 0; i < scalarHits.size(); ++i) {
+		if (scalarHits[i] != packetHits[i]) mismatches++;
+	}
+
+	const double rays = (double)width * height;
+	std::cout << "Primary rays (" << pool.getThreadCount() << " threads):" << std::endl;
+	std::cout << "	Scalar:			" << rays / scalarTime / 1e6 << " Mrays/s" << std::endl;
+	std::cout << "	" << cpu::packet_isa() << " " << PACKET_WIDTH << "x" << PACKET_HEIGHT << " packets:	" << rays / packetTime / 1e6 << " Mrays/s (" << scalarTime / packetTime << "x)" << std::endl;
+	std::cout << "	Mismatched hits:	" << mismatches << std::endl;
+}
+
+void CPUTracer::checkLodSelection() {
+	const cpu::WorldPack pack = getWorldPack();
+	const cl_float2 centre = { 1.0f / 3.0f, 1.0f / 3.0f };
+
+	size_t rays = 0, biased = 0;
+	for (cl_uint m = 0; m < pack.world->numModels; ++m) {
+		const ModelStruct* model = pack.models + m;
+		if (model->lodCount <= 1) continue;
+
+		// A reflection ray leaving the centre of every sampled triangle of every level, along its normal
+		const cl_uint step = std::max(model->numTriangles / CPU_LOD_CHECK_RAYS, 1u);
+		for (cl_uint i = 0; i < model->numTriangles; i += step) {
+			const Triangle* triangle = pack.triangles + model->triangleOffset + i;
+			const cl_float3 v0 = pack.vertices[triangle->face.x], v1 = pack.vertices[triangle->face.y], v2 = pack.vertices[triangle->face.z];
+			const cl_float3 origin = { (v0.x + v1.x + v2.x) / 3.0f, (v0.y + v1.y + v2.y) / 3.0f, (v0.z + v1.z + v2.z) / 3.0f };
+			const cl_float3 normal = cpu::triangle_normal(&pack, triangle, centre);
+			float planeDotRayOrigin[BVH_PLANE_COUNT];
+			for (int plane_i = 0; plane_i < BVH_PLANE_COUNT; ++plane_i) {
+				planeDotRayOrigin[plane_i] = _world_dot(origin + normal * EPSILON, BVH_PlaneNormals[plane_i]);
+			}
+
+			const bool inside = cpu::bvh_contains(model, planeDotRayOrigin);
+			if (cpu::model_selectLod(model, inside, REFLECT_TYPE, 1) != model->lodLevel) biased++;
+			rays++;
+		}
+	}
+	if (rays == 0) return;
+	std::cout << "LOD check: " << biased << " of " << rays << " reflection rays leaving a model surface picked a coarser level than the hit" << std::endl;
+}
+
+void CPUTracer::destroy() {
+	pool.stop();
+	for (int i = 0; i < 6; ++i) {
+		if (skyboxImages[i] != nullptr) {
+			SOIL_free_image_data(skyboxImages[i]);
+			skyboxImages[i] = nullptr;
+		}
+	}
+}
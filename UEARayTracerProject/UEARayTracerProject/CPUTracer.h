@@ -0,0 +1,135 @@
+#pragma once
+#include <CL/opencl.h>
+#include <vector>
+#include <string>
+#include "World.h"
+#include "RARKernel.h"
+#include "ThreadPool.h"
+
+#define CPU_TILE_SIZE (16)
+// Triangles per model sampled by checkLodSelection
+#define CPU_LOD_CHECK_RAYS (1024)
+
+/**
+	Host ports of the OpenCL C in cl_kernels/func.h, rarkernel.cl and imageresolver.cl.
+	The functions keep the kernel names and follow the kernel code line by line so the two can be compared directly.
+*/
+namespace cpu {
+
+	// Mirrors the WorldPack struct in structs.h
+	struct WorldPack {
+		const WorldStruct* world;
+		const cl_float3* vertices;
+		const cl_uint* normals;
+		const Material* materials;
+		const Sphere* spheres;
+		const Triangle* triangles;
+		const ModelStruct* models;
+		const unsigned int* grid;
+		const unsigned int* triangleCountGrid;
+	};
+
+	struct SkyboxData {
+		const unsigned char* data;
+		int width, height;
+	};
+
+	int rar_getNumRays(int bounces);
+
+	Ray generateEyeRay(const RayConfig* config, int x, int y);
+
+	bool sphere_intersect(const Ray* ray, const Sphere* sphere, float* minT, float* maxT);
+
+	bool triangle_intersect(const Ray* ray, const Triangle* triangle, const cl_float3* vertices, cl_float2* barycentric, float* T);
+
+	cl_float3 triangle_normal(const WorldPack* pack, const Triangle* triangle, cl_float2 barycentric);
+
+	bool bvh_plane_intersect(const ModelStruct* model, const float* planeDotOrigin, const float* planeDotDirection, float* tNear, float* tFar, cl_uint* planeIndex);
+
+	// True when the point is within every slab of the model's k-DOP, give or take EPSILON for points on its surface
+	bool bvh_contains(const ModelStruct* model, const float* planeDotPoint);
+
+	cl_uint model_selectLod(const ModelStruct* model, bool inside, cl_uint rayType, cl_uint bounce);
+
+	bool model_intersect(const WorldPack* pack, const Ray* ray, unsigned char modelIndex, cl_uint level, float* closest_T, int* closest_I, cl_float2* closest_UV);
+
+	float fresnel(cl_float3 in, cl_float3 normal, float fromIOR, float toIOR);
+
+	cl_float3 phong(const TraceResult* trace, const Material* material);
+
+	cl_float3 skybox_cubemap(const SkyboxData* skybox, cl_float3 dir);
+
+	void local_trace(const WorldPack* pack, const Ray* ray, TraceResult* result);
+
+	// Fills in the intersection data of a result the same way local_trace does for its closest hit
+	void fill_hit(const WorldPack* pack, const Ray* ray, int objectType, int objectIndex, float T, float T2, cl_float2 barycentric, TraceResult* result);
+
+	// Traces the full ray tree of one pixel into results (rar_getNumRays(bounces) entries)
+	void trace_pixel(const RayConfig* config, const WorldPack* pack, int x, int y, TraceResult* results, int numRays);
+
+	// Traces the ray tree below results[0]. If rootTraced is set the root ray has already been traced (e.g. by the packet tracer).
+	void trace_tree(const RayConfig* config, const WorldPack* pack, TraceResult* results, bool rootTraced);
+
+	// Resolves the ray tree of one pixel into a colour
+	cl_float3 resolve_pixel(const WorldPack* pack, const SkyboxData* skybox, const TraceResult* results, int numRays);
+
+}
+
+/**
+	Multithreaded native ray tracer working on the same World and RayConfig data as the OpenCL kernels.
+	The image is split into CPU_TILE_SIZE square tiles which are distributed over a work-stealing thread pool.
+*/
+class CPUTracer {
+
+	World* world = nullptr;
+	RayConfig* config = nullptr;
+
+	ThreadPool pool;
+	unsigned int numThreads = 0;
+
+	// Trace primary rays in SIMD packets (see PacketTracer.h)
+	bool usePackets = false;
+
+	// Per-worker storage for one pixel's ray tree
+	std::vector<std::vector<TraceResult>> scratch;
+
+	unsigned char* skyboxImages[6] = { nullptr ,nullptr ,nullptr ,nullptr ,nullptr ,nullptr };
+	std::vector<unsigned char> skybox;
+	cpu::SkyboxData skyboxData;
+
+	double lastFrameTime = 0.0;
+
+	cpu::WorldPack getWorldPack();
+
+	void renderTilePixels(const RayConfig* frameConfig, const cpu::WorldPack* pack, TraceResult* results, int x0, int y0, int x1, int y1, unsigned char* output);
+
+	void renderTilePackets(const RayConfig* frameConfig, const cpu::WorldPack* pack, TraceResult* results, int x0, int y0, int x1, int y1, unsigned char* output);
+
+public:
+	CPUTracer();
+	~CPUTracer();
+
+	inline void setWorldPtr(World* ptr) { world = ptr; }
+	inline void setPrimaryConfig(RayConfig* ptr) { config = ptr; }
+	inline void setThreadCount(unsigned int count) { numThreads = count; }
+	inline void setPacketTracing(bool enabled) { usePackets = enabled; }
+
+	inline unsigned int getThreadCount() { return pool.getThreadCount(); }
+
+	// Host time in seconds spent in the last call to render
+	inline double getLastFrameTime() { return lastFrameTime; }
+
+	void create();
+
+	// Renders config->width * config->height pixels into an RGBA8 buffer laid out like the kernel output image
+	void render(unsigned char* output);
+
+	// Times primary visibility alone with single rays and with packets over the whole image, and prints rays per second for both
+	void benchmarkPrimaryRays();
+
+	// Checks that reflection rays leaving the surface of a model with levels of detail stay on the level they hit, and prints how many don't
+	void checkLodSelection();
+
+	void destroy();
+
+};
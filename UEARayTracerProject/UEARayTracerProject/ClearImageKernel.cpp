@@ -27,6 +27,7 @@ cl_event ClearImageKernel::queue(cl_uint num_events, cl_event* wait_events) {
 	const size_t workgroupSize[2] = { cfg->res.x, cfg->res.y };
 	cl_int err = clEnqueueNDRangeKernel(cl::queue, getKernel(), 2, workgroupOffset, workgroupSize, NULL, num_events, wait_events, &queueEvent);
 	cl::printErrorMsg("Clear Image Kernel Queue", __LINE__, __FILE__, err);
+	cl::profiler::record(getKernelName(), queueEvent);
 	return queueEvent;
 }
 
@@ -1,7 +1,11 @@
 #include "ImageResolverKernel.h"
 #include <SOIL.h>
+#include <string.h>
+#include <algorithm>
 
 ImageResolverKernel::ImageResolverKernel() : CLKernel("ResolveImage") {
+	config.debugMode = DEBUG_MODE_SHADED;
+	config.heatmapScale = 1.0f;
 }
 
 ImageResolverKernel::~ImageResolverKernel() {
@@ -30,7 +34,7 @@ void ImageResolverKernel::create() {
 
 	// Config buffer
 	config.skyboxSize = { skyboxWidth, skyboxHeight };
-	configBuffer = clCreateBuffer(cl::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(config), &config, &err);
+	configBuffer = cl::memory::createBuffer(MEMORY_CONFIG, "Image Config Buffer", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(config), &config, &err);
 
 	// Skybox buffers
 	size_t rgbsize = (size_t)skyboxWidth * skyboxHeight * 3;
@@ -38,23 +42,42 @@ void ImageResolverKernel::create() {
 	for (int i = 0; i < 6; ++i) {
 		memcpy(skbuf + (i * rgbsize), skyboxImages[i], rgbsize * sizeof(unsigned char));
 	}
-	skyboxBuffer = clCreateBuffer(cl::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 6 * rgbsize * sizeof(unsigned char), skbuf, &err);
+	skyboxBuffer = cl::memory::createBuffer(MEMORY_SKYBOX, "Skybox Buffer", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 6 * rgbsize * sizeof(unsigned char), skbuf, &err);
 	cl::printErrorMsg("Image Resolver Skybox Buffer", __LINE__, __FILE__, err);
 	delete[] skbuf;
 
-	outputImageBuffer = clCreateFromGLTexture(cl::context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, texture, &err);
-	cl::printErrorMsg("Image Resolver Output Buffer", __LINE__, __FILE__, err);
-
 	// Output image buffer
-	if (texture == 0) {
-		std::cout << "Texture is empty. Cannot create image resolver kernel without texture/output image buffer." << std::endl;
-		return;
+	const size_t outputImageSize = (size_t)config.res.x * config.res.y * 4;
+	if (!cl::memory::canAllocate("Output Image", outputImageSize)) return;
+	if (headless) {
+		// Plain device image which is read back to the host instead of being shared with GL
+		cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
+		cl_image_desc desc;
+		memset(&desc, 0, sizeof(desc));
+		desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+		desc.image_width = config.res.x;
+		desc.image_height = config.res.y;
+		outputImageBuffer = clCreateImage(cl::context, CL_MEM_WRITE_ONLY, &format, &desc, NULL, &err);
+		cl::printErrorMsg("Image Resolver Headless Output Buffer", __LINE__, __FILE__, err);
+	} else {
+		if (texture == 0) {
+			std::cout << "Texture is empty. Cannot create image resolver kernel without texture/output image buffer." << std::endl;
+			return;
+		}
+		outputImageBuffer = clCreateFromGLTexture(cl::context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, texture, &err);
+		cl::printErrorMsg("Image Resolver Output Buffer", __LINE__, __FILE__, err);
 	}
-	outputImageBuffer = clCreateFromGLTexture(cl::context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, texture, &err);
+	if (err == CL_SUCCESS) cl::memory::track(MEMORY_IMAGE, "Output Image", outputImageBuffer, outputImageSize);
 
-	// Set Kernel Args
+	heatmapMaxBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Heatmap Max Buffer", CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err);
+	cl::printErrorMsg("Image Resolver Heatmap Max Buffer", __LINE__, __FILE__, err);
+
+	setArgs();
+	configDirty = false;
+}
 
-	err = clSetKernelArg(getKernel(), 0, sizeof(outputImageBuffer), &outputImageBuffer);
+void ImageResolverKernel::setArgs() {
+	cl_int err = clSetKernelArg(getKernel(), 0, sizeof(outputImageBuffer), &outputImageBuffer);
 	cl::printErrorMsg("Image Resolver Output Image Kernel Arg", __LINE__, __FILE__, err);
 
 	err = clSetKernelArg(getKernel(), 1, sizeof(*rayConfig), rayConfig);
@@ -63,14 +86,14 @@ void ImageResolverKernel::create() {
 	err = clSetKernelArg(getKernel(), 2, sizeof(configBuffer), &configBuffer);
 	cl::printErrorMsg("Image Resolver Config Kernel Arg", __LINE__, __FILE__, err);
 
-	err = clSetKernelArg(getKernel(), 3, sizeof(*rayBuffer), rayBuffer);
-	cl::printErrorMsg("Image Resolver Ray Kernel Arg", __LINE__, __FILE__, err);
-
 	err = clSetKernelArg(getKernel(), 4, sizeof(skyboxBuffer), &skyboxBuffer);
 	cl::printErrorMsg("Image Resolver Skybox Kernel Arg", __LINE__, __FILE__, err);
 
 	err = clSetKernelArg(getKernel(), 5, sizeof(*materialBuffer), materialBuffer);
 	cl::printErrorMsg("Image Resolver Material Buffer Arg", __LINE__, __FILE__, err);
+
+	err = clSetKernelArg(getKernel(), 6, sizeof(heatmapMaxBuffer), &heatmapMaxBuffer);
+	cl::printErrorMsg("Image Resolver Heatmap Max Arg", __LINE__, __FILE__, err);
 }
 
 cl_event ImageResolverKernel::update() {
@@ -81,9 +104,74 @@ void ImageResolverKernel::destroy() {
 }
 
 cl_event ImageResolverKernel::queue(cl_uint num_events, cl_event* wait_events) {
-	const size_t workgroupOffset[2] = { 0, 0 };
-	const size_t workgroupSize[2] = { config.res.x, config.res.y};
-	cl_int err = clEnqueueNDRangeKernel(cl::queue, getKernel(), 2, workgroupOffset, workgroupSize, NULL, num_events, wait_events, &queueEvent);
+	const bool heatmap = config.debugMode != DEBUG_MODE_SHADED;
+
+	cl_int err = clSetKernelArg(getKernel(), 3, sizeof(*rayBuffer), rayBuffer);
+	cl::printErrorMsg("Image Resolver Ray Kernel Arg", __LINE__, __FILE__, err);
+
+	// Mode or scale changed since the last frame
+	if (configDirty) {
+		cl_event writeEvent;
+		err = clEnqueueWriteBuffer(cl::queue, configBuffer, true, 0, sizeof(config), &config, 0, NULL, &writeEvent);
+		cl::printErrorMsg("Image Resolver Config Write", __LINE__, __FILE__, err);
+		if (err == CL_SUCCESS) {
+			cl::profiler::record("Image Resolver Config Write", writeEvent);
+			clReleaseEvent(writeEvent);
+		}
+		configDirty = false;
+	}
+
+	// The largest cost is kept across the tiles of a frame
+	if (heatmap && tile->index == 0) {
+		const cl_uint zero = 0;
+		cl_event fillEvent;
+		err = clEnqueueFillBuffer(cl::queue, heatmapMaxBuffer, &zero, sizeof(zero), 0, sizeof(zero), 0, NULL, &fillEvent);
+		cl::printErrorMsg("Image Resolver Heatmap Max Clear", __LINE__, __FILE__, err);
+		if (err == CL_SUCCESS) {
+			cl::profiler::record("Image Resolver Heatmap Max Clear", fillEvent);
+			clReleaseEvent(fillEvent);
+		}
+	}
+
+	err = enqueueTileKernel(getKernel(), *tile, getLocalSize(), num_events, wait_events, &queueEvent);
 	cl::printErrorMsg("Image Resolver Kernel Queue", __LINE__, __FILE__, err);
+	if (err != CL_SUCCESS) return queueEvent = NULL;
+	cl::profiler::record(getKernelName(), queueEvent);
+
+	if (heatmap && heatmapMaxEvent == NULL && tile->index + 1 == tile->count) {
+		err = clEnqueueReadBuffer(cl::queue, heatmapMaxBuffer, false, 0, sizeof(cl_uint), &heatmapMaxReadback, 1, &queueEvent, &heatmapMaxEvent);
+		cl::printErrorMsg("Image Resolver Heatmap Max Read", __LINE__, __FILE__, err);
+		if (err != CL_SUCCESS) heatmapMaxEvent = NULL;
+		cl::profiler::record("Image Resolver Heatmap Max Read", heatmapMaxEvent);
+	}
 	return queueEvent;
 }
+
+bool ImageResolverKernel::readHeatmapMax(cl_uint* max) {
+	if (heatmapMaxEvent == NULL) return false;
+
+	cl_int status = CL_QUEUED;
+	cl::readEventStatus(heatmapMaxEvent, &status);
+	if (status > CL_COMPLETE) return false;
+
+	clReleaseEvent(heatmapMaxEvent);
+	heatmapMaxEvent = NULL;
+	if (status < 0) return false;
+
+	*max = heatmapMaxReadback;
+	if (fixedHeatmapScale <= 0.0f && config.heatmapScale != (float)std::max(*max, 1u)) {
+		config.heatmapScale = (float)std::max(*max, 1u);
+		configDirty = true;
+	}
+	return true;
+}
+
+cl_event ImageResolverKernel::readImage(unsigned char* output, cl_uint num_events, cl_event* wait_events) {
+	cl_event readEvent;
+	const size_t origin[3] = { 0, 0, 0 };
+	const size_t region[3] = { (size_t)config.res.x, (size_t)config.res.y, 1 };
+	cl_int err = clEnqueueReadImage(cl::queue, outputImageBuffer, false, origin, region, 0, 0, output, num_events, wait_events, &readEvent);
+	cl::printErrorMsg("Image Resolver Read Image", __LINE__, __FILE__, err);
+	cl::profiler::record("Image Resolver Read Image", readEvent);
+	return readEvent;
+}
@@ -8,14 +8,28 @@
 #include "cl_helper.h"
 #include "RARKernel.h"
 
-__declspec (align(16)) struct ImageConfig {
+// Output modes, mirrors the DEBUG_MODE_ defines in cl_kernels/defines.h
+#define DEBUG_MODE_SHADED (0)
+#define DEBUG_MODE_TESTS (1)
+#define DEBUG_MODE_STEPS (2)
+#define DEBUG_MODE_COUNT (3)
+#define DEBUG_MODE_NAMES { "shaded", "tests", "steps" }
+
+struct alignas(16) ImageConfig {
 	cl_int2 skyboxSize;
 	cl_int2 res;
+	cl_int debugMode;
+	cl_float heatmapScale;
+	cl_int pad[2];
 };
 
+// Loads the six skybox faces (RGB) from the skybox folder
+void _image_loadSkyboxTexture(unsigned char** skyboxImages, int* width, int* height);
+
 class ImageResolverKernel : public CLKernel {
 
 	cl_mem* rayBuffer;
+	const Tile* tile;
 	cl_mem* rayConfig;
 	cl_mem* materialBuffer;
 
@@ -28,6 +42,15 @@ class ImageResolverKernel : public CLKernel {
 	GLuint texture;
 	cl_mem outputImageBuffer;
 
+	bool headless = false;
+
+	// Heatmap modes. A fixed scale of 0 scales to the largest cost of the last frame read back.
+	float fixedHeatmapScale = 0.0f;
+	bool configDirty = false;
+	cl_mem heatmapMaxBuffer;
+	cl_uint heatmapMaxReadback = 0;
+	cl_event heatmapMaxEvent = NULL;
+
 	cl_event updateEvent;
 	cl_event queueEvent;
 
@@ -36,24 +59,39 @@ public:
 	~ImageResolverKernel();
 
 	inline void setRayBuffer(cl_mem* ptr) { rayBuffer = ptr; }
+	inline void setTile(const Tile* ptr) { tile = ptr; }
 	inline void setTexture(GLuint t) { texture = t; }
+	inline void setHeadless(bool h) { headless = h; }
 	inline void setResolution(int w, int h) { config.res.x = w; config.res.y = h; };
 
 	inline void setMaterialBuffer(cl_mem* ptr) { materialBuffer = ptr; }
 
 	inline void setRayConfig(cl_mem* ptr) { rayConfig = ptr; }
 
+	inline void setDebugMode(int mode) { config.debugMode = mode; configDirty = true; }
+	inline int getDebugMode() { return config.debugMode; }
+	inline void setHeatmapScale(float scale) { fixedHeatmapScale = scale; config.heatmapScale = scale > 0.0f ? scale : 1.0f; configDirty = true; }
+	inline float getHeatmapScale() { return config.heatmapScale; }
+
+	// Returns true and sets max to the largest per pixel cost of a heatmap frame (all of its tiles) once its read back has finished
+	bool readHeatmapMax(cl_uint* max);
+
 	inline ImageConfig* getImageConfig() { return &config; }
 	inline cl_mem* getImageConfigBufferPtr() { return &configBuffer; }
 	inline cl_mem* getImageBufferPtr() { return &outputImageBuffer; }
 
 	virtual void create() override;
 
+	virtual void setArgs() override;
+
 	virtual cl_event update() override;
 
 	virtual void destroy() override;
 
 	virtual cl_event queue(cl_uint num_events, cl_event* wait_events) override;
 
+	// Non-blocking read of the output image into an RGBA8 host buffer of res.x * res.y * 4 bytes
+	cl_event readImage(unsigned char* output, cl_uint num_events, cl_event* wait_events);
+
 };
 
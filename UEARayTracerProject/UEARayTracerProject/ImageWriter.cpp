@@ -0,0 +1,124 @@
+#include "ImageWriter.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <stdint.h>
+#include <algorithm>
+
+#define PNG_MAX_STORED_BLOCK (65535)
+
+uint32_t _image_crcTable[256];
+bool _image_crcTableReady = false;
+
+void _image_createCrcTable() {
+	for (uint32_t n = 0; n < 256; ++n) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; ++k) {
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		_image_crcTable[n] = c;
+	}
+	_image_crcTableReady = true;
+}
+
+uint32_t _image_crc(uint32_t crc, const unsigned char* data, size_t length) {
+	if (!_image_crcTableReady) _image_createCrcTable();
+	for (size_t i = 0; i < length; ++i) {
+		crc = _image_crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+void _image_pushU32(std::vector<unsigned char>& out, uint32_t value) {
+	out.push_back((value >> 24) & 0xFF);
+	out.push_back((value >> 16) & 0xFF);
+	out.push_back((value >> 8) & 0xFF);
+	out.push_back(value & 0xFF);
+}
+
+void _image_writeChunk(std::ofstream& file, const char* type, const std::vector<unsigned char>& data) {
+	std::vector<unsigned char> chunk;
+	chunk.reserve(data.size() + 12);
+	_image_pushU32(chunk, (uint32_t)data.size());
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	// CRC covers the chunk type and data but not the length
+	uint32_t crc = _image_crc(0xFFFFFFFFu, &chunk[4], chunk.size() - 4) ^ 0xFFFFFFFFu;
+	_image_pushU32(chunk, crc);
+	file.write((const char*)&chunk[0], chunk.size());
+}
+
+namespace image {
+
+	bool writePNG(const std::string& path, int width, int height, const unsigned char* rgba) {
+		std::ofstream file(path, std::ios::out | std::ios::binary);
+		if (!file.is_open()) {
+			std::cout << "Could not open " << path << " for writing." << std::endl;
+			return false;
+		}
+
+		const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		file.write((const char*)signature, sizeof(signature));
+
+		// Header: 8 bits per channel, colour type 6 (RGBA)
+		std::vector<unsigned char> header;
+		_image_pushU32(header, (uint32_t)width);
+		_image_pushU32(header, (uint32_t)height);
+		header.push_back(8);
+		header.push_back(6);
+		header.push_back(0);
+		header.push_back(0);
+		header.push_back(0);
+		_image_writeChunk(file, "IHDR", header);
+
+		// Raw scanlines each prefixed by filter type 0
+		const size_t rowSize = (size_t)width * 4;
+		std::vector<unsigned char> raw;
+		raw.reserve((rowSize + 1) * height);
+		for (int y = 0; y < height; ++y) {
+			raw.push_back(0);
+			raw.insert(raw.end(), rgba + y * rowSize, rgba + (y + 1) * rowSize);
+		}
+
+		/**
+			Zlib stream using stored (uncompressed) deflate blocks.
+			Adler-32 checksum of the uncompressed data follows the final block.
+		*/
+		std::vector<unsigned char> idat;
+		idat.reserve(raw.size() + (raw.size() / PNG_MAX_STORED_BLOCK + 1) * 5 + 6);
+		idat.push_back(0x78);
+		idat.push_back(0x01);
+		uint32_t adlerA = 1, adlerB = 0;
+		for (size_t offset = 0; offset < raw.size() || offset == 0; offset += PNG_MAX_STORED_BLOCK) {
+			size_t blockSize = std::min((size_t)PNG_MAX_STORED_BLOCK, raw.size() - offset);
+			bool last = offset + blockSize >= raw.size();
+			idat.push_back(last ? 1 : 0);
+			idat.push_back(blockSize & 0xFF);
+			idat.push_back((blockSize >> 8) & 0xFF);
+			idat.push_back(~blockSize & 0xFF);
+			idat.push_back((~blockSize >> 8) & 0xFF);
+			for (size_t i = 0; i < blockSize; ++i) {
+				unsigned char byte = raw[offset + i];
+				idat.push_back(byte);
+				adlerA = (adlerA + byte) % 65521;
+				adlerB = (adlerB + adlerA) % 65521;
+			}
+			if (last) break;
+		}
+		_image_pushU32(idat, (adlerB << 16) | adlerA);
+		_image_writeChunk(file, "IDAT", idat);
+
+		_image_writeChunk(file, "IEND", std::vector<unsigned char>());
+
+		file.close();
+		return true;
+	}
+
+	std::string getFrameFilename(const std::string& prefix, int frame) {
+		std::ostringstream stream;
+		stream << prefix << "_" << std::setw(4) << std::setfill('0') << frame << ".png";
+		return stream.str();
+	}
+
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <string>
+#include <vector>
+
+namespace image {
+
+	/**
+		Writes 8-bit RGBA pixel data (rows top to bottom) to a PNG file.
+		The image data is stored uncompressed so encoding is cheap enough to run alongside rendering.
+	*/
+	bool writePNG(const std::string& path, int width, int height, const unsigned char* rgba);
+
+	std::string getFrameFilename(const std::string& prefix, int frame);
+
+}
@@ -0,0 +1,245 @@
+#include "Lod.h"
+#include <queue>
+#include <algorithm>
+#include <iterator>
+#include <math.h>
+
+int lodLevels = MODEL_LOD_LEVELS;
+float lodDistanceFactor = DEFAULT_LOD_DISTANCE;
+
+// Symmetric 4x4 matrix stored as its upper triangle: xx xy xz xw yy yz yw zz zw ww
+struct LodQuadric {
+	double a[10] = {};
+};
+
+struct LodCollapse {
+	double cost;
+	unsigned int from;
+	unsigned int to;
+	unsigned int fromVersion;
+	unsigned int toVersion;
+
+	bool operator>(const LodCollapse& other) const { return cost > other.cost; }
+};
+
+struct LodState {
+	const std::vector<cl_float3>* positions;
+	std::vector<unsigned int> triangles; // 3 per triangle
+	std::vector<bool> alive; // Per triangle
+	size_t aliveCount;
+	std::vector<std::vector<unsigned int>> vertexTriangles; // May still list dead triangles
+	std::vector<LodQuadric> quadrics;
+	std::vector<unsigned int> versions; // Bumped whenever the quadric or the triangles of a vertex change, which invalidates queued collapses
+	std::vector<bool> removed;
+	std::priority_queue<LodCollapse, std::vector<LodCollapse>, std::greater<LodCollapse>> queue;
+};
+
+void _lod_addPlane(LodQuadric* q, cl_float3 normal, double d, double weight) {
+	const double x = normal.x, y = normal.y, z = normal.z;
+	q->a[0] += weight * x * x; q->a[1] += weight * x * y; q->a[2] += weight * x * z; q->a[3] += weight * x * d;
+	q->a[4] += weight * y * y; q->a[5] += weight * y * z; q->a[6] += weight * y * d;
+	q->a[7] += weight * z * z; q->a[8] += weight * z * d;
+	q->a[9] += weight * d * d;
+}
+
+// Error of (a + b) at p
+double _lod_error(const LodQuadric& a, const LodQuadric& b, const cl_float3& p) {
+	double q[10];
+	for (int i = 0; i < 10; ++i) q[i] = a.a[i] + b.a[i];
+	const double x = p.x, y = p.y, z = p.z;
+	return q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x
+		+ q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y
+		+ q[7] * z * z + 2.0 * q[8] * z
+		+ q[9];
+}
+
+inline bool _lod_contains(const LodState& state, unsigned int triangle, unsigned int vertex) {
+	const unsigned int* t = &state.triangles[triangle * 3];
+	return t[0] == vertex || t[1] == vertex || t[2] == vertex;
+}
+
+void _lod_push(LodState* state, unsigned int from, unsigned int to) {
+	const double cost = _lod_error(state->quadrics[from], state->quadrics[to], (*state->positions)[to]);
+	state->queue.push({ cost, from, to, state->versions[from], state->versions[to] });
+}
+
+// Sorted vertices sharing an alive triangle with vertex
+std::vector<unsigned int> _lod_neighbours(const LodState& state, unsigned int vertex) {
+	std::vector<unsigned int> neighbours;
+	for (unsigned int triangle : state.vertexTriangles[vertex]) {
+		if (!state.alive[triangle]) continue;
+		for (int v = 0; v < 3; ++v) {
+			unsigned int other = state.triangles[triangle * 3 + v];
+			if (other != vertex) neighbours.push_back(other);
+		}
+	}
+	std::sort(neighbours.begin(), neighbours.end());
+	neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+	return neighbours;
+}
+
+bool _lod_canCollapse(const LodState& state, unsigned int from, unsigned int to) {
+	// Link condition: the only vertices next to both ends may be the ones opposite the edge, otherwise the collapse pinches the surface
+	size_t shared = 0;
+	for (unsigned int triangle : state.vertexTriangles[from]) {
+		if (state.alive[triangle] && _lod_contains(state, triangle, to)) shared++;
+	}
+	if (shared == 0) return false;
+	std::vector<unsigned int> fromNeighbours = _lod_neighbours(state, from);
+	std::vector<unsigned int> toNeighbours = _lod_neighbours(state, to);
+	std::vector<unsigned int> common;
+	std::set_intersection(fromNeighbours.begin(), fromNeighbours.end(), toNeighbours.begin(), toNeighbours.end(), std::back_inserter(common));
+	if (common.size() > shared) return false;
+
+	// Reject collapses that flip or degenerate the triangles which keep their area
+	const std::vector<cl_float3>& positions = *state.positions;
+	for (unsigned int triangle : state.vertexTriangles[from]) {
+		if (!state.alive[triangle] || _lod_contains(state, triangle, to)) continue;
+		cl_float3 before[3], after[3];
+		for (int v = 0; v < 3; ++v) {
+			unsigned int vertex = state.triangles[triangle * 3 + v];
+			before[v] = positions[vertex];
+			after[v] = positions[vertex == from ? to : vertex];
+		}
+		cl_float3 normalBefore = _world_cross(before[1] - before[0], before[2] - before[0]);
+		cl_float3 normalAfter = _world_cross(after[1] - after[0], after[2] - after[0]);
+		double lengths = (double)_world_computeLength(normalBefore) * _world_computeLength(normalAfter);
+		if (lengths <= 0.0 || _world_dot(normalBefore, normalAfter) < LOD_MIN_NORMAL_COSINE * lengths) return false;
+	}
+	return true;
+}
+
+void _lod_collapse(LodState* state, unsigned int from, unsigned int to) {
+	for (unsigned int triangle : state->vertexTriangles[from]) {
+		if (!state->alive[triangle]) continue;
+		if (_lod_contains(*state, triangle, to)) {
+			state->alive[triangle] = false;
+			state->aliveCount--;
+			continue;
+		}
+		for (int v = 0; v < 3; ++v) {
+			if (state->triangles[triangle * 3 + v] == from) state->triangles[triangle * 3 + v] = to;
+		}
+		state->vertexTriangles[to].push_back(triangle);
+	}
+	std::vector<unsigned int>().swap(state->vertexTriangles[from]);
+	state->removed[from] = true;
+
+	for (int i = 0; i < 10; ++i) state->quadrics[to].a[i] += state->quadrics[from].a[i];
+	state->versions[to]++;
+
+	std::vector<unsigned int>& triangles = state->vertexTriangles[to];
+	triangles.erase(std::remove_if(triangles.begin(), triangles.end(), [&](unsigned int triangle) { return !state->alive[triangle]; }), triangles.end());
+
+	for (unsigned int neighbour : _lod_neighbours(*state, to)) {
+		_lod_push(state, to, neighbour);
+		_lod_push(state, neighbour, to);
+	}
+}
+
+namespace lod {
+
+	void setLevels(int levels) {
+		lodLevels = std::max(1, std::min(levels, MODEL_LOD_LEVELS));
+	}
+
+	int getLevels() {
+		return lodLevels;
+	}
+
+	void setDistanceFactor(float factor) {
+		lodDistanceFactor = factor;
+	}
+
+	float getDistanceFactor() {
+		return lodDistanceFactor;
+	}
+
+	void simplify(const std::vector<cl_float3>& positions, const std::vector<unsigned int>& indices, size_t targetTriangles, std::vector<unsigned int>* simplified) {
+		LodState state;
+		state.positions = &positions;
+		state.triangles.assign(indices.begin(), indices.begin() + indices.size() / 3 * 3);
+		const size_t triangleCount = state.triangles.size() / 3;
+		state.alive.assign(triangleCount, true);
+		state.aliveCount = triangleCount;
+		state.vertexTriangles.resize(positions.size());
+		state.quadrics.resize(positions.size());
+		state.versions.assign(positions.size(), 0);
+		state.removed.assign(positions.size(), false);
+
+		// Area weighted plane of every triangle
+		struct LodEdge { unsigned int a, b, triangle; };
+		std::vector<LodEdge> edges;
+		edges.reserve(state.triangles.size());
+		for (unsigned int t = 0; t < triangleCount; ++t) {
+			const unsigned int* v = &state.triangles[t * 3];
+			cl_float3 normal = _world_cross(positions[v[1]] - positions[v[0]], positions[v[2]] - positions[v[0]]);
+			float length = _world_computeLength(normal);
+			for (int i = 0; i < 3; ++i) {
+				state.vertexTriangles[v[i]].push_back(t);
+				edges.push_back({ std::min(v[i], v[(i + 1) % 3]), std::max(v[i], v[(i + 1) % 3]), t });
+			}
+			if (!(length > 0.0f)) continue;
+			normal = normal * (1.0f / length);
+			for (int i = 0; i < 3; ++i) _lod_addPlane(&state.quadrics[v[i]], normal, -_world_dot(normal, positions[v[0]]), length * 0.5);
+		}
+
+		// Edges used by a single triangle are on an open border. A plane through the edge, perpendicular to the triangle, keeps it from moving inwards.
+		std::sort(edges.begin(), edges.end(), [](const LodEdge& x, const LodEdge& y) { return x.a != y.a ? x.a < y.a : x.b < y.b; });
+		for (size_t i = 0; i < edges.size();) {
+			size_t j = i + 1;
+			while (j < edges.size() && edges[j].a == edges[i].a && edges[j].b == edges[i].b) ++j;
+			const LodEdge& edge = edges[i];
+			if (j - i == 1) {
+				const unsigned int* v = &state.triangles[edge.triangle * 3];
+				cl_float3 faceNormal = _world_cross(positions[v[1]] - positions[v[0]], positions[v[2]] - positions[v[0]]);
+				cl_float3 direction = positions[edge.b] - positions[edge.a];
+				cl_float3 normal = _world_cross(direction, faceNormal);
+				float length = _world_computeLength(normal);
+				if (length > 0.0f) {
+					normal = normal * (1.0f / length);
+					double weight = LOD_BOUNDARY_WEIGHT * _world_dot(direction, direction);
+					_lod_addPlane(&state.quadrics[edge.a], normal, -_world_dot(normal, positions[edge.a]), weight);
+					_lod_addPlane(&state.quadrics[edge.b], normal, -_world_dot(normal, positions[edge.a]), weight);
+				}
+			}
+			if (edge.a != edge.b) {
+				_lod_push(&state, edge.a, edge.b);
+				_lod_push(&state, edge.b, edge.a);
+			}
+			i = j;
+		}
+		std::vector<LodEdge>().swap(edges);
+
+		while (state.aliveCount > targetTriangles && !state.queue.empty()) {
+			LodCollapse collapse = state.queue.top();
+			state.queue.pop();
+			if (state.removed[collapse.from] || state.removed[collapse.to]) continue;
+			if (state.versions[collapse.from] != collapse.fromVersion || state.versions[collapse.to] != collapse.toVersion) continue;
+			if (!_lod_canCollapse(state, collapse.from, collapse.to)) continue;
+			_lod_collapse(&state, collapse.from, collapse.to);
+		}
+
+		simplified->clear();
+		simplified->reserve(state.aliveCount * 3);
+		for (size_t t = 0; t < triangleCount; ++t) {
+			if (!state.alive[t]) continue;
+			simplified->insert(simplified->end(), state.triangles.begin() + t * 3, state.triangles.begin() + t * 3 + 3);
+		}
+	}
+
+	cl_uint selectLevel(const ModelStruct& model, cl_float3 camera) {
+		if (model.lodCount <= 1 || !(model.lodDistance > 0.0f)) return 0;
+
+		// Distance to the box of the first three k-DOP axes
+		float distanceSq = 0.0f;
+		for (int axis = 0; axis < 3; ++axis) {
+			if (camera.s[axis] < model.bounds[axis].x) distanceSq += SQ(model.bounds[axis].x - camera.s[axis]);
+			else if (camera.s[axis] > model.bounds[axis].y) distanceSq += SQ(camera.s[axis] - model.bounds[axis].y);
+		}
+		float distance = sqrtf(distanceSq);
+		if (distance < model.lodDistance) return 0;
+		return std::min(1 + (cl_uint)log2f(distance / model.lodDistance), model.lodCount - 1);
+	}
+
+}
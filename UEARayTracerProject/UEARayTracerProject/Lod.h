@@ -0,0 +1,41 @@
+#pragma once
+#include <CL/opencl.h>
+#include <vector>
+#include "World.h"
+
+// Each level keeps about this fraction of the triangles of the previous one. A quarter keeps the on-screen density as every level starts at twice the distance.
+#define LOD_TRIANGLE_RATIO (0.25f)
+// Levels are not generated below this many triangles, or when the simplifier can't get under this fraction of the previous level
+#define LOD_MIN_TRIANGLES (64)
+#define LOD_MAX_RATIO (0.75f)
+// Distance at which level 1 starts, as a multiple of the diagonal of the model bounds
+#define DEFAULT_LOD_DISTANCE (4.0f)
+// Weight of the planes that keep open borders in place, relative to the squared edge length
+#define LOD_BOUNDARY_WEIGHT (1000.0)
+// Collapses that turn a triangle further than this (cosine between the old and new normal) are rejected
+#define LOD_MIN_NORMAL_COSINE (0.2)
+
+/**
+	Level of detail meshes for imported models. Levels are built with quadric error edge collapse (Garland and Heckbert) restricted to collapsing
+	onto one of the edge's vertices, so every level indexes the vertices of the full model and stays inside its bounds and grid.
+	The level of each model is picked per frame from the camera distance (see World::selectLods). Rays that start outside a model's bounds
+	go further down for every bounce and for shadow rays (LOD_BOUNCE_BIAS and LOD_SHADOW_BIAS in cl_kernels/defines.h).
+*/
+namespace lod {
+
+	// Set before any model is loaded (--lod-levels, --lod-distance). Both are part of the scene cache key.
+	void setLevels(int levels);
+	int getLevels();
+
+	void setDistanceFactor(float factor);
+	float getDistanceFactor();
+
+	/**
+		Simplifies a triangle list (3 indices per triangle into positions) until at most targetTriangles are left or no collapse is possible.
+		simplified uses the same positions.
+	*/
+	void simplify(const std::vector<cl_float3>& positions, const std::vector<unsigned int>& indices, size_t targetTriangles, std::vector<unsigned int>* simplified);
+
+	cl_uint selectLevel(const ModelStruct& model, cl_float3 camera);
+
+}
@@ -0,0 +1,86 @@
+#include "MappedFile.h"
+#include <iostream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() : data(nullptr), size(0) {
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+#else
+	fd = -1;
+#endif
+}
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+bool MappedFile::open(const std::string& path) {
+	close();
+
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		close();
+		return false;
+	}
+	size = (size_t)fileSize.QuadPart;
+	if (size == 0) return true; // Empty files can't be mapped
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping != NULL) data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		close();
+		return false;
+	}
+	size = (size_t)info.st_size;
+	if (size == 0) return true;
+
+	void* address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (address != MAP_FAILED) {
+		data = (const char*)address;
+		madvise(address, size, MADV_SEQUENTIAL);
+	}
+#endif
+
+	if (data == nullptr) {
+		std::cout << "Could not memory map " << path << std::endl;
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close() {
+#ifdef _WIN32
+	if (data != nullptr) UnmapViewOfFile(data);
+	if (mapping != NULL) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (data != nullptr) munmap((void*)data, size);
+	if (fd >= 0) ::close(fd);
+	fd = -1;
+#endif
+	data = nullptr;
+	size = 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include <stddef.h>
+
+/**
+	Read-only memory mapping of a whole file.
+	The mapping stays valid until close() or destruction, so keep the object alive as long as getData() is used.
+*/
+class MappedFile {
+
+	const char* data;
+	size_t size;
+
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int fd;
+#endif
+
+public:
+	MappedFile();
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const std::string& path);
+
+	void close();
+
+	inline bool isOpen() const { return data != nullptr; }
+
+	inline const char* getData() const { return data; }
+
+	inline size_t getSize() const { return size; }
+
+};
@@ -1,7 +1,7 @@
 #pragma once
 #include <CL/opencl.h>
 
-__declspec (align(16)) struct Material {
+struct alignas(16) Material {
 	cl_float3 diffuse;
 	cl_float specular;
 	cl_float reflectivity;
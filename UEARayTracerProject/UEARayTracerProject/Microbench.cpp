@@ -0,0 +1,339 @@
+#include "Microbench.h"
+#include "CPUTracer.h"
+#include "CPUDefines.h"
+#include "Mesh.h"
+#include "cl_memory.h"
+#include "cl_profiler.h"
+#include <chrono>
+#include <random>
+#include <functional>
+#include <fstream>
+#include <iomanip>
+#include <math.h>
+#include <string.h>
+
+// One primitive benchmark. host returns what the kernel writes for a ray: its hit count, or the summed reflectance for fresnel.
+struct MicrobenchCase {
+	std::string primitive;
+	const char* kernelName;
+	std::vector<cl_mem> buffers;
+	cl_uint count;
+	size_t testsPerRay;
+	bool floatOutput;
+	std::function<float(const Ray*)> host;
+};
+
+std::default_random_engine microbenchEngine(1234);
+
+float _microbench_random(float from, float to) {
+	return std::uniform_real_distribution<float>(from, to)(microbenchEngine);
+}
+
+cl_float3 _microbench_randomDirection() {
+	cl_float3 v;
+	do {
+		v = { _microbench_random(-1.0f, 1.0f), _microbench_random(-1.0f, 1.0f), _microbench_random(-1.0f, 1.0f) };
+	} while (_world_dot(v, v) > 1.0f || _world_dot(v, v) < 1e-4f);
+	return _world_normalise(v);
+}
+
+// Rays from a shell around the box aimed at random points inside it, so they hit and miss the primitives in it
+std::vector<Ray> _microbench_rays(size_t count, cl_float3 boxMin, cl_float3 boxMax) {
+	const cl_float3 center = { (boxMin.x + boxMax.x) * 0.5f, (boxMin.y + boxMax.y) * 0.5f, (boxMin.z + boxMax.z) * 0.5f };
+	const cl_float3 extent = { boxMax.x - center.x, boxMax.y - center.y, boxMax.z - center.z };
+	const float radius = 4.0f * sqrtf(_world_dot(extent, extent));
+
+	std::vector<Ray> rays(count);
+	for (Ray& ray : rays) {
+		cl_float3 offset = _microbench_randomDirection();
+		ray.origin = { center.x + offset.x * radius, center.y + offset.y * radius, center.z + offset.z * radius };
+		cl_float3 target = { _microbench_random(boxMin.x, boxMax.x), _microbench_random(boxMin.y, boxMax.y), _microbench_random(boxMin.z, boxMax.z) };
+		ray.direction = _world_normalise({ target.x - ray.origin.x, target.y - ray.origin.y, target.z - ray.origin.z });
+	}
+	return rays;
+}
+
+template <typename F>
+std::vector<double> _microbench_time(F run) {
+	run(); // Warm-up
+	std::vector<double> seconds;
+	for (int i = 0; i < MICROBENCH_REPETITIONS; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		run();
+		seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+	return seconds;
+}
+
+microbench::Result _microbench_result(const std::string& primitive, const std::string& backend, size_t tests, const std::vector<double>& seconds) {
+	microbench::Result result = {};
+	result.primitive = primitive;
+	result.backend = backend;
+	result.tests = tests;
+	result.minNs = 1e300;
+	for (double s : seconds) {
+		double ns = s * 1e9 / tests;
+		result.meanNs += ns;
+		result.minNs = std::min(result.minNs, ns);
+	}
+	result.meanNs /= seconds.size();
+	for (double s : seconds) {
+		double ns = s * 1e9 / tests;
+		result.stddevNs += (ns - result.meanNs) * (ns - result.meanNs);
+	}
+	result.stddevNs = seconds.size() > 1 ? sqrt(result.stddevNs / (seconds.size() - 1)) : 0.0;
+	return result;
+}
+
+/**
+	Times a Bench* kernel with the arguments (rays, buffers..., count, output) and reads its output back.
+	Device time is measured on the host around a finished launch, which is far longer than the launch overhead at MICROBENCH_RAYS rays.
+*/
+bool _microbench_runKernel(const MicrobenchCase& c, cl_mem rays, cl_mem output, size_t numRays, std::vector<double>* seconds, std::vector<cl_uint>* values) {
+	cl_kernel kernel = cl::createKernel(c.kernelName);
+	if (kernel == nullptr) {
+		std::cout << "Could not create " << c.kernelName << " kernel." << std::endl;
+		return false;
+	}
+
+	cl_uint arg = 0;
+	cl_int err = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &rays);
+	for (const cl_mem& buffer : c.buffers) {
+		if (err == CL_SUCCESS) err = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &buffer);
+	}
+	if (err == CL_SUCCESS) err = clSetKernelArg(kernel, arg++, sizeof(cl_uint), &c.count);
+	if (err == CL_SUCCESS) err = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &output);
+	cl::printErrorMsg(std::string(c.kernelName) + " Kernel Args", __LINE__, __FILE__, err);
+
+	if (err == CL_SUCCESS) {
+		*seconds = _microbench_time([&]() {
+			cl_event launchEvent;
+			cl_int launchErr = clEnqueueNDRangeKernel(cl::queue, kernel, 1, NULL, &numRays, NULL, 0, NULL, &launchEvent);
+			if (launchErr == CL_SUCCESS) {
+				cl::profiler::record(c.kernelName, launchEvent);
+				clReleaseEvent(launchEvent);
+				launchErr = clFinish(cl::queue);
+			}
+			if (launchErr != CL_SUCCESS) err = launchErr;
+		});
+		cl::printErrorMsg(std::string("Enqueue ") + c.kernelName, __LINE__, __FILE__, err);
+	}
+	if (err == CL_SUCCESS) {
+		values->resize(numRays);
+		cl_event readEvent;
+		err = clEnqueueReadBuffer(cl::queue, output, true, 0, sizeof(cl_uint) * numRays, &(*values)[0], 0, NULL, &readEvent);
+		cl::printErrorMsg(std::string(c.kernelName) + " Read Output", __LINE__, __FILE__, err);
+		if (err == CL_SUCCESS) {
+			cl::profiler::record("Microbench Read Output", readEvent);
+			clReleaseEvent(readEvent);
+		}
+	}
+	clReleaseKernel(kernel);
+	return err == CL_SUCCESS;
+}
+
+float _microbench_value(const MicrobenchCase& c, cl_uint raw) {
+	if (!c.floatOutput) return (float)raw;
+	float value;
+	memcpy(&value, &raw, sizeof(value));
+	return value;
+}
+
+bool _microbench_case(const MicrobenchCase& c, const std::vector<Ray>& rays, cl_mem raysBuffer, cl_mem outputBuffer, std::vector<microbench::Result>* results) {
+	std::cout << "Benchmarking " << c.primitive << "..." << std::endl;
+
+	std::vector<double> seconds;
+	std::vector<cl_uint> deviceValues;
+	if (!_microbench_runKernel(c, raysBuffer, outputBuffer, rays.size(), &seconds, &deviceValues)) return false;
+	microbench::Result device = _microbench_result(c.primitive, "cl", rays.size() * c.testsPerRay, seconds);
+
+	std::vector<float> hostValues(MICROBENCH_HOST_RAYS);
+	seconds = _microbench_time([&]() {
+		for (size_t i = 0; i < hostValues.size(); ++i) hostValues[i] = c.host(&rays[i]);
+	});
+	microbench::Result host = _microbench_result(c.primitive, "cpu", hostValues.size() * c.testsPerRay, seconds);
+
+	// The host batch is the start of the device batch
+	double deviceTotal = 0.0, hostTotal = 0.0;
+	for (size_t i = 0; i < deviceValues.size(); ++i) deviceTotal += _microbench_value(c, deviceValues[i]);
+	for (size_t i = 0; i < hostValues.size(); ++i) {
+		float deviceValue = _microbench_value(c, deviceValues[i]);
+		hostTotal += hostValues[i];
+		if (fabs(deviceValue - hostValues[i]) > (c.floatOutput ? 1e-3f * std::max(1.0f, fabs(hostValues[i])) : 0.0f)) device.mismatches++;
+	}
+	host.mismatches = device.mismatches;
+	device.hitRate = deviceTotal / device.tests;
+	host.hitRate = hostTotal / host.tests;
+
+	results->push_back(device);
+	results->push_back(host);
+	return true;
+}
+
+void _microbench_print(const std::vector<microbench::Result>& results) {
+	std::cout << std::left << std::setw(24) << "Primitive" << std::setw(8) << "backend" << std::right << std::setw(12) << "tests" << std::setw(12) << "ns/test"
+		<< std::setw(12) << "stddev" << std::setw(12) << "min" << std::setw(16) << "tests/s" << std::setw(10) << "hit rate" << std::setw(12) << "mismatches" << std::endl;
+	for (const microbench::Result& r : results) {
+		std::cout << std::left << std::setw(24) << r.primitive << std::setw(8) << r.backend << std::right << std::fixed << std::setprecision(3)
+			<< std::setw(12) << r.tests << std::setw(12) << r.meanNs << std::setw(12) << r.stddevNs << std::setw(12) << r.minNs
+			<< std::scientific << std::setprecision(3) << std::setw(16) << 1e9 / r.meanNs << std::fixed << std::setw(10) << r.hitRate << std::setw(12) << r.mismatches << std::endl;
+	}
+	std::cout.unsetf(std::ios::floatfield);
+	std::cout << std::setprecision(6);
+}
+
+bool _microbench_write(const std::string& path, const std::vector<microbench::Result>& results) {
+	std::ofstream file(path);
+	if (!file) {
+		std::cout << "Could not open " << path << " for writing." << std::endl;
+		return false;
+	}
+	file << "primitive,backend,tests,mean_ns,stddev_ns,min_ns,tests_per_s,hit_rate,mismatches" << std::endl;
+	for (const microbench::Result& r : results) {
+		file << r.primitive << "," << r.backend << "," << r.tests << "," << r.meanNs << "," << r.stddevNs << "," << r.minNs << "," << 1e9 / r.meanNs << ","
+			<< r.hitRate << "," << r.mismatches << std::endl;
+	}
+	std::cout << "Wrote microbenchmark results to " << path << std::endl;
+	return true;
+}
+
+namespace microbench {
+
+	bool run(World* world, const std::string& path) {
+		// Synthetic primitives inside the unit cube
+		const cl_float3 boxMin = { -1.0f, -1.0f, -1.0f }, boxMax = { 1.0f, 1.0f, 1.0f };
+		std::vector<Sphere> spheres(MICROBENCH_PRIMITIVES);
+		for (Sphere& sphere : spheres) {
+			sphere.position = { _microbench_random(-1.0f, 1.0f), _microbench_random(-1.0f, 1.0f), _microbench_random(-1.0f, 1.0f) };
+			sphere.radius = _microbench_random(0.05f, 0.2f);
+			sphere.material = 0;
+		}
+
+		std::vector<Triangle> triangles(MICROBENCH_PRIMITIVES);
+		std::vector<cl_float3> vertices;
+		for (size_t i = 0; i < triangles.size(); ++i) {
+			cl_float3 v0 = { _microbench_random(-1.0f, 1.0f), _microbench_random(-1.0f, 1.0f), _microbench_random(-1.0f, 1.0f) };
+			cl_float3 v1 = { v0.x + _microbench_random(-0.3f, 0.3f), v0.y + _microbench_random(-0.3f, 0.3f), v0.z + _microbench_random(-0.3f, 0.3f) };
+			cl_float3 v2 = { v0.x + _microbench_random(-0.3f, 0.3f), v0.y + _microbench_random(-0.3f, 0.3f), v0.z + _microbench_random(-0.3f, 0.3f) };
+			vertices.insert(vertices.end(), { v0, v1, v2 });
+			triangles[i].face.s[0] = (cl_uint)i * 3;
+			triangles[i].face.s[1] = (cl_uint)i * 3 + 1;
+			triangles[i].face.s[2] = (cl_uint)i * 3 + 2;
+			triangles[i].materialIndex = 0;
+		}
+
+		// k-DOPs bounding random spheres
+		std::vector<ModelStruct> models(MICROBENCH_PRIMITIVES);
+		for (ModelStruct& model : models) {
+			memset(&model, 0, sizeof(model));
+			cl_float3 center = { _microbench_random(-1.0f, 1.0f), _microbench_random(-1.0f, 1.0f), _microbench_random(-1.0f, 1.0f) };
+			float radius = _microbench_random(0.05f, 0.3f);
+			for (int p = 0; p < BVH_PLANE_COUNT; ++p) {
+				float d = _world_dot(center, BVH_PlaneNormals[p]);
+				float r = radius * sqrtf(_world_dot(BVH_PlaneNormals[p], BVH_PlaneNormals[p]));
+				model.bounds[p] = { d - r, d + r };
+			}
+		}
+
+		std::vector<cl_float3> normals(MICROBENCH_PRIMITIVES);
+		for (cl_float3& normal : normals) normal = _microbench_randomDirection();
+
+		std::vector<Ray> rays = _microbench_rays(MICROBENCH_RAYS, boxMin, boxMax);
+
+		cl_int err;
+		cl_mem raysBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Microbench Rays", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Ray) * rays.size(), &rays[0], &err);
+		cl_mem outputBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Microbench Output", CL_MEM_WRITE_ONLY, sizeof(cl_uint) * rays.size(), NULL, &err);
+		cl_mem sphereBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Microbench Spheres", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Sphere) * spheres.size(), &spheres[0], &err);
+		cl_mem triangleBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Microbench Triangles", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Triangle) * triangles.size(), &triangles[0], &err);
+		cl_mem vertexBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Microbench Vertices", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float3) * vertices.size(), &vertices[0], &err);
+		cl_mem modelBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Microbench Models", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(ModelStruct) * models.size(), &models[0], &err);
+		cl_mem normalBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Microbench Normals", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float3) * normals.size(), &normals[0], &err);
+
+		std::vector<MicrobenchCase> cases;
+		cases.push_back({ "sphere_intersect", "BenchSphere", { sphereBuffer }, MICROBENCH_PRIMITIVES, MICROBENCH_PRIMITIVES, false, [&](const Ray* ray) {
+			float hits = 0.0f, minT, maxT;
+			for (const Sphere& sphere : spheres) hits += cpu::sphere_intersect(ray, &sphere, &minT, &maxT);
+			return hits;
+		} });
+		cases.push_back({ "triangle_intersect", "BenchTriangle", { triangleBuffer, vertexBuffer }, MICROBENCH_PRIMITIVES, MICROBENCH_PRIMITIVES, false, [&](const Ray* ray) {
+			float hits = 0.0f, T;
+			cl_float2 barycentric;
+			for (const Triangle& triangle : triangles) hits += cpu::triangle_intersect(ray, &triangle, &vertices[0], &barycentric, &T);
+			return hits;
+		} });
+		cases.push_back({ "bvh_plane_intersect", "BenchPlanes", { modelBuffer }, MICROBENCH_PRIMITIVES, MICROBENCH_PRIMITIVES, false, [&](const Ray* ray) {
+			float planeDotRayOrigin[BVH_PLANE_COUNT], planeDotRayDirection[BVH_PLANE_COUNT];
+			for (int p = 0; p < BVH_PLANE_COUNT; ++p) {
+				planeDotRayOrigin[p] = _world_dot(ray->origin, BVH_PlaneNormals[p]);
+				planeDotRayDirection[p] = _world_dot(ray->direction, BVH_PlaneNormals[p]);
+			}
+			float hits = 0.0f;
+			for (const ModelStruct& model : models) {
+				float tnear = -MAX_VALUE, tfar = MAX_VALUE;
+				cl_uint planeIndex = (cl_uint)-1;
+				hits += cpu::bvh_plane_intersect(&model, planeDotRayOrigin, planeDotRayDirection, &tnear, &tfar, &planeIndex);
+			}
+			return hits;
+		} });
+		cases.push_back({ "fresnel", "BenchFresnel", { normalBuffer }, MICROBENCH_PRIMITIVES, MICROBENCH_PRIMITIVES, true, [&](const Ray* ray) {
+			float sum = 0.0f;
+			for (const cl_float3& normal : normals) sum += cpu::fresnel(ray->direction, normal, AIR_REFRACTIVE_INDEX, MICROBENCH_IOR);
+			return sum;
+		} });
+
+		std::vector<Result> results;
+		bool ok = !cl::memory::hasFailed();
+		for (const MicrobenchCase& c : cases) {
+			if (ok) ok = _microbench_case(c, rays, raysBuffer, outputBuffer, &results);
+		}
+
+		// model_intersect needs a real grid, so it walks the first model of the loaded scene with rays aimed at its bounds
+		if (ok && !world->getModels().empty()) {
+			const ModelStruct& model = world->getModels()[0];
+			std::vector<Ray> modelRays = _microbench_rays(MICROBENCH_RAYS, { model.bounds[0].x, model.bounds[1].x, model.bounds[2].x }, { model.bounds[0].y, model.bounds[1].y, model.bounds[2].y });
+			cl_event writeEvent;
+			err = clEnqueueWriteBuffer(cl::queue, raysBuffer, true, 0, sizeof(Ray) * modelRays.size(), &modelRays[0], 0, NULL, &writeEvent);
+			cl::printErrorMsg("Microbench Model Rays", __LINE__, __FILE__, err);
+			if (err == CL_SUCCESS) {
+				cl::profiler::record("Microbench Model Rays", writeEvent);
+				clReleaseEvent(writeEvent);
+			}
+
+			cpu::WorldPack pack;
+			pack.world = &world->getStruct();
+			pack.vertices = &world->getVertexBuffer()[0];
+			pack.normals = &world->getNormals()[0];
+			pack.materials = &world->getMaterialBuffer()[0];
+			pack.spheres = world->getSpheres().empty() ? nullptr : &world->getSpheres()[0];
+			pack.triangles = &world->getTriangles()[0];
+			pack.models = &world->getModels()[0];
+			pack.grid = &world->getTriangleGrid()[0];
+			pack.triangleCountGrid = &world->getTriangleCountGrid()[0];
+
+			MicrobenchCase c = { "model_intersect", "BenchModel", { *world->getBufferPtr(), *world->getMaterialBufferPtr(), *world->getSphereBufferPtr(),
+				*world->getModelBufferPtr(), *world->getSceneBufferPtr() }, 0, 1, false, [&](const Ray* ray) {
+				float planeDotRayOrigin[BVH_PLANE_COUNT], planeDotRayDirection[BVH_PLANE_COUNT];
+				for (int p = 0; p < BVH_PLANE_COUNT; ++p) {
+					planeDotRayOrigin[p] = _world_dot(ray->origin, BVH_PlaneNormals[p]);
+					planeDotRayDirection[p] = _world_dot(ray->direction, BVH_PlaneNormals[p]);
+				}
+				float tnear = -MAX_VALUE, tfar = MAX_VALUE;
+				cl_uint planeIndex = (cl_uint)-1;
+				int triangle;
+				cl_float2 barycentric;
+				if (!cpu::bvh_plane_intersect(&model, planeDotRayOrigin, planeDotRayDirection, &tnear, &tfar, &planeIndex)) return 0.0f;
+				return cpu::model_intersect(&pack, ray, 0, 0, &tnear, &triangle, &barycentric) ? 1.0f : 0.0f;
+			} };
+			if (err == CL_SUCCESS) ok = _microbench_case(c, modelRays, raysBuffer, outputBuffer, &results);
+		} else if (ok) {
+			std::cout << "The scene has no models, skipping model_intersect." << std::endl;
+		}
+
+		for (cl_mem buffer : { raysBuffer, outputBuffer, sphereBuffer, triangleBuffer, vertexBuffer, modelBuffer, normalBuffer }) cl::memory::release(buffer);
+
+		if (results.empty()) return false;
+		_microbench_print(results);
+		return _microbench_write(path, results) && ok;
+	}
+
+}
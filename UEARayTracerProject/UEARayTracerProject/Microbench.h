@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include "World.h"
+
+#define MICROBENCH_FILE ("microbench.csv")
+// Rays per kernel launch and per host pass. The host ports run on one thread, so they get a smaller batch.
+#define MICROBENCH_RAYS (1 << 18)
+#define MICROBENCH_HOST_RAYS (1 << 14)
+// Spheres, triangles, k-DOPs or normals each ray is tested against. Must match the define in cl_kernels/microbench.cl
+#define MICROBENCH_PRIMITIVES (64)
+#define MICROBENCH_REPETITIONS (20)
+// Must match the define in cl_kernels/microbench.cl
+#define MICROBENCH_IOR (1.517f)
+
+/**
+	Times the intersection primitives of func.h on their own, as the Bench* kernels in cl_kernels/microbench.cl and through the host ports in CPUTracer.
+	Both backends trace the same synthetic rays, so the hit counts of the host batch are compared to catch ports that have drifted apart.
+*/
+namespace microbench {
+
+	struct Result {
+		std::string primitive;
+		std::string backend;
+		size_t tests; // Per repetition
+		double meanNs; // Per test
+		double stddevNs;
+		double minNs;
+		double hitRate;
+		size_t mismatches; // Rays of the host batch whose result differs between the backends
+	};
+
+	/**
+		Runs every primitive for both backends and writes the results to path.
+		model_intersect walks the first model of world, so it is skipped when the scene has none. The kernels must already be built.
+	*/
+	bool run(World* world, const std::string& path);
+
+}
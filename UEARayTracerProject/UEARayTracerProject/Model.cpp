@@ -1,8 +1,47 @@
 #include "Model.h"
-#include "OBJ_Loader.h"
+#include "ObjParser.h"
+#include "SceneCache.h"
+#include "VertexWeld.h"
+#include "Lod.h"
+#include <chrono>
 #include <algorithm>
 #include <limits>
 #include <iomanip>
+#include <unordered_map>
+
+/**
+	Gives every distinct (position, normal) pair of the faces its own vertex, so the index lists can address both with one index.
+	normals gets the encoded normal of every vertex, NORMAL_NONE for face vertices written without one.
+*/
+void _model_splitNormals(obj::ObjData* data, std::vector<cl_uint>* normals) {
+	if (data->normals.empty()) {
+		normals->assign(data->positions.size(), NORMAL_NONE);
+		return;
+	}
+
+	std::vector<cl_uint> encoded(data->normals.size());
+	for (size_t i = 0; i < data->normals.size(); ++i) encoded[i] = _world_encodeNormal(data->normals[i]);
+
+	std::vector<cl_float3> positions;
+	std::unordered_map<unsigned long long, unsigned int> vertices;
+	vertices.reserve(data->positions.size());
+	normals->clear();
+	for (obj::ObjMesh& mesh : data->meshes) {
+		for (size_t i = 0; i < mesh.indices.size(); ++i) {
+			const unsigned int normal = mesh.normalIndices[i];
+			const unsigned long long key = (unsigned long long)mesh.indices[i] << 32 | normal;
+			auto vertex = vertices.emplace(key, (unsigned int)positions.size());
+			if (vertex.second) {
+				positions.push_back(data->positions[mesh.indices[i]]);
+				normals->push_back(normal == OBJ_NO_NORMAL ? NORMAL_NONE : encoded[normal]);
+			}
+			mesh.indices[i] = vertex.first->second;
+		}
+		std::vector<unsigned int>().swap(mesh.normalIndices);
+	}
+	data->positions.swap(positions);
+	std::vector<cl_float3>().swap(data->normals);
+}
 
 Model::Model()
 {
@@ -19,99 +58,192 @@ void Model::loadFromFile(const char* filename, World* world, float scale, int ma
 		return;
 	}
 
-	objl::Loader loader;
-
-	bool loaded = loader.LoadFile(filename);
+	if (scenecache::isEnabled() && scenecache::load(filename, scale, mat, world, &modelStruct)) return;
+	scenecache::Mark cacheStart = scenecache::mark(world);
 
-	if (!loaded) {
+	obj::ObjData data;
+	bool parsed = obj::load(filename, &data);
+	if (!parsed) {
 		std::cout << "Could not load OBJ." << std::endl;
 	}
 
+	std::vector<cl_uint> normals;
+	_model_splitNormals(&data, &normals);
+
+	// The epsilon is in world units and the positions are scaled when they are added
+	std::vector<std::vector<unsigned int>*> meshIndices;
+	for (obj::ObjMesh& mesh : data.meshes) meshIndices.push_back(&mesh.indices);
+	weld::optimise(&data.positions, &normals, meshIndices, weld::getEpsilon() / scale, weld::getReorder());
+
 	ModelStruct mStruct;
+	beginModel(world, &mStruct);
+
+	// Every mesh indexes the same positions, so they are only added once
+	size_t vertexOffset = addVertices(world, data.positions, normals, scale);
+	std::vector<cl_uint>().swap(normals);
+
+	// Create Mesh objects
+	for (auto mesh_it = data.meshes.begin(); mesh_it != data.meshes.end(); ++mesh_it) {
+		addMesh(world, mesh_it->name, vertexOffset, mesh_it->indices, mat, &mStruct);
+	}
+
+	// All meshes share the grid of the model, so the levels are simplified from every mesh at once
+	std::vector<unsigned int> modelIndices;
+	for (const obj::ObjMesh& mesh : data.meshes) modelIndices.insert(modelIndices.end(), mesh.indices.begin(), mesh.indices.end());
+	addLods(world, data.positions, vertexOffset, modelIndices, mat, &mStruct);
+	std::vector<cl_float3>().swap(data.positions);
+
+	finishModel(world, &mStruct);
+
+	if (parsed && scenecache::isEnabled()) scenecache::write(filename, scale, mat, world, cacheStart, *modelStruct);
+}
+
+void Model::loadFromMesh(const std::string& name, const std::vector<cl_float3>& positions, const std::vector<unsigned int>& indices, World* world, float scale, int mat)
+{
+	if (world == nullptr) {
+		std::cout << "World ptr cannot be null. Could not load mesh." << std::endl;
+		return;
+	}
+
+	ModelStruct mStruct;
+	beginModel(world, &mStruct);
+	addMesh(world, name, addVertices(world, positions, {}, scale), indices, mat, &mStruct);
+	finishModel(world, &mStruct);
+}
+
+void Model::beginModel(World* world, ModelStruct* mStruct)
+{
+	*mStruct = ModelStruct();
+	mStruct->lodCount = 1;
 
 	// Reset bounds
-	for (int i = 0; i < sizeof(mStruct.bounds) / sizeof(mStruct.bounds[0]); ++i) {
-		mStruct.bounds[i].x = std::numeric_limits<float>::max();
-		mStruct.bounds[i].y = std::numeric_limits<float>::min();
+	for (int i = 0; i < sizeof(mStruct->bounds) / sizeof(mStruct->bounds[0]); ++i) {
+		mStruct->bounds[i].x = std::numeric_limits<float>::max();
+		mStruct->bounds[i].y = std::numeric_limits<float>::min();
 	}
 
-	mStruct.triangleOffset = world->getTriangleCount();
+	mStruct->triangleOffset = world->getTriangleCount();
+}
 
-	// Create Mesh objects
-	for (auto mesh_it = loader.LoadedMeshes.begin(); mesh_it != loader.LoadedMeshes.end(); ++mesh_it) {
-		meshes.push_back(Mesh());
-		Mesh* m = &meshes[0];
-		m->name = mesh_it->MeshName;
-
-		/**
-			Add vertices to world. The indices for the mesh need to be offset by the vertices already in the world object.
-		*/
-		size_t vertex_index_offset = world->getVertexBuffer().size();
-		for (auto vertex_it = mesh_it->Vertices.begin(); vertex_it != mesh_it->Vertices.end(); ++vertex_it) {
-			world->addVertex({ vertex_it->Position.X * scale, vertex_it->Position.Y * scale, vertex_it->Position.Z * scale});
-		}
+size_t Model::addVertices(World* world, const std::vector<cl_float3>& positions, const std::vector<cl_uint>& normals, float scale)
+{
+	/**
+		Add vertices to world. The indices for the mesh need to be offset by the vertices already in the world object.
+		The scale is uniform, so the normals don't change.
+	*/
+	size_t vertex_index_offset = world->getVertexBuffer().size();
+	world->getVertexBuffer().reserve(vertex_index_offset + positions.size());
+	world->getNormals().reserve(vertex_index_offset + positions.size());
+	for (size_t i = 0; i < positions.size(); ++i) {
+		world->addVertex({ positions[i].x * scale, positions[i].y * scale, positions[i].z * scale }, normals.empty() ? NORMAL_NONE : normals[i]);
+	}
+	return vertex_index_offset;
+}
 
-		for (int i = 0; i < mesh_it->Indices.size(); i += 3) {
-			cl_uint3 face = { mesh_it->Indices[i] + vertex_index_offset, mesh_it->Indices[i+1] + vertex_index_offset, mesh_it->Indices[i+2] + vertex_index_offset };
-			// Assuming the face only has 1 normal
-			// The object contains normals for each vertex so the normal of a point on the face can be interpolated
-			//cl_float3 normal = { mesh_it->Vertices[i].Normal.X, mesh_it->Vertices[i].Normal.Y, mesh_it->Vertices[i].Normal.Z };
-			int triangle = world->addTriangle(face.x, face.y, face.z);
-			m->addTriangle(triangle);
+void Model::addMesh(World* world, const std::string& name, size_t vertex_index_offset, const std::vector<unsigned int>& indices, int mat, ModelStruct* mStruct)
+{
+	meshes.push_back(Mesh());
+	Mesh* m = &meshes[0];
+	m->name = name;
 
-			world->setTriangleMaterial(triangle, mat);
-		}
+	for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+		cl_uint3 face = { (cl_uint)(indices[i] + vertex_index_offset), (cl_uint)(indices[i+1] + vertex_index_offset), (cl_uint)(indices[i+2] + vertex_index_offset) };
+		int triangle = world->addTriangle(face.x, face.y, face.z);
+		m->addTriangle(triangle);
+
+		world->setTriangleMaterial(triangle, mat);
+	}
+
+	std::cout << "Mesh " << m->name << " with " << m->getTriangleCount() << " triangles." << std::endl;
 
-		std::cout << "Mesh " << m->name << " with " << m->getTriangleCount() << " triangles." << std::endl;
+	// Create bounds for the mesh
+	m->createBoundingVolume(world->getTriangle(0), world->getVertexBuffer());
+
+	// Find min max bounds of the entire model
+	for (int i = 0; i < sizeof(mStruct->bounds) / sizeof(mStruct->bounds[0]); ++i) {
+		mStruct->bounds[i].x = std::min(mStruct->bounds[i].x, m->getBounds(i).x);
+		mStruct->bounds[i].y = std::max(mStruct->bounds[i].y, m->getBounds(i).y);
+	}
+}
 
-		// Create bounds for the mesh
-		m->createBoundingVolume(world->getTriangle(0), world->getVertexBuffer());
+void Model::addLods(World* world, const std::vector<cl_float3>& positions, size_t vertexOffset, const std::vector<unsigned int>& indices, int mat, ModelStruct* mStruct)
+{
+	std::vector<unsigned int> previous = indices;
+	for (int level = 1; level < lod::getLevels(); ++level) {
+		size_t target = (size_t)(previous.size() / 3 * LOD_TRIANGLE_RATIO);
+		if (target < LOD_MIN_TRIANGLES) break;
+
+		auto starttime = std::chrono::steady_clock::now();
+		std::vector<unsigned int> simplified;
+		lod::simplify(positions, previous, target, &simplified);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+		if (simplified.size() > previous.size() * LOD_MAX_RATIO) {
+			std::cout << "LOD " << level << " could only be simplified to " << simplified.size() / 3 << " triangles, stopping at " << level << " levels." << std::endl;
+			break;
+		}
 
-		// Find min max bounds of the entire model
-		for (int i = 0; i < sizeof(mStruct.bounds) / sizeof(mStruct.bounds[0]); ++i) {
-			mStruct.bounds[i].x = std::min(mStruct.bounds[i].x, m->getBounds(i).x);
-			mStruct.bounds[i].y = std::max(mStruct.bounds[i].y, m->getBounds(i).y);
+		Mesh m;
+		m.name = "LOD " + std::to_string(level);
+		for (size_t i = 0; i + 2 < simplified.size(); i += 3) {
+			unsigned int triangle = world->addTriangle(simplified[i] + vertexOffset, simplified[i + 1] + vertexOffset, simplified[i + 2] + vertexOffset);
+			world->setTriangleMaterial(triangle, mat);
+			m.addTriangle(triangle);
 		}
+		std::cout << m.name << " with " << m.getTriangleCount() << " triangles, simplified in " << seconds * 1000.0 << "ms." << std::endl;
+
+		buildGrid(world, &m, mStruct, &mStruct->lodGridOffset[level - 1], &mStruct->lodCountOffset[level - 1]);
+		mStruct->lodCount = level + 1;
+		previous.swap(simplified);
 	}
 
-	for (auto mesh_it = meshes.begin(); mesh_it != meshes.end(); ++mesh_it) {
-		Mesh* m = &(*mesh_it);
+	cl_float diagonal = sqrtf(SQ(mStruct->bounds[0].y - mStruct->bounds[0].x) + SQ(mStruct->bounds[1].y - mStruct->bounds[1].x) + SQ(mStruct->bounds[2].y - mStruct->bounds[2].x));
+	mStruct->lodDistance = diagonal * lod::getDistanceFactor();
+}
 
-		// Compute the size of the grid bounds
-		cl_float boundsSize[3] = { mStruct.bounds[0].y - mStruct.bounds[0].x, mStruct.bounds[1].y - mStruct.bounds[1].x, mStruct.bounds[2].y - mStruct.bounds[2].x };
-		cl_float cellSize[3];
-		for (int i = 0; i < 3; ++i) cellSize[i] = boundsSize[i] / GRID_CELL_ROW_COUNT; // Calculate width, height, and length/depth of the grid cells
+void Model::buildGrid(World* world, Mesh* m, ModelStruct* mStruct, unsigned int* gridOffset, unsigned int* countOffset)
+{
+	// Compute the size of the grid bounds
+	cl_float boundsSize[3] = { mStruct->bounds[0].y - mStruct->bounds[0].x, mStruct->bounds[1].y - mStruct->bounds[1].x, mStruct->bounds[2].y - mStruct->bounds[2].x };
+	cl_float cellSize[3];
+	for (int i = 0; i < 3; ++i) cellSize[i] = boundsSize[i] / getGridCellRowCount(); // Calculate width, height, and length/depth of the grid cells
 
-		std::cout << "Constructing triangle grid for mesh " << m->name << std::endl;
+	std::cout << "Constructing triangle grid for mesh " << m->name << std::endl;
 
-		world->addTriangleGrid(&mStruct.triangleGridOffset, &mStruct.triangleCountOffset);
+	world->addTriangleGrid(gridOffset, countOffset);
 
-		std::cout << "Constructing octree for mesh " << m->name << std::endl;
-		m->constructOctree(world, GRID_CELL_DEPTH, mStruct.bounds);
+	std::cout << "Constructing octree for mesh " << m->name << std::endl;
+	m->constructOctree(world, getGridCellDepth(), mStruct->bounds);
 
-		std::cout << "Adding octree leaf nodes to mesh grid" << std::endl;
-		// Get leaf nodes and put into grid
-		for (auto leaf = m->getLeafNodes().begin(); leaf != m->getLeafNodes().end(); ++leaf) {
-			const OctreeCell* cell = *leaf;
-			cl_float3 cellMid = { (cell->bounds[0].y + cell->bounds[0].x) * 0.5f, (cell->bounds[1].y + cell->bounds[1].x) * 0.5f, (cell->bounds[2].y + cell->bounds[2].x) * 0.5f };
-			cl_float3 boundsOffset = { cellMid.x - mStruct.bounds[0].x, cellMid.y - mStruct.bounds[1].x, cellMid.z - mStruct.bounds[2].x };
+	std::cout << "Adding octree leaf nodes to mesh grid" << std::endl;
+	// Get leaf nodes and put into grid
+	for (auto leaf = m->getLeafNodes().begin(); leaf != m->getLeafNodes().end(); ++leaf) {
+		const OctreeCell* cell = *leaf;
+		cl_float3 cellMid = { (cell->bounds[0].y + cell->bounds[0].x) * 0.5f, (cell->bounds[1].y + cell->bounds[1].x) * 0.5f, (cell->bounds[2].y + cell->bounds[2].x) * 0.5f };
+		cl_float3 boundsOffset = { cellMid.x - mStruct->bounds[0].x, cellMid.y - mStruct->bounds[1].x, cellMid.z - mStruct->bounds[2].x };
 
-			cl_int3 index = { (boundsOffset.x / boundsSize[0]) * GRID_CELL_ROW_COUNT, (boundsOffset.y / boundsSize[1]) * GRID_CELL_ROW_COUNT, (boundsOffset.z / boundsSize[2]) * GRID_CELL_ROW_COUNT };
+		const int rowCount = getGridCellRowCount();
+		cl_int3 index = { (boundsOffset.x / boundsSize[0]) * rowCount, (boundsOffset.y / boundsSize[1]) * rowCount, (boundsOffset.z / boundsSize[2]) * rowCount };
 
-			unsigned int coord = getGridOffset(index);
+		unsigned int coord = *countOffset + getGridOffset(index);
 
-			for (auto leaf_tri = cell->triangles.begin(); leaf_tri != cell->triangles.end() && world->getTriangleCountGrid()[coord] < GRID_MAX_TRIANGLES_PER_CELL; ++leaf_tri) {
-				world->addTriangleToGrid(*leaf_tri, coord);
-				if (world->getTriangleCountGrid()[coord] == GRID_MAX_TRIANGLES_PER_CELL) {
-					std::cout << "Max triangle count per cell reached." << std::endl;
-				}
+		for (auto leaf_tri = cell->triangles.begin(); leaf_tri != cell->triangles.end() && world->getTriangleCountGrid()[coord] < GRID_MAX_TRIANGLES_PER_CELL; ++leaf_tri) {
+			world->addTriangleToGrid(*leaf_tri, coord);
+			if (world->getTriangleCountGrid()[coord] == GRID_MAX_TRIANGLES_PER_CELL) {
+				std::cout << "Max triangle count per cell reached." << std::endl;
 			}
-
 		}
+
+	}
+}
+
+void Model::finishModel(World* world, ModelStruct* mStruct)
+{
+	for (auto mesh_it = meshes.begin(); mesh_it != meshes.end(); ++mesh_it) {
+		buildGrid(world, &(*mesh_it), mStruct, &mStruct->triangleGridOffset, &mStruct->triangleCountOffset);
 	}
 
-	mStruct.numTriangles = world->getTriangleCount() - mStruct.triangleOffset;
+	mStruct->numTriangles = world->getTriangleCount() - mStruct->triangleOffset;
 
-	modelStruct = world->addModel(mStruct);
+	modelStruct = world->addModel(*mStruct);
 
 }
@@ -21,6 +21,22 @@ class Model
 
 	ModelStruct * modelStruct;
 
+	void beginModel(World* world, ModelStruct* mStruct);
+
+	// Adds scaled positions and their encoded normals (empty for none) to the world and returns the index of the first one
+	size_t addVertices(World* world, const std::vector<cl_float3>& positions, const std::vector<cl_uint>& normals, float scale);
+
+	// indices are relative to vertexOffset
+	void addMesh(World* world, const std::string& name, size_t vertexOffset, const std::vector<unsigned int>& indices, int mat, ModelStruct* mStruct);
+
+	// Simplifies the whole model (indices relative to vertexOffset) into the LOD levels and builds their grids
+	void addLods(World* world, const std::vector<cl_float3>& positions, size_t vertexOffset, const std::vector<unsigned int>& indices, int mat, ModelStruct* mStruct);
+
+	// Fills a new grid in the world with the triangles of m, using the bounds of the model
+	void buildGrid(World* world, Mesh* m, ModelStruct* mStruct, unsigned int* gridOffset, unsigned int* countOffset);
+
+	void finishModel(World* world, ModelStruct* mStruct);
+
 public:
 	Model();
 	~Model();
@@ -29,5 +45,8 @@ public:
 
 	void loadFromFile(const char* filename, World* world, float scale, int mat);
 
+	// Creates the model from a single triangle list (3 indices per triangle) instead of an OBJ file
+	void loadFromMesh(const std::string& name, const std::vector<cl_float3>& positions, const std::vector<unsigned int>& indices, World* world, float scale, int mat);
+
 };
 
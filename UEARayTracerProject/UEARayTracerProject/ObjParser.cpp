@@ -0,0 +1,291 @@
+#include "ObjParser.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <string.h>
+#include <limits>
+
+// Chunk normal index of a face vertex without a normal. Resolved relative indices never reach it.
+#define OBJ_CHUNK_NO_NORMAL (std::numeric_limits<int>::min())
+
+struct ObjMeshStart {
+	std::string name;
+	size_t index; // First index of the mesh within the chunk
+};
+
+struct ObjChunk {
+	const char* begin;
+	const char* end;
+	std::vector<cl_float3> positions;
+	std::vector<int> indices; // 0-based. Negative OBJ indices are stored relative to the first position of the chunk until the merge.
+	std::vector<size_t> relative; // Entries of indices that are still relative
+	std::vector<cl_float3> normals;
+	std::vector<int> normalIndices; // One per index, like indices but relative to the first normal of the chunk, or OBJ_CHUNK_NO_NORMAL
+	std::vector<size_t> relativeNormals;
+	std::vector<ObjMeshStart> meshes;
+	size_t errors = 0;
+};
+
+const double objPowersOfTen[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+inline bool _obj_isSpace(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline void _obj_skipSpace(const char*& p, const char* end) {
+	while (p < end && _obj_isSpace(*p)) ++p;
+}
+
+inline void _obj_skipLine(const char*& p, const char* end) {
+	const char* next = (const char*)memchr(p, '\n', end - p);
+	p = next != nullptr ? next + 1 : end;
+}
+
+// Decimal float with optional sign, fraction and exponent. Mantissas beyond 19 digits lose precision, which is far below float precision.
+bool _obj_parseFloat(const char*& p, const char* end, float* value) {
+	_obj_skipSpace(p, end);
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+	unsigned long long mantissa = 0;
+	int exponent = 0, digits = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+		if (mantissa < 1000000000000000000ULL) mantissa = mantissa * 10 + (*p - '0');
+		else exponent++;
+	}
+	if (p < end && *p == '.') {
+		for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+			if (mantissa < 1000000000000000000ULL) {
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			}
+		}
+	}
+	if (digits == 0) return false;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		++p;
+		bool negativeExponent = false;
+		if (p < end && (*p == '-' || *p == '+')) negativeExponent = *p++ == '-';
+		int e = 0;
+		for (; p < end && *p >= '0' && *p <= '9'; ++p) e = std::min(e * 10 + (*p - '0'), 1000);
+		exponent += negativeExponent ? -e : e;
+	}
+
+	double result = (double)mantissa;
+	while (exponent > 22) result *= 1e22, exponent -= 22;
+	while (exponent < -22) result /= 1e22, exponent += 22;
+	result = exponent >= 0 ? result * objPowersOfTen[exponent] : result / objPowersOfTen[-exponent];
+	*value = (float)(negative ? -result : result);
+	return true;
+}
+
+// Signed OBJ index. 0 is not a valid index and is returned when there are no digits.
+int _obj_parseInteger(const char*& p, const char* end) {
+	bool negative = false;
+	if (p < end && *p == '-') negative = true, ++p;
+	int value = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; ++p) value = value * 10 + (*p - '0');
+	return negative ? -value : value;
+}
+
+// Position and normal index of a face vertex (v, v/vt, v//vn or v/vt/vn). The texture index is skipped and normal is 0 if there is none.
+bool _obj_parseIndex(const char*& p, const char* end, int* index, int* normal) {
+	_obj_skipSpace(p, end);
+	if (p >= end || (*p != '-' && (*p < '0' || *p > '9'))) return false;
+
+	*index = _obj_parseInteger(p, end);
+	*normal = 0;
+	if (p < end && *p == '/') {
+		++p;
+		_obj_parseInteger(p, end);
+		if (p < end && *p == '/') {
+			++p;
+			*normal = _obj_parseInteger(p, end);
+		}
+	}
+	while (p < end && !_obj_isSpace(*p) && *p != '\n') ++p;
+	return *index != 0;
+}
+
+void _obj_addIndex(std::vector<int>* indices, std::vector<size_t>* relative, size_t count, int index) {
+	if (index > 0) {
+		indices->push_back(index - 1);
+	} else {
+		// -1 is the last element read so far, which may be in an earlier chunk
+		relative->push_back(indices->size());
+		indices->push_back((int)count + index);
+	}
+}
+
+void _obj_addVertex(ObjChunk* chunk, int index, int normal) {
+	_obj_addIndex(&chunk->indices, &chunk->relative, chunk->positions.size(), index);
+	if (normal != 0) _obj_addIndex(&chunk->normalIndices, &chunk->relativeNormals, chunk->normals.size(), normal);
+	else chunk->normalIndices.push_back(OBJ_CHUNK_NO_NORMAL);
+}
+
+void _obj_parseChunk(ObjChunk* chunk) {
+	const char* p = chunk->begin;
+	const char* end = chunk->end;
+	chunk->positions.reserve((end - p) / 64);
+	chunk->indices.reserve((end - p) / 16);
+
+	while (p < end) {
+		_obj_skipSpace(p, end);
+		if (p >= end) break;
+
+		if (*p == 'v' && p + 1 < end && _obj_isSpace(p[1])) {
+			p += 1;
+			cl_float3 position;
+			if (_obj_parseFloat(p, end, &position.x) && _obj_parseFloat(p, end, &position.y) && _obj_parseFloat(p, end, &position.z)) {
+				chunk->positions.push_back(position);
+			} else {
+				chunk->errors++;
+			}
+		} else if (*p == 'v' && p + 2 < end && p[1] == 'n' && _obj_isSpace(p[2])) {
+			p += 2;
+			cl_float3 normal;
+			if (_obj_parseFloat(p, end, &normal.x) && _obj_parseFloat(p, end, &normal.y) && _obj_parseFloat(p, end, &normal.z)) {
+				chunk->normals.push_back(normal);
+			} else {
+				chunk->errors++;
+			}
+		} else if (*p == 'f' && p + 1 < end && _obj_isSpace(p[1])) {
+			p += 1;
+			// Fan triangulation: (first, previous, current) for every vertex after the second
+			int first, previous, current;
+			int firstNormal, previousNormal, currentNormal;
+			if (_obj_parseIndex(p, end, &first, &firstNormal) && _obj_parseIndex(p, end, &previous, &previousNormal)) {
+				while (_obj_parseIndex(p, end, &current, &currentNormal)) {
+					_obj_addVertex(chunk, first, firstNormal);
+					_obj_addVertex(chunk, previous, previousNormal);
+					_obj_addVertex(chunk, current, currentNormal);
+					previous = current;
+					previousNormal = currentNormal;
+				}
+			} else {
+				chunk->errors++;
+			}
+		} else if ((*p == 'o' || *p == 'g') && p + 1 < end && _obj_isSpace(p[1])) {
+			p += 1;
+			_obj_skipSpace(p, end);
+			const char* nameEnd = (const char*)memchr(p, '\n', end - p);
+			if (nameEnd == nullptr) nameEnd = end;
+			const char* nameBegin = p;
+			while (nameEnd > nameBegin && _obj_isSpace(nameEnd[-1])) --nameEnd;
+			chunk->meshes.push_back({ std::string(nameBegin, nameEnd), chunk->indices.size() });
+		}
+
+		_obj_skipLine(p, end);
+	}
+}
+
+void _obj_appendIndices(obj::ObjData* data, const ObjChunk& chunk, size_t from, size_t to) {
+	std::vector<unsigned int>& indices = data->meshes.back().indices;
+	indices.insert(indices.end(), chunk.indices.begin() + from, chunk.indices.begin() + to);
+	if (data->normals.empty()) return;
+	std::vector<unsigned int>& normalIndices = data->meshes.back().normalIndices;
+	for (size_t i = from; i < to; ++i) {
+		normalIndices.push_back(chunk.normalIndices[i] == OBJ_CHUNK_NO_NORMAL ? OBJ_NO_NORMAL : (unsigned int)chunk.normalIndices[i]);
+	}
+}
+
+namespace obj {
+
+	bool load(const std::string& path, ObjData* data, unsigned int threads) {
+		auto starttime = std::chrono::steady_clock::now();
+
+		MappedFile file;
+		if (!file.open(path)) {
+			std::cout << "Could not open " << path << std::endl;
+			return false;
+		}
+
+		// Split at the first line break after every OBJ_CHUNK_SIZE bytes
+		std::vector<ObjChunk> chunks;
+		const char* begin = file.getData();
+		const char* fileEnd = file.getData() + file.getSize();
+		while (begin < fileEnd) {
+			const char* end = begin + std::min((size_t)(fileEnd - begin), (size_t)OBJ_CHUNK_SIZE);
+			if (end < fileEnd) {
+				const char* lineEnd = (const char*)memchr(end, '\n', fileEnd - end);
+				end = lineEnd != nullptr ? lineEnd + 1 : fileEnd;
+			}
+			chunks.push_back(ObjChunk());
+			chunks.back().begin = begin;
+			chunks.back().end = end;
+			begin = end;
+		}
+
+		ThreadPool pool;
+		pool.start(std::min(threads > 0 ? threads : std::thread::hardware_concurrency(), (unsigned int)std::max(chunks.size(), (size_t)1)));
+		pool.run((unsigned int)chunks.size(), [&](unsigned int task, unsigned int) {
+			_obj_parseChunk(&chunks[task]);
+		});
+
+		// Positions and normals of each chunk start after those of the chunks before it
+		std::vector<size_t> positionOffsets(chunks.size() + 1, 0);
+		std::vector<size_t> normalOffsets(chunks.size() + 1, 0);
+		size_t errors = 0;
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			positionOffsets[i + 1] = positionOffsets[i] + chunks[i].positions.size();
+			normalOffsets[i + 1] = normalOffsets[i] + chunks[i].normals.size();
+			errors += chunks[i].errors;
+		}
+
+		data->positions.resize(positionOffsets.back());
+		data->normals.resize(normalOffsets.back());
+		std::atomic<bool> indicesValid(true);
+		pool.run((unsigned int)chunks.size(), [&](unsigned int task, unsigned int) {
+			ObjChunk& chunk = chunks[task];
+			if (!chunk.positions.empty()) memcpy(&data->positions[positionOffsets[task]], &chunk.positions[0], sizeof(cl_float3) * chunk.positions.size());
+			if (!chunk.normals.empty()) memcpy(&data->normals[normalOffsets[task]], &chunk.normals[0], sizeof(cl_float3) * chunk.normals.size());
+			for (size_t r : chunk.relative) chunk.indices[r] += (int)positionOffsets[task];
+			for (size_t r : chunk.relativeNormals) chunk.normalIndices[r] += (int)normalOffsets[task];
+			for (int index : chunk.indices) {
+				if (index < 0 || (size_t)index >= data->positions.size()) indicesValid = false;
+			}
+			for (int index : chunk.normalIndices) {
+				if (index != OBJ_CHUNK_NO_NORMAL && (index < 0 || (size_t)index >= data->normals.size())) indicesValid = false;
+			}
+			std::vector<cl_float3>().swap(chunk.positions);
+			std::vector<cl_float3>().swap(chunk.normals);
+		});
+		pool.stop();
+
+		if (!indicesValid) {
+			std::cout << "OBJ " << path << " has face indices outside its " << data->positions.size() << " positions or " << data->normals.size() << " normals." << std::endl;
+			return false;
+		}
+
+		// Faces before the first o/g line go into an unnamed mesh like objl::Loader
+		data->meshes.clear();
+		data->meshes.push_back({ "unnamed", {}, {} });
+		for (ObjChunk& chunk : chunks) {
+			size_t from = 0;
+			for (const ObjMeshStart& start : chunk.meshes) {
+				_obj_appendIndices(data, chunk, from, start.index);
+				from = start.index;
+				if (data->meshes.back().indices.empty()) data->meshes.back().name = start.name;
+				else data->meshes.push_back({ start.name, {}, {} });
+			}
+			_obj_appendIndices(data, chunk, from, chunk.indices.size());
+			std::vector<int>().swap(chunk.indices);
+			std::vector<int>().swap(chunk.normalIndices);
+		}
+		if (data->meshes.back().indices.empty()) data->meshes.pop_back();
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+		size_t triangles = 0;
+		for (const ObjMesh& mesh : data->meshes) triangles += mesh.indices.size() / 3;
+		std::cout << "Parsed " << path << ": " << data->positions.size() << " positions, " << data->normals.size() << " normals, " << triangles << " triangles in " << data->meshes.size() << " meshes, "
+			<< file.getSize() / (1024.0 * 1024.0) << " MB in " << seconds * 1000.0 << "ms (" << file.getSize() / seconds / 1e9 << " GB/s, " << chunks.size() << " chunks)." << std::endl;
+		if (errors > 0) std::cout << "Skipped " << errors << " malformed v/vn/f lines." << std::endl;
+		return true;
+	}
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+
+// Bytes of the file each parse task covers. Chunks end at the next line break after this size.
+#define OBJ_CHUNK_SIZE (1 << 22)
+// Normal index of a face vertex written without one (v or v/vt)
+#define OBJ_NO_NORMAL (0xFFFFFFFF)
+
+/**
+	OBJ loader for large meshes. The file is memory mapped, split into chunks at line boundaries and the chunks are parsed in parallel
+	without allocating per line or token, then merged in file order.
+	Only positions (v), normals (vn), faces (f) and objects/groups (o, g) are read. Polygons are fan triangulated.
+*/
+namespace obj {
+
+	struct ObjMesh {
+		std::string name;
+		std::vector<unsigned int> indices; // 3 per triangle into ObjData::positions
+		std::vector<unsigned int> normalIndices; // Per index into ObjData::normals or OBJ_NO_NORMAL. Empty if the file has no normals.
+	};
+
+	struct ObjData {
+		std::vector<cl_float3> positions; // Shared by every mesh
+		std::vector<cl_float3> normals; // As written in the file, not normalised
+		std::vector<ObjMesh> meshes;
+	};
+
+	// threads = 0 uses every hardware thread
+	bool load(const std::string& path, ObjData* data, unsigned int threads = 0);
+
+}
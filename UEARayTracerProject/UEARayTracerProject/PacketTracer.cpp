@@ -0,0 +1,370 @@
+#include "PacketTracer.h"
+#include "CPUDefines.h"
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+typedef __m256 packet_t;
+
+inline packet_t _packet_set1(float f) { return _mm256_set1_ps(f); }
+inline packet_t _packet_index(int i) { return _mm256_castsi256_ps(_mm256_set1_epi32(i)); }
+inline packet_t _packet_load(const float* p) { return _mm256_loadu_ps(p); }
+inline void _packet_store(float* p, packet_t a) { _mm256_storeu_ps(p, a); }
+inline packet_t _packet_add(packet_t a, packet_t b) { return _mm256_add_ps(a, b); }
+inline packet_t _packet_sub(packet_t a, packet_t b) { return _mm256_sub_ps(a, b); }
+inline packet_t _packet_mul(packet_t a, packet_t b) { return _mm256_mul_ps(a, b); }
+inline packet_t _packet_div(packet_t a, packet_t b) { return _mm256_div_ps(a, b); }
+inline packet_t _packet_sqrt(packet_t a) { return _mm256_sqrt_ps(a); }
+inline packet_t _packet_floor(packet_t a) { return _mm256_floor_ps(a); }
+inline packet_t _packet_lt(packet_t a, packet_t b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline packet_t _packet_le(packet_t a, packet_t b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline packet_t _packet_eq(packet_t a, packet_t b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+inline packet_t _packet_and(packet_t a, packet_t b) { return _mm256_and_ps(a, b); }
+inline packet_t _packet_or(packet_t a, packet_t b) { return _mm256_or_ps(a, b); }
+inline packet_t _packet_andnot(packet_t a, packet_t b) { return _mm256_andnot_ps(a, b); }
+inline packet_t _packet_select(packet_t mask, packet_t a, packet_t b) { return _mm256_blendv_ps(b, a, mask); }
+inline packet_t _packet_indexEq(packet_t a, int i) { return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_castps_si256(a), _mm256_set1_epi32(i))); }
+inline int _packet_movemask(packet_t a) { return _mm256_movemask_ps(a); }
+#else
+#include <emmintrin.h>
+
+typedef __m128 packet_t;
+
+inline packet_t _packet_set1(float f) { return _mm_set1_ps(f); }
+inline packet_t _packet_index(int i) { return _mm_castsi128_ps(_mm_set1_epi32(i)); }
+inline packet_t _packet_load(const float* p) { return _mm_loadu_ps(p); }
+inline void _packet_store(float* p, packet_t a) { _mm_storeu_ps(p, a); }
+inline packet_t _packet_add(packet_t a, packet_t b) { return _mm_add_ps(a, b); }
+inline packet_t _packet_sub(packet_t a, packet_t b) { return _mm_sub_ps(a, b); }
+inline packet_t _packet_mul(packet_t a, packet_t b) { return _mm_mul_ps(a, b); }
+inline packet_t _packet_div(packet_t a, packet_t b) { return _mm_div_ps(a, b); }
+inline packet_t _packet_sqrt(packet_t a) { return _mm_sqrt_ps(a); }
+inline packet_t _packet_lt(packet_t a, packet_t b) { return _mm_cmplt_ps(a, b); }
+inline packet_t _packet_le(packet_t a, packet_t b) { return _mm_cmple_ps(a, b); }
+inline packet_t _packet_eq(packet_t a, packet_t b) { return _mm_cmpeq_ps(a, b); }
+inline packet_t _packet_and(packet_t a, packet_t b) { return _mm_and_ps(a, b); }
+inline packet_t _packet_or(packet_t a, packet_t b) { return _mm_or_ps(a, b); }
+inline packet_t _packet_andnot(packet_t a, packet_t b) { return _mm_andnot_ps(a, b); }
+inline packet_t _packet_select(packet_t mask, packet_t a, packet_t b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+inline packet_t _packet_indexEq(packet_t a, int i) { return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_castps_si128(a), _mm_set1_epi32(i))); }
+inline int _packet_movemask(packet_t a) { return _mm_movemask_ps(a); }
+
+// SSE2 has no floor. Truncate and step down for negative non-integers (inf and NaN end up far outside the grid either way).
+inline packet_t _packet_floor(packet_t a) {
+	packet_t t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+	return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1.0f)));
+}
+#endif
+
+inline packet_t _packet_abs(packet_t a) { return _packet_andnot(_packet_set1(-0.0f), a); }
+inline packet_t _packet_not(packet_t a) { return _packet_andnot(a, _packet_index(-1)); }
+inline bool _packet_any(packet_t a) { return _packet_movemask(a) != 0; }
+
+// Structure of arrays float3, one component register per axis
+struct PacketVec {
+	packet_t x, y, z;
+};
+
+inline PacketVec _packet_vec(cl_float3 v) {
+	return { _packet_set1(v.x), _packet_set1(v.y), _packet_set1(v.z) };
+}
+
+inline PacketVec _packet_vadd(const PacketVec& a, const PacketVec& b) {
+	return { _packet_add(a.x, b.x), _packet_add(a.y, b.y), _packet_add(a.z, b.z) };
+}
+
+inline PacketVec _packet_vsub(const PacketVec& a, const PacketVec& b) {
+	return { _packet_sub(a.x, b.x), _packet_sub(a.y, b.y), _packet_sub(a.z, b.z) };
+}
+
+inline PacketVec _packet_vmul(const PacketVec& a, const PacketVec& b) {
+	return { _packet_mul(a.x, b.x), _packet_mul(a.y, b.y), _packet_mul(a.z, b.z) };
+}
+
+inline PacketVec _packet_vscale(const PacketVec& a, packet_t s) {
+	return { _packet_mul(a.x, s), _packet_mul(a.y, s), _packet_mul(a.z, s) };
+}
+
+inline packet_t _packet_dot(const PacketVec& a, const PacketVec& b) {
+	return _packet_add(_packet_add(_packet_mul(a.x, b.x), _packet_mul(a.y, b.y)), _packet_mul(a.z, b.z));
+}
+
+inline PacketVec _packet_cross(const PacketVec& a, const PacketVec& b) {
+	return {
+		_packet_sub(_packet_mul(a.y, b.z), _packet_mul(a.z, b.y)),
+		_packet_sub(_packet_mul(a.z, b.x), _packet_mul(a.x, b.z)),
+		_packet_sub(_packet_mul(a.x, b.y), _packet_mul(a.y, b.x))
+	};
+}
+
+/**
+	Packet version of model_intersect. Only lanes in the lanes mask take part.
+	Every step the active lanes are grouped by the grid cell they are in, so each triangle of a cell is loaded once and tested against all lanes inside it.
+*/
+packet_t _packet_modelIntersect(const cpu::WorldPack* pack, const PacketVec& origin, const PacketVec& direction, unsigned char modelIndex, packet_t lanes, packet_t* closest_T, packet_t* closest_I, packet_t* closest_U, packet_t* closest_V) {
+	const ModelStruct* model = pack->models + modelIndex;
+	const packet_t zero = _packet_set1(0.0f);
+	const packet_t one = _packet_set1(1.0f);
+	const int gridRowCount = getGridCellRowCount();
+	const packet_t rowCount = _packet_set1((float)gridRowCount);
+
+	PacketVec gridmin = _packet_vec({ model->bounds[0].x, model->bounds[1].x, model->bounds[2].x });
+	PacketVec gridmax = _packet_vec({ model->bounds[0].y, model->bounds[1].y, model->bounds[2].y });
+
+	PacketVec cellSize = _packet_vscale(_packet_vsub(gridmax, gridmin), _packet_set1(1.0f / gridRowCount));
+	PacketVec rayStart = _packet_vadd(origin, _packet_vscale(direction, *closest_T));
+	PacketVec dda_origin = _packet_vsub(rayStart, gridmin);
+
+	PacketVec zeroDir = { _packet_eq(direction.x, zero), _packet_eq(direction.y, zero), _packet_eq(direction.z, zero) };
+	PacketVec positiveDir = { _packet_lt(zero, direction.x), _packet_lt(zero, direction.y), _packet_lt(zero, direction.z) };
+
+	const packet_t minusOne = _packet_set1(-1.0f);
+	PacketVec step = {
+		_packet_andnot(zeroDir.x, _packet_select(_packet_lt(direction.x, zero), minusOne, one)),
+		_packet_andnot(zeroDir.y, _packet_select(_packet_lt(direction.y, zero), minusOne, one)),
+		_packet_andnot(zeroDir.z, _packet_select(_packet_lt(direction.z, zero), minusOne, one))
+	};
+
+	dda_origin = _packet_vadd(dda_origin, _packet_vscale(step, _packet_set1(EPSILON)));
+
+	const packet_t maxValue = _packet_set1((float)MAX_VALUE);
+	PacketVec invdir = {
+		_packet_select(zeroDir.x, maxValue, _packet_div(one, direction.x)),
+		_packet_select(zeroDir.y, maxValue, _packet_div(one, direction.y)),
+		_packet_select(zeroDir.z, maxValue, _packet_div(one, direction.z))
+	};
+
+	PacketVec deltaT = _packet_vmul(cellSize, invdir);
+	deltaT = { _packet_abs(deltaT.x), _packet_abs(deltaT.y), _packet_abs(deltaT.z) };
+
+	PacketVec cellO = { _packet_div(dda_origin.x, cellSize.x), _packet_div(dda_origin.y, cellSize.y), _packet_div(dda_origin.z, cellSize.z) };
+	PacketVec currentV = { _packet_floor(cellO.x), _packet_floor(cellO.y), _packet_floor(cellO.z) };
+	PacketVec cellBoundaryOffset = { _packet_and(positiveDir.x, one), _packet_and(positiveDir.y, one), _packet_and(positiveDir.z, one) };
+	PacketVec cellBoundary = _packet_vadd(_packet_vmul(_packet_vadd(currentV, cellBoundaryOffset), cellSize), gridmin);
+	PacketVec boundaryDist = _packet_vsub(cellBoundary, origin);
+	const packet_t noBoundary = _packet_set1(9999.0f);
+	PacketVec Tv = {
+		_packet_select(zeroDir.x, noBoundary, _packet_div(boundaryDist.x, direction.x)),
+		_packet_select(zeroDir.y, noBoundary, _packet_div(boundaryDist.y, direction.y)),
+		_packet_select(zeroDir.z, noBoundary, _packet_div(boundaryDist.z, direction.z))
+	};
+
+	packet_t hasIntersect = _packet_set1(0.0f);
+	packet_t closest_triangle_T = maxValue;
+	packet_t active = lanes;
+	const packet_t epsilon = _packet_set1(EPSILON);
+	const packet_t negEpsilon = _packet_set1(-EPSILON);
+
+	for (int max_step = 1000; max_step > 0; --max_step) {
+		// Mask off lanes which have left the grid
+		packet_t inside = _packet_and(
+			_packet_and(_packet_and(_packet_le(zero, currentV.x), _packet_lt(currentV.x, rowCount)), _packet_and(_packet_le(zero, currentV.y), _packet_lt(currentV.y, rowCount))),
+			_packet_and(_packet_le(zero, currentV.z), _packet_lt(currentV.z, rowCount))
+		);
+		active = _packet_and(active, inside);
+		if (!_packet_any(active)) break;
+
+		packet_t cellOffset = _packet_add(_packet_add(_packet_mul(currentV.x, _packet_set1((float)SQ(gridRowCount))), _packet_mul(currentV.y, rowCount)), currentV.z);
+		float cellOffsets[PACKET_SIZE];
+		_packet_store(cellOffsets, cellOffset);
+
+		// Visit each distinct cell among the active lanes once
+		int pending = _packet_movemask(active);
+		for (int lane = 0; lane < PACKET_SIZE; ++lane) {
+			if (!(pending & (1 << lane))) continue;
+
+			packet_t cellLanes = _packet_and(active, _packet_eq(cellOffset, _packet_set1(cellOffsets[lane])));
+			pending &= ~_packet_movemask(cellLanes);
+
+			unsigned int celloffset = (unsigned int)cellOffsets[lane];
+			// Primary rays always use the level picked for the frame
+			const unsigned int count = pack->triangleCountGrid[getModelCountOffset(model, model->lodLevel) + celloffset];
+			const unsigned int* cell = pack->grid + getModelGridOffset(model, model->lodLevel) + (celloffset * GRID_MAX_TRIANGLES_PER_CELL);
+			for (unsigned int i = 0; i < count; ++i) {
+				unsigned int tri_i = cell[i];
+				const Triangle* triangle = pack->triangles + tri_i;
+
+				// Moller-Trumbore against every lane in the cell, as in triangle_intersect
+				cl_float3 v0 = pack->vertices[triangle->face.x];
+				PacketVec edge1 = _packet_vec(pack->vertices[triangle->face.y] - v0);
+				PacketVec edge2 = _packet_vec(pack->vertices[triangle->face.z] - v0);
+				PacketVec h = _packet_cross(direction, edge2);
+				packet_t a = _packet_dot(edge1, h);
+
+				packet_t valid = _packet_andnot(_packet_and(_packet_lt(negEpsilon, a), _packet_lt(a, epsilon)), cellLanes);
+				if (!_packet_any(valid)) continue;
+
+				packet_t f = _packet_div(one, a);
+				PacketVec s = _packet_vsub(origin, _packet_vec(v0));
+				packet_t u = _packet_mul(f, _packet_dot(s, h));
+				valid = _packet_andnot(_packet_or(_packet_lt(u, zero), _packet_lt(one, u)), valid);
+
+				PacketVec q = _packet_cross(s, edge1);
+				packet_t v = _packet_mul(f, _packet_dot(direction, q));
+				valid = _packet_andnot(_packet_or(_packet_lt(v, zero), _packet_lt(one, _packet_add(u, v))), valid);
+
+				packet_t t = _packet_mul(f, _packet_dot(edge2, q));
+				valid = _packet_andnot(_packet_lt(t, epsilon), valid);
+				if (!_packet_any(valid)) continue;
+
+				packet_t closer = _packet_and(valid, _packet_lt(t, closest_triangle_T));
+				closest_triangle_T = _packet_select(closer, t, closest_triangle_T);
+				*closest_T = _packet_select(closer, t, *closest_T);
+				*closest_I = _packet_select(closer, _packet_index((int)tri_i), *closest_I);
+				*closest_U = _packet_select(closer, u, *closest_U);
+				*closest_V = _packet_select(closer, v, *closest_V);
+
+				hasIntersect = _packet_or(hasIntersect, valid);
+			}
+		}
+
+		PacketVec incr = {
+			_packet_and(_packet_and(_packet_le(Tv.x, Tv.y), _packet_le(Tv.x, Tv.z)), one),
+			_packet_and(_packet_and(_packet_le(Tv.y, Tv.x), _packet_le(Tv.y, Tv.z)), one),
+			_packet_and(_packet_and(_packet_le(Tv.z, Tv.x), _packet_le(Tv.z, Tv.y)), one)
+		};
+
+		Tv = _packet_vadd(Tv, _packet_vmul(incr, deltaT));
+		currentV = _packet_vadd(currentV, _packet_vmul(incr, step));
+	}
+	return hasIntersect;
+}
+
+namespace cpu {
+
+	const char* packet_isa() {
+#if defined(__AVX2__)
+		return "AVX2";
+#else
+		return "SSE2";
+#endif
+	}
+
+	void trace_packet(const WorldPack* pack, const Ray* rays, PacketHit* hit) {
+		float lanes[6][PACKET_SIZE];
+		for (int i = 0; i < PACKET_SIZE; ++i) {
+			lanes[0][i] = rays[i].origin.x;
+			lanes[1][i] = rays[i].origin.y;
+			lanes[2][i] = rays[i].origin.z;
+			lanes[3][i] = rays[i].direction.x;
+			lanes[4][i] = rays[i].direction.y;
+			lanes[5][i] = rays[i].direction.z;
+		}
+		const PacketVec origin = { _packet_load(lanes[0]), _packet_load(lanes[1]), _packet_load(lanes[2]) };
+		const PacketVec direction = { _packet_load(lanes[3]), _packet_load(lanes[4]), _packet_load(lanes[5]) };
+
+		const packet_t zero = _packet_set1(0.0f);
+		const packet_t epsilon = _packet_set1(EPSILON);
+		const packet_t maxValue = _packet_set1((float)MAX_VALUE);
+
+		// Sphere intersection
+		packet_t closest_T = maxValue;
+		packet_t closest_T2 = zero;
+		packet_t closest_i = _packet_index(-1);
+		packet_t closest_type = _packet_index(-1);
+		packet_t closest_U = zero;
+		packet_t closest_V = zero;
+		for (cl_uint i = 0; i < pack->world->numSpheres; ++i) {
+			const Sphere* sphere = &pack->spheres[i];
+
+			PacketVec vec_raysphere = _packet_vsub(origin, _packet_vec(sphere->position));
+			packet_t dot_raysphere = _packet_dot(vec_raysphere, direction);
+			packet_t dist2 = _packet_dot(vec_raysphere, vec_raysphere);
+			packet_t radius2 = _packet_set1(SQ(sphere->radius));
+
+			// If sphere is behind origin and origin is outside, skip
+			packet_t valid = _packet_not(_packet_and(_packet_lt(zero, dot_raysphere), _packet_lt(radius2, dist2)));
+
+			packet_t b = _packet_mul(_packet_set1(2.0f), dot_raysphere);
+			packet_t c = _packet_sub(dist2, radius2);
+			packet_t discriminant = _packet_sub(_packet_mul(b, b), _packet_mul(_packet_set1(4.0f), c));
+			valid = _packet_andnot(_packet_lt(discriminant, zero), valid);
+			if (!_packet_any(valid)) continue;
+
+			packet_t dsqrt = _packet_sqrt(discriminant);
+			packet_t minT = _packet_div(_packet_sub(_packet_sub(zero, b), dsqrt), _packet_set1(2.0f));
+			packet_t maxT = _packet_div(_packet_add(_packet_sub(zero, b), dsqrt), _packet_set1(2.0f));
+
+			// Epsilon (Make sure ray from a sphere doesn't intersect itself)
+			minT = _packet_select(_packet_lt(minT, epsilon), maxT, minT);
+
+			// If intersect is behind origin, it doesn't intersect
+			valid = _packet_andnot(_packet_lt(maxT, epsilon), valid);
+
+			packet_t closer = _packet_and(valid, _packet_lt(minT, closest_T));
+			closest_T = _packet_select(closer, minT, closest_T);
+			closest_T2 = _packet_select(closer, maxT, closest_T2);
+			closest_i = _packet_select(closer, _packet_index((int)i), closest_i);
+			closest_type = _packet_select(closer, _packet_index(SPHERE_TYPE), closest_type);
+		}
+
+		// Model k-DOP intersections
+		packet_t planeDotRayOrigin[BVH_PLANE_COUNT];
+		packet_t planeDotRayDirection[BVH_PLANE_COUNT];
+		for (int plane_i = 0; plane_i < BVH_PLANE_COUNT; ++plane_i) {
+			PacketVec planeNormal = _packet_vec(BVH_PlaneNormals[plane_i]);
+			planeDotRayOrigin[plane_i] = _packet_dot(origin, planeNormal);
+			planeDotRayDirection[plane_i] = _packet_dot(direction, planeNormal);
+		}
+
+		packet_t closest_model = _packet_index(-1);
+		packet_t closest_model_T = maxValue;
+		for (cl_uint i = 0; i < pack->world->numModels; ++i) {
+			const ModelStruct* model = pack->models + i;
+
+			// Same start value as bvh_plane_intersect's caller, including the unsigned wrap of -MAX_VALUE
+			const float tnearStart = -MAX_VALUE;
+			packet_t tNear = _packet_set1(tnearStart);
+			packet_t tFar = maxValue;
+			packet_t alive = _packet_index(-1);
+			for (int plane_i = 0; plane_i < BVH_PLANE_COUNT; ++plane_i) {
+				packet_t tNearPlane = _packet_div(_packet_sub(_packet_set1(model->bounds[plane_i].x), planeDotRayOrigin[plane_i]), planeDotRayDirection[plane_i]);
+				packet_t tFarPlane = _packet_div(_packet_sub(_packet_set1(model->bounds[plane_i].y), planeDotRayOrigin[plane_i]), planeDotRayDirection[plane_i]);
+				packet_t flip = _packet_lt(planeDotRayDirection[plane_i], zero);
+				packet_t nearPlane = _packet_select(flip, tFarPlane, tNearPlane);
+				packet_t farPlane = _packet_select(flip, tNearPlane, tFarPlane);
+
+				tNear = _packet_select(_packet_lt(tNear, nearPlane), nearPlane, tNear);
+				tFar = _packet_select(_packet_lt(farPlane, tFar), farPlane, tFar);
+				alive = _packet_andnot(_packet_lt(tFar, tNear), alive);
+				if (!_packet_any(alive)) break;
+			}
+
+			packet_t closer = _packet_and(alive, _packet_lt(tNear, closest_model_T));
+			closest_model_T = _packet_select(closer, tNear, closest_model_T);
+			closest_model = _packet_select(closer, _packet_index((int)i), closest_model);
+		}
+
+		// Grid traversal of each lane's closest model, where the bounding volume is in front of the closest sphere
+		packet_t testModel = _packet_lt(closest_model_T, closest_T);
+		for (cl_uint i = 0; i < pack->world->numModels && _packet_any(testModel); ++i) {
+			packet_t lanes = _packet_and(testModel, _packet_indexEq(closest_model, (int)i));
+			if (!_packet_any(lanes)) continue;
+			testModel = _packet_andnot(lanes, testModel);
+
+			packet_t model_T = closest_model_T;
+			packet_t tri_i = _packet_index(-1);
+			packet_t tri_U = zero, tri_V = zero;
+			packet_t modelHit = _packet_and(lanes, _packet_modelIntersect(pack, origin, direction, (unsigned char)i, lanes, &model_T, &tri_i, &tri_U, &tri_V));
+
+			closest_T = _packet_select(modelHit, model_T, closest_T);
+			closest_T2 = _packet_select(modelHit, model_T, closest_T2);
+			closest_i = _packet_select(modelHit, tri_i, closest_i);
+			closest_U = _packet_select(modelHit, tri_U, closest_U);
+			closest_V = _packet_select(modelHit, tri_V, closest_V);
+			closest_type = _packet_select(modelHit, _packet_index(TRIANGLE_TYPE), closest_type);
+		}
+
+		float objectIndex[PACKET_SIZE], objectType[PACKET_SIZE];
+		_packet_store(hit->T, closest_T);
+		_packet_store(hit->T2, closest_T2);
+		_packet_store(hit->u, closest_U);
+		_packet_store(hit->v, closest_V);
+		_packet_store(objectIndex, closest_i);
+		_packet_store(objectType, closest_type);
+		memcpy(hit->objectIndex, objectIndex, sizeof(objectIndex));
+		memcpy(hit->objectType, objectType, sizeof(objectType));
+	}
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "CPUTracer.h"
+
+// 8-wide AVX2 packets when the compiler targets AVX2 (/arch:AVX2), otherwise 4-wide SSE2
+#if defined(__AVX2__)
+#define PACKET_WIDTH (4)
+#define PACKET_HEIGHT (2)
+#else
+#define PACKET_WIDTH (2)
+#define PACKET_HEIGHT (2)
+#endif
+#define PACKET_SIZE (PACKET_WIDTH * PACKET_HEIGHT)
+
+namespace cpu {
+
+	// Closest hit of every lane in a packet. objectIndex is -1 for lanes that miss.
+	struct PacketHit {
+		float T[PACKET_SIZE];
+		float T2[PACKET_SIZE];
+		int objectType[PACKET_SIZE];
+		int objectIndex[PACKET_SIZE];
+		float u[PACKET_SIZE]; // Barycentrics of triangle hits
+		float v[PACKET_SIZE];
+	};
+
+	// Name of the instruction set the packet tracer was compiled for
+	const char* packet_isa();
+
+	/**
+		Traces PACKET_SIZE rays through the sphere list, the k-DOP of every model and the closest model's grid at once.
+		Gives the same closest hit as local_trace for each lane. Lanes are masked off as they miss or leave the grid.
+	*/
+	void trace_packet(const WorldPack* pack, const Ray* rays, PacketHit* hit);
+
+}
@@ -0,0 +1,238 @@
+#include "ProgramCache.h"
+#include "MappedFile.h"
+#include "cl_helper.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <unordered_set>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+bool programCacheEnabled = true;
+
+struct ProgramCacheHeader {
+	char magic[8];
+	cl_uint version;
+	cl_uint headerSize;
+	cl_ulong key;
+	cl_ulong binarySize;
+};
+
+// FNV-1a 64
+cl_ulong _programcache_hash(const void* data, size_t size, cl_ulong hash = 14695981039346656037ULL) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+cl_ulong _programcache_hashString(cl_ulong hash, const std::string& string) {
+	return _programcache_hash(string.c_str(), string.length() + 1, hash); // The terminator keeps "ab"+"c" and "a"+"bc" apart
+}
+
+std::vector<std::string> _programcache_includeDirectories(const std::string& buildOptions) {
+	std::vector<std::string> directories;
+	std::istringstream stream(buildOptions);
+	std::string token;
+	while (stream >> token) {
+		if (token == "-I") {
+			if (stream >> token) directories.push_back(token);
+		} else if (token.compare(0, 2, "-I") == 0) {
+			directories.push_back(token.substr(2));
+		}
+	}
+	return directories;
+}
+
+// Hashes source and then every file it includes, in the order the compiler would first reach them. Files are hashed once since the kernels guard their includes.
+cl_ulong _programcache_hashSource(cl_ulong hash, const std::string& source, const std::vector<std::string>& directories, std::unordered_set<std::string>& included) {
+	hash = _programcache_hashString(hash, source);
+
+	std::istringstream lines(source);
+	std::string line;
+	while (std::getline(lines, line)) {
+		size_t start = line.find_first_not_of(" \t");
+		if (start == std::string::npos || line.compare(start, 8, "#include") != 0) continue;
+		size_t open = line.find('"', start);
+		size_t close = open == std::string::npos ? std::string::npos : line.find('"', open + 1);
+		if (close == std::string::npos) continue;
+
+		// The name goes in the key even if the file isn't found, since the source build then fails on it
+		const std::string name = line.substr(open + 1, close - open - 1);
+		if (!included.insert(name).second) continue;
+		hash = _programcache_hashString(hash, name);
+		for (const std::string& directory : directories) {
+			std::string path = directory;
+			if (!path.empty() && path.back() != '/' && path.back() != '\\') path += '/';
+			path += name;
+			std::ifstream file(path, std::ios::in | std::ios::binary);
+			if (!file.is_open()) continue;
+			hash = _programcache_hashSource(hash, std::string(std::istreambuf_iterator<char>(file), (std::istreambuf_iterator<char>())), directories, included);
+			break;
+		}
+	}
+	return hash;
+}
+
+std::string _programcache_platformString(cl_platform_id platform, cl_platform_info info) {
+	size_t size = 0;
+	clGetPlatformInfo(platform, info, 0, NULL, &size);
+	std::string value(size, '\0');
+	if (size > 0) clGetPlatformInfo(platform, info, size, &value[0], NULL);
+	return value;
+}
+
+std::string _programcache_deviceString(cl_device_id device, cl_device_info info) {
+	size_t size = 0;
+	clGetDeviceInfo(device, info, 0, NULL, &size);
+	std::string value(size, '\0');
+	if (size > 0) clGetDeviceInfo(device, info, size, &value[0], NULL);
+	return value;
+}
+
+namespace programcache {
+
+	void setEnabled(bool enabled) {
+		programCacheEnabled = enabled;
+	}
+
+	bool isEnabled() {
+		return programCacheEnabled;
+	}
+
+	cl_ulong getKey(const std::vector<std::string>& sources, const std::string& buildOptions, cl_platform_id platform, cl_device_id device) {
+		const cl_uint version = PROGRAM_CACHE_VERSION;
+		cl_ulong hash = _programcache_hash(&version, sizeof(version));
+
+		const std::vector<std::string> directories = _programcache_includeDirectories(buildOptions);
+		std::unordered_set<std::string> included;
+		for (const std::string& source : sources) hash = _programcache_hashSource(hash, source, directories, included);
+
+		hash = _programcache_hashString(hash, buildOptions);
+		hash = _programcache_hashString(hash, _programcache_platformString(platform, CL_PLATFORM_NAME));
+		hash = _programcache_hashString(hash, _programcache_platformString(platform, CL_PLATFORM_VERSION));
+		hash = _programcache_hashString(hash, _programcache_deviceString(device, CL_DEVICE_NAME));
+		hash = _programcache_hashString(hash, _programcache_deviceString(device, CL_DEVICE_VENDOR));
+		hash = _programcache_hashString(hash, _programcache_deviceString(device, CL_DEVICE_VERSION));
+		hash = _programcache_hashString(hash, _programcache_deviceString(device, CL_DRIVER_VERSION));
+		return hash;
+	}
+
+	std::string getPath(cl_ulong key) {
+		std::ostringstream stream;
+		stream << PROGRAM_CACHE_DIRECTORY << "program_" << std::hex << std::setw(16) << std::setfill('0') << key << PROGRAM_CACHE_EXTENSION;
+		return stream.str();
+	}
+
+	cl_program load(cl_ulong key, const std::string& buildOptions, cl_context context, cl_device_id device) {
+		const std::string path = getPath(key);
+
+		MappedFile file;
+		if (!file.open(path)) return nullptr;
+
+		ProgramCacheHeader header;
+		if (file.getSize() < sizeof(ProgramCacheHeader)) {
+			std::cout << "Program cache " << path << " is truncated, building from source." << std::endl;
+			return nullptr;
+		}
+		memcpy(&header, file.getData(), sizeof(ProgramCacheHeader));
+		if (memcmp(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != PROGRAM_CACHE_VERSION
+			|| header.headerSize != sizeof(ProgramCacheHeader) || header.key != key || header.binarySize != file.getSize() - sizeof(ProgramCacheHeader)) {
+			std::cout << "Program cache " << path << " is invalid, building from source." << std::endl;
+			return nullptr;
+		}
+
+		const size_t size = (size_t)header.binarySize;
+		const unsigned char* binary = (const unsigned char*)(file.getData() + sizeof(ProgramCacheHeader));
+		cl_int status, err;
+		cl_program program = clCreateProgramWithBinary(context, 1, &device, &size, &binary, &status, &err);
+		if (err != CL_SUCCESS || status != CL_SUCCESS) {
+			std::cout << "Program cache " << path << " was rejected by the driver, building from source." << std::endl;
+			if (program) clReleaseProgram(program);
+			return nullptr;
+		}
+
+		// The binary is already compiled, this only links it for the device
+		err = clBuildProgram(program, 1, &device, buildOptions.c_str(), NULL, NULL);
+		if (err != CL_SUCCESS) {
+			std::cout << "Program cache " << path << " failed to build, building from source." << std::endl;
+			clReleaseProgram(program);
+			return nullptr;
+		}
+		touchCacheFile(PROGRAM_CACHE_INDEX, path, PROGRAM_CACHE_MAX_FILES);
+		return program;
+	}
+
+	bool write(cl_ulong key, cl_program program, cl_device_id device) {
+		const std::string path = getPath(key);
+		const std::string temporaryPath = path + ".tmp";
+
+		// The binaries are in the order of the program's devices, so take the one of device
+		cl_uint deviceCount = 0;
+		if (clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &deviceCount, NULL) != CL_SUCCESS || deviceCount == 0) {
+			std::cout << "The driver didn't provide a program binary to cache." << std::endl;
+			return false;
+		}
+		std::vector<cl_device_id> devices(deviceCount);
+		std::vector<size_t> sizes(deviceCount, 0);
+		if (clGetProgramInfo(program, CL_PROGRAM_DEVICES, sizeof(cl_device_id) * deviceCount, devices.data(), NULL) != CL_SUCCESS
+			|| clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * deviceCount, sizes.data(), NULL) != CL_SUCCESS) {
+			std::cout << "The driver didn't provide a program binary to cache." << std::endl;
+			return false;
+		}
+		const size_t deviceIndex = std::find(devices.begin(), devices.end(), device) - devices.begin();
+		if (deviceIndex == deviceCount || sizes[deviceIndex] == 0) {
+			std::cout << "The driver didn't provide a program binary for the device to cache." << std::endl;
+			return false;
+		}
+
+		// Binaries of the other devices aren't needed, so they get no storage
+		const size_t size = sizes[deviceIndex];
+		std::vector<unsigned char> binary(size);
+		std::vector<unsigned char*> binaryPtrs(deviceCount, nullptr);
+		binaryPtrs[deviceIndex] = binary.data();
+		if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*) * deviceCount, binaryPtrs.data(), NULL) != CL_SUCCESS) {
+			std::cout << "The driver didn't provide a program binary to cache." << std::endl;
+			return false;
+		}
+
+		ProgramCacheHeader header;
+		memset(&header, 0, sizeof(ProgramCacheHeader));
+		memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+		header.version = PROGRAM_CACHE_VERSION;
+		header.headerSize = sizeof(ProgramCacheHeader);
+		header.key = key;
+		header.binarySize = size;
+
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			std::cout << "Could not write program cache " << temporaryPath << std::endl;
+			return false;
+		}
+		file.write((const char*)&header, sizeof(ProgramCacheHeader));
+		file.write((const char*)binary.data(), size);
+		file.close();
+
+		if (file.fail()) {
+			std::cout << "Could not write program cache " << temporaryPath << std::endl;
+			remove(temporaryPath.c_str());
+			return false;
+		}
+
+		// rename doesn't replace an existing file on Windows
+		remove(path.c_str());
+		if (rename(temporaryPath.c_str(), path.c_str()) != 0) {
+			std::cout << "Could not rename " << temporaryPath << " to " << path << std::endl;
+			remove(temporaryPath.c_str());
+			return false;
+		}
+		std::cout << "Wrote program cache " << path << " (" << size / 1024.0 << " KB)" << std::endl;
+		touchCacheFile(PROGRAM_CACHE_INDEX, path, PROGRAM_CACHE_MAX_FILES);
+		return true;
+	}
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+
+#define PROGRAM_CACHE_MAGIC ("UEACLBIN")
+#define PROGRAM_CACHE_VERSION (1)
+#define PROGRAM_CACHE_DIRECTORY ("cl_kernels/")
+#define PROGRAM_CACHE_EXTENSION (".clcache")
+// Binaries kept, one per combination of sources, build options and device. The least recently used are deleted beyond it.
+#define PROGRAM_CACHE_MAX_FILES (16)
+#define PROGRAM_CACHE_INDEX ("cl_kernels/program_cache_index.txt")
+
+/**
+	Binary cache of the built OpenCL program, written to cl_kernels/program_<key>.clcache.
+	The key hashes the kernel sources with every #include expanded, the build options and the platform, device and driver version strings,
+	so a change to any kernel file, config.ini option or driver update gives a new key and the program is built from source again.
+	Each key gets its own file, so switching between configurations doesn't throw away the other binaries.
+*/
+namespace programcache {
+
+	// Enabled by default. Disabled by --no-program-cache or disableProgramCache in config.ini.
+	void setEnabled(bool enabled);
+	bool isEnabled();
+
+	// Include directories are taken from the -I options in buildOptions
+	cl_ulong getKey(const std::vector<std::string>& sources, const std::string& buildOptions, cl_platform_id platform, cl_device_id device);
+
+	std::string getPath(cl_ulong key);
+
+	// Creates and builds the program from the cached binary. Returns nullptr if there is no binary for key or the driver rejects it.
+	cl_program load(cl_ulong key, const std::string& buildOptions, cl_context context, cl_device_id device);
+
+	// Writes the binary built for device. Written under a temporary name and renamed, so a partial write is never loaded
+	bool write(cl_ulong key, cl_program program, cl_device_id device);
+
+}
@@ -1,5 +1,91 @@
 #include "RARKernel.h"
 #include <math.h>
+#include <algorithm>
+
+RayTree rayTree = FULL_RAY_TREE;
+bool mortonDispatch = false;
+
+cl_uint _rar_mortonBlocks(cl_uint pixels) {
+	return (pixels + MORTON_BLOCK_SIZE - 1) / MORTON_BLOCK_SIZE;
+}
+
+RayTree chooseRayTree(World* world) {
+	// Materials that can be hit, unused ones never spawn rays
+	std::vector<bool> used(world->getMaterialBuffer().size(), false);
+	for (const Sphere& sphere : world->getSpheres()) used[sphere.material] = true;
+	for (const Triangle& triangle : world->getTriangles()) used[triangle.materialIndex] = true;
+
+	// Same conditions the kernels spawn children on
+	bool reflect = false, refract = false, shadow = false;
+	for (size_t i = 0; i < used.size(); ++i) {
+		if (!used[i]) continue;
+		const Material& material = world->getMaterialBuffer()[i];
+		reflect |= material.reflectivity > RAY_SPAWN_EPSILON;
+		refract |= material.opacity < 1.0f - RAY_SPAWN_EPSILON;
+		shadow |= material.opacity > RAY_SPAWN_EPSILON;
+	}
+
+	RayTree tree = { 0, RAY_SLOT_NONE, RAY_SLOT_NONE, RAY_SLOT_NONE };
+	if (reflect) tree.reflectSlot = ++tree.children;
+	if (refract) tree.refractSlot = ++tree.children;
+	if (shadow) tree.shadowSlot = ++tree.children;
+	if (tree.children == 0) tree.children = 1; // Keeps the index maths of the kernels defined, the slot is never used
+	return tree;
+}
+
+void setRayTree(RayTree tree) {
+	rayTree = tree;
+}
+
+const RayTree& getRayTree() {
+	return rayTree;
+}
+
+unsigned int getRayTreeSize(const RayTree& tree, cl_uint bounces) {
+	unsigned int size = 0, level = 1;
+	for (cl_uint bounce = 0; bounce <= bounces; ++bounce) {
+		size += level;
+		level *= tree.children;
+	}
+	return size;
+}
+
+void setMortonDispatch(bool enabled) {
+	mortonDispatch = enabled;
+}
+
+bool getMortonDispatch() {
+	return mortonDispatch;
+}
+
+size_t getTilePixels(const Tile& tile) {
+	if (!mortonDispatch) return (size_t)tile.width * tile.height;
+	return (size_t)_rar_mortonBlocks(tile.width) * _rar_mortonBlocks(tile.height) * SQ(MORTON_BLOCK_SIZE);
+}
+
+cl_int enqueueTileKernel(cl_kernel kernel, const Tile& tile, const size_t* localSize, cl_uint num_events, cl_event* wait_events, cl_event* event) {
+	if (!mortonDispatch) {
+		const size_t workgroupOffset[2] = { tile.x, tile.y };
+		const size_t workgroupSize[2] = { tile.width, tile.height };
+		return clEnqueueNDRangeKernel(cl::queue, kernel, 2, workgroupOffset, workgroupSize, localSize, num_events, wait_events, event);
+	}
+	const size_t workgroupOffset[3] = { 0, tile.x, tile.y };
+	const size_t workgroupSize[3] = { SQ(MORTON_BLOCK_SIZE), _rar_mortonBlocks(tile.width), _rar_mortonBlocks(tile.height) };
+	const size_t curveLocalSize[3] = { localSize ? localSize[0] * localSize[1] : 0, 1, 1 };
+	return clEnqueueNDRangeKernel(cl::queue, kernel, 3, workgroupOffset, workgroupSize, localSize ? curveLocalSize : NULL, num_events, wait_events, event);
+}
+
+void reportRayTree(cl_uint bounces, size_t pixels) {
+	const RayTree full = FULL_RAY_TREE;
+	const unsigned int rays = getRayTreeSize(bounces), fullRays = getRayTreeSize(full, bounces);
+	const double mb = sizeof(TraceResult) * pixels / (1024.0 * 1024.0);
+
+	std::string slots;
+	if (rayTree.reflectSlot != RAY_SLOT_NONE) slots += " reflect";
+	if (rayTree.refractSlot != RAY_SLOT_NONE) slots += " refract";
+	if (rayTree.shadowSlot != RAY_SLOT_NONE) slots += " shadow";
+	std::cout << "Ray tree: " << rayTree.children << " children per ray (" << (slots.empty() ? "none" : slots.substr(1)) << "), " << rays << " rays per pixel instead of " << fullRays << ", " << (int)(rays * mb) << " MB of ray results per frame instead of " << (int)(fullRays * mb) << " MB" << std::endl;
+}
 
 RARKernel::RARKernel() : CLKernel("RARTrace") {
 }
@@ -8,77 +94,157 @@ RARKernel::~RARKernel() {
 }
 
 void RARKernel::read() {
-	cl_int err = clEnqueueReadBuffer(cl::queue, outputBuffer, true, 0, sizeof(TraceResult) * config->width * config->height, results, 0, NULL, NULL);
+	cl_event readEvent;
+	cl_int err = clEnqueueReadBuffer(cl::queue, activeBuffer, true, 0, sizeof(TraceResult) * activeTile.width * activeTile.height, results, 0, NULL, &readEvent);
 	cl::printErrorMsg("Output Read Buffer", __LINE__, __FILE__, err);
+	if (err != CL_SUCCESS) return;
+	cl::profiler::record("Output Read Buffer", readEvent);
+	clReleaseEvent(readEvent);
 }
 
 void RARKernel::create() {
 
-	const unsigned int numrays = static_numrays(NUM_RAY_CHILDREN, config->bounces);
+	const unsigned int numrays = getRayTreeSize(config->bounces);
 
 	// Assume kernel object has been created
 
 	cl_int err;
 
-	configBuffer = clCreateBuffer(cl::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(*config), config, &err);
+	configBuffer = cl::memory::createBuffer(MEMORY_CONFIG, "Ray Config Buffer", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(*config), config, &err);
 	cl::printErrorMsg("Config Buffer", __LINE__, __FILE__, err);
 
-	// Create results 2D array
-	size_t outputBufferSize = (unsigned int)(sizeof(TraceResult)) * config->width * config->height * numrays;
-	if (outputBufferSize > cl::device_info.max_constant_buffer) {
-		std::cout << "Warning! Attempting to allocate buffer larger than OpenCL max buffer size." << std::endl;
-		outputBufferSize = cl::device_info.max_constant_buffer;
+	// Every ray of every pixel of a tile has a result. The whole frame is one tile when it fits, otherwise the tiles are shrunk until TILE_BUFFER_COUNT buffers fit.
+	const size_t pixelSize = sizeof(TraceResult) * numrays;
+	const cl_uint width = (cl_uint)config->width, height = (cl_uint)config->height;
+	const cl_ulong budget = cl::memory::getBudget();
+	const cl_ulong budgetLeft = budget > cl::memory::getDeviceTotal() ? budget - cl::memory::getDeviceTotal() : 0;
+	cl_uint size = tileSize;
+	if (size == 0 && pixelSize * getTilePixels({ 0, 0, width, height, 0, 1 }) <= std::min(cl::device_info.max_mem_alloc, budgetLeft)) {
+		size = std::max(width, height);
+	} else {
+		if (size == 0) size = DEFAULT_TILE_SIZE;
+		const cl_ulong limit = std::min(cl::device_info.max_mem_alloc, budgetLeft / TILE_BUFFER_COUNT);
+		while (size > MIN_TILE_SIZE && pixelSize * size * size > limit) size /= 2;
+		// Tiles inside the image are whole Morton blocks, so only the blocks on its edges are padded
+		if (mortonDispatch) size = std::max(size / MORTON_BLOCK_SIZE, 1u) * MORTON_BLOCK_SIZE;
 	}
-	std::cout << "Max mem alloc size: " << cl::device_info.max_constant_buffer << std::endl;
-	outputBuffer = clCreateBuffer(cl::context, CL_MEM_READ_WRITE, outputBufferSize, NULL, &err);
-	cl::printErrorMsg("Output Buffer", __LINE__, __FILE__, err);
 
-	// Set kernel args
-	err = clSetKernelArg(getKernel(), 0, sizeof(configBuffer), &configBuffer);
+	tiles.clear();
+	for (cl_uint y = 0; y < height; y += size) {
+		for (cl_uint x = 0; x < width; x += size) {
+			tiles.push_back({ x, y, std::min(size, width - x), std::min(size, height - y), (cl_uint)tiles.size(), 0 });
+		}
+	}
+	for (Tile& tile : tiles) tile.count = tiles.size();
+	outputBufferCount = tiles.size() > 1 ? TILE_BUFFER_COUNT : 1;
+	if (tiles.size() > 1) std::cout << "Rendering in " << tiles.size() << " tiles of " << size << "x" << size << " pixels" << std::endl;
+
+	// The first tile is the largest
+	const size_t outputBufferSize = pixelSize * getTilePixels(tiles[0]);
+	for (cl_uint i = 0; i < outputBufferCount; ++i) {
+		outputBuffers[i] = cl::memory::createBuffer(MEMORY_RAYS, "Ray Output Buffer " + std::to_string(i), CL_MEM_READ_WRITE, outputBufferSize, NULL, &err);
+		cl::printErrorMsg("Output Buffer", __LINE__, __FILE__, err);
+	}
+	setTile(0);
+
+	if (useRayStats) {
+		rayStatsBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Ray Stats Buffer", CL_MEM_READ_WRITE, sizeof(rayStatsReadback), NULL, &err);
+		cl::printErrorMsg("Ray Stats Buffer", __LINE__, __FILE__, err);
+	}
+
+	setArgs();
+}
+
+void RARKernel::setArgs() {
+	cl_int err = clSetKernelArg(getKernel(), 0, sizeof(configBuffer), &configBuffer);
 	cl::printErrorMsg("Config Buffer Kernel Arg", __LINE__, __FILE__, err);
 
 	err = clSetKernelArg(getKernel(), 1, sizeof(*world->getBufferPtr()), world->getBufferPtr());
 	cl::printErrorMsg("World Buffer Kernel Arg", __LINE__, __FILE__, err);
 
-	err = clSetKernelArg(getKernel(), 2, sizeof(outputBuffer), &outputBuffer);
-	cl::printErrorMsg("Output Buffer Kernel Arg", __LINE__, __FILE__, err);
-
-	err = clSetKernelArg(getKernel(), 3, sizeof(*vertexBuffer), vertexBuffer);
-	cl::printErrorMsg("Vertex Buffer Kernel Arg", __LINE__, __FILE__, err);
-
-	err = clSetKernelArg(getKernel(), 4, sizeof(*materialBuffer), materialBuffer);
+	err = clSetKernelArg(getKernel(), 3, sizeof(*materialBuffer), materialBuffer);
 	cl::printErrorMsg("Material Buffer Kernel Arg", __LINE__, __FILE__, err);
 
-	err = clSetKernelArg(getKernel(), 5, sizeof(*sphereBuffer), sphereBuffer);
+	err = clSetKernelArg(getKernel(), 4, sizeof(*sphereBuffer), sphereBuffer);
 	cl::printErrorMsg("Sphere Buffer Kernel Arg", __LINE__, __FILE__, err);
 
-	err = clSetKernelArg(getKernel(), 6, sizeof(*triangleBuffer), triangleBuffer);
-	cl::printErrorMsg("Triangle Buffer Kernel Arg", __LINE__, __FILE__, err);
-
-	err = clSetKernelArg(getKernel(), 7, sizeof(*modelBuffer), modelBuffer);
+	err = clSetKernelArg(getKernel(), 5, sizeof(*modelBuffer), modelBuffer);
 	cl::printErrorMsg("Model Buffer Kernel Arg", __LINE__, __FILE__, err);
 
-	err = clSetKernelArg(getKernel(), 8, sizeof(*triangleGridBuffer), triangleGridBuffer);
-	cl::printErrorMsg("Triangle Grid Buffer Kernel Arg", __LINE__, __FILE__, err);
+	err = clSetKernelArg(getKernel(), 6, sizeof(*sceneBuffer), sceneBuffer);
+	cl::printErrorMsg("Scene Buffer Kernel Arg", __LINE__, __FILE__, err);
 
-	err = clSetKernelArg(getKernel(), 9, sizeof(*triangleCountGridBuffer), triangleCountGridBuffer);
-	cl::printErrorMsg("Triangle Count Buffer Kernel Arg", __LINE__, __FILE__, err);
+	if (useRayStats) {
+		err = clSetKernelArg(getKernel(), 7, sizeof(rayStatsBuffer), &rayStatsBuffer);
+		cl::printErrorMsg("Ray Stats Buffer Kernel Arg", __LINE__, __FILE__, err);
+	}
 }
 
 cl_event RARKernel::update() {
+	// The model buffer is written before the config on the in-order queue, so the next trace sees both
+	if (world->selectLods(config->camera)) {
+		cl_event modelEvent = world->updateModels();
+		if (modelEvent != NULL) clReleaseEvent(modelEvent);
+	}
 	cl_int err = clEnqueueWriteBuffer(cl::queue, configBuffer, true, 0, sizeof(RayConfig), config, 0, NULL, &updateEvent);
 	cl::printErrorMsg("Write Config Buffer", __LINE__, __FILE__, err);
+	cl::profiler::record("Write Config Buffer", updateEvent);
 	return updateEvent;
 }
 
+void RARKernel::setTile(cl_uint index) {
+	activeTile = tiles[index];
+	activeBuffer = outputBuffers[index % outputBufferCount];
+}
+
 cl_event RARKernel::queue(cl_uint num_events, cl_event* wait_events) {
-	const size_t workgroupOffset[2] = { 0, 0 };
-	const size_t workgroupSize[2] = { config->width, config->height };
-	cl_int err = clEnqueueNDRangeKernel(cl::queue, getKernel(), 2, workgroupOffset, workgroupSize, NULL, num_events, wait_events, &queueEvent);
+	// Arguments are captured at enqueue, so every tile can point the kernel at its own buffer
+	cl_int err = clSetKernelArg(getKernel(), 2, sizeof(activeBuffer), &activeBuffer);
+	cl::printErrorMsg("Output Buffer Kernel Arg", __LINE__, __FILE__, err);
+
+	// The queue is in order so the counters are cleared before the first tile is traced, and read back after the last
+	if (useRayStats && activeTile.index == 0) {
+		const cl_uint zero = 0;
+		cl_event fillEvent;
+		err = clEnqueueFillBuffer(cl::queue, rayStatsBuffer, &zero, sizeof(zero), 0, sizeof(rayStatsReadback), 0, NULL, &fillEvent);
+		cl::printErrorMsg("Clear Ray Stats Buffer", __LINE__, __FILE__, err);
+		if (err == CL_SUCCESS) {
+			cl::profiler::record("Clear Ray Stats Buffer", fillEvent);
+			clReleaseEvent(fillEvent);
+		}
+	}
+
+	err = enqueueTileKernel(getKernel(), activeTile, getLocalSize(), num_events, wait_events, &queueEvent);
 	cl::printErrorMsg("Enqueue Primary Ray Kernel", __LINE__, __FILE__, err);
+	if (err != CL_SUCCESS) return queueEvent = NULL; // e.g. a local size the kernel can't run with
+	cl::profiler::record(getKernelName(), queueEvent);
+
+	if (useRayStats && rayStatsEvent == NULL && activeTile.index + 1 == activeTile.count) {
+		err = clEnqueueReadBuffer(cl::queue, rayStatsBuffer, false, 0, sizeof(rayStatsReadback), rayStatsReadback, 1, &queueEvent, &rayStatsEvent);
+		cl::printErrorMsg("Read Ray Stats Buffer", __LINE__, __FILE__, err);
+		if (err != CL_SUCCESS) rayStatsEvent = NULL;
+		cl::profiler::record("Read Ray Stats Buffer", rayStatsEvent);
+	}
 	return queueEvent;
 }
 
+bool RARKernel::readRayStats(RayStats* stats) {
+	if (rayStatsEvent == NULL) return false;
+
+	cl_int status = CL_QUEUED;
+	cl::readEventStatus(rayStatsEvent, &status);
+	if (status > CL_COMPLETE) return false;
+
+	clReleaseEvent(rayStatsEvent);
+	rayStatsEvent = NULL;
+	if (status < 0) return false;
+
+	for (int i = 0; i < RAY_STAT_COUNT; ++i) {
+		stats->counters[i] = (cl_ulong)rayStatsReadback[i * 2] | ((cl_ulong)rayStatsReadback[i * 2 + 1] << 32);
+	}
+	return true;
+}
+
 void RARKernel::destroy() {
 
 }
@@ -4,19 +4,93 @@
 #include <glad/glad.h>
 #include <time.h>
 #include <stdio.h>
+#include <vector>
 #include "CLKernel.h"
 #include "cl_helper.h"
 #include "World.h"
 #include "Material.h"
 
-#define NUM_RAY_CHILDREN (3)
+// Material threshold the kernels spawn child rays above, EPSILON in cl_kernels/defines.h
+#define RAY_SPAWN_EPSILON (0.05f)
+// Slot of a ray type that no material in the scene spawns
+#define RAY_SLOT_NONE (0)
+// Deepest ray tree the image resolver walks. Must be MAX_RESOLVE_DEPTH - 1 of cl_kernels/defines.h.
+#define MAX_BOUNCES (7)
+// Reflect, refract and shadow children on every node, in the order of the ray type defines
+#define FULL_RAY_TREE { 3, 1, 2, 3 }
+
+/**
+	Shape of the ray tree of a pixel. The children of node i are at children * i + slot, and ray types that can't be spawned
+	have no slot, so the tree grows with the child count actually needed instead of 3^bounces.
+	Baked into the kernels (NUM_RAY_CHILDREN and the _SLOT build options), so it has to be set before the build.
+*/
+struct RayTree {
+	cl_uint children;
+	cl_uint reflectSlot;
+	cl_uint refractSlot;
+	cl_uint shadowSlot;
+};
+
+// Smallest tree for the materials of the spheres and triangles in the world. Keeps at least one slot.
+RayTree chooseRayTree(World* world);
+void setRayTree(RayTree tree);
+const RayTree& getRayTree();
+
+// Rays per pixel of a tree with the given bounces
+unsigned int getRayTreeSize(const RayTree& tree, cl_uint bounces);
+inline unsigned int getRayTreeSize(cl_uint bounces) { return getRayTreeSize(getRayTree(), bounces); }
+
+// Prints the slots of the tree in use and the rays and ray buffer memory per frame it saves over FULL_RAY_TREE
+void reportRayTree(cl_uint bounces, size_t pixels);
+
+// Mirrors the STAT_ defines in cl_kernels/defines.h
+#define RAY_STAT_COUNT (11)
+#define RAY_STAT_NAMES { "root rays", "reflect rays", "refract rays", "shadow rays", "sphere tests", "k-DOP tests", "triangle tests", "DDA steps", "max_step truncations", "tree stack truncations", "resolve depth truncations" }
+
+struct RayStats {
+	cl_ulong counters[RAY_STAT_COUNT];
+};
+
+// Ray buffers the tiles of a frame alternate between. A second buffer would only let a tile be traced while the one before it resolves
+// on an out-of-order queue, and cl::queue is in order, so one buffer is used and the tiles run one after another.
+#define TILE_BUFFER_COUNT (1)
+// Edge of the square tiles in pixels when the rays of the whole frame don't fit one allocation. Halved until a tile buffer fits.
+#define DEFAULT_TILE_SIZE (512)
+#define MIN_TILE_SIZE (16)
+
+// Screen rectangle whose rays are in the active ray buffer. The reset, trace and resolve kernels run over it with a global work offset.
+struct Tile {
+	cl_uint x, y;
+	cl_uint width, height;
+	cl_uint index, count; // Of the frame
+};
+
+// Edge of the square pixel blocks traced along a Z-order curve in Morton dispatch. Must be a power of two.
+#define MORTON_BLOCK_SIZE (16)
 
-__declspec (align(16)) struct Ray{
+/**
+	Morton dispatch (--morton-dispatch, mortonDispatch in config.ini) swizzles the work items of the trace and resolve into Z-order within
+	MORTON_BLOCK_SIZE blocks of the tile, so neighbouring work items cover a compact square of pixels and fetch the same grid cells and triangles
+	instead of spanning a row. The ray buffer of a tile is laid out block by block in the same order. Baked into the kernels (MORTON_DISPATCH).
+*/
+void setMortonDispatch(bool enabled);
+bool getMortonDispatch();
+
+// Pixels in the ray buffer of the tile, including the padding of the blocks on the right and bottom edges in Morton dispatch
+size_t getTilePixels(const Tile& tile);
+
+/**
+	Enqueues a trace or resolve kernel over the tile: a 2D range over its pixels, or in Morton dispatch a 3D range of (position along the curve
+	of a block, block column, block row) offset by (0, tile x, tile y). An x by y localSize becomes x * y work items along the curve.
+*/
+cl_int enqueueTileKernel(cl_kernel kernel, const Tile& tile, const size_t* localSize, cl_uint num_events, cl_event* wait_events, cl_event* event);
+
+struct alignas(16) Ray{
 	cl_float3 origin;
 	cl_float3 direction;
 } ;
 
-__declspec (align(16)) struct RayConfig {
+struct alignas(16) RayConfig {
 	cl_float aspect;
 	cl_float width;
 	cl_float height;
@@ -27,7 +101,7 @@ __declspec (align(16)) struct RayConfig {
 	cl_uint bounces;
 };
 
-__declspec (align(16)) struct TraceResult {
+struct alignas(16) TraceResult {
 	Ray ray;
 
 	cl_float3 intersect;
@@ -45,7 +119,9 @@ __declspec (align(16)) struct TraceResult {
 	cl_uint bounce;
 
 	cl_uint rayType;
-	cl_uint pad1[3];
+	cl_uint intersectTests; // Totals of the whole ray tree, only set on the root ray of HEATMAP builds. Padding otherwise.
+	cl_uint ddaSteps;
+	cl_uint pad1;
 
 	cl_int hasIntersect;
 	cl_int hasTraced;
@@ -58,20 +134,29 @@ class RARKernel : public CLKernel {
 	cl_mem configBuffer;
 
 	TraceResult * results;
-	cl_mem outputBuffer;
+	cl_mem outputBuffers[TILE_BUFFER_COUNT];
+	cl_uint outputBufferCount = 1;
+	cl_mem activeBuffer; // Ray buffer of the active tile
+
+	std::vector<Tile> tiles;
+	Tile activeTile;
+	cl_uint tileSize = 0;
 
 	World* world;
 
-	cl_mem* vertexBuffer;
 	cl_mem* materialBuffer;
 	cl_mem* sphereBuffer;
-	cl_mem* triangleBuffer;
 	cl_mem* modelBuffer;
-	cl_mem* triangleGridBuffer;
-	cl_mem* triangleCountGridBuffer;
+	cl_mem* sceneBuffer;
 
 	cl_event updateEvent, queueEvent;
 
+	// Ray statistics (RAY_STATS builds). Counters are (low, high) word pairs, read back without blocking.
+	bool useRayStats = false;
+	cl_mem rayStatsBuffer;
+	cl_uint rayStatsReadback[RAY_STAT_COUNT * 2];
+	cl_event rayStatsEvent = NULL;
+
 public:
 	RARKernel();
 	~RARKernel();
@@ -81,20 +166,42 @@ public:
 	inline void setWorldPtr(World* ptr) { world = ptr; }
 
 	inline cl_mem* getConfigBuffer() { return &configBuffer; }
-	inline cl_mem* getRayBuffer() { return &outputBuffer; }
+	// Always holds the ray buffer of the active tile
+	inline cl_mem* getRayBuffer() { return &activeBuffer; }
+
+	/**
+		Edge of the screen tiles in pixels. 0 renders the whole frame as one tile when its rays fit one allocation and the memory budget,
+		otherwise tiles of DEFAULT_TILE_SIZE. Must be set before create().
+	*/
+	inline void setTileSize(cl_uint size) { tileSize = size; }
+	inline cl_uint getTileCount() { return tiles.size(); }
+
+	// The next reset, trace and resolve run over tile index, in the ray buffer it alternates onto
+	void setTile(cl_uint index);
+	inline const Tile* getActiveTile() { return &activeTile; }
 
-	inline void setVertexBuffer(cl_mem* ptr) { vertexBuffer = ptr; }
 	inline void setMaterialBuffer(cl_mem* ptr) { materialBuffer = ptr; }
 	inline void setSphereBuffer(cl_mem* ptr) { sphereBuffer = ptr; }
-	inline void setTriangleBuffer(cl_mem* ptr) { triangleBuffer = ptr; }
 	inline void setModelBuffer(cl_mem* ptr) { modelBuffer = ptr; }
-	inline void setTriangleGridBuffer(cl_mem* ptr) { triangleGridBuffer = ptr; }
-	inline void setTrianlgeCountGridBuffer(cl_mem* ptr) { triangleCountGridBuffer = ptr; }
+	// Geometry region of the scene arena (see World::create)
+	inline void setSceneBuffer(cl_mem* ptr) { sceneBuffer = ptr; }
+
+	// Must match whether the program was built with RAY_STATS, as it adds a kernel argument
+	inline void setRayStats(bool enabled) { useRayStats = enabled; }
+	inline bool getRayStats() { return useRayStats; }
+
+	/**
+		Returns true and fills stats if the counters of a frame have finished reading back since the last call.
+		Counters are only read back for a frame when the previous read has been collected, so not every frame is reported.
+	*/
+	bool readRayStats(RayStats* stats);
 
 	void read();
 
 	virtual void create() override;
 
+	virtual void setArgs() override;
+
 	virtual cl_event update() override;
 
 	virtual cl_event queue(cl_uint num_events, cl_event* wait_events) override;
@@ -15,9 +15,6 @@ void ResetKernel::create()
 	err = clSetKernelArg(getKernel(), 0, sizeof(*configBuffer), configBuffer);
 	cl::printErrorMsg("Reset Kernel Config Kernel Arg", __LINE__, __FILE__, err);
 
-	err = clSetKernelArg(getKernel(), 1, sizeof(*resultBuffer), resultBuffer);
-	cl::printErrorMsg("Reset Kernel Result Kernel Arg", __LINE__, __FILE__, err);
-
 }
 
 cl_event ResetKernel::update()
@@ -27,11 +24,14 @@ cl_event ResetKernel::update()
 
 cl_event ResetKernel::queue(cl_uint num_events, cl_event* wait_events)
 {
-	const unsigned int numrays = static_numrays(NUM_RAY_CHILDREN, config->bounces);
+	const unsigned int numrays = getRayTreeSize(config->bounces);
 	const size_t workgroupOffset[1] = { 0};
-	const size_t workgroupSize[1] = { config->width * config->height * numrays };
-	cl_int err = clEnqueueNDRangeKernel(cl::queue, getKernel(), 1, workgroupOffset, workgroupSize, NULL, num_events, wait_events, &queueEvent);
+	const size_t workgroupSize[1] = { getTilePixels(*tile) * numrays };
+	cl_int err = clSetKernelArg(getKernel(), 1, sizeof(*resultBuffer), resultBuffer);
+	cl::printErrorMsg("Reset Kernel Result Kernel Arg", __LINE__, __FILE__, err);
+	err = clEnqueueNDRangeKernel(cl::queue, getKernel(), 1, workgroupOffset, workgroupSize, NULL, num_events, wait_events, &queueEvent);
 	cl::printErrorMsg("Enqueue Reset Kernel", __LINE__, __FILE__, err);
+	cl::profiler::record(getKernelName(), queueEvent);
 	return queueEvent;
 }
 
@@ -12,6 +12,7 @@ class ResetKernel : public CLKernel
 	RayConfig* config;
 	cl_mem* resultBuffer;
 	cl_mem* configBuffer;
+	const Tile* tile;
 
 	cl_event queueEvent;
 
@@ -22,6 +23,7 @@ public:
 	inline void setRayBuffer(cl_mem* ptr) { resultBuffer = ptr; }
 	inline void setConfigBuffer(cl_mem* ptr) { configBuffer = ptr; }
 	inline void setConfig(RayConfig* ptr) { config = ptr; }
+	inline void setTile(const Tile* ptr) { tile = ptr; }
 
 	// Inherited via CLKernel
 	virtual void create() override;
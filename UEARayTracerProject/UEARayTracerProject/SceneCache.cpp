@@ -0,0 +1,245 @@
+#include "SceneCache.h"
+#include "MappedFile.h"
+#include "VertexWeld.h"
+#include "Lod.h"
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+bool sceneCacheEnabled = true;
+
+const cl_ulong sceneCacheElementSizes[SCENE_CACHE_SECTION_COUNT] = {
+	sizeof(cl_float3), sizeof(Triangle), sizeof(ModelStruct), sizeof(unsigned int), sizeof(unsigned int), sizeof(cl_uint)
+};
+
+// FNV-1a 64
+cl_ulong _scenecache_hash(const void* data, size_t size, cl_ulong hash = 14695981039346656037ULL) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+template <typename T>
+cl_ulong _scenecache_hashValue(cl_ulong hash, T value) {
+	return _scenecache_hash(&value, sizeof(T), hash);
+}
+
+cl_ulong _scenecache_settingsHash(float scale, int mat) {
+	cl_ulong hash = _scenecache_hashValue(14695981039346656037ULL, (cl_uint)SCENE_CACHE_VERSION);
+	hash = _scenecache_hashValue(hash, getGridCellDepth());
+	hash = _scenecache_hashValue(hash, (int)GRID_MAX_TRIANGLES_PER_CELL);
+	hash = _scenecache_hashValue(hash, scale);
+	hash = _scenecache_hashValue(hash, mat);
+	hash = _scenecache_hashValue(hash, weld::getEpsilon());
+	hash = _scenecache_hashValue(hash, weld::getReorder());
+	hash = _scenecache_hashValue(hash, lod::getLevels());
+	hash = _scenecache_hashValue(hash, lod::getDistanceFactor());
+	for (int i = 0; i < SCENE_CACHE_SECTION_COUNT; ++i) hash = _scenecache_hashValue(hash, sceneCacheElementSizes[i]);
+	return hash;
+}
+
+bool _scenecache_hashSource(const std::string& source, cl_ulong* size, cl_ulong* hash) {
+	MappedFile file;
+	if (!file.open(source)) return false;
+	*size = file.getSize();
+	*hash = _scenecache_hash(file.getData(), file.getSize());
+	return true;
+}
+
+cl_ulong _scenecache_align(cl_ulong offset) {
+	return (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+}
+
+// Checks the layout and that every index stays inside the model, so a damaged file can't reference memory outside the arrays
+bool _scenecache_validate(const MappedFile& file, const scenecache::Header& header) {
+	for (int i = 0; i < SCENE_CACHE_SECTION_COUNT; ++i) {
+		const scenecache::Section& section = header.sections[i];
+		if (section.offset % SCENE_CACHE_ALIGNMENT != 0 || section.offset < header.headerSize || section.offset > file.getSize()
+			|| section.size > file.getSize() - section.offset || section.size % sceneCacheElementSizes[i] != 0) {
+			return false;
+		}
+	}
+	if (header.sections[SCENE_CACHE_MODEL].size != sizeof(ModelStruct)) return false;
+
+	const char* data = file.getData();
+	const size_t vertexCount = header.sections[SCENE_CACHE_VERTICES].size / sizeof(cl_float3);
+	if (header.sections[SCENE_CACHE_NORMALS].size != vertexCount * sizeof(cl_uint)) return false;
+	const size_t triangleCount = header.sections[SCENE_CACHE_TRIANGLES].size / sizeof(Triangle);
+	const size_t cellCount = header.sections[SCENE_CACHE_TRIANGLE_COUNT_GRID].size / sizeof(unsigned int);
+	const size_t gridSize = header.sections[SCENE_CACHE_TRIANGLE_GRID].size / sizeof(unsigned int);
+	if (gridSize != cellCount * GRID_MAX_TRIANGLES_PER_CELL) return false;
+
+	const ModelStruct* model = (const ModelStruct*)(data + header.sections[SCENE_CACHE_MODEL].offset);
+	if (model->triangleOffset != 0 || model->numTriangles != triangleCount || model->lodCount < 1 || model->lodCount > MODEL_LOD_LEVELS) return false;
+	for (cl_uint level = 0; level < model->lodCount; ++level) {
+		// Grids are allocated in step with their counts, which is what the traversal relies on
+		const size_t gridOffset = getModelGridOffset(model, level);
+		const size_t countOffset = getModelCountOffset(model, level);
+		if (gridOffset != countOffset * GRID_MAX_TRIANGLES_PER_CELL || countOffset + (size_t)getGridCellCount() > cellCount) return false;
+	}
+
+	const Triangle* triangles = (const Triangle*)(data + header.sections[SCENE_CACHE_TRIANGLES].offset);
+	for (size_t i = 0; i < triangleCount; ++i) {
+		for (int v = 0; v < 3; ++v) {
+			if (triangles[i].face.s[v] >= vertexCount) return false;
+		}
+	}
+
+	const unsigned int* grid = (const unsigned int*)(data + header.sections[SCENE_CACHE_TRIANGLE_GRID].offset);
+	const unsigned int* counts = (const unsigned int*)(data + header.sections[SCENE_CACHE_TRIANGLE_COUNT_GRID].offset);
+	for (size_t cell = 0; cell < cellCount; ++cell) {
+		if (counts[cell] > GRID_MAX_TRIANGLES_PER_CELL) return false;
+		for (unsigned int i = 0; i < counts[cell]; ++i) {
+			if (grid[cell * GRID_MAX_TRIANGLES_PER_CELL + i] >= triangleCount) return false;
+		}
+	}
+	return true;
+}
+
+void _scenecache_writeSection(std::ofstream& file, scenecache::Header* header, int section, const void* data, size_t size) {
+	static const char padding[SCENE_CACHE_ALIGNMENT] = {};
+	cl_ulong offset = (cl_ulong)file.tellp();
+	file.write(padding, _scenecache_align(offset) - offset);
+	header->sections[section].offset = _scenecache_align(offset);
+	header->sections[section].size = size;
+	if (size > 0) file.write((const char*)data, size);
+}
+
+namespace scenecache {
+
+	void setEnabled(bool enabled) {
+		sceneCacheEnabled = enabled;
+	}
+
+	bool isEnabled() {
+		return sceneCacheEnabled;
+	}
+
+	std::string getPath(const std::string& source) {
+		return source + SCENE_CACHE_EXTENSION;
+	}
+
+	Mark mark(World* world) {
+		return { world->getVertexBuffer().size(), world->getTriangles().size(), world->getTriangleGrid().size(), world->getTriangleCountGrid().size() };
+	}
+
+	bool load(const std::string& source, float scale, int mat, World* world, ModelStruct** model) {
+		auto starttime = std::chrono::steady_clock::now();
+		const std::string path = getPath(source);
+
+		MappedFile file;
+		if (!file.open(path)) return false;
+
+		Header header;
+		if (file.getSize() < sizeof(Header)) {
+			std::cout << "Scene cache " << path << " is truncated, rebuilding." << std::endl;
+			return false;
+		}
+		memcpy(&header, file.getData(), sizeof(Header));
+		if (memcmp(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != SCENE_CACHE_VERSION || header.headerSize != sizeof(Header)) {
+			std::cout << "Scene cache " << path << " has an unknown format, rebuilding." << std::endl;
+			return false;
+		}
+
+		cl_ulong sourceSize, sourceHash;
+		if (!_scenecache_hashSource(source, &sourceSize, &sourceHash) || sourceSize != header.sourceSize || sourceHash != header.sourceHash) {
+			std::cout << "Scene cache " << path << " is out of date, rebuilding." << std::endl;
+			return false;
+		}
+		if (header.settingsHash != _scenecache_settingsHash(scale, mat)) {
+			std::cout << "Scene cache " << path << " was built with other settings, rebuilding." << std::endl;
+			return false;
+		}
+		if (!_scenecache_validate(file, header)) {
+			std::cout << "Scene cache " << path << " is corrupt, rebuilding." << std::endl;
+			return false;
+		}
+
+		const char* data = file.getData();
+		*model = world->addModelData(
+			(const cl_float3*)(data + header.sections[SCENE_CACHE_VERTICES].offset), (const cl_uint*)(data + header.sections[SCENE_CACHE_NORMALS].offset),
+			header.sections[SCENE_CACHE_VERTICES].size / sizeof(cl_float3),
+			(const Triangle*)(data + header.sections[SCENE_CACHE_TRIANGLES].offset), header.sections[SCENE_CACHE_TRIANGLES].size / sizeof(Triangle),
+			(const unsigned int*)(data + header.sections[SCENE_CACHE_TRIANGLE_GRID].offset), header.sections[SCENE_CACHE_TRIANGLE_GRID].size / sizeof(unsigned int),
+			(const unsigned int*)(data + header.sections[SCENE_CACHE_TRIANGLE_COUNT_GRID].offset), header.sections[SCENE_CACHE_TRIANGLE_COUNT_GRID].size / sizeof(unsigned int),
+			*(const ModelStruct*)(data + header.sections[SCENE_CACHE_MODEL].offset));
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+		std::cout << "Loaded " << (*model)->numTriangles << " triangles from scene cache " << path << " ("
+			<< file.getSize() / (1024.0 * 1024.0) << " MB) in " << seconds * 1000.0 << "ms." << std::endl;
+		touchCacheFile(SCENE_CACHE_INDEX, path, SCENE_CACHE_MAX_FILES);
+		return true;
+	}
+
+	bool write(const std::string& source, float scale, int mat, World* world, const Mark& start, const ModelStruct& model) {
+		const std::string path = getPath(source);
+		const std::string temporaryPath = path + ".tmp";
+
+		Header header;
+		memset(&header, 0, sizeof(Header));
+		memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+		header.version = SCENE_CACHE_VERSION;
+		header.headerSize = sizeof(Header);
+		header.settingsHash = _scenecache_settingsHash(scale, mat);
+		if (!_scenecache_hashSource(source, &header.sourceSize, &header.sourceHash)) return false;
+
+		// Indices are stored relative to the model, so the cache can be appended to a world that already holds other objects
+		std::vector<Triangle> triangles(world->getTriangles().begin() + start.triangles, world->getTriangles().end());
+		for (Triangle& triangle : triangles) {
+			for (int v = 0; v < 3; ++v) triangle.face.s[v] -= (cl_uint)start.vertices;
+		}
+		std::vector<unsigned int> grid(world->getTriangleGrid().begin() + start.triangleGrid, world->getTriangleGrid().end());
+		const std::vector<unsigned int> counts(world->getTriangleCountGrid().begin() + start.triangleCountGrid, world->getTriangleCountGrid().end());
+		for (size_t cell = 0; cell < counts.size(); ++cell) {
+			for (unsigned int i = 0; i < counts[cell]; ++i) grid[cell * GRID_MAX_TRIANGLES_PER_CELL + i] -= (unsigned int)start.triangles;
+		}
+		ModelStruct relativeModel = model;
+		relativeModel.triangleOffset -= (cl_uint)start.triangles;
+		relativeModel.triangleGridOffset -= (cl_uint)start.triangleGrid;
+		relativeModel.triangleCountOffset -= (cl_uint)start.triangleCountGrid;
+		relativeModel.lodLevel = 0;
+		for (cl_uint level = 1; level < relativeModel.lodCount; ++level) {
+			relativeModel.lodGridOffset[level - 1] -= (cl_uint)start.triangleGrid;
+			relativeModel.lodCountOffset[level - 1] -= (cl_uint)start.triangleCountGrid;
+		}
+
+		std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			std::cout << "Could not write scene cache " << temporaryPath << std::endl;
+			return false;
+		}
+		file.write((const char*)&header, sizeof(Header)); // Rewritten once the section offsets are known
+		_scenecache_writeSection(file, &header, SCENE_CACHE_VERTICES, world->getVertexBuffer().data() + start.vertices, sizeof(cl_float3) * (world->getVertexBuffer().size() - start.vertices));
+		_scenecache_writeSection(file, &header, SCENE_CACHE_TRIANGLES, triangles.data(), sizeof(Triangle) * triangles.size());
+		_scenecache_writeSection(file, &header, SCENE_CACHE_MODEL, &relativeModel, sizeof(ModelStruct));
+		_scenecache_writeSection(file, &header, SCENE_CACHE_TRIANGLE_GRID, grid.data(), sizeof(unsigned int) * grid.size());
+		_scenecache_writeSection(file, &header, SCENE_CACHE_TRIANGLE_COUNT_GRID, counts.data(), sizeof(unsigned int) * counts.size());
+		_scenecache_writeSection(file, &header, SCENE_CACHE_NORMALS, world->getNormals().data() + start.vertices, sizeof(cl_uint) * (world->getNormals().size() - start.vertices));
+		file.seekp(0);
+		file.write((const char*)&header, sizeof(Header));
+		file.close();
+
+		if (file.fail()) {
+			std::cout << "Could not write scene cache " << temporaryPath << std::endl;
+			remove(temporaryPath.c_str());
+			return false;
+		}
+
+		// rename doesn't replace an existing file on Windows
+		remove(path.c_str());
+		if (rename(temporaryPath.c_str(), path.c_str()) != 0) {
+			std::cout << "Could not rename " << temporaryPath << " to " << path << std::endl;
+			remove(temporaryPath.c_str());
+			return false;
+		}
+		std::cout << "Wrote scene cache " << path << std::endl;
+		touchCacheFile(SCENE_CACHE_INDEX, path, SCENE_CACHE_MAX_FILES);
+		return true;
+	}
+
+}
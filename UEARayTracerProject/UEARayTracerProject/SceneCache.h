@@ -0,0 +1,68 @@
+#pragma once
+#include <CL/opencl.h>
+#include <string>
+#include "World.h"
+
+#define SCENE_CACHE_MAGIC ("UEASCENE")
+#define SCENE_CACHE_VERSION (2)
+#define SCENE_CACHE_EXTENSION (".scenecache")
+// Caches kept, one per OBJ file. The least recently used are deleted beyond it, e.g. those of renamed or removed files.
+#define SCENE_CACHE_MAX_FILES (32)
+#define SCENE_CACHE_INDEX ("scene_cache_index.txt")
+// Every section starts on a multiple of this, so the cl_float3 and struct arrays can be read straight from the mapping
+#define SCENE_CACHE_ALIGNMENT (16)
+
+#define SCENE_CACHE_VERTICES (0)
+#define SCENE_CACHE_TRIANGLES (1)
+#define SCENE_CACHE_MODEL (2)
+#define SCENE_CACHE_TRIANGLE_GRID (3)
+#define SCENE_CACHE_TRIANGLE_COUNT_GRID (4)
+#define SCENE_CACHE_NORMALS (5)
+#define SCENE_CACHE_SECTION_COUNT (6)
+
+/**
+	Binary cache of a model built from an OBJ file, written next to the source as <file>.scenecache.
+	It holds the model's slices of the world arrays (vertices, vertex normals, triangles, ModelStruct and triangle grids) with indices relative to the model,
+	so loading is a memory map, a validation pass and one bulk append per array instead of parsing the OBJ and rebuilding the octree and grid.
+	A cache is only used when the hash of the source file and the build settings (grid depth, cell capacity, scale, material, welding, LOD and struct layouts) match.
+*/
+namespace scenecache {
+
+	struct Section {
+		cl_ulong offset; // From the start of the file
+		cl_ulong size; // Bytes
+	};
+
+	struct Header {
+		char magic[8];
+		cl_uint version;
+		cl_uint headerSize;
+		cl_ulong sourceSize;
+		cl_ulong sourceHash;
+		cl_ulong settingsHash;
+		Section sections[SCENE_CACHE_SECTION_COUNT];
+	};
+
+	// Sizes of the world arrays before a model is built. Everything after them belongs to the model.
+	struct Mark {
+		size_t vertices;
+		size_t triangles;
+		size_t triangleGrid;
+		size_t triangleCountGrid;
+	};
+
+	// Enabled by default. Disabled by --no-scene-cache or disableSceneCache in config.ini.
+	void setEnabled(bool enabled);
+	bool isEnabled();
+
+	std::string getPath(const std::string& source);
+
+	Mark mark(World* world);
+
+	// Appends the cached model to world. Returns false if there is no cache for source or it is stale or invalid, and world is left unchanged.
+	bool load(const std::string& source, float scale, int mat, World* world, ModelStruct** model);
+
+	// Writes the model built since start. The file is written under a temporary name and renamed, so a partial write is never loaded.
+	bool write(const std::string& source, float scale, int mat, World* world, const Mark& start, const ModelStruct& model);
+
+}
@@ -0,0 +1,79 @@
+#include "Specialisation.h"
+#include "cl_helper.h"
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+bool specialisationEnabled = true;
+
+// The thread is joined on exit if the program closes before the build finishes
+struct SpecialisationBuild {
+	std::thread thread;
+	std::atomic<bool> done{ false };
+	bool taken = false;
+	cl_program program = nullptr;
+	bool cached = false;
+	double milliseconds = 0.0;
+	std::string error;
+
+	~SpecialisationBuild() {
+		if (thread.joinable()) thread.join();
+	}
+};
+
+SpecialisationBuild specialisationBuild;
+
+void _specialisation_build(std::vector<std::string> sources, std::string buildOptions) {
+	auto starttime = std::chrono::steady_clock::now();
+	SpecialisationBuild& build = specialisationBuild;
+	build.program = cl::buildProgram(sources, buildOptions, &build.cached, &build.error);
+	build.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - starttime).count();
+	build.done = true;
+}
+
+namespace specialisation {
+
+	void setEnabled(bool enabled) {
+		specialisationEnabled = enabled;
+	}
+
+	bool isEnabled() {
+		return specialisationEnabled;
+	}
+
+	std::string getBuildOptions(World* world, const RayConfig* config) {
+		std::ostringstream stream;
+		stream << cl::getBuildOptions()
+			<< "-D SPECIALISED_NUM_SPHERES=" << world->getSpheres().size()
+			<< " -D SPECIALISED_NUM_MODELS=" << world->getModels().size()
+			<< " -D SPECIALISED_BOUNCES=" << config->bounces << " ";
+		return stream.str();
+	}
+
+	void start(const std::vector<std::string>& sources, World* world, const RayConfig* config) {
+		if (specialisationBuild.thread.joinable()) return;
+		const std::string buildOptions = getBuildOptions(world, config);
+		std::cout << "Building scene-specialised kernels in the background: " << buildOptions << std::endl;
+		specialisationBuild.thread = std::thread(_specialisation_build, sources, buildOptions);
+	}
+
+	cl_program poll() {
+		SpecialisationBuild& build = specialisationBuild;
+		if (build.taken || !build.done) return nullptr;
+		if (build.thread.joinable()) build.thread.join();
+		build.taken = true;
+
+		if (build.program == nullptr) {
+			std::cout << "Could not build the scene-specialised kernels, staying on the generic program: " << build.error << std::endl;
+			return nullptr;
+		}
+		std::cout << "Switching to the scene-specialised kernels, " << (build.cached ? "loaded from the program cache" : "built from source") << " in " << build.milliseconds << "ms." << std::endl;
+		return build.program;
+	}
+
+	void wait() {
+		if (specialisationBuild.thread.joinable() && !specialisationBuild.taken) specialisationBuild.thread.join();
+	}
+
+}
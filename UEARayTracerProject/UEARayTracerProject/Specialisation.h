@@ -0,0 +1,33 @@
+#pragma once
+#include <CL/opencl.h>
+#include <string>
+#include <vector>
+#include "World.h"
+#include "RARKernel.h"
+
+/**
+	Scene-specialised build of the kernels. The sphere and model counts and the bounces are added to the generic build options as
+	SPECIALISED_* defines (see defines.h), so the trace and resolve loops have fixed trip counts, the paths of an object type the scene doesn't have
+	compile out and the resolver's per-level arrays shrink to bounces + 1. Ray types the materials never spawn and the grid dimensions are
+	already build options of the generic program.
+	The variant is built on a background thread while the generic program renders and is swapped in between frames once it's ready.
+*/
+namespace specialisation {
+
+	// Enabled by default. Disabled by --no-specialise or disableSpecialisation in config.ini.
+	void setEnabled(bool enabled);
+	bool isEnabled();
+
+	// The generic build options followed by the scene's defines
+	std::string getBuildOptions(World* world, const RayConfig* config);
+
+	// Starts building the variant. It goes through the program cache, so once it has been built it only has to be loaded on the next start.
+	void start(const std::vector<std::string>& sources, World* world, const RayConfig* config);
+
+	// Returns the variant the first time it's called after the build has finished, otherwise nullptr. A failed build is reported and the generic program stays in use.
+	cl_program poll();
+
+	// Blocks until the build has finished
+	void wait();
+
+}
@@ -2,7 +2,7 @@
 #include <CL/opencl.h>
 #include "Material.h"
 
-__declspec (align(16)) struct Sphere {
+struct alignas(16) Sphere {
 	cl_float3 position;
 	cl_float radius;
 	cl_uint material;
@@ -12,14 +12,14 @@ void TestKernel::create()
 {
 	cl_int err;
 
-	in_modelBuffer = clCreateBuffer(cl::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(ModelStruct), &in_model, &err);
+	in_modelBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Test Input Model Buffer", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(ModelStruct), &in_model, &err);
 	cl::printErrorMsg("Test Kernel Input Model Buffer", __LINE__, __FILE__, err);
-	out_modelBuffer = clCreateBuffer(cl::context, CL_MEM_READ_WRITE, sizeof(ModelStruct), NULL, &err);
+	out_modelBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Test Output Model Buffer", CL_MEM_READ_WRITE, sizeof(ModelStruct), NULL, &err);
 	cl::printErrorMsg("Test Kernel Output Model Buffer", __LINE__, __FILE__, err);
 
-	in_worldBuffer = clCreateBuffer(cl::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(WorldStruct), &in_world, &err);
+	in_worldBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Test Input World Buffer", CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(WorldStruct), &in_world, &err);
 	cl::printErrorMsg("Test Kernel Input World Buffer", __LINE__, __FILE__, err);
-	out_worldBuffer = clCreateBuffer(cl::context, CL_MEM_READ_WRITE, sizeof(WorldStruct), NULL, &err);
+	out_worldBuffer = cl::memory::createBuffer(MEMORY_DEBUG, "Test Output World Buffer", CL_MEM_READ_WRITE, sizeof(WorldStruct), NULL, &err);
 	cl::printErrorMsg("Test Kernel Output World Buffer", __LINE__, __FILE__, err);
 
 	clSetKernelArg(getKernel(), 0, sizeof(in_modelBuffer), &in_modelBuffer);
@@ -44,6 +44,7 @@ cl_event TestKernel::queue(cl_uint num_events, cl_event* wait_events)
 	const size_t workgroupSize = 1;
 	cl_int err = clEnqueueNDRangeKernel(cl::queue, getKernel(), 1, &workgroupOffset, &workgroupSize, NULL, num_events, wait_events, &mainQueueEvent);
 	cl::printErrorMsg("Test Kernel Queue", __LINE__, __FILE__, err);
+	cl::profiler::record(getKernelName(), mainQueueEvent);
 
 	err = clEnqueueReadBuffer(cl::queue, out_modelBuffer, true, 0, sizeof(ModelStruct), &out_model, 0, NULL, NULL);
 	cl::printErrorMsg("Test Kernel Read Model", __LINE__, __FILE__, err);
@@ -0,0 +1,107 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool() : remainingTasks(0) {
+}
+
+ThreadPool::~ThreadPool() {
+	stop();
+}
+
+void ThreadPool::start(unsigned int numThreads) {
+	if (!threads.empty()) return;
+	if (numThreads == 0) numThreads = std::thread::hardware_concurrency();
+	if (numThreads == 0) numThreads = 1;
+
+	stopping = false;
+	for (unsigned int i = 0; i < numThreads; ++i) {
+		queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+	}
+	for (unsigned int i = 0; i < numThreads; ++i) {
+		threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+	}
+}
+
+void ThreadPool::stop() {
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		stopping = true;
+	}
+	jobStart.notify_all();
+	for (auto it = threads.begin(); it != threads.end(); ++it) {
+		if (it->joinable()) it->join();
+	}
+	threads.clear();
+	queues.clear();
+}
+
+bool ThreadPool::popTask(unsigned int worker, unsigned int* task) {
+	// Own queue first
+	{
+		WorkerQueue* own = queues[worker].get();
+		std::lock_guard<std::mutex> guard(own->lock);
+		if (!own->tasks.empty()) {
+			*task = own->tasks.front();
+			own->tasks.pop_front();
+			return true;
+		}
+	}
+
+	// Steal from the back of the other queues
+	for (size_t i = 1; i < queues.size(); ++i) {
+		WorkerQueue* victim = queues[(worker + i) % queues.size()].get();
+		std::lock_guard<std::mutex> guard(victim->lock);
+		if (!victim->tasks.empty()) {
+			*task = victim->tasks.back();
+			victim->tasks.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::workerLoop(unsigned int worker) {
+	unsigned int seenGeneration = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> guard(jobLock);
+			jobStart.wait(guard, [&]() { return stopping || jobGeneration != seenGeneration; });
+			if (stopping) return;
+			seenGeneration = jobGeneration;
+		}
+
+		unsigned int task;
+		while (popTask(worker, &task)) {
+			job(task, worker);
+			remainingTasks--;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(jobLock);
+			busyWorkers--;
+		}
+		jobDone.notify_all();
+	}
+}
+
+void ThreadPool::run(unsigned int numTasks, std::function<void(unsigned int, unsigned int)> fn) {
+	if (threads.empty()) start(0);
+	if (numTasks == 0) return;
+
+	// Deal tasks out in contiguous runs so neighbouring tiles start on the same worker
+	const unsigned int perWorker = (numTasks + (unsigned int)queues.size() - 1) / (unsigned int)queues.size();
+	for (unsigned int task = 0; task < numTasks; ++task) {
+		queues[task / perWorker]->tasks.push_back(task);
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(jobLock);
+		job = fn;
+		remainingTasks = numTasks;
+		busyWorkers = (unsigned int)threads.size();
+		jobGeneration++;
+	}
+	jobStart.notify_all();
+
+	std::unique_lock<std::mutex> guard(jobLock);
+	jobDone.wait(guard, [&]() { return busyWorkers == 0; });
+}
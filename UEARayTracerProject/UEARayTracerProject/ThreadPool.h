@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+/**
+	Fixed set of worker threads which each own a queue of tasks.
+	Workers pop tasks from the front of their own queue and steal from the back of other workers' queues once theirs is empty,
+	so uneven tiles (e.g. tiles covering glass or dense meshes) don't leave threads idle.
+*/
+class ThreadPool {
+
+	struct WorkerQueue {
+		std::mutex lock;
+		std::deque<unsigned int> tasks;
+	};
+
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+
+	std::mutex jobLock;
+	std::condition_variable jobStart;
+	std::condition_variable jobDone;
+
+	std::function<void(unsigned int, unsigned int)> job;
+	unsigned int jobGeneration = 0;
+	unsigned int busyWorkers = 0;
+	std::atomic<unsigned int> remainingTasks;
+	bool stopping = false;
+
+	bool popTask(unsigned int worker, unsigned int* task);
+
+	void workerLoop(unsigned int worker);
+
+public:
+	ThreadPool();
+	~ThreadPool();
+
+	// Starts numThreads workers. 0 uses the number of hardware threads.
+	void start(unsigned int numThreads);
+
+	void stop();
+
+	inline unsigned int getThreadCount() { return (unsigned int)threads.size(); }
+
+	// Runs fn(task, worker) for every task in [0, numTasks) and blocks until all tasks have finished
+	void run(unsigned int numTasks, std::function<void(unsigned int, unsigned int)> fn);
+
+};
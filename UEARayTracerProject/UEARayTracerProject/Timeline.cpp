@@ -0,0 +1,154 @@
+#include "Timeline.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <map>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <string.h>
+
+// Device spans are drawn as their own thread in the trace
+#define TIMELINE_DEVICE_THREAD (0)
+
+struct TimelineSpan {
+	char name[TIMELINE_NAME_LENGTH];
+	uint64_t start;
+	uint64_t end;
+	uint32_t thread;
+	bool device;
+};
+
+// sequence is index + 1 of the span last written to the slot, or 0 while it is being written
+struct TimelineSlot {
+	std::atomic<uint64_t> sequence;
+	TimelineSpan span;
+};
+
+std::atomic<bool> timelineEnabled(false);
+std::chrono::steady_clock::time_point timelineEpoch;
+TimelineSlot* timelineSlots = nullptr;
+std::atomic<uint64_t> timelineWriteIndex(0);
+
+std::atomic<uint32_t> timelineNextThread(TIMELINE_DEVICE_THREAD + 1);
+thread_local uint32_t timelineThread = timelineNextThread++;
+std::mutex threadNameLock;
+std::map<uint32_t, std::string> threadNames;
+
+// Only touched from the thread collecting profiling events
+int64_t deviceOffset = 0;
+bool deviceCalibrated = false;
+
+void _timeline_push(const char* name, uint64_t start, uint64_t end, uint32_t thread, bool device) {
+	uint64_t index = timelineWriteIndex.fetch_add(1, std::memory_order_relaxed);
+	TimelineSlot& slot = timelineSlots[index % TIMELINE_BUFFER_SIZE];
+
+	slot.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	// Bounded copy, strncpy is rejected by the /sdl build
+	size_t length = strlen(name);
+	if (length > TIMELINE_NAME_LENGTH - 1) length = TIMELINE_NAME_LENGTH - 1;
+	memcpy(slot.span.name, name, length);
+	slot.span.name[length] = '\0';
+	slot.span.start = start;
+	slot.span.end = end;
+	slot.span.thread = thread;
+	slot.span.device = device;
+	slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+std::string _timeline_escape(const char* text) {
+	std::string out;
+	for (const char* c = text; *c; ++c) {
+		if (*c == '"' || *c == '\\') out += '\\';
+		out += *c;
+	}
+	return out;
+}
+
+namespace timeline {
+
+	void enable() {
+		if (timelineEnabled) return;
+		timelineSlots = new TimelineSlot[TIMELINE_BUFFER_SIZE];
+		for (size_t i = 0; i < TIMELINE_BUFFER_SIZE; ++i) timelineSlots[i].sequence = 0;
+		timelineEpoch = std::chrono::steady_clock::now();
+		timelineEnabled = true;
+	}
+
+	bool isEnabled() {
+		return timelineEnabled.load(std::memory_order_relaxed);
+	}
+
+	uint64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - timelineEpoch).count();
+	}
+
+	void setThreadName(const std::string& name) {
+		std::lock_guard<std::mutex> guard(threadNameLock);
+		threadNames[timelineThread] = name;
+	}
+
+	void addHostSpan(const char* name, uint64_t start, uint64_t end) {
+		if (!isEnabled()) return;
+		_timeline_push(name, start, end, timelineThread, false);
+	}
+
+	void addDeviceSpan(const char* name, uint64_t start, uint64_t end) {
+		if (!isEnabled()) return;
+		_timeline_push(name, start, end, TIMELINE_DEVICE_THREAD, true);
+	}
+
+	void calibrateDevice(uint64_t hostEnqueued, uint64_t deviceQueued) {
+		int64_t offset = (int64_t)hostEnqueued - (int64_t)deviceQueued;
+		if (!deviceCalibrated || offset < deviceOffset) deviceOffset = offset;
+		deviceCalibrated = true;
+	}
+
+	bool writeJSON(const std::string& path) {
+		if (!isEnabled()) return false;
+		std::ofstream file(path);
+		if (!file) {
+			std::cout << "Could not open " << path << " for writing." << std::endl;
+			return false;
+		}
+
+		file << std::fixed << std::setprecision(3);
+		file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << std::endl;
+		file << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << TIMELINE_DEVICE_THREAD << ", \"args\": {\"name\": \"OpenCL device\"}}";
+		{
+			std::lock_guard<std::mutex> guard(threadNameLock);
+			for (auto& it : threadNames) {
+				file << "," << std::endl << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << it.first << ", \"args\": {\"name\": \"" << _timeline_escape(it.second.c_str()) << "\"}}";
+			}
+		}
+
+		// Only the last TIMELINE_BUFFER_SIZE spans are still in the buffer
+		const uint64_t end = timelineWriteIndex.load(std::memory_order_acquire);
+		const uint64_t begin = end > TIMELINE_BUFFER_SIZE ? end - TIMELINE_BUFFER_SIZE : 0;
+		size_t written = 0;
+		for (uint64_t i = begin; i < end; ++i) {
+			TimelineSlot& slot = timelineSlots[i % TIMELINE_BUFFER_SIZE];
+			uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+			if (sequence != i + 1) continue;
+			TimelineSpan span = slot.span;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.sequence.load(std::memory_order_relaxed) != sequence) continue; // Overwritten while copying
+
+			int64_t start = (int64_t)span.start, finish = (int64_t)span.end;
+			if (span.device) {
+				if (!deviceCalibrated) continue;
+				start += deviceOffset;
+				finish += deviceOffset;
+			}
+			file << "," << std::endl << "{\"name\": \"" << _timeline_escape(span.name) << "\", \"cat\": \"" << (span.device ? "device" : "host")
+				<< "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << span.thread << ", \"ts\": " << start * 1e-3 << ", \"dur\": " << (finish - start) * 1e-3 << "}";
+			written++;
+		}
+		file << std::endl << "]}" << std::endl;
+
+		std::cout << "Wrote " << written << " timeline spans to " << path << std::endl;
+		return true;
+	}
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <string>
+#include <stdint.h>
+
+// Number of spans kept. Older spans are overwritten once the buffer wraps.
+#define TIMELINE_BUFFER_SIZE (1 << 16)
+#define TIMELINE_NAME_LENGTH (48)
+#define TIMELINE_FILE ("timeline.json")
+
+/**
+	Records host and device spans on one timebase and exports them as Chrome Trace Event JSON
+	(load in chrome://tracing or ui.perfetto.dev).
+	Spans are written into a fixed ring buffer with an atomic write index, so recording never locks and is safe from any thread.
+*/
+namespace timeline {
+
+	void enable();
+
+	bool isEnabled();
+
+	// Host time in nanoseconds since the timeline was enabled
+	uint64_t now();
+
+	// Labels the calling thread in the exported trace
+	void setThreadName(const std::string& name);
+
+	void addHostSpan(const char* name, uint64_t start, uint64_t end);
+
+	// start and end are OpenCL device timestamps. They are mapped onto the host timebase when the trace is exported.
+	void addDeviceSpan(const char* name, uint64_t start, uint64_t end);
+
+	/**
+		Pairs the host time a command was enqueued with its CL_PROFILING_COMMAND_QUEUED device timestamp.
+		The smallest host - device difference seen is used as the device clock offset, as any enqueue latency only makes it larger.
+	*/
+	void calibrateDevice(uint64_t hostEnqueued, uint64_t deviceQueued);
+
+	bool writeJSON(const std::string& path);
+
+	/**
+		Records the time from construction to destruction as a span on the calling thread.
+		next() ends the current span and starts another so consecutive steps of a loop don't each need their own block.
+		name must outlive the scope (string literals).
+	*/
+	class Scope {
+		const char* name;
+		uint64_t start;
+
+	public:
+		inline Scope(const char* spanName) : name(spanName), start(isEnabled() ? now() : 0) {}
+		inline ~Scope() { end(); }
+
+		inline void end() {
+			if (name != nullptr && isEnabled()) addHostSpan(name, start, now());
+			name = nullptr;
+		}
+
+		inline void next(const char* spanName) {
+			end();
+			name = spanName;
+			start = isEnabled() ? now() : 0;
+		}
+	};
+
+}
@@ -8,7 +8,7 @@
 #include "Sphere.h"
 #include "Material.h"
 
-__declspec (align(32)) struct RTConfig {
+struct alignas(32) RTConfig {
 	cl_int2 skyboxSize;
 	cl_int bounceLimit = 3;
 	cl_int skybox = true;
@@ -17,7 +17,7 @@ __declspec (align(32)) struct RTConfig {
 	cl_int refraction = true;
 };
 
-__declspec (align(16)) struct KernelInputStruct {
+struct alignas(16) KernelInputStruct {
 	cl_float aspect;
 	cl_float width;
 	cl_float height;
@@ -2,8 +2,8 @@
 #include <CL/opencl.h>
 #include "Material.h"
 
-__declspec (align(16)) struct Triangle {
-	cl_float3 normal;
+// The normal is interpolated from the vertex normals, or computed from the face when a vertex has none (see World::addVertex)
+struct alignas(16) Triangle {
 	cl_uint3 face;
 	cl_uint materialIndex;
 };
\ No newline at end of file
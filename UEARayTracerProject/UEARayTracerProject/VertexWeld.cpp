@@ -0,0 +1,213 @@
+#include "VertexWeld.h"
+#include <iostream>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <math.h>
+#include <string.h>
+
+#define WELD_NONE (0xFFFFFFFF)
+
+float weldEpsilon = DEFAULT_WELD_EPSILON;
+bool weldReorder = true;
+
+// Cells of the hash grid are epsilon wide, so a position within epsilon of another is in the same or a neighbouring cell.
+// Different cells may share a key, which only costs an extra distance test.
+unsigned long long _weld_cellKey(long long x, long long y, long long z) {
+	return (unsigned long long)x * 73856093ULL ^ (unsigned long long)y * 19349663ULL ^ (unsigned long long)z * 83492791ULL;
+}
+
+inline bool _weld_isClose(const cl_float3& a, const cl_float3& b, float epsilon) {
+	return fabsf(a.x - b.x) <= epsilon && fabsf(a.y - b.y) <= epsilon && fabsf(a.z - b.z) <= epsilon;
+}
+
+// Spreads the low WELD_MORTON_BITS bits of v so there are two zero bits between each of them
+unsigned int _weld_expandBits(unsigned int v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+unsigned int _weld_mortonCode(const cl_float3& p, const cl_float3& min, const cl_float3& size) {
+	const float scale = (float)((1 << WELD_MORTON_BITS) - 1);
+	unsigned int x = (unsigned int)std::min(std::max((p.x - min.x) / size.x * scale, 0.0f), scale);
+	unsigned int y = (unsigned int)std::min(std::max((p.y - min.y) / size.y * scale, 0.0f), scale);
+	unsigned int z = (unsigned int)std::min(std::max((p.z - min.z) / size.z * scale, 0.0f), scale);
+	return (_weld_expandBits(x) << 2) | (_weld_expandBits(y) << 1) | _weld_expandBits(z);
+}
+
+// Maps every position to the first earlier position within epsilon with the same normal, or to itself
+std::vector<unsigned int> _weld_findRepresentatives(const std::vector<cl_float3>& positions, const std::vector<cl_uint>* normals, float epsilon) {
+	std::vector<unsigned int> remap(positions.size());
+	std::vector<unsigned int> next(positions.size(), WELD_NONE); // Chains the representatives of a bucket
+	std::unordered_map<unsigned long long, unsigned int> buckets;
+	buckets.reserve(positions.size());
+
+	const int range = epsilon > 0.0f ? 1 : 0;
+	for (size_t i = 0; i < positions.size(); ++i) {
+		const cl_float3& p = positions[i];
+		remap[i] = (unsigned int)i;
+		if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) continue;
+
+		long long cell[3];
+		for (int axis = 0; axis < 3; ++axis) {
+			float value = p.s[axis] + 0.0f; // -0 and 0 are the same position
+			if (epsilon > 0.0f) {
+				cell[axis] = (long long)std::min(std::max(floor((double)value / epsilon), -1e15), 1e15);
+			} else {
+				unsigned int bits;
+				memcpy(&bits, &value, sizeof(bits));
+				cell[axis] = bits;
+			}
+		}
+
+		bool found = false;
+		for (int dx = -range; dx <= range && !found; ++dx) {
+			for (int dy = -range; dy <= range && !found; ++dy) {
+				for (int dz = -range; dz <= range && !found; ++dz) {
+					auto bucket = buckets.find(_weld_cellKey(cell[0] + dx, cell[1] + dy, cell[2] + dz));
+					if (bucket == buckets.end()) continue;
+					for (unsigned int r = bucket->second; r != WELD_NONE; r = next[r]) {
+						if (_weld_isClose(positions[r], p, epsilon) && (normals == nullptr || (*normals)[r] == (*normals)[i])) {
+							remap[i] = r;
+							found = true;
+							break;
+						}
+					}
+				}
+			}
+		}
+
+		if (!found) {
+			unsigned int& head = buckets.emplace(_weld_cellKey(cell[0], cell[1], cell[2]), WELD_NONE).first->second;
+			next[i] = head;
+			head = (unsigned int)i;
+		}
+	}
+	return remap;
+}
+
+void _weld_sortTriangles(const std::vector<cl_float3>& positions, std::vector<unsigned int>* indices) {
+	const size_t triangleCount = indices->size() / 3;
+	if (triangleCount < 2) return;
+
+	std::vector<cl_float3> centroids(triangleCount);
+	cl_float3 min = { std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+	cl_float3 max = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+	for (size_t t = 0; t < triangleCount; ++t) {
+		const cl_float3& a = positions[(*indices)[t * 3]];
+		const cl_float3& b = positions[(*indices)[t * 3 + 1]];
+		const cl_float3& c = positions[(*indices)[t * 3 + 2]];
+		centroids[t] = { (a.x + b.x + c.x) / 3.0f, (a.y + b.y + c.y) / 3.0f, (a.z + b.z + c.z) / 3.0f };
+		for (int axis = 0; axis < 3; ++axis) {
+			min.s[axis] = std::min(min.s[axis], centroids[t].s[axis]);
+			max.s[axis] = std::max(max.s[axis], centroids[t].s[axis]);
+		}
+	}
+	cl_float3 size;
+	for (int axis = 0; axis < 3; ++axis) size.s[axis] = std::max(max.s[axis] - min.s[axis], std::numeric_limits<float>::min());
+
+	std::vector<unsigned int> codes(triangleCount);
+	for (size_t t = 0; t < triangleCount; ++t) codes[t] = _weld_mortonCode(centroids[t], min, size);
+
+	std::vector<unsigned int> order(triangleCount);
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](unsigned int a, unsigned int b) { return codes[a] < codes[b]; });
+
+	std::vector<unsigned int> sorted(triangleCount * 3);
+	for (size_t t = 0; t < triangleCount; ++t) {
+		for (int v = 0; v < 3; ++v) sorted[t * 3 + v] = (*indices)[order[t] * 3 + v];
+	}
+	indices->swap(sorted);
+}
+
+namespace weld {
+
+	void setEpsilon(float epsilon) {
+		weldEpsilon = epsilon;
+	}
+
+	float getEpsilon() {
+		return weldEpsilon;
+	}
+
+	void setReorder(bool reorder) {
+		weldReorder = reorder;
+	}
+
+	bool getReorder() {
+		return weldReorder;
+	}
+
+	void optimise(std::vector<cl_float3>* positions, std::vector<cl_uint>* normals, const std::vector<std::vector<unsigned int>*>& meshes, float epsilon, bool reorder) {
+		auto starttime = std::chrono::steady_clock::now();
+		const size_t positionsBefore = positions->size();
+
+		size_t degenerate = 0;
+		if (epsilon >= 0.0f) {
+			std::vector<unsigned int> remap = _weld_findRepresentatives(*positions, normals, epsilon);
+			for (std::vector<unsigned int>* indices : meshes) {
+				size_t kept = 0;
+				for (size_t i = 0; i + 2 < indices->size(); i += 3) {
+					unsigned int a = remap[(*indices)[i]], b = remap[(*indices)[i + 1]], c = remap[(*indices)[i + 2]];
+					if (a == b || b == c || a == c) {
+						degenerate++;
+						continue;
+					}
+					(*indices)[kept++] = a;
+					(*indices)[kept++] = b;
+					(*indices)[kept++] = c;
+				}
+				indices->resize(kept);
+			}
+		}
+
+		if (reorder) {
+			for (std::vector<unsigned int>* indices : meshes) _weld_sortTriangles(*positions, indices);
+		}
+
+		// Renumber the used positions, in order of first use when reordering so they follow the triangle order
+		std::vector<unsigned int> newIndex(positions->size(), WELD_NONE);
+		unsigned int used = 0;
+		if (reorder) {
+			for (std::vector<unsigned int>* indices : meshes) {
+				for (unsigned int index : *indices) {
+					if (newIndex[index] == WELD_NONE) newIndex[index] = used++;
+				}
+			}
+		} else {
+			for (std::vector<unsigned int>* indices : meshes) {
+				for (unsigned int index : *indices) newIndex[index] = 0;
+			}
+			for (unsigned int& index : newIndex) {
+				if (index != WELD_NONE) index = used++;
+			}
+		}
+
+		std::vector<cl_float3> compacted(used);
+		for (size_t i = 0; i < positions->size(); ++i) {
+			if (newIndex[i] != WELD_NONE) compacted[newIndex[i]] = (*positions)[i];
+		}
+		positions->swap(compacted);
+		if (normals != nullptr) {
+			std::vector<cl_uint> compactedNormals(used);
+			for (size_t i = 0; i < normals->size(); ++i) {
+				if (newIndex[i] != WELD_NONE) compactedNormals[newIndex[i]] = (*normals)[i];
+			}
+			normals->swap(compactedNormals);
+		}
+		for (std::vector<unsigned int>* indices : meshes) {
+			for (unsigned int& index : *indices) index = newIndex[index];
+		}
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+		std::cout << "Welded " << positionsBefore << " to " << positions->size() << " vertices (" << positionsBefore * sizeof(cl_float3) / 1024.0 << " KB to "
+			<< positions->size() * sizeof(cl_float3) / 1024.0 << " KB), removed " << degenerate << " degenerate triangles"
+			<< (reorder ? ", Morton ordered" : "") << " in " << seconds * 1000.0 << "ms." << std::endl;
+	}
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <CL/opencl.h>
+#include <vector>
+
+// Largest per-axis distance (world units) at which two positions are merged. Negative disables welding, 0 only merges identical positions.
+#define DEFAULT_WELD_EPSILON (1e-5f)
+// Bits per axis of the Morton code used to sort triangles
+#define WELD_MORTON_BITS (10)
+
+/**
+	Import-time cleanup of indexed meshes before they are added to the world.
+	Positions closer than the weld epsilon with the same encoded normal are merged through a hash grid and the indices are remapped. Triangles that collapse are dropped.
+	Optionally the triangles of every mesh are sorted by the Morton code of their centroid and the vertices are renumbered in order of first use,
+	so neighbouring triangles and their vertices sit close together in the buffers.
+*/
+namespace weld {
+
+	// Set before any model is loaded (--weld-epsilon, --no-reorder or weldEpsilon/reorderMeshes in config.ini). Both are part of the scene cache key.
+	void setEpsilon(float epsilon);
+	float getEpsilon();
+
+	void setReorder(bool reorder);
+	bool getReorder();
+
+	/**
+		Welds positions shared by every index list in meshes (3 indices per triangle) and removes positions no triangle uses.
+		normals holds the encoded normal of every position (see _world_encodeNormal) and is compacted with them, or is null.
+		epsilon is in the units of positions.
+	*/
+	void optimise(std::vector<cl_float3>* positions, std::vector<cl_uint>* normals, const std::vector<std::vector<unsigned int>*>& meshes, float epsilon, bool reorder);
+
+}
@@ -1,8 +1,47 @@
 #include "World.h"
+#include "cl_profiler.h"
+#include "cl_memory.h"
+#include "Lod.h"
 #include <stddef.h>
+#include <algorithm>
 
-cl_mem _world_createBuffer(cl_mem_flags flags, size_t size, void * data, cl_int* err) {
-	return clCreateBuffer(cl::context, flags, size > 0 ? size : 1, size > 0 ? data : NULL, err);
+cl_mem _world_createBuffer(const std::string& name, cl_mem_flags flags, size_t size, void * data, cl_int* err) {
+	return cl::memory::createBuffer(MEMORY_SCENE, name, flags, size > 0 ? size : 1, size > 0 ? data : NULL, err);
+}
+
+template <typename T>
+void _world_trackVector(const std::string& name, const std::vector<T>& vector) {
+	cl::memory::trackHost(MEMORY_SCENE, name, vector.capacity() * sizeof(T));
+}
+
+int gridCellDepth = DEFAULT_GRID_CELL_DEPTH;
+int gridCellRowCount = static_pow(2, DEFAULT_GRID_CELL_DEPTH);
+
+void setGridCellDepth(int depth) {
+	gridCellDepth = depth;
+	gridCellRowCount = static_pow(2, depth);
+}
+
+int getGridCellDepth() {
+	return gridCellDepth;
+}
+
+int getGridCellRowCount() {
+	return gridCellRowCount;
+}
+
+int getGridCellCount() {
+	return CUBE(gridCellRowCount);
+}
+
+LocalStaging localStaging = { false, 0, 0, 0 };
+
+void setLocalStaging(LocalStaging staging) {
+	localStaging = staging;
+}
+
+const LocalStaging& getLocalStaging() {
+	return localStaging;
 }
 
 template<typename T>
@@ -11,34 +50,119 @@ void* _world_vectorFirstPtr(std::vector<T> & vector) {
 	return NULL;
 }
 
+// Reserves size bytes at the next aligned offset of a region. Empty tables still get a byte so their sub-buffer is valid.
+size_t _world_reserve(size_t* regionSize, size_t size, size_t align) {
+	size_t offset = (*regionSize + align - 1) / align * align;
+	*regionSize = offset + (size > 0 ? size : 1);
+	return offset;
+}
+
+cl_mem _world_createSubBuffer(cl_mem arena, size_t offset, size_t size, cl_int* err) {
+	cl_buffer_region region = { offset, size > 0 ? size : 1 };
+	return clCreateSubBuffer(arena, CL_MEM_READ_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &region, err);
+}
+
+void _world_writeArena(cl_mem arena, size_t offset, size_t size, const void* data, const std::string& name) {
+	if (size == 0) return;
+	cl_event writeEvent;
+	cl_int err = clEnqueueWriteBuffer(cl::queue, arena, true, offset, size, data, 0, NULL, &writeEvent);
+	cl::printErrorMsg("Write " + name, __LINE__, __FILE__, err);
+	if (err != CL_SUCCESS) return;
+	cl::profiler::record("Write " + name, writeEvent);
+	clReleaseEvent(writeEvent);
+}
+
+SceneHeader World::layoutScene(size_t sectionSizes[SCENE_SECTION_COUNT], size_t* size) {
+	sectionSizes[SCENE_VERTICES] = sizeof(cl_float3) * vertices.size();
+	sectionSizes[SCENE_NORMALS] = sizeof(cl_uint) * normals.size();
+	sectionSizes[SCENE_TRIANGLES] = sizeof(Triangle) * triangles.size();
+	sectionSizes[SCENE_GRID] = sizeof(unsigned int) * triangleGrid.size();
+	sectionSizes[SCENE_GRID_COUNT] = sizeof(unsigned int) * triangleCountGrid.size();
+
+	SceneHeader header = {};
+	*size = sizeof(SceneHeader);
+	for (int i = 0; i < SCENE_SECTION_COUNT; ++i) header.offsets[i] = (cl_uint)_world_reserve(size, sectionSizes[i], SCENE_SECTION_ALIGN);
+	return header;
+}
+
+bool World::sceneFitsConstantMemory() {
+	size_t sectionSizes[SCENE_SECTION_COUNT];
+	size_t sceneSize;
+	layoutScene(sectionSizes, &sceneSize);
+	const size_t tableSize = sizeof(WorldStruct) + sizeof(Material) * materials.size() + sizeof(Sphere) * spheres.size() + sizeof(ModelStruct) * models.size();
+	return SCENE_CONSTANT_ARGS <= cl::device_info.max_constant && tableSize + sceneSize <= cl::device_info.max_constant_buffer;
+}
+
+cl_ulong World::getLocalStagingSize() {
+	return sizeof(Sphere) * spheres.size() + sizeof(Material) * materials.size();
+}
+
+bool World::fitsLocalStaging() {
+	return getLocalStagingSize() <= cl::device_info.local_mem_size / 2;
+}
+
+cl_uint World::getLocalStagingChunk() {
+	const cl_ulong chunk = cl::device_info.local_mem_size / 2 / sizeof(Sphere);
+	return (cl_uint)std::min<cl_ulong>(chunk, spheres.size());
+}
+
 void World::create() {
 	cl_int err;
 
 	writeEvent = NULL;
 
-	worldBuffer = _world_createBuffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(WorldStruct), &world, &err);
-	cl::printErrorMsg("Create World Buffer", __LINE__, __FILE__, err);
+	// Sub-buffer origins have to be aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN
+	const size_t align = std::max<size_t>(cl::device_info.mem_base_addr_align, SCENE_SECTION_ALIGN);
+	size_t arenaSize = 0;
+	const size_t worldOffset = _world_reserve(&arenaSize, sizeof(WorldStruct), align);
+	const size_t materialOffset = _world_reserve(&arenaSize, sizeof(Material) * materials.size(), align);
+	const size_t sphereOffset = _world_reserve(&arenaSize, sizeof(Sphere) * spheres.size(), align);
+	const size_t modelOffset = _world_reserve(&arenaSize, sizeof(ModelStruct) * models.size(), align);
+
+	size_t sectionSizes[SCENE_SECTION_COUNT];
+	size_t sceneSize;
+	SceneHeader header = layoutScene(sectionSizes, &sceneSize);
+	const size_t sceneOffset = _world_reserve(&arenaSize, sceneSize, align);
 
-	vertexBuffer = _world_createBuffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float3) * vertices.size(), _world_vectorFirstPtr(vertices), &err);
-	cl::printErrorMsg("Create Vertex Buffer", __LINE__, __FILE__, err);
+	arenaBuffer = _world_createBuffer("Scene Arena", CL_MEM_READ_ONLY, arenaSize, NULL, &err);
+	cl::printErrorMsg("Create Scene Arena", __LINE__, __FILE__, err);
 
-	materialBuffer = _world_createBuffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Material) * materials.size(), _world_vectorFirstPtr(materials), &err);
+	worldBuffer = _world_createSubBuffer(arenaBuffer, worldOffset, sizeof(WorldStruct), &err);
+	cl::printErrorMsg("Create World Buffer", __LINE__, __FILE__, err);
+
+	materialBuffer = _world_createSubBuffer(arenaBuffer, materialOffset, sizeof(Material) * materials.size(), &err);
 	cl::printErrorMsg("Create Material Buffer", __LINE__, __FILE__, err);
 
-	sphereBuffer = _world_createBuffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Sphere) * spheres.size(), _world_vectorFirstPtr(spheres), &err);
+	sphereBuffer = _world_createSubBuffer(arenaBuffer, sphereOffset, sizeof(Sphere) * spheres.size(), &err);
 	cl::printErrorMsg("Create Sphere Buffer", __LINE__, __FILE__, err);
 
-	triangleBuffer = _world_createBuffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Triangle) * triangles.size(), _world_vectorFirstPtr(triangles), &err);
-	cl::printErrorMsg("Create Triangle Buffer", __LINE__, __FILE__, err);
-
-	modelBuffer = _world_createBuffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(ModelStruct) * models.size(), _world_vectorFirstPtr(models), &err);
+	modelBuffer = _world_createSubBuffer(arenaBuffer, modelOffset, sizeof(ModelStruct) * models.size(), &err);
 	cl::printErrorMsg("Create Model Buffer", __LINE__, __FILE__, err);
 
-	triangleGridBuffer = _world_createBuffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(unsigned int) * triangleGrid.size(), _world_vectorFirstPtr(triangleGrid), &err);
-	cl::printErrorMsg("Create Triangle Grid Buffer", __LINE__, __FILE__, err);
+	sceneBuffer = _world_createSubBuffer(arenaBuffer, sceneOffset, sceneSize, &err);
+	cl::printErrorMsg("Create Scene Buffer", __LINE__, __FILE__, err);
+
+	_world_writeArena(arenaBuffer, worldOffset, sizeof(WorldStruct), &world, "World");
+	_world_writeArena(arenaBuffer, materialOffset, sizeof(Material) * materials.size(), _world_vectorFirstPtr(materials), "Materials");
+	_world_writeArena(arenaBuffer, sphereOffset, sizeof(Sphere) * spheres.size(), _world_vectorFirstPtr(spheres), "Spheres");
+	_world_writeArena(arenaBuffer, modelOffset, sizeof(ModelStruct) * models.size(), _world_vectorFirstPtr(models), "Models");
 
-	triangleCountGridBuffer = _world_createBuffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(unsigned int) * triangleCountGrid.size(), _world_vectorFirstPtr(triangleCountGrid), &err);
-	cl::printErrorMsg("Create Triangle Count Grid Buffer", __LINE__, __FILE__, err);
+	const char* sectionNames[] = SCENE_SECTION_NAMES;
+	const void* sectionData[SCENE_SECTION_COUNT] = { _world_vectorFirstPtr(vertices), _world_vectorFirstPtr(normals), _world_vectorFirstPtr(triangles),
+		_world_vectorFirstPtr(triangleGrid), _world_vectorFirstPtr(triangleCountGrid) };
+	_world_writeArena(arenaBuffer, sceneOffset, sizeof(SceneHeader), &header, "Scene Header");
+	for (int i = 0; i < SCENE_SECTION_COUNT; ++i) {
+		_world_writeArena(arenaBuffer, sceneOffset + header.offsets[i], sectionSizes[i], sectionData[i], sectionNames[i]);
+	}
+
+	_world_trackVector("Vertices", vertices);
+	_world_trackVector("Normals", normals);
+	_world_trackVector("Materials", materials);
+	_world_trackVector("Spheres", spheres);
+	_world_trackVector("Triangles", triangles);
+	_world_trackVector("Models", models);
+	_world_trackVector("Triangle Grid", triangleGrid);
+	_world_trackVector("Triangle Count Grid", triangleCountGrid);
 }
 
 ModelStruct* World::addModel(ModelStruct modelStruct)
@@ -48,6 +172,40 @@ ModelStruct* World::addModel(ModelStruct modelStruct)
 	return &models.back();
 }
 
+ModelStruct* World::addModelData(const cl_float3* modelVertices, const cl_uint* modelNormals, size_t vertexCount, const Triangle* modelTriangles, size_t triangleCount,
+	const unsigned int* grid, size_t gridSize, const unsigned int* counts, size_t countSize, ModelStruct modelStruct)
+{
+	const cl_uint vertexOffset = vertices.size();
+	const cl_uint triangleOffset = triangles.size();
+	const cl_uint gridOffset = triangleGrid.size();
+	const cl_uint countOffset = triangleCountGrid.size();
+
+	vertices.insert(vertices.end(), modelVertices, modelVertices + vertexCount);
+	normals.insert(normals.end(), modelNormals, modelNormals + vertexCount);
+
+	triangles.insert(triangles.end(), modelTriangles, modelTriangles + triangleCount);
+	for (size_t i = triangleOffset; i < triangles.size(); ++i) {
+		for (int v = 0; v < 3; ++v) triangles[i].face.s[v] += vertexOffset;
+	}
+	world.numTriangles = triangles.size();
+
+	// Slots past the count of a cell are never read, so only the used ones are rebased
+	triangleGrid.insert(triangleGrid.end(), grid, grid + gridSize);
+	triangleCountGrid.insert(triangleCountGrid.end(), counts, counts + countSize);
+	for (size_t cell = 0; cell < countSize; ++cell) {
+		for (unsigned int i = 0; i < counts[cell]; ++i) triangleGrid[gridOffset + cell * GRID_MAX_TRIANGLES_PER_CELL + i] += triangleOffset;
+	}
+
+	modelStruct.triangleOffset += triangleOffset;
+	modelStruct.triangleGridOffset += gridOffset;
+	modelStruct.triangleCountOffset += countOffset;
+	for (cl_uint level = 1; level < modelStruct.lodCount; ++level) {
+		modelStruct.lodGridOffset[level - 1] += gridOffset;
+		modelStruct.lodCountOffset[level - 1] += countOffset;
+	}
+	return addModel(modelStruct);
+}
+
 unsigned int World::addSphere(cl_float3 position, cl_float radius, unsigned int material) {
 	Sphere s = { position, radius, material };
 	spheres.push_back(s);
@@ -60,31 +218,20 @@ Sphere* World::getSphere(unsigned int index) {
 }
 
 unsigned int World::addTriangle(unsigned int i0, unsigned int i1, unsigned int i2) {
-	// Get vertices
-	cl_float3 v0 = vertices[i0];
-	cl_float3 v1 = vertices[i1];
-	cl_float3 v2 = vertices[i2];
-	// Compute normal
-	triangles.push_back({_world_computeTriangleNormal(v0, v1, v2), { i0, i1, i2 } });
+	triangles.push_back({ { i0, i1, i2 }, 0 }); // Material set by setTriangleMaterial
 	world.numTriangles = triangles.size();
 	return triangles.size()-1;
 }
 
-unsigned int World::addTriangle(cl_uint3 face, cl_float3 normal)
-{
-	triangles.push_back({ normal, face });
-	world.numTriangles = triangles.size();
-	return triangles.size();
-}
-
 Triangle* World::getTriangle(unsigned int index)
 {
 	return &triangles[index];
 }
 
-unsigned int World::addVertex(cl_float3 vertex)
+unsigned int World::addVertex(cl_float3 vertex, cl_uint normal)
 {
 	vertices.push_back(vertex);
+	normals.push_back(normal);
 	return vertices.size()-1;
 }
 
@@ -97,8 +244,8 @@ unsigned int World::addMaterial(Material m)
 void World::addTriangleGrid(unsigned int* gridOffset, unsigned int* countOffset) {
 	*gridOffset = triangleGrid.size();
 	*countOffset = triangleCountGrid.size();
-	triangleGrid.resize(triangleGrid.size() + GRID_CELL_COUNT * GRID_MAX_TRIANGLES_PER_CELL, 0);
-	triangleCountGrid.resize(triangleCountGrid.size() + GRID_CELL_COUNT, 0);
+	triangleGrid.resize(triangleGrid.size() + getGridCellCount() * GRID_MAX_TRIANGLES_PER_CELL, 0);
+	triangleCountGrid.resize(triangleCountGrid.size() + getGridCellCount(), 0);
 }
 
 void World::addTriangleToGrid(unsigned int triangle, unsigned int offset) {
@@ -114,11 +261,32 @@ void World::setTriangleMaterial(unsigned int triangle, unsigned int material)
 cl_event World::update() {
 	cl_int err = clEnqueueWriteBuffer(cl::queue, worldBuffer, false, 0, sizeof(world), &world, 0, NULL, &writeEvent);
 	cl::printErrorMsg("Update World Buffer", __LINE__, __FILE__, err);
+	cl::profiler::record("Update World Buffer", writeEvent);
 	return writeEvent;
 }
 
+bool World::selectLods(cl_float3 camera) {
+	bool changed = false;
+	for (ModelStruct& model : models) {
+		cl_uint level = lod::selectLevel(model, camera);
+		changed |= level != model.lodLevel;
+		model.lodLevel = level;
+	}
+	return changed;
+}
+
+cl_event World::updateModels() {
+	if (models.empty()) return NULL;
+	cl_event modelEvent = NULL;
+	cl_int err = clEnqueueWriteBuffer(cl::queue, modelBuffer, false, 0, sizeof(ModelStruct) * models.size(), &models[0], 0, NULL, &modelEvent);
+	cl::printErrorMsg("Update Model Buffer", __LINE__, __FILE__, err);
+	cl::profiler::record("Update Model Buffer", modelEvent);
+	return modelEvent;
+}
+
 cl_event World::updateSpheres(unsigned int sphereStartIndex, unsigned int numSpheres) {
 	cl_int err = clEnqueueWriteBuffer(cl::queue, sphereBuffer, false, sizeof(Sphere) * sphereStartIndex, sizeof(Sphere) * numSpheres, &spheres[sphereStartIndex], 0, NULL, &writeEvent);
 	cl::printErrorMsg("Update Spheres [" + std::to_string(sphereStartIndex) + ", " + std::to_string(numSpheres) + "]", __LINE__, __FILE__, err);
+	cl::profiler::record("Update Spheres", writeEvent);
 	return writeEvent;
 }
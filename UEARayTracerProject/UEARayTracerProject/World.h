@@ -1,6 +1,7 @@
 #pragma once
 #include <CL/opencl.h>
 #include <vector>
+#include <math.h>
 #include "cl_helper.h"
 #include "Sphere.h"
 #include "Material.h"
@@ -10,16 +11,39 @@
 #define SQ(x) ((x)*(x)) 
 #define CUBE(x) ((x)*(x)*(x))
 
-#define GRID_CELL_DEPTH (4)
+#define DEFAULT_GRID_CELL_DEPTH (4)
 #define GRID_MAX_TRIANGLES_PER_CELL (128) // MAKE SURE THIS IS A MULTIPLE OF 16
+// Grids per model including the full resolution one. Must match cl_kernels/defines.h and can't exceed 4, as the extra levels live in the padding of ModelStruct.
+#define MODEL_LOD_LEVELS (4)
 
 inline constexpr int static_pow(const int base, const int exp) { return (exp == 0) ? 1 : base * static_pow(base, exp-1); }
 inline constexpr int static_numrays(const int numchildren, const int bounce) { return (1 - static_pow(numchildren, bounce + 1)) / (1-numchildren); }
 
-constexpr int GRID_CELL_ROW_COUNT = static_pow(2, GRID_CELL_DEPTH);
-constexpr int GRID_CELL_COUNT = CUBE(GRID_CELL_ROW_COUNT);
+/**
+	Model grid depth (2^depth cells per axis). Can be changed at startup (--grid-depth) but must be set before any model is loaded
+	and before the kernels are built, as it is baked into the triangle grids and the GRID_CELL_ROW_COUNT build option.
+*/
+void setGridCellDepth(int depth);
+int getGridCellDepth();
+int getGridCellRowCount();
+int getGridCellCount();
+
+/**
+	Sphere and material counts the kernels copy to local memory once per work-group (STAGE_LOCAL build option, see cl_kernels/defines.h).
+	Set at startup (--stage-local) when World::fitsLocalStaging allows and before the kernels are built, as the counts are baked into them.
+	When the tables don't fit, sphereChunk spheres at a time are staged for the primary rays instead (STAGE_LOCAL_CHUNK build option).
+*/
+struct LocalStaging {
+	bool enabled;
+	cl_uint spheres;
+	cl_uint materials;
+	cl_uint sphereChunk; // 0 unless the spheres are staged in chunks
+};
+
+void setLocalStaging(LocalStaging staging);
+const LocalStaging& getLocalStaging();
 
-inline constexpr unsigned int getGridOffset(const cl_int3 coord) { return coord.x * SQ(GRID_CELL_ROW_COUNT) + coord.y * GRID_CELL_ROW_COUNT + coord.z; }
+inline unsigned int getGridOffset(const cl_int3 coord) { const int rowCount = getGridCellRowCount(); return coord.x * SQ(rowCount) + coord.y * rowCount + coord.z; }
 
 inline cl_float _world_computeLength(cl_float3 vector) {
 	return sqrtf(vector.x * vector.x + vector.y * vector.y + vector.z * vector.z);
@@ -42,28 +66,107 @@ inline cl_float3 operator-(const cl_float3& a, const cl_float3& b) {
 	return { a.x - b.x, a.y - b.y, a.z - b.z};
 }
 
+inline cl_float3 operator+(const cl_float3& a, const cl_float3& b) {
+	return { a.x + b.x, a.y + b.y, a.z + b.z };
+}
+
+inline cl_float3 operator*(const cl_float3& a, const cl_float3& b) {
+	return { a.x * b.x, a.y * b.y, a.z * b.z };
+}
+
+inline cl_float3 operator*(const cl_float3& v, cl_float s) {
+	return { v.x * s, v.y * s, v.z * s };
+}
+
+inline cl_float3 operator*(cl_float s, const cl_float3& v) {
+	return { v.x * s, v.y * s, v.z * s };
+}
+
+inline cl_float3 operator/(const cl_float3& a, const cl_float3& b) {
+	return { a.x / b.x, a.y / b.y, a.z / b.z };
+}
+
+inline cl_float _world_dot(const cl_float3& a, const cl_float3& b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
 inline cl_float3 _world_computeTriangleNormal(cl_float3 v0, cl_float3 v1, cl_float3 v2) {
 	cl_float3 v0v1 = { v1.x - v0.x, v1.y - v0.y, v1.z - v0.z };
 	cl_float3 v0v2 = { v2.x - v0.x, v2.y - v0.y, v2.z - v0.z };
 	return _world_normalise(_world_cross(v0v1, v0v2));
 }
 
+// Normal of vertices without one, whose triangles use the face normal. _world_encodeNormal never produces it as it keeps both components within +-32767.
+#define NORMAL_NONE (0x80008000u)
+
+/**
+	Octahedral normal encoding: the normal is projected onto the octahedron |x|+|y|+|z|=1, the lower half is folded over the upper one
+	and x and y are stored as 16-bit snorm. Must match decode_normal in cl_kernels/func.h.
+*/
+inline cl_uint _world_encodeNormal(cl_float3 normal) {
+	cl_float l1 = fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z);
+	if (!(l1 > 0.0f) || !isfinite(l1)) return NORMAL_NONE;
+	cl_float x = normal.x / l1;
+	cl_float y = normal.y / l1;
+	if (normal.z < 0.0f) {
+		cl_float foldedX = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		cl_float foldedY = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = foldedX;
+		y = foldedY;
+	}
+	cl_short packedX = (cl_short)lrintf(fminf(fmaxf(x, -1.0f), 1.0f) * 32767.0f);
+	cl_short packedY = (cl_short)lrintf(fminf(fmaxf(y, -1.0f), 1.0f) * 32767.0f);
+	return (cl_uint)(cl_ushort)packedX | ((cl_uint)(cl_ushort)packedY << 16);
+}
+
+inline cl_float3 _world_decodeNormal(cl_uint packed) {
+	cl_float3 normal = { (cl_short)(packed & 0xFFFF) / 32767.0f, (cl_short)(packed >> 16) / 32767.0f, 0.0f };
+	normal.z = 1.0f - fabsf(normal.x) - fabsf(normal.y);
+	cl_float fold = fmaxf(-normal.z, 0.0f);
+	normal.x += normal.x >= 0.0f ? -fold : fold;
+	normal.y += normal.y >= 0.0f ? -fold : fold;
+	return _world_normalise(normal);
+}
+
 
 class Model;
 
-__declspec (align(16)) struct ModelStruct {
+struct alignas(16) ModelStruct {
 	cl_float2 bounds[8]; // Only 7 axis but the 8th is for padding (struct alignment)
 	cl_uint triangleOffset;
-	cl_uint pad1[3];
-	cl_uint numTriangles;
+	cl_uint lodCount; // Grids of the model, 1 without LODs
+	cl_uint lodLevel; // Level picked for the current frame by World::selectLods
+	cl_float lodDistance; // Distance from the camera to the bounds at which level 1 starts. Every further level starts at twice the distance.
+	cl_uint numTriangles; // Of every level
 	cl_uint pad2[3];
 	cl_uint triangleGridOffset;
-	cl_uint pad3[3];
+	cl_uint lodGridOffset[MODEL_LOD_LEVELS - 1]; // Grids of levels 1 and up
 	cl_uint triangleCountOffset;
-	cl_uint pad4[3];
+	cl_uint lodCountOffset[MODEL_LOD_LEVELS - 1];
+};
+
+// Sections of the geometry region of the scene arena, in order. Must match cl_kernels/defines.h.
+#define SCENE_VERTICES (0)
+#define SCENE_NORMALS (1)
+#define SCENE_TRIANGLES (2)
+#define SCENE_GRID (3)
+#define SCENE_GRID_COUNT (4)
+#define SCENE_SECTION_COUNT (5)
+#define SCENE_SECTION_NAMES { "Vertices", "Normals", "Triangles", "Triangle Grid", "Triangle Count Grid" }
+#define SCENE_SECTION_ALIGN (16) // float3 and Triangle are 16 byte aligned in the kernels
+// __constant arguments of RARTrace while the geometry is in constant memory: config, world, materials, spheres, models and scene
+#define SCENE_CONSTANT_ARGS (6)
+
+// Start of the geometry region, the kernels find each section from it (scene_pack in cl_kernels/func.h)
+struct alignas(16) SceneHeader {
+	cl_uint offsets[SCENE_SECTION_COUNT]; // Bytes from the start of the header
+	cl_uint pad[3];
 };
 
-__declspec (align(16)) struct WorldStruct {
+inline cl_uint getModelGridOffset(const ModelStruct* model, cl_uint level) { return level == 0 ? model->triangleGridOffset : model->lodGridOffset[level - 1]; }
+inline cl_uint getModelCountOffset(const ModelStruct* model, cl_uint level) { return level == 0 ? model->triangleCountOffset : model->lodCountOffset[level - 1]; }
+
+struct alignas(16) WorldStruct {
 	cl_uint numRays;
 	cl_uint numSpheres;
 	cl_uint numTriangles;
@@ -79,13 +182,13 @@ class World {
 	cl_event writeEvent;
 
 	std::vector<cl_float3> vertices;
-	cl_mem vertexBuffer;
+
+	std::vector<cl_uint> normals; // Octahedral encoded, one per vertex
 
 	std::vector<Material> materials;
 	cl_mem materialBuffer;
 
 	std::vector<Triangle> triangles;
-	cl_mem triangleBuffer;
 
 	std::vector<Sphere> spheres;
 	cl_mem sphereBuffer;
@@ -94,50 +197,85 @@ class World {
 	cl_mem modelBuffer;
 
 	std::vector<unsigned int> triangleGrid;
-	cl_mem triangleGridBuffer;
 
 	std::vector<unsigned int> triangleCountGrid;
-	cl_mem triangleCountGridBuffer;
+
+	// Every buffer of the scene is a region of the arena: the world, material, sphere and model tables, then the geometry
+	cl_mem arenaBuffer;
+	cl_mem sceneBuffer;
+
+	// Offsets of the geometry sections and the size of the geometry region
+	SceneHeader layoutScene(size_t sectionSizes[SCENE_SECTION_COUNT], size_t* size);
 
 public:
 
+	/**
+		Allocates the scene arena and uploads the scene. The world, material, sphere and model tables each get a sub-buffer so they
+		stay separate __constant arguments and can be updated on their own, the geometry is one more sub-buffer behind a SceneHeader.
+	*/
 	void create();
 
 	inline cl_mem* getBufferPtr() { return &worldBuffer; }
 
-	inline cl_mem* getVertexBufferPtr() { return &vertexBuffer; }
-
 	inline cl_mem* getMaterialBufferPtr() { return &materialBuffer; }
 
 	inline cl_mem* getSphereBufferPtr() { return &sphereBuffer; }
-	inline cl_mem* getTriangleBufferPtr() { return &triangleBuffer; }
 	inline cl_mem* getModelBufferPtr() { return &modelBuffer; }
+	inline cl_mem* getSceneBufferPtr() { return &sceneBuffer; }
+
+	/**
+		True when the tables and the geometry fit the constant memory of the device. Otherwise the kernels have to be built with
+		SCENE_GLOBAL (sceneGlobal in config.ini) so they read the geometry from global memory. Only meaningful once the scene is loaded.
+	*/
+	bool sceneFitsConstantMemory();
 
-	inline cl_mem* getTriangleGridPtr() { return &triangleGridBuffer; }
+	// Bytes of local memory the sphere and material tables take when staged per work-group
+	cl_ulong getLocalStagingSize();
 
-	inline cl_mem* getTriangleCountPtr() { return &triangleCountGridBuffer; }
+	// True when the staged tables fit in half the local memory of the device, leaving the rest to the driver and other kernels
+	bool fitsLocalStaging();
+
+	// Spheres per chunk when they are staged a chunk at a time, as many as fit that half of local memory
+	cl_uint getLocalStagingChunk();
+
+	// Picks the LOD level of every model from its distance to camera. Returns true if any level changed.
+	bool selectLods(cl_float3 camera);
 
 	inline std::vector<cl_float3>& getVertexBuffer() { return vertices; }
 
+	inline std::vector<cl_uint>& getNormals() { return normals; }
+
 	inline std::vector<Material>& getMaterialBuffer() { return materials; }
 
 	inline std::vector<Sphere>& getSpheres() { return spheres; }
 
 	inline cl_uint getTriangleCount() { return world.numTriangles; }
 
+	inline const WorldStruct& getStruct() { return world; }
+
+	inline std::vector<Triangle>& getTriangles() { return triangles; }
+
+	inline std::vector<ModelStruct>& getModels() { return models; }
+
 	ModelStruct* addModel(ModelStruct modelStruct);
 
+	/**
+		Appends a prebuilt model in one pass per array (see SceneCache). Face, grid and model offsets are relative to the model
+		and are rebased onto the arrays already in the world.
+	*/
+	ModelStruct* addModelData(const cl_float3* modelVertices, const cl_uint* modelNormals, size_t vertexCount, const Triangle* modelTriangles, size_t triangleCount,
+		const unsigned int* grid, size_t gridSize, const unsigned int* counts, size_t countSize, ModelStruct modelStruct);
+
 	unsigned int addSphere(cl_float3 position, cl_float radius, unsigned int material);
 
 	Sphere* getSphere(unsigned int index);
 
 	unsigned int addTriangle(unsigned int i0, unsigned int i1, unsigned int i2);
 
-	unsigned int addTriangle(cl_uint3 face, cl_float3 normal);
-
 	Triangle* getTriangle(unsigned int index);
 
-	unsigned int addVertex(cl_float3 vertex);
+	// normal is encoded with _world_encodeNormal. Triangles with a vertex that has no normal are flat shaded.
+	unsigned int addVertex(cl_float3 vertex, cl_uint normal = NORMAL_NONE);
 
 	unsigned int addMaterial(Material m);
 
@@ -155,5 +293,8 @@ public:
 
 	cl_event updateSpheres(unsigned int sphereStartIndex, unsigned int numSpheres);
 
+	// Writes the selected levels of detail. The caller releases the returned event.
+	cl_event updateModels();
+
 };
 
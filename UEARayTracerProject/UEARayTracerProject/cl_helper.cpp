@@ -4,6 +4,10 @@
 #include <iomanip>
 #include "TracerKernel.h"
 #include "RARKernel.h"
+#include "cl_profiler.h"
+#include "cl_memory.h"
+#include "ProgramCache.h"
+#include <chrono>
 
 cl_platform_id retrievePlatform() {
 	cl_platform_id platforms[MAX_PLATFORMS];
@@ -84,6 +88,25 @@ void loadConfigFromFile(std::string file, std::unordered_map<std::string, std::s
 	}
 }
 
+void touchCacheFile(const std::string& indexPath, const std::string& path, size_t maxFiles) {
+	std::vector<std::string> files;
+	std::ifstream in(indexPath);
+	std::string line;
+	while (std::getline(in, line)) {
+		if (!line.empty() && line != path) files.push_back(line);
+	}
+	in.close();
+	files.push_back(path);
+
+	const size_t evicted = files.size() > maxFiles ? files.size() - maxFiles : 0;
+	for (size_t i = 0; i < evicted; ++i) {
+		if (remove(files[i].c_str()) == 0) std::cout << "Evicted cache file " << files[i] << std::endl;
+	}
+
+	std::ofstream out(indexPath, std::ios::trunc);
+	for (size_t i = evicted; i < files.size(); ++i) out << files[i] << std::endl;
+}
+
 namespace cl {
 
 	// Externs
@@ -203,9 +226,8 @@ namespace cl {
 		cl_int err = clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), status, NULL);
 	}
 
-	bool init() {
-		// Load config
-		loadConfigFromFile(CONFIG_FILE, config);
+	bool init(bool headless) {
+		if (getConfigBool("enableProfiling")) profiler::enable();
 
 		// CL stuff
 		platform = retrievePlatform();
@@ -225,17 +247,25 @@ namespace cl {
 		clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 2048, extensions, NULL);
 		std::cout << extensions << std::endl;
 
-		// Create context
-		cl_context_properties props[7] = {
-			CL_GL_CONTEXT_KHR, (cl_context_properties) wglGetCurrentContext(),
-			CL_WGL_HDC_KHR, (cl_context_properties) wglGetCurrentDC(),
-			CL_CONTEXT_PLATFORM, (cl_context_properties) platform,
-			0
-		};
+		// Headless rendering has no GL context to share
+		if (headless) config["useInterop"] = "false";
 
 		cl_int err;
 		if (getConfigBool("useInterop")) {
+#ifdef _WIN32
+			// Create context
+			cl_context_properties props[7] = {
+				CL_GL_CONTEXT_KHR, (cl_context_properties) wglGetCurrentContext(),
+				CL_WGL_HDC_KHR, (cl_context_properties) wglGetCurrentDC(),
+				CL_CONTEXT_PLATFORM, (cl_context_properties) platform,
+				0
+			};
 			context = clCreateContext(props, 1, &device, NULL, NULL, &err);
+#else
+			std::cout << "GL interop is only supported on Windows. Creating context without interop." << std::endl;
+			config["useInterop"] = "false";
+			context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+#endif
 		} else {
 			context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
 		}
@@ -245,9 +275,12 @@ namespace cl {
 		clGetDeviceInfo(cl::device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(device_info.max_compute_units), &device_info.max_compute_units, NULL);
 		clGetDeviceInfo(cl::device, CL_DEVICE_MAX_CONSTANT_ARGS, sizeof(device_info.max_constant), &device_info.max_constant, NULL);
 		clGetDeviceInfo(cl::device, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(device_info.max_constant_buffer), &device_info.max_constant_buffer, NULL);
+		clGetDeviceInfo(cl::device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(device_info.mem_base_addr_align), &device_info.mem_base_addr_align, NULL);
+		device_info.mem_base_addr_align /= 8; // Reported in bits
 		clGetDeviceInfo(cl::device, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(device_info.max_image2d_height), &device_info.max_image2d_height, NULL);
 		clGetDeviceInfo(cl::device, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(device_info.max_image2d_width), &device_info.max_image2d_width, NULL);
 		clGetDeviceInfo(cl::device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(device_info.max_mem_alloc), &device_info.max_mem_alloc, NULL);
+		clGetDeviceInfo(cl::device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(device_info.global_mem_size), &device_info.global_mem_size, NULL);
 		clGetDeviceInfo(cl::device, CL_DEVICE_MAX_PARAMETER_SIZE, sizeof(device_info.max_parameters), &device_info.max_parameters, NULL);
 		clGetDeviceInfo(cl::device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(device_info.max_work_group_size), &device_info.max_work_group_size, NULL);
 		clGetDeviceInfo(cl::device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(device_info.max_work_dimensions), &device_info.max_work_dimensions, NULL);
@@ -266,11 +299,15 @@ namespace cl {
 		std::cout << std::setw(48) << "CL_DEVICE_MAX_CONSTANT_ARGS: " << std::setw(8) << device_info.max_constant << std::endl;
 		std::cout << std::setw(48) << "CL_DEVICE_LOCAL_MEM_SIZE: " << std::setw(8) << device_info.local_mem_size << std::endl;
 		std::cout << std::setw(48) << "CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE: " << std::setw(8) << device_info.max_constant_buffer << std::endl;
+		std::cout << std::setw(48) << "CL_DEVICE_MEM_BASE_ADDR_ALIGN (bytes): " << std::setw(8) << device_info.mem_base_addr_align << std::endl;
 		std::cout << std::setw(48) << "CL_DEVICE_MAX_MEM_ALLOC_SIZE: " << std::setw(8) << device_info.max_mem_alloc << std::endl;
+		std::cout << std::setw(48) << "CL_DEVICE_GLOBAL_MEM_SIZE: " << std::setw(8) << device_info.global_mem_size << std::endl;
 		std::cout << std::setw(48) << "CL_DEVICE_MAX_PARAMETER_SIZE: " << std::setw(8) << device_info.max_parameters << std::endl;
 		std::cout << std::setw(48) << "CL_DEVICE_IMAGE2D_MAX_WIDTH: " << std::setw(8) << device_info.max_image2d_width << std::endl;
 		std::cout << std::setw(48) << "CL_DEVICE_IMAGE2D_MAX_HEIGHT: " << std::setw(8) << device_info.max_image2d_height << std::endl;
 
+		if (getConfigInt("memoryBudgetMB") > 0) memory::setBudget((cl_ulong)getConfigInt("memoryBudgetMB") << 20);
+
 		if (err == NULL) return true;
 
 		// Error reporting
@@ -294,11 +331,23 @@ namespace cl {
 	std::string getBuildOptions() {
 		std::ostringstream stream;
 		stream << BUILD_OPTIONS
-			<< " -D GRID_CELL_ROW_COUNT=" << GRID_CELL_ROW_COUNT
+			<< " -D GRID_CELL_ROW_COUNT=" << getGridCellRowCount()
 			<< " -D GRID_MAX_TRIANGLES_PER_CELL=" << GRID_MAX_TRIANGLES_PER_CELL
-			<< " -D NUM_RAY_CHILDREN=" << NUM_RAY_CHILDREN
+			<< " -D NUM_RAY_CHILDREN=" << getRayTree().children
+			<< " -D REFLECT_SLOT=" << getRayTree().reflectSlot
+			<< " -D REFRACT_SLOT=" << getRayTree().refractSlot
+			<< " -D SHADOW_SLOT=" << getRayTree().shadowSlot
 			<< " -g "; 
 		if (getConfigBool("useInterop")) stream << "-D USE_INTEROP ";
+		if (getConfigBool("rayStats")) stream << "-D RAY_STATS ";
+		if (getConfigBool("heatmap")) stream << "-D HEATMAP ";
+		if (getConfigBool("sceneGlobal")) stream << "-D SCENE_GLOBAL ";
+		if (getLocalStaging().enabled) {
+			stream << "-D STAGE_LOCAL -D STAGE_LOCAL_SPHERES=" << getLocalStaging().spheres << " -D STAGE_LOCAL_MATERIALS=" << getLocalStaging().materials << " ";
+		} else if (getLocalStaging().sphereChunk > 0) {
+			stream << "-D STAGE_LOCAL_CHUNK=" << getLocalStaging().sphereChunk << " ";
+		}
+		if (getMortonDispatch()) stream << "-D MORTON_DISPATCH -D MORTON_BLOCK_SIZE=" << MORTON_BLOCK_SIZE << " ";
 		if (getConfigBool("disableWarnings")) stream << "-w ";
 		if (getConfigBool("makeWarningsErrors")) stream << "-Werror ";
 		if (getConfigBool("disableOptimisation")) stream << "-cl-opt-disable ";
@@ -314,46 +363,75 @@ namespace cl {
 		return stream.str();
 	}
 
-	bool build() {
+	cl_program buildProgram(const std::vector<std::string>& programSources, const std::string& buildOptions, bool* cached, std::string* error) {
 		cl_int err;
+		const cl_ulong cacheKey = programcache::isEnabled() ? programcache::getKey(programSources, buildOptions, platform, device) : 0;
+		cl_program built = programcache::isEnabled() ? programcache::load(cacheKey, buildOptions, context, device) : nullptr;
+		if (cached) *cached = built != nullptr;
+		if (built) return built;
 
 		std::vector<const char*> srcvec;
 		std::vector<size_t> srclen;
-		for (auto it = sources.begin(); it != sources.end(); ++it) {
+		for (auto it = programSources.begin(); it != programSources.end(); ++it) {
 			srcvec.push_back(it->c_str());
 			srclen.push_back(it->length());
 		}
 
- 		program = clCreateProgramWithSource(context, sources.size(), &srcvec[0], &srclen[0], &err);
-		if (err != NULL) {
-			std::cout << "Program creation error: " << getErrorString(err) << std::endl;
+		built = clCreateProgramWithSource(context, (cl_uint)programSources.size(), &srcvec[0], &srclen[0], &err);
+		if (err != CL_SUCCESS) {
+			if (error) *error = "Program creation error: " + getErrorString(err);
+			return nullptr;
 		}
 
-		std::string buildOptions = getBuildOptions();
-		std::cout << "BuildOptions: " << buildOptions << std::endl;
-		err = clBuildProgram(program, 1, &device, buildOptions.c_str(), NULL, NULL);
+		err = clBuildProgram(built, 1, &device, buildOptions.c_str(), NULL, NULL);
 		if (err == CL_SUCCESS) {
-			queue = clCreateCommandQueueWithProperties(context, device, NULL, &err);
-			sources.clear(); // Deallocate sources
-			if (err == NULL) return true;
-			std::cout << "Could not create command queue: " << getErrorString(err) << std::endl;
-			return false;
+			if (programcache::isEnabled()) programcache::write(cacheKey, built, device);
+			return built;
 		}
 
-		// IF BUILD FAILS
-		std::cout << "Build error: " << getErrorString(err) << std::endl;
+		if (error) {
+			*error = "Build error: " + getErrorString(err);
+			size_t buildLogLength = 0;
+			err = clGetProgramBuildInfo(built, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &buildLogLength);
+			std::string buildLog(buildLogLength, '\0');
+			if (err == CL_SUCCESS && buildLogLength > 0) err = clGetProgramBuildInfo(built, device, CL_PROGRAM_BUILD_LOG, buildLogLength, &buildLog[0], NULL);
+			if (err != CL_SUCCESS) {
+				*error += "\nFailed to get program build log: " + getErrorString(err);
+			} else {
+				*error += "\n" + buildLog;
+			}
+		}
+		clReleaseProgram(built);
+		return nullptr;
+	}
 
-		size_t buildLogLength;
-		clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, NULL, NULL, &buildLogLength);
-		char* buildLog = new char[buildLogLength];
-		err = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, buildLogLength, buildLog, NULL);
-		if (err != CL_SUCCESS) {
-			std::cout << "Failed to get program build log: " << getErrorString(err) << std::endl;
+	bool build() {
+		cl_int err;
+		auto starttime = std::chrono::steady_clock::now();
+
+		std::string buildOptions = getBuildOptions();
+		std::cout << "BuildOptions: " << buildOptions << std::endl;
+
+		bool cached;
+		std::string error;
+		program = buildProgram(sources, buildOptions, &cached, &error);
+		if (program == nullptr) {
+			std::cout << error << std::endl;
+			return false;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+		if (cached) {
+			std::cout << "Loaded program from the program cache in " << seconds * 1000.0 << "ms (warm start)." << std::endl;
 		} else {
-			std::cout << buildLog << std::endl;
+			std::cout << "Built program from source in " << seconds * 1000.0 << "ms (cold start)." << std::endl;
 		}
-		delete[] buildLog;
 
+		// Profiling adds a little overhead to every command so it's only enabled on request
+		cl_queue_properties properties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+		queue = clCreateCommandQueueWithProperties(context, device, profiler::isEnabled() ? properties : NULL, &err);
+		sources.clear(); // Deallocate sources
+		if (err == NULL) return true;
+		std::cout << "Could not create command queue: " << getErrorString(err) << std::endl;
 		return false;
 	}
 
@@ -5,7 +5,9 @@
 #include <CL/opencl.h>
 #include <vector>
 #include <iostream>
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 #include <string>
 #include <unordered_map>
 
@@ -16,15 +18,26 @@
 
 #define BUILD_OPTIONS ("-cl-std=CL2.0")
 
+// Reads key=value lines into config (used for config.ini and benchmark sweep files)
+void loadConfigFromFile(std::string file, std::unordered_map<std::string, std::string>& config);
+
+/**
+	Marks path as the most recently used file of a cache whose files are listed in indexPath, oldest first, and deletes the least
+	recently used ones beyond maxFiles. Called when a cache file is written or loaded, so caches don't grow without bound.
+*/
+void touchCacheFile(const std::string& indexPath, const std::string& path, size_t maxFiles);
+
 namespace cl {
 	struct device_info_struct {
 		size_t max_parameters;
 		cl_ulong max_mem_alloc;
+		cl_ulong global_mem_size;
 		cl_uint max_constant;
 		cl_uint max_compute_units;
 		size_t max_image2d_width, max_image2d_height;
 		cl_ulong local_mem_size;
 		cl_ulong max_constant_buffer;
+		cl_uint mem_base_addr_align; // In bytes, the alignment of sub-buffer origins
 		cl_uint max_work_dimensions;
 		size_t max_work_group_size;
 		size_t* max_work_item_sizes;
@@ -48,10 +61,17 @@ namespace cl {
 
 	void readEventStatus(cl_event event, cl_int* status);
 
-	bool init();
+	// Selects the device and creates the context. cl::config must already hold config.ini.
+	bool init(bool headless = false);
 
 	void addSource(const std::string source);
 
+	// Defines and flags every program is built with, from the settings and config.ini
+	std::string getBuildOptions();
+
+	// Builds a program for the device, through the program cache when it's enabled. Returns nullptr and sets error (with the build log) on failure.
+	cl_program buildProgram(const std::vector<std::string>& sources, const std::string& buildOptions, bool* cached, std::string* error);
+
 	bool build();
 
 	cl_kernel createKernel(const char* kernelName);
@@ -26,6 +26,14 @@
 
 #define BVH_PLANE_COUNT (7)
 
+// Grids per model including the full resolution one. Must match World.h.
+#define MODEL_LOD_LEVELS (4)
+// Extra levels a ray that starts outside a model's bounds goes down per bounce, and for shadow rays
+#define LOD_BOUNCE_BIAS (1)
+#define LOD_SHADOW_BIAS (1)
+// Octahedral vertex normal of vertices without one, whose triangles use the face normal. Must match World.h.
+#define NORMAL_NONE (0x80008000u)
+
 #define AMBIENT_STRENGTH (0.2f)
 #define SPECULAR_STRENGTH (0.3f)
 
@@ -33,17 +41,125 @@
 #define DAYLIGHT_SHADOW_STRENGTH (0.7f)
 
 #define MAX_RESULT_TREE_STACK (256)
+// Slot of a ray type the scene never spawns. NUM_RAY_CHILDREN and REFLECT_SLOT, REFRACT_SLOT and SHADOW_SLOT are build options (RayTree).
+#define RAY_SLOT_NONE (0)
+// Levels of the ray tree the image resolver walks, bounces + 1. Trees of one child per ray (e.g. mirror-only scenes) have exactly that many,
+// while a queue of MAX_RESULT_TREE_STACK rays reaches at most 8 levels with two children and 6 with three. The host clamps bounces to
+// MAX_BOUNCES (RARKernel.h) so that every level fits.
+#if defined(SPECIALISED_BOUNCES) && SPECIALISED_BOUNCES < 8
+#define MAX_RESOLVE_DEPTH (SPECIALISED_BOUNCES + 1)
+#else
+#define MAX_RESOLVE_DEPTH (8)
+#endif
+
+// Scene-specialised builds (see Specialisation.h) bake the sphere and model counts and the bounces in as build options,
+// so the loops over them have fixed trip counts and the paths of an absent object type compile out. The generic program reads them from the buffers.
+#ifdef SPECIALISED_NUM_SPHERES
+#define WORLD_NUM_SPHERES(world) (SPECIALISED_NUM_SPHERES)
+#define WORLD_HAS_SPHERES (SPECIALISED_NUM_SPHERES > 0)
+#else
+#define WORLD_NUM_SPHERES(world) ((world)->numSpheres)
+#define WORLD_HAS_SPHERES (1)
+#endif
+#ifdef SPECIALISED_NUM_MODELS
+#define WORLD_NUM_MODELS(world) (SPECIALISED_NUM_MODELS)
+#define WORLD_HAS_MODELS (SPECIALISED_NUM_MODELS > 0)
+#else
+#define WORLD_NUM_MODELS(world) ((world)->numModels)
+#define WORLD_HAS_MODELS (1)
+#endif
+#ifdef SPECIALISED_BOUNCES
+#define CONFIG_BOUNCES(config) (SPECIALISED_BOUNCES)
+#else
+#define CONFIG_BOUNCES(config) ((config)->bounces)
+#endif
+
+// Ray statistics counters (RAY_STATS builds). Order must match RAY_STAT_NAMES in RARKernel.h.
+// The first four follow the ray type defines so STAT_ROOT_RAYS + rayType counts a ray of any type.
+#define STAT_ROOT_RAYS (0)
+#define STAT_REFLECT_RAYS (1)
+#define STAT_REFRACT_RAYS (2)
+#define STAT_SHADOW_RAYS (3)
+#define STAT_SPHERE_TESTS (4)
+#define STAT_KDOP_TESTS (5)
+#define STAT_TRIANGLE_TESTS (6)
+#define STAT_DDA_STEPS (7)
+#define STAT_MAX_STEP_TRUNCATED (8)
+#define STAT_TREE_STACK_TRUNCATED (9)
+#define STAT_RESOLVE_TRUNCATED (10)
+#define RAY_STAT_COUNT (11)
+
+// ResolveImage output modes (ImageConfig.debugMode). Mirrored in ImageResolverKernel.h.
+#define DEBUG_MODE_SHADED (0)
+#define DEBUG_MODE_TESTS (1)
+#define DEBUG_MODE_STEPS (2)
+
+#define HEATMAP_LEGEND_WIDTH (256)
+#define HEATMAP_LEGEND_HEIGHT (8)
+
+// Per pixel cost counters of the heatmap modes (HEATMAP builds)
+#ifdef HEATMAP
+#define HEATMAP_COUNT(pack, counter) ((pack)->counter++)
+#else
+#define HEATMAP_COUNT(pack, counter)
+#endif
+
+#ifdef RAY_STATS
+#define RAY_STAT(pack, counter, n) ((pack)->stats[counter] += (n))
+#else
+#define RAY_STAT(pack, counter, n)
+#endif
 
 #define print3f(v) printf("%f, %f, %f", v.x, v.y, v.z)
 
 // #define SKIP_DDA
 
+// Sections of the geometry arena, the offsets header at its start is indexed by these
+#define SCENE_VERTICES (0)
+#define SCENE_NORMALS (1)
+#define SCENE_TRIANGLES (2)
+#define SCENE_GRID (3)
+#define SCENE_GRID_COUNT (4)
+#define SCENE_SECTION_COUNT (5)
+
+// Set by the host when the geometry does not fit the device's constant memory
+#ifdef SCENE_GLOBAL
+#define SCENE_SPACE __global
+#else
+#define SCENE_SPACE __constant
+#endif
+
+// Spheres and materials are copied to local memory once per work-group in STAGE_LOCAL builds, whose exact counts are the
+// STAGE_LOCAL_SPHERES and STAGE_LOCAL_MATERIALS build options. Set by the host when they fit (see World::getLocalStagingSize).
+// When they don't, STAGE_LOCAL_CHUNK builds stage the spheres for the primary rays only, that many at a time (see stage_primary_spheres).
+#define STAGE_LOCAL_ID (get_local_id(1) * get_local_size(0) + get_local_id(0))
+#define STAGE_LOCAL_STRIDE (get_local_size(0) * get_local_size(1))
+#ifdef STAGE_LOCAL
+#define STAGE_SPACE __local
+// Declares the local array staged and fills it with count items of src, each work item copying a share. Contains a barrier, so it must
+// be reached by every work item of the group, i.e. outside the divergent ray tree loop.
+// The same holds for work-group collectives such as ray_stats_flush, which must not sit behind an early return (e.g. of the Morton padding).
+#define STAGE_ARRAY(type, staged, src, count) \
+    __local type staged[(count) > 0 ? (count) : 1]; \
+    for(uint stage_i = STAGE_LOCAL_ID; stage_i < (count); stage_i += STAGE_LOCAL_STRIDE) staged[stage_i] = (src)[stage_i]; \
+    barrier(CLK_LOCAL_MEM_FENCE)
+#define STAGED(staged, src) (staged)
+#else
+#define STAGE_SPACE __constant
+#define STAGE_ARRAY(type, staged, src, count)
+#define STAGED(staged, src) (src)
+#endif
+#define STAGE_MATERIALS(materials) STAGE_ARRAY(Material, stagedMaterials, materials, STAGE_LOCAL_MATERIALS)
+#define STAGE_SPHERES(spheres) STAGE_ARRAY(Sphere, stagedSpheres, spheres, STAGE_LOCAL_SPHERES)
+#define STAGED_MATERIALS(materials) STAGED(stagedMaterials, materials)
+#define STAGED_SPHERES(spheres) STAGED(stagedSpheres, spheres)
+
 // types
 typedef __constant unsigned char* SKYBOX;
 
-typedef __constant unsigned int* TRIANGLE_GRID;
+typedef SCENE_SPACE unsigned int* TRIANGLE_GRID;
 
-typedef __constant unsigned int* TRIANGLE_GRID_COUNT;
+typedef SCENE_SPACE unsigned int* TRIANGLE_GRID_COUNT;
 
 // Constants
 
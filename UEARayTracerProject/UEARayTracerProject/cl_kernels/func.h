@@ -4,8 +4,8 @@
 #include "structs.h"
 #endif
 
-bool debug_isCenterPixel(){
-    return get_global_id(0) == 1280 / 2 && get_global_id(1) == 720 / 2;
+bool debug_isCenterPixel(int x, int y){
+    return x == 1280 / 2 && y == 720 / 2;
 }
 
 void swap(float* a, float* b){
@@ -14,7 +14,30 @@ void swap(float* a, float* b){
     *b = temp;
 }
 
-void generateEyeRay(__global Ray* output, __constant RayConfig* config, int x, int y){
+// Points the geometry of the pack at the sections of the scene arena, the offsets are in bytes from its start
+WorldPack scene_pack(__constant World* world, STAGE_SPACE Material* materials, STAGE_SPACE Sphere* spheres, __constant Model* models, SCENE_SPACE uchar* scene){
+    SCENE_SPACE uint* offsets = (SCENE_SPACE uint*)scene;
+    WorldPack pack;
+    pack.world = world;
+    pack.vertices = (SCENE_SPACE float3*)(scene + offsets[SCENE_VERTICES]);
+    pack.normals = (SCENE_SPACE uint*)(scene + offsets[SCENE_NORMALS]);
+    pack.materials = materials;
+    pack.spheres = spheres;
+    pack.triangles = (SCENE_SPACE Triangle*)(scene + offsets[SCENE_TRIANGLES]);
+    pack.models = models;
+    pack.grid = (TRIANGLE_GRID)(scene + offsets[SCENE_GRID]);
+    pack.triangleCountGrid = (TRIANGLE_GRID_COUNT)(scene + offsets[SCENE_GRID_COUNT]);
+#ifdef HEATMAP
+    pack.intersectTests = 0;
+    pack.ddaSteps = 0;
+#endif
+#ifdef STAGE_LOCAL_CHUNK
+    pack.primaryStaged = false;
+#endif
+    return pack;
+}
+
+Ray eyeRay(__constant RayConfig* config, int x, int y){
     // Normalised coordinates
     float nx = 2.0f * (((float)(x) / config->width) - 0.5f) * config->aspect;
     float ny = 2.0f * (((float)(y) / config->height) - 0.5f);
@@ -23,8 +46,14 @@ void generateEyeRay(__global Ray* output, __constant RayConfig* config, int x, i
     float3 coord = {nx, ny * cos(config->pitch) + nz * -sin(config->pitch), nz * cos(config->pitch) + ny * sin(config->pitch)};
     coord = (float3)(coord.x * cos(config->yaw) + coord.z * sin(config->yaw), coord.y, coord.z * cos(config->yaw) + coord.x * -sin(config->yaw));
 
-    output->origin = coord + config->camera;
-    output->direction = normalize(output->origin - config->camera);
+    Ray ray;
+    ray.origin = coord + config->camera;
+    ray.direction = normalize(ray.origin - config->camera);
+    return ray;
+}
+
+void generateEyeRay(__global Ray* output, __constant RayConfig* config, int x, int y){
+    *output = eyeRay(config, x, y);
 }
 
 float logbase(float base, float num){
@@ -32,9 +61,49 @@ float logbase(float base, float num){
 }
 
 int rar_getNumRays(int bounces){
+#if NUM_RAY_CHILDREN > 1
     return (int)((1.0f-pow(NUM_RAY_CHILDREN, (float)bounces+1)) / (1.0f-NUM_RAY_CHILDREN));
+#else
+    return bounces + 1;
+#endif
 }
 
+#ifdef MORTON_DISPATCH
+// Compacts the even bits of a Morton code into the low bits
+uint morton_compact(uint code){
+    code &= 0x55555555;
+    code = (code | (code >> 1)) & 0x33333333;
+    code = (code | (code >> 2)) & 0x0f0f0f0f;
+    code = (code | (code >> 4)) & 0x00ff00ff;
+    code = (code | (code >> 8)) & 0x0000ffff;
+    return code;
+}
+
+/**
+    Tiles are enqueued as (position on the Z-order curve of a MORTON_BLOCK_SIZE block, block column, block row) with a global offset of
+    (0, tile x, tile y). Consecutive work items cover a compact square of pixels and their rays are stored consecutively, block after block.
+ */
+int2 rar_getPixel(){
+    uint code = get_global_id(0);
+    return (int2)(get_global_offset(1) + (get_global_id(1) - get_global_offset(1)) * MORTON_BLOCK_SIZE + morton_compact(code),
+        get_global_offset(2) + (get_global_id(2) - get_global_offset(2)) * MORTON_BLOCK_SIZE + morton_compact(code >> 1));
+}
+
+int rar_getTilePixel(){
+    return get_global_id(0) + ((get_global_id(1) - get_global_offset(1)) + (get_global_id(2) - get_global_offset(2)) * get_global_size(1)) * get_global_size(0);
+}
+#else
+// Screen coordinates of the work item. Tiles are enqueued with a global offset, so the ids stay screen coordinates.
+int2 rar_getPixel(){
+    return (int2)(get_global_id(0), get_global_id(1));
+}
+
+// Pixel of the work item within the tile being rendered
+int rar_getTilePixel(){
+    return (get_global_id(0) - get_global_offset(0)) + (get_global_id(1) - get_global_offset(1)) * get_global_size(0);
+}
+#endif
+
 int rar_getBounce(int index){
     return (int)ceil(logbase(NUM_RAY_CHILDREN, 1 + (NUM_RAY_CHILDREN-1)*index) - 1);
 }
@@ -43,16 +112,17 @@ int rar_getParentIndex(int index){
     return (index-1) / NUM_RAY_CHILDREN;
 }
 
+// Ray types without a slot in the tree (see RayTree) give an index past the end of every tree
 int rar_getReflectChild(int index){
-    return NUM_RAY_CHILDREN*index + REFLECT_TYPE;
+    return REFLECT_SLOT == RAY_SLOT_NONE ? INT_MAX : NUM_RAY_CHILDREN*index + REFLECT_SLOT;
 }
 
 int rar_getRefractChild(int index){
-    return NUM_RAY_CHILDREN*index + REFRACT_TYPE;
+    return REFRACT_SLOT == RAY_SLOT_NONE ? INT_MAX : NUM_RAY_CHILDREN*index + REFRACT_SLOT;
 }
 
 int rar_getShadowChild(int index){
-    return NUM_RAY_CHILDREN*index + SHADOW_TYPE;
+    return SHADOW_SLOT == RAY_SLOT_NONE ? INT_MAX : NUM_RAY_CHILDREN*index + SHADOW_SLOT;
 }
 
 void getReflectDirection(__global float3* direction_out, float3 direction_in, float3 normal){
@@ -122,17 +192,18 @@ uint getTriangleGridOffset(float3 cellindex){
     INTERSECT FUNCTIONS
  */
 
-float3 sphere_normal(__constant Sphere* sphere, float3 surface){
+float3 sphere_normal(STAGE_SPACE Sphere* sphere, float3 surface){
     return normalize(surface - sphere->position);
 }
 
-bool sphere_intersect(Ray* ray, __constant Sphere* sphere, SphereIntersect* result){
-    float3 vec_raysphere = ray->origin - sphere->position; // This line should be omitted in the future for performance optimizations
+// Takes the sphere by value, so spheres from any address space can be tested
+bool sphere_intersect_at(Ray* ray, float3 position, float radius, SphereIntersect* result){
+    float3 vec_raysphere = ray->origin - position; // This line should be omitted in the future for performance optimizations
 
     // at^2 + bt + c = 0
     float a = 1.0f; // dot(ray->direction, ray->direction) Since ray direction is normalized, this is just 1.0
     float b = 2.0f * dot(ray->direction, vec_raysphere);
-    float c = dot(vec_raysphere, vec_raysphere) - SQ(sphere->radius);
+    float c = dot(vec_raysphere, vec_raysphere) - SQ(radius);
 
     // t = (-b +- sqrt(b^2 - 4ac)) / 2a;
     float discriminant = SQ(b) - 4*a*c;
@@ -156,7 +227,12 @@ bool sphere_intersect(Ray* ray, __constant Sphere* sphere, SphereIntersect* resu
     return true;
 }
 
-bool triangle_intersect(Ray* ray, __constant Triangle* const_triangle, __constant float3* vertices, float3* intersect, float* T){
+bool sphere_intersect(Ray* ray, STAGE_SPACE Sphere* sphere, SphereIntersect* result){
+    return sphere_intersect_at(ray, sphere->position, sphere->radius, result);
+}
+
+// barycentric gets the weights (u, v) of the second and third vertex at the hit
+bool triangle_intersect(Ray* ray, SCENE_SPACE Triangle* const_triangle, SCENE_SPACE float3* vertices, float2* barycentric, float* T){
     // Copy to local/generic memory for faster operations
     Triangle triangle = *const_triangle;
 
@@ -189,25 +265,61 @@ bool triangle_intersect(Ray* ray, __constant Triangle* const_triangle, __constan
     }
 
     *T = t;
-    *intersect = ray->origin + ray->direction * t;
+    *barycentric = (float2)(u, v);
 
     return true;
 }
 
+// Inverse of _world_encodeNormal in World.h
+float3 decode_normal(uint packed){
+    float3 normal = (float3)((short)(packed & 0xFFFF) / 32767.0f, (short)(packed >> 16) / 32767.0f, 0.0f);
+    normal.z = 1.0f - fabs(normal.x) - fabs(normal.y);
+    float fold = max(-normal.z, 0.0f);
+    normal.x += normal.x >= 0.0f ? -fold : fold;
+    normal.y += normal.y >= 0.0f ? -fold : fold;
+    return normalize(normal);
+}
+
+// Vertex normals interpolated at the hit, or the face normal if a vertex has none
+float3 triangle_normal(WorldPack* pack, SCENE_SPACE Triangle* triangle, float2 barycentric){
+    uint n0 = pack->normals[triangle->vertices.x];
+    uint n1 = pack->normals[triangle->vertices.y];
+    uint n2 = pack->normals[triangle->vertices.z];
+    if(n0 == NORMAL_NONE || n1 == NORMAL_NONE || n2 == NORMAL_NONE){
+        float3 v0 = pack->vertices[triangle->vertices.x];
+        return normalize(cross(pack->vertices[triangle->vertices.y] - v0, pack->vertices[triangle->vertices.z] - v0));
+    }
+    return normalize((1.0f - barycentric.x - barycentric.y) * decode_normal(n0) + barycentric.x * decode_normal(n1) + barycentric.y * decode_normal(n2));
+}
+
 int getCellBoundaryOffset(float a){
     return a < 0.0f ? 0 : 1;
 }
 
+/**
+    Level of detail of a model for a ray. Rays that start inside the bounds use the level of the frame, so secondary rays leaving the surface
+    see the same triangles as the ray that hit it. Rays from elsewhere go coarser with every bounce and for shadows.
+ */
+uint model_selectLod(__constant Model* model, bool inside, uint rayType, uint bounce){
+    uint level = model->lodLevel;
+    if(!inside) level += bounce * LOD_BOUNCE_BIAS + (rayType == SHADOW_TYPE ? LOD_SHADOW_BIAS : 0);
+    return min(level, model->lodCount - 1);
+}
+
 bool model_intersect(
     WorldPack* pack,
     Ray* ray, 
     uchar modelIndex, 
+    uint level,
     float* closest_T, 
-    int* closest_I){
+    int* closest_I,
+    float2* closest_UV){
 
     float T = *closest_T;
 
     __constant Model* model = pack->models + modelIndex;
+    uint gridOffset = level == 0 ? model->triangleGridOffset : model->lodGridOffset[level - 1];
+    uint countOffset = level == 0 ? model->triangleCountOffset : model->lodCountOffset[level - 1];
 
     // Step through model grid
     float3 gridmin = {model->bounds[0].x, model->bounds[1].x, model->bounds[2].x};
@@ -253,21 +365,26 @@ bool model_intersect(
         max_step > 0
     ){
         max_step--;
+        RAY_STAT(pack, STAT_DDA_STEPS, 1);
+        HEATMAP_COUNT(pack, ddaSteps);
         unsigned int celloffset = getTriangleGridOffset(currentV);
 
-        for(int i = 0; i < pack->triangleCountGrid[model->triangleCountOffset + celloffset]; ++i){
-            unsigned int tri_i = pack->grid[model->triangleGridOffset + (celloffset * GRID_MAX_TRIANGLES_PER_CELL) + i];
-            __constant Triangle* triangle = pack->triangles + tri_i;
+        for(int i = 0; i < pack->triangleCountGrid[countOffset + celloffset]; ++i){
+            unsigned int tri_i = pack->grid[gridOffset + (celloffset * GRID_MAX_TRIANGLES_PER_CELL) + i];
+            SCENE_SPACE Triangle* triangle = pack->triangles + tri_i;
 
-            float3 intersect;
+            float2 barycentric;
             float T;
 
-            if(!triangle_intersect(ray, triangle, pack->vertices, &intersect, &T)) continue;
+            RAY_STAT(pack, STAT_TRIANGLE_TESTS, 1);
+            HEATMAP_COUNT(pack, intersectTests);
+            if(!triangle_intersect(ray, triangle, pack->vertices, &barycentric, &T)) continue;
 
             if(T < closest_triangle_T){
                 closest_triangle_T = T;
                 *closest_T = T;
                 *closest_I = tri_i;
+                *closest_UV = barycentric;
             }
 
             hasIntersect = true;
@@ -283,6 +400,8 @@ bool model_intersect(
         Tv += incr * deltaT;
         currentV += incr * step;
     }
+    // Grids are at most 3 * GRID_CELL_ROW_COUNT cells across, so running out of steps means the walk was cut short
+    RAY_STAT(pack, STAT_MAX_STEP_TRUNCATED, max_step == 0);
     return hasIntersect;
 }
 
@@ -303,6 +422,14 @@ bool bvh_plane_intersect(__constant Model* model, float* planeDotOrigin, float*
     return true;
 }
 
+// True when the point is within every slab of the model's k-DOP, give or take EPSILON for points on its surface
+bool bvh_contains(__constant Model* model, float* planeDotPoint){
+    for(uint plane_i = 0; plane_i < BVH_PLANE_COUNT; ++plane_i){
+        if(planeDotPoint[plane_i] < model->bounds[plane_i].x - EPSILON || planeDotPoint[plane_i] > model->bounds[plane_i].y + EPSILON) return false;
+    }
+    return true;
+}
+
 /**
     RAY TRACE
  */
@@ -344,12 +471,39 @@ float3 refract(float3 in, float3 normal, float fromIOR, float toIOR){
     return k < 0.0f ? (float3)(0.0f, 0.0f, 0.0f) : n * in + (n * cosI - sqrt(k)) * N;
 }
 
-float triangle_intersect_T(Ray* ray, Triangle* triangle, __constant float3* vertices){
-    float d = dot(triangle->normal, vertices[triangle->vertices[0]]);
-    float t = (dot(triangle->normal, ray->origin) + d) / dot(triangle->normal, ray->direction);
-    return t;
-}
 
+#ifdef STAGE_LOCAL_CHUNK
+/**
+    Finds the closest sphere of the primary ray of every work item of the group, copying STAGE_LOCAL_CHUNK spheres to chunk at a time.
+    The chunk loop only depends on the sphere count, so every work item reaches its barriers, including those that trace nothing (active false).
+    local_trace then takes the closest sphere of the root ray from pack instead of testing every sphere from constant memory again.
+ */
+void stage_primary_spheres(WorldPack* pack, __constant Sphere* spheres, __local Sphere* chunk, Ray ray, bool active){
+    pack->primarySphere = -1;
+    pack->primaryT = MAX_VALUE;
+    pack->primaryT2 = 0.0f;
+    for(uint first = 0; first < WORLD_NUM_SPHERES(pack->world); first += STAGE_LOCAL_CHUNK){
+        uint count = min((uint)STAGE_LOCAL_CHUNK, (uint)WORLD_NUM_SPHERES(pack->world) - first);
+        for(uint i = STAGE_LOCAL_ID; i < count; i += STAGE_LOCAL_STRIDE) chunk[i] = spheres[first + i];
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for(uint i = 0; active && i < count; ++i){
+            SphereIntersect intersect_result;
+            RAY_STAT(pack, STAT_SPHERE_TESTS, 1);
+            HEATMAP_COUNT(pack, intersectTests);
+            if(!sphere_intersect_at(&ray, chunk[i].position, chunk[i].radius, &intersect_result)) continue;
+            if(intersect_result.minT < pack->primaryT){
+                pack->primaryT = intersect_result.minT;
+                pack->primaryT2 = intersect_result.maxT;
+                pack->primarySphere = first + i;
+            }
+        }
+        // The chunk is overwritten by the next iteration
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    pack->primaryStaged = active;
+}
+#endif
 
 /**
 This function just calculates the intersections of a ray and the scene/world.
@@ -367,8 +521,17 @@ void local_trace(
     float closest_T2 = 0;
     int closest_i = -1;
     int closest_type = -1;
-    for(int i = 0; i < pack->world->numSpheres; ++i){
-        __constant Sphere* sphere = &pack->spheres[i];
+    float2 closest_UV = (float2)(0.0f, 0.0f);
+#ifdef STAGE_LOCAL_CHUNK
+    if(pack->primaryStaged && result->rayType == ROOT_TYPE){
+        closest_T = pack->primaryT;
+        closest_T2 = pack->primaryT2;
+        closest_i = pack->primarySphere;
+        closest_type = SPHERE_TYPE;
+    }else
+#endif
+    for(int i = 0; i < WORLD_NUM_SPHERES(pack->world); ++i){
+        STAGE_SPACE Sphere* sphere = &pack->spheres[i];
 
         float3 vec_raysphere = ray->origin - sphere->position;
         float dot_raysphere = dot(normalize(vec_raysphere), ray->direction);
@@ -378,6 +541,8 @@ void local_trace(
 
         // Find intersection
         SphereIntersect intersect_result;
+        RAY_STAT(pack, STAT_SPHERE_TESTS, 1);
+        HEATMAP_COUNT(pack, intersectTests);
         if(!sphere_intersect(ray, sphere, &intersect_result)) continue;
 
         // Check if closer
@@ -401,13 +566,15 @@ void local_trace(
     char closest_model = -1;
     float closest_model_T = MAX_VALUE;
     char closest_plane = -1;
-    for(int i = 0; i < pack->world->numModels; ++i){
+    for(int i = 0; i < WORLD_NUM_MODELS(pack->world); ++i){
         __constant Model* model = pack->models + i;
 
         float tnear = -MAX_VALUE;
         float tfar = MAX_VALUE;
         uint planeIndex = -1;
         
+        RAY_STAT(pack, STAT_KDOP_TESTS, 1);
+        HEATMAP_COUNT(pack, intersectTests);
         if(bvh_plane_intersect(model, planeDotRayOrigin, planeDotRayDirection, &tnear, &tfar, &planeIndex)){
             if(tnear < closest_model_T){
                 closest_model_T = tnear;
@@ -419,10 +586,13 @@ void local_trace(
 
 #ifndef SKIP_DDA
     // If model bounding volume intersect
-    if(closest_model_T < closest_T){
+    if(WORLD_HAS_MODELS && closest_model_T < closest_T){
         float model_T = closest_model_T;
         int tri_i;
-        if(model_intersect(pack, ray, closest_model, &model_T, &tri_i)){
+        // tnear can't tell a ray starting inside the bounds, as the slab test starts it at -MAX_VALUE, which wraps to 1
+        bool inside = bvh_contains(pack->models + closest_model, planeDotRayOrigin);
+        uint level = model_selectLod(pack->models + closest_model, inside, result->rayType, result->bounce);
+        if(model_intersect(pack, ray, closest_model, level, &model_T, &tri_i, &closest_UV)){
             closest_T = model_T;
             closest_T2 = closest_T;
             closest_i = tri_i;
@@ -431,12 +601,15 @@ void local_trace(
     }
 #else
     for(int i = 0; i < pack->world->numTriangles; ++i){
-        __constant Triangle* tri = pack->triangles + i; 
-        float3 tri_intersect;
+        SCENE_SPACE Triangle* tri = pack->triangles + i; 
+        float2 tri_UV;
         float tri_T;
-        if(triangle_intersect(ray, tri, pack->vertices, &tri_intersect, &tri_T)){
+        RAY_STAT(pack, STAT_TRIANGLE_TESTS, 1);
+        HEATMAP_COUNT(pack, intersectTests);
+        if(triangle_intersect(ray, tri, pack->vertices, &tri_UV, &tri_T)){
             if(tri_T < closest_T){
                 closest_T = tri_T;
+                closest_UV = tri_UV;
                 closest_T2 = closest_T;
                 closest_i = i;
                 closest_type = TRIANGLE_TYPE;
@@ -463,7 +636,7 @@ void local_trace(
         result->normal = sphere_normal(&pack->spheres[result->objectIndex], result->intersect);
         result->material = pack->spheres[result->objectIndex].material;
     }else if(result->objectType == TRIANGLE_TYPE){
-        result->normal = pack->triangles[closest_i].normal;
+        result->normal = triangle_normal(pack, pack->triangles + closest_i, closest_UV);
         result->material = pack->triangles[result->objectIndex].materialIndex;
     }
     result->cosine = fabs(dot(ray->direction, result->normal));
@@ -475,11 +648,29 @@ void trace(
     WorldPack* pack,
     Ray* ray, 
     __global TraceResult* result){
-    TraceResult localResult;
+    // Start from the stored result so the ray, bounce and ray type set by the parent survive the copy back
+    TraceResult localResult = *result;
     local_trace(input, pack, ray, &localResult);
     *result = localResult;
 }
 
+#ifdef RAY_STATS
+/**
+    Sums the private counters over the work-group and adds them to the global counters from one work item.
+    Global counters are 64-bit as (low, high) word pairs since the triangle tests of a frame can overflow 32 bits.
+ */
+void ray_stats_flush(uint* stats, __global uint* globalStats){
+    bool leader = get_local_linear_id() == 0;
+    for(int i = 0; i < RAY_STAT_COUNT; ++i){
+        uint sum = work_group_reduce_add(stats[i]);
+        if(leader && sum > 0){
+            uint old = atomic_add(&globalStats[i * 2], sum);
+            if(old + sum < old) atomic_inc(&globalStats[i * 2 + 1]); // Carry into the high word
+        }
+    }
+}
+#endif
+
 // Image resolve
 
 float3 phong(TraceResult* trace, Material* material){
@@ -5,19 +5,6 @@
 #include "func.h"
 #endif
 
-typedef struct RayTraceNode RayTraceNode;
-struct __attribute__ ((aligned(16))) RayTraceNode{
-    int reflectIndex;
-    int refractIndex;
-    int reflectChild;
-    int refractChild;
-    uint index;
-    uint visit;
-    uint type; // 0 = root; 1 = reflection; 2 = refraction; 3 = shadow;
-    uint processed;
-    int pad1;
-};
-
 float3 skybox_cubemap(__constant ImageConfig* config, SKYBOX skybox_data, float3 dir){
 
     const int skybox_img_size = config->skyboxSize.x * config->skyboxSize.y * 3;
@@ -110,122 +97,155 @@ float3 skybox_cubemap(__constant ImageConfig* config, SKYBOX skybox_data, float3
     return col;
 }
 
-int pushStack(RayTraceNode* stack, int* stackHead, uint index, uint type){
-    int readhead = *stackHead;
-    if(readhead >= MAX_RESULT_TREE_STACK) return 0;
-    RayTraceNode* next = stack + readhead;
-    next->reflectIndex = -1;
-    next->refractIndex = -1;
-    next->reflectChild = 0;
-    next->refractChild = 0;
-    next->index = index;
-    next->visit = 0;
-    next->type = type;
-    next->processed = false;
-    (*stackHead)++;
-    return readhead;
-}
-
-__kernel void ResolveImage(__write_only image2d_t image, __constant RayConfig* config, __constant ImageConfig* imageConfig, __global TraceResult* results, SKYBOX skybox, __constant Material* materials){
-    // These are the global IDs for the current instance of the kernel
-    int idx = get_global_id(0);
-    int idy = get_global_id(1);
-    
-    int numRays = rar_getNumRays(config->bounces);
-    int baseIndex = (idx + idy * config->width) * numRays;
-    __global TraceResult* baseResult = results + baseIndex;
+#ifdef HEATMAP
+// Fixed heatmap colour ramp from no work to heatmapScale
+#define HEATMAP_STOP_COUNT (6)
+__constant float3 heatmap_stops[HEATMAP_STOP_COUNT] = {
+    {0.0f, 0.0f, 0.0f},
+    {0.0f, 0.0f, 1.0f},
+    {0.0f, 1.0f, 1.0f},
+    {0.0f, 1.0f, 0.0f},
+    {1.0f, 1.0f, 0.0f},
+    {1.0f, 0.0f, 0.0f},
+};
 
-    float3 final = (float3)(0.0f, 0.0f, 0.0f);
+float3 heatmap_ramp(float t){
+    if(t > 1.0f) return (float3)(1.0f, 1.0f, 1.0f); // Above the scale
+    float x = max(t, 0.0f) * (HEATMAP_STOP_COUNT - 1);
+    int i = min((int)x, HEATMAP_STOP_COUNT - 2);
+    return mix(heatmap_stops[i], heatmap_stops[i + 1], x - i);
+}
 
-    if(!baseResult->hasIntersect){
-        final = skybox_cubemap(imageConfig, skybox, baseResult->ray.direction);
-    }else{
-        // Stack for ray bounce processing
-        RayTraceNode treeStack[MAX_RESULT_TREE_STACK];
-        float3 outputStack[MAX_RESULT_TREE_STACK];
-        int stackHead = 0;
-        int iterHead = 0;
-
-        // Copy results to local memory
-        __private TraceResult localResults[MAX_RESULT_TREE_STACK];
-        for(int i = 0; i < numRays; ++i){
-            localResults[i] = baseResult[i];
-        }
-        
-        // Add ray 
-        pushStack(treeStack, &stackHead, 0, 0);
-
-        // Adding all rays to stack
-        while(iterHead <= stackHead){
-            /**
-            Conditions:
-            Visit 1: Add reflect node
-            Visit 2: Add refract node
-            Visit 4: Process current node
-            */
-
-            RayTraceNode* currentNode = treeStack + iterHead;
-
-            uint reflectChildIndex = rar_getReflectChild(currentNode->index);
-            if(localResults[reflectChildIndex].hasTraced){ // Reflect child node
-                // Add reflect trace to stack
-                currentNode->reflectChild = reflectChildIndex;
-                currentNode->reflectIndex = pushStack(treeStack, &stackHead, reflectChildIndex, REFLECT_TYPE);
-            }
-            uint refractChildIndex = rar_getRefractChild(currentNode->index);
-            if(localResults[refractChildIndex].hasTraced){
-                // Add refract trace to stack
-                currentNode->refractChild = refractChildIndex;
-                currentNode->refractIndex = pushStack(treeStack, &stackHead, refractChildIndex, REFRACT_TYPE);
-            }
-            
-            iterHead++;
-        }
+/**
+    Colours a pixel by the intersection tests or DDA steps of its whole ray tree.
+    The largest cost of the frame goes to heatmapMax, and a legend of the ramp is drawn in the bottom left corner.
+ */
+float3 resolve_heatmap(__constant ImageConfig* imageConfig, __global TraceResult* baseResult, __global uint* heatmapMax, int idx, int idy){
+    uint cost = imageConfig->debugMode == DEBUG_MODE_TESTS ? baseResult->intersectTests : baseResult->ddaSteps;
+    atomic_max(heatmapMax, cost);
 
-        // Iterate through stack (popping, so iterating through the array backwards)
-        while(stackHead >= 0){
-            RayTraceNode* currentNode = treeStack + stackHead;
+    if(idx < HEATMAP_LEGEND_WIDTH && idy < HEATMAP_LEGEND_HEIGHT){
+        return heatmap_ramp(idx / (float)(HEATMAP_LEGEND_WIDTH - 1));
+    }
+    return heatmap_ramp(cost / imageConfig->heatmapScale);
+}
+#endif
 
-            TraceResult* result = localResults + currentNode->index;
-            if(result->hasIntersect){
-                Material objectMaterial = materials[result->material];
-                float kr = fresnel(result->ray.direction, result->normal, AIR_REFRACTIVE_INDEX, objectMaterial.refractiveIndex);
+/**
+    Colour of one node of the ray tree once its refract and reflect children are resolved. children has a bit per ray type
+    for the children that were traced, whose colours are in refraction and reflection.
+ */
+float3 resolve_node(__constant ImageConfig* imageConfig, __global TraceResult* baseResult, SKYBOX skybox, STAGE_SPACE Material* materials, uint numRays,
+    uint index, uint children, float3 refraction, float3 reflection){
+    TraceResult result = baseResult[index];
+    if(!result.hasIntersect){
+        return skybox_cubemap(imageConfig, skybox, result.ray.direction);
+    }
 
-                float daylight_cosine = 1.0f - max(dot(result->normal, daylight_direction), 0.0f) * DAYLIGHT_COSINE_STRENGTH;
-                uint shadowChildIndex = rar_getShadowChild(currentNode->index);
-                TraceResult* shadowResult = localResults + shadowChildIndex;
+    Material objectMaterial = materials[result.material];
+    float kr = fresnel(result.ray.direction, result.normal, AIR_REFRACTIVE_INDEX, objectMaterial.refractiveIndex);
 
-                // Calculate emission
-                float3 transmission = phong(result, &objectMaterial);
-                if(currentNode->refractIndex > -1) transmission = mix(outputStack[currentNode->refractChild], transmission, objectMaterial.opacity);
+    // Calculate emission
+    float3 transmission = phong(&result, &objectMaterial);
+    if(children & (1 << REFRACT_TYPE)) transmission = mix(refraction, transmission, objectMaterial.opacity);
 
-                // Calculate reflection
-                float3 reflection = transmission;
-                if(currentNode->reflectIndex > -1) reflection = outputStack[currentNode->reflectChild];
+    // Calculate reflection
+    if(!(children & (1 << REFLECT_TYPE))) reflection = transmission;
 
-                // Transform kr based on opacity
-                kr = mix(kr, 1.0f - kr, objectMaterial.opacity);
+    // Transform kr based on opacity
+    kr = mix(kr, 1.0f - kr, objectMaterial.opacity);
 
-                float3 out = transmission * (1.0f - kr) + reflection * kr;
+    float3 out = transmission * (1.0f - kr) + reflection * kr;
 
-                // Calculate shadows
-                if(shadowResult->hasTraced && shadowResult->hasIntersect){
-                    out *= 1.0f - (DAYLIGHT_SHADOW_STRENGTH * (1.0f - shadowResult->shadowSoftness) * materials[shadowResult->material].opacity);
-                }
+    // Calculate shadows
+    uint shadowIndex = rar_getShadowChild(index);
+    if(shadowIndex < numRays){
+        __global TraceResult* shadowResult = baseResult + shadowIndex;
+        if(shadowResult->hasTraced && shadowResult->hasIntersect){
+            out *= 1.0f - (DAYLIGHT_SHADOW_STRENGTH * (1.0f - shadowResult->shadowSoftness) * materials[shadowResult->material].opacity);
+        }
+    }
+    return out;
+}
 
-                outputStack[currentNode->index] = out;
-            }else{
-                float3 sky = skybox_cubemap(imageConfig, skybox, result->ray.direction);
-                outputStack[currentNode->index] = sky;
+/**
+    Resolves the ray tree of a pixel bottom-up without copying it. The tree is walked depth first using the implicit child indices and
+    a node is composed as soon as its refract and reflect children are, so the only state is one entry per level.
+    Results are read from global memory when they are used and untraced children are never visited.
+ */
+float3 resolve_tree(__constant ImageConfig* imageConfig, __global TraceResult* baseResult, SKYBOX skybox, STAGE_SPACE Material* materials, uint numRays){
+    uint nodes[MAX_RESOLVE_DEPTH];
+    uint stages[MAX_RESOLVE_DEPTH]; // 0 visits the refract child, 1 the reflect child, 2 composes the node
+    uint children[MAX_RESOLVE_DEPTH];
+    float3 refractions[MAX_RESOLVE_DEPTH];
+    float3 reflections[MAX_RESOLVE_DEPTH];
+
+    int depth = 0;
+    nodes[0] = 0;
+    stages[0] = 0;
+    children[0] = 0;
+
+    while(true){
+        uint index = nodes[depth];
+        uint stage = stages[depth]++;
+
+        // Rays that missed have no children
+        if(stage == 0 && !baseResult[index].hasIntersect) stage = stages[depth] = 2;
+
+        if(stage < 2){
+            uint child = stage == 0 ? rar_getRefractChild(index) : rar_getReflectChild(index);
+            // Children past MAX_RESOLVE_DEPTH are dropped, RARTrace counts them as STAT_RESOLVE_TRUNCATED
+            if(depth + 1 < MAX_RESOLVE_DEPTH && child < numRays && baseResult[child].hasTraced){
+                ++depth;
+                nodes[depth] = child;
+                stages[depth] = 0;
+                children[depth] = 0;
             }
+            continue;
+        }
 
-            stackHead--;
+        float3 out = resolve_node(imageConfig, baseResult, skybox, materials, numRays, index, children[depth], refractions[depth], reflections[depth]);
+        if(depth == 0) return out;
+
+        // The parent has moved past the child that was just resolved
+        --depth;
+        if(stages[depth] == 1){
+            refractions[depth] = out;
+            children[depth] |= 1 << REFRACT_TYPE;
+        }else{
+            reflections[depth] = out;
+            children[depth] |= 1 << REFLECT_TYPE;
         }
+    }
+}
 
-        final = outputStack[0];
+__kernel void ResolveImage(__write_only image2d_t image, __constant RayConfig* config, __constant ImageConfig* imageConfig, __global TraceResult* results, SKYBOX skybox, __constant Material* materials, __global uint* heatmapMax){
+    STAGE_MATERIALS(materials);
+
+    // Screen coordinates of the pixel of this instance of the kernel
+    int2 pixel = rar_getPixel();
+    int idx = pixel.x;
+    int idy = pixel.y;
+    // Work items in the padding of the Morton blocks on the edges of the image
+    if(idx >= imageConfig->res.x || idy >= imageConfig->res.y) return;
+    
+    int numRays = rar_getNumRays(CONFIG_BOUNCES(config));
+    int baseIndex = rar_getTilePixel() * numRays;
+    __global TraceResult* baseResult = results + baseIndex;
+
+    float3 final = (float3)(0.0f, 0.0f, 0.0f);
+
+#ifdef HEATMAP
+    if(imageConfig->debugMode != DEBUG_MODE_SHADED){
+        final = resolve_heatmap(imageConfig, baseResult, heatmapMax, idx, idy);
+    }else{
+        final = resolve_tree(imageConfig, baseResult, skybox, STAGED_MATERIALS(materials), numRays);
     }
+#else
+    final = resolve_tree(imageConfig, baseResult, skybox, STAGED_MATERIALS(materials), numRays);
+#endif
 
-    if(debug_isCenterPixel()){
+    if(debug_isCenterPixel(idx, idy) && imageConfig->debugMode == DEBUG_MODE_SHADED){
         final = (float3)(1.0f, 0.0f, 0.0f);
     }
 
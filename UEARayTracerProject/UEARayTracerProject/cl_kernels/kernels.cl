@@ -6,5 +6,6 @@
 #include "resetkernel.cl"
 #include "teststructs.cl"
 #include "clearimage.cl"
+#include "microbench.cl"
 
 #endif
\ No newline at end of file
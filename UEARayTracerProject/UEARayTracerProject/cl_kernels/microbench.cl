@@ -0,0 +1,115 @@
+#ifndef INCLUDES
+#define INCLUDES
+#include "defines.h"
+#include "structs.h"
+#include "func.h"
+#endif
+
+// Refractive index of the "refractive" benchmark material
+#define MICROBENCH_IOR (1.517f)
+// Must match the define in Microbench.h
+#define MICROBENCH_PRIMITIVES (64)
+
+/**
+    Isolated intersection primitives for the --microbench mode.
+    Every work item tests one ray against count primitives and writes its hit count so the tests can't be optimised away.
+ */
+
+__kernel void BenchSphere(__global const Ray* rays, __constant Sphere* spheres, uint count, __global uint* hits){
+    // sphere_intersect reads the spheres from where the trace keeps them, so STAGE_LOCAL builds stage the synthetic ones too
+    STAGE_ARRAY(Sphere, stagedBench, spheres, MICROBENCH_PRIMITIVES);
+    int id = get_global_id(0);
+    Ray ray = rays[id];
+    uint hit = 0;
+    for(uint i = 0; i < count; ++i){
+        SphereIntersect result;
+        hit += sphere_intersect(&ray, STAGED(stagedBench, spheres) + i, &result);
+    }
+    hits[id] = hit;
+}
+
+__kernel void BenchTriangle(__global const Ray* rays, SCENE_SPACE Triangle* triangles, SCENE_SPACE float3* vertices, uint count, __global uint* hits){
+    int id = get_global_id(0);
+    Ray ray = rays[id];
+    uint hit = 0;
+    for(uint i = 0; i < count; ++i){
+        float2 barycentric;
+        float T;
+        hit += triangle_intersect(&ray, triangles + i, vertices, &barycentric, &T);
+    }
+    hits[id] = hit;
+}
+
+__kernel void BenchPlanes(__global const Ray* rays, __constant Model* models, uint count, __global uint* hits){
+    int id = get_global_id(0);
+    Ray ray = rays[id];
+
+    // Same per-ray setup as local_trace
+    float planeDotRayOrigin[BVH_PLANE_COUNT];
+    float planeDotRayDirection[BVH_PLANE_COUNT];
+    for(int plane_i = 0; plane_i < BVH_PLANE_COUNT; ++plane_i){
+        planeDotRayOrigin[plane_i] = dot(ray.origin, BVH_PlaneNormals[plane_i]);
+        planeDotRayDirection[plane_i] = dot(ray.direction, BVH_PlaneNormals[plane_i]);
+    }
+
+    uint hit = 0;
+    for(uint i = 0; i < count; ++i){
+        float tnear = -MAX_VALUE;
+        float tfar = MAX_VALUE;
+        uint planeIndex = -1;
+        hit += bvh_plane_intersect(models + i, planeDotRayOrigin, planeDotRayDirection, &tnear, &tfar, &planeIndex);
+    }
+    hits[id] = hit;
+}
+
+// Walks the grid of one model of the loaded world from where the ray enters its bounds
+__kernel void BenchModel(
+    __global const Ray* rays,
+    __constant World* world,
+    __constant Material* materials,
+    __constant Sphere* spheres,
+    __constant Model* models,
+    SCENE_SPACE uchar* scene,
+    uint modelIndex,
+    __global uint* hits){
+
+    STAGE_MATERIALS(materials);
+    STAGE_SPHERES(spheres);
+    WorldPack pack = scene_pack(world, STAGED_MATERIALS(materials), STAGED_SPHERES(spheres), models, scene);
+#ifdef RAY_STATS
+    uint stats[RAY_STAT_COUNT];
+    pack.stats = stats;
+#endif
+
+    int id = get_global_id(0);
+    Ray ray = rays[id];
+
+    float planeDotRayOrigin[BVH_PLANE_COUNT];
+    float planeDotRayDirection[BVH_PLANE_COUNT];
+    for(int plane_i = 0; plane_i < BVH_PLANE_COUNT; ++plane_i){
+        planeDotRayOrigin[plane_i] = dot(ray.origin, BVH_PlaneNormals[plane_i]);
+        planeDotRayDirection[plane_i] = dot(ray.direction, BVH_PlaneNormals[plane_i]);
+    }
+
+    float tnear = -MAX_VALUE;
+    float tfar = MAX_VALUE;
+    uint planeIndex = -1;
+    uint hit = 0;
+    if(bvh_plane_intersect(models + modelIndex, planeDotRayOrigin, planeDotRayDirection, &tnear, &tfar, &planeIndex)){
+        int tri_i;
+        float2 barycentric;
+        hit = model_intersect(&pack, &ray, modelIndex, 0, &tnear, &tri_i, &barycentric);
+    }
+    hits[id] = hit;
+}
+
+// Accumulates the reflectance of the ray direction against count normals
+__kernel void BenchFresnel(__global const Ray* rays, __constant float3* normals, uint count, __global float* reflectance){
+    int id = get_global_id(0);
+    float3 direction = rays[id].direction;
+    float sum = 0.0f;
+    for(uint i = 0; i < count; ++i){
+        sum += fresnel(direction, normals[i], AIR_REFRACTIVE_INDEX, MICROBENCH_IOR);
+    }
+    reflectance[id] = sum;
+}
@@ -10,133 +10,165 @@ __kernel void RARTrace(
     __constant RayConfig* config, 
     __constant World* world, 
     __global TraceResult* results, 
-    __constant float3* vertices, 
     __constant Material* materials,
     __constant Sphere* spheres,
-    __constant Triangle* triangles,
     __constant Model* models,
-    TRIANGLE_GRID triangleGrid,
-    TRIANGLE_GRID_COUNT triangleCountGrid
+    SCENE_SPACE uchar* scene
+#ifdef RAY_STATS
+    , __global uint* rayStats
+#endif
 ){
 
-    WorldPack pack = {world, vertices, materials, spheres, triangles, models, triangleGrid, triangleCountGrid};
-
-    // These are the global IDs for the current instance of the kernel
-    int idx = get_global_id(0);
-    int idy = get_global_id(1);
-
-    int offset = (idx + (int)(idy * config->width)) * rar_getNumRays(config->bounces);
-    __global TraceResult* baseResult = results + offset;
-    baseResult->bounce = 0;
-    baseResult->rayType = ROOT_TYPE;
-    
-    generateEyeRay(&baseResult->ray, config, idx, idy);
-
-    // Queue for processing new rays
-    int queueTail = 0;
-    int offsets[MAX_RESULT_TREE_STACK];
-    offsets[queueTail] = 0;
-
-    for(int i = 0; i <= queueTail && queueTail < MAX_RESULT_TREE_STACK - NUM_RAY_CHILDREN; ++i){
-        int rayOffset = offsets[i];
-        __global TraceResult* result = baseResult + rayOffset;
-        Ray r = result->ray;
-        trace(config, &pack, &r, result);
-
-        // If is shadow ray, cast multiple rays to find softness
-        if(result->rayType == SHADOW_TYPE){
-            Ray softShadowRay;
-            softShadowRay.origin = r.origin;
-		    float3 axis = fabs(r.direction.x) > 0.1f ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
-            float3 u = normalize(cross(axis, r.direction));
-            float3 v = cross(r.direction, u);
-            int numHit = result->hasIntersect;
-            for(int i = 0; i < NUM_SHADOW_RAYS; ++i){
-                float dist = pow(i / (NUM_SHADOW_RAYS - 1.0f), 0.5f) * SHADOW_RAY_DIST;
-                float angle = 2.0f * PI * TURN_FRACTION * i;
-                float sx = dist * cos(angle);
-                float sy = dist * sin(angle);
-                softShadowRay.direction = normalize(dist * sx * u + dist * sy * v + r.direction);
-
-                TraceResult shadowResult;
-                local_trace(config, &pack, &softShadowRay, &shadowResult);
-                if(shadowResult.hasIntersect) numHit++;
-            }
+    STAGE_MATERIALS(materials);
+    STAGE_SPHERES(spheres);
+    WorldPack pack = scene_pack(world, STAGED_MATERIALS(materials), STAGED_SPHERES(spheres), models, scene);
+#ifdef RAY_STATS
+    uint stats[RAY_STAT_COUNT];
+    for(int i = 0; i < RAY_STAT_COUNT; ++i) stats[i] = 0;
+    pack.stats = stats;
+#endif
 
-            result->shadowSoftness = 1.0f - pow((float)numHit / (float)(NUM_SHADOW_RAYS + 1), 8.0f);
-        }
+    // Screen coordinates of the pixel of this instance of the kernel
+    int2 pixel = rar_getPixel();
+    int idx = pixel.x;
+    int idy = pixel.y;
+    // Work items in the padding of the Morton blocks on the edges of the image trace nothing, but stay alive for the stats flush
+    bool inside = idx < config->width && idy < config->height;
+#ifdef STAGE_LOCAL_CHUNK
+    // Holds barriers, so every work item of the group runs it before the ray trees diverge
+    __local Sphere sphereChunk[STAGE_LOCAL_CHUNK];
+    stage_primary_spheres(&pack, spheres, sphereChunk, eyeRay(config, idx, idy), inside);
+#endif
+    if(inside){
+        int offset = rar_getTilePixel() * rar_getNumRays(CONFIG_BOUNCES(config));
+        __global TraceResult* baseResult = results + offset;
+        baseResult->bounce = 0;
+        baseResult->rayType = ROOT_TYPE;
+        
+        generateEyeRay(&baseResult->ray, config, idx, idy);
+
+        // Queue for processing new rays
+        int queueTail = 0;
+        int offsets[MAX_RESULT_TREE_STACK];
+        offsets[queueTail] = 0;
+
+        for(int i = 0; i <= queueTail && queueTail < MAX_RESULT_TREE_STACK - NUM_RAY_CHILDREN; ++i){
+            int rayOffset = offsets[i];
+            __global TraceResult* result = baseResult + rayOffset;
+            Ray r = result->ray;
+            trace(config, &pack, &r, result);
+            RAY_STAT(&pack, STAT_ROOT_RAYS + result->rayType, 1);
+            // Reflect and refract rays deeper than the image resolver walks are traced but never shown
+            RAY_STAT(&pack, STAT_RESOLVE_TRUNCATED, result->rayType != SHADOW_TYPE && result->bounce >= MAX_RESOLVE_DEPTH);
+
+            // If is shadow ray, cast multiple rays to find softness
+            if(result->rayType == SHADOW_TYPE){
+                Ray softShadowRay;
+                softShadowRay.origin = r.origin;
+    		    float3 axis = fabs(r.direction.x) > 0.1f ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
+                float3 u = normalize(cross(axis, r.direction));
+                float3 v = cross(r.direction, u);
+                int numHit = result->hasIntersect;
+                for(int i = 0; i < NUM_SHADOW_RAYS; ++i){
+                    float dist = pow(i / (NUM_SHADOW_RAYS - 1.0f), 0.5f) * SHADOW_RAY_DIST;
+                    float angle = 2.0f * PI * TURN_FRACTION * i;
+                    float sx = dist * cos(angle);
+                    float sy = dist * sin(angle);
+                    softShadowRay.direction = normalize(dist * sx * u + dist * sy * v + r.direction);
+
+                    TraceResult shadowResult;
+                    shadowResult.rayType = SHADOW_TYPE;
+                    shadowResult.bounce = result->bounce;
+                    local_trace(config, &pack, &softShadowRay, &shadowResult);
+                    RAY_STAT(&pack, STAT_SHADOW_RAYS, 1);
+                    if(shadowResult.hasIntersect) numHit++;
+                }
+
+                result->shadowSoftness = 1.0f - pow((float)numHit / (float)(NUM_SHADOW_RAYS + 1), 8.0f);
+            }
 
-        if(result->bounce >= config->bounces) continue;
+            if(result->bounce >= CONFIG_BOUNCES(config)) continue;
 
-        // If intersect, add more rays
-        if(result->hasIntersect && result->rayType != SHADOW_TYPE){
+            // If intersect, add more rays
+            if(result->hasIntersect && result->rayType != SHADOW_TYPE){
 
-            TraceResult localResult = *result;
-            __constant Material* material = materials + localResult.material;
+                TraceResult localResult = *result;
+                STAGE_SPACE Material* material = pack.materials + localResult.material;
 
-            // Add reflective ray
-            if(material->reflectivity > EPSILON){
-                // Queue reflection ray
-                queueTail++;
-                offsets[queueTail] = rar_getReflectChild(rayOffset);
-                // Create ray
-                baseResult[offsets[queueTail]].ray.origin = localResult.intersect;
-                getReflectDirection(&baseResult[offsets[queueTail]].ray.direction, r.direction, localResult.normal);
-                baseResult[offsets[queueTail]].bounce = localResult.bounce + 1;
-                baseResult[offsets[queueTail]].rayType = REFLECT_TYPE;
-            }
-            
-            // Add refractive ray
-            if(material->opacity < 1.0f - EPSILON){
-                if(localResult.objectType == SPHERE_TYPE){ // Only trace exit ray if not triangle
-                    __constant Sphere* sphere = spheres + localResult.objectIndex;
-                    // Calculate internal ray direction
-                    float3 internal_direction;
-                    local_getRefractDirection(&internal_direction, r.direction, localResult.normal, AIR_REFRACTIVE_INDEX, material->refractiveIndex);
-                    // Calculate exit ray origin
-                    /**
-                        This calculates the angle between the internal ray direction and the normal of the sphere.
-                        Used to find the distance from the internal ray origin (original intersection point) to the exit ray origin.
-                        Together with the internal ray direction, the exit ray origin can be calculated.
-                    */
-                    float internal_theta = fabs(dot(internal_direction, localResult.normal));
-                    float internal_length = sin(internal_theta * HPI) * sphere->radius * 2.0f;
-                    
-                    // Get child ray
+                // Add reflective ray
+                if(REFLECT_SLOT != RAY_SLOT_NONE && material->reflectivity > EPSILON){
+                    // Queue reflection ray
                     queueTail++;
-                    offsets[queueTail] = rar_getRefractChild(rayOffset);
-
-                    // Set exit ray origin
-                    baseResult[offsets[queueTail]].ray.origin = localResult.intersect + internal_direction * internal_length;
-                    
-                    // Calculate exit ray direction
-                    float3 exit_normal = normalize(baseResult[offsets[queueTail]].ray.origin - sphere->position);
-                    getRefractDirection(&baseResult[offsets[queueTail]].ray.direction, internal_direction, -exit_normal, material->refractiveIndex, AIR_REFRACTIVE_INDEX);
+                    offsets[queueTail] = rar_getReflectChild(rayOffset);
+                    // Create ray
+                    baseResult[offsets[queueTail]].ray.origin = localResult.intersect;
+                    getReflectDirection(&baseResult[offsets[queueTail]].ray.direction, r.direction, localResult.normal);
                     baseResult[offsets[queueTail]].bounce = localResult.bounce + 1;
-                    baseResult[offsets[queueTail]].rayType = REFRACT_TYPE;
-                }else{
+                    baseResult[offsets[queueTail]].rayType = REFLECT_TYPE;
+                }
+                
+                // Add refractive ray
+                if(REFRACT_SLOT != RAY_SLOT_NONE && material->opacity < 1.0f - EPSILON){
+                    if(WORLD_HAS_SPHERES && localResult.objectType == SPHERE_TYPE){ // Only trace exit ray if not triangle
+                        STAGE_SPACE Sphere* sphere = pack.spheres + localResult.objectIndex;
+                        // Calculate internal ray direction
+                        float3 internal_direction;
+                        local_getRefractDirection(&internal_direction, r.direction, localResult.normal, AIR_REFRACTIVE_INDEX, material->refractiveIndex);
+                        // Calculate exit ray origin
+                        /**
+                            This calculates the angle between the internal ray direction and the normal of the sphere.
+                            Used to find the distance from the internal ray origin (original intersection point) to the exit ray origin.
+                            Together with the internal ray direction, the exit ray origin can be calculated.
+                        */
+                        float internal_theta = fabs(dot(internal_direction, localResult.normal));
+                        float internal_length = sin(internal_theta * HPI) * sphere->radius * 2.0f;
+                        
+                        // Get child ray
+                        queueTail++;
+                        offsets[queueTail] = rar_getRefractChild(rayOffset);
+
+                        // Set exit ray origin
+                        baseResult[offsets[queueTail]].ray.origin = localResult.intersect + internal_direction * internal_length;
+                        
+                        // Calculate exit ray direction
+                        float3 exit_normal = normalize(baseResult[offsets[queueTail]].ray.origin - sphere->position);
+                        getRefractDirection(&baseResult[offsets[queueTail]].ray.direction, internal_direction, -exit_normal, material->refractiveIndex, AIR_REFRACTIVE_INDEX);
+                        baseResult[offsets[queueTail]].bounce = localResult.bounce + 1;
+                        baseResult[offsets[queueTail]].rayType = REFRACT_TYPE;
+                    }else{
+                        queueTail++;
+                        offsets[queueTail] = rar_getRefractChild(rayOffset);
+                        baseResult[offsets[queueTail]].ray.origin = localResult.intersect; // Slightly refract the ray on infinitely small thickness
+                        float3 refractNormal = -localResult.normal;
+                        if(dot(r.direction, refractNormal) > 0) refractNormal = -refractNormal;
+                        getRefractDirection(&baseResult[offsets[queueTail]].ray.direction, r.direction, refractNormal, 1.0f, material->refractiveIndex);
+                        baseResult[offsets[queueTail]].bounce = localResult.bounce + 1;
+                        baseResult[offsets[queueTail]].rayType = REFRACT_TYPE;
+                    }
+                }
+
+                // Add shadow ray
+                if(SHADOW_SLOT != RAY_SLOT_NONE && material->opacity > EPSILON){
+                    // Queue the ray
                     queueTail++;
-                    offsets[queueTail] = rar_getRefractChild(rayOffset);
-                    baseResult[offsets[queueTail]].ray.origin = localResult.intersect; // Slightly refract the ray on infinitely small thickness
-                    float3 refractNormal = -localResult.normal;
-                    if(dot(r.direction, refractNormal) > 0) refractNormal = -refractNormal;
-                    getRefractDirection(&baseResult[offsets[queueTail]].ray.direction, r.direction, refractNormal, 1.0f, material->refractiveIndex);
+                    offsets[queueTail] = rar_getShadowChild(rayOffset);
+                    // Create shadow ray
+                    baseResult[offsets[queueTail]].ray.origin = localResult.intersect;
+                    baseResult[offsets[queueTail]].ray.direction = -daylight_direction; // Shadow ray should be cast towards light source
                     baseResult[offsets[queueTail]].bounce = localResult.bounce + 1;
-                    baseResult[offsets[queueTail]].rayType = REFRACT_TYPE;
+                    baseResult[offsets[queueTail]].rayType = SHADOW_TYPE;
                 }
             }
-
-            // Add shadow ray
-            if(material->opacity > EPSILON){
-                // Queue the ray
-                queueTail++;
-                offsets[queueTail] = rar_getShadowChild(rayOffset);
-                // Create shadow ray
-                baseResult[offsets[queueTail]].ray.origin = localResult.intersect;
-                baseResult[offsets[queueTail]].ray.direction = -daylight_direction; // Shadow ray should be cast towards light source
-                baseResult[offsets[queueTail]].bounce = localResult.bounce + 1;
-                baseResult[offsets[queueTail]].rayType = SHADOW_TYPE;
-            }
         }
+
+        // Rays left in the queue once it is full are never traced
+        RAY_STAT(&pack, STAT_TREE_STACK_TRUNCATED, queueTail >= MAX_RESULT_TREE_STACK - NUM_RAY_CHILDREN);
+#ifdef HEATMAP
+        baseResult->intersectTests = pack.intersectTests;
+        baseResult->ddaSteps = pack.ddaSteps;
+#endif
     }
+#ifdef RAY_STATS
+    ray_stats_flush(stats, rayStats);
+#endif
 }
@@ -10,22 +10,24 @@ __kernel void SamplerTrace(
     __constant RayConfig* config, 
     __constant World* world, 
     __global TraceResult* results, 
-    __constant float3* vertices, 
     __constant Material* materials,
     __constant Sphere* spheres,
-    __constant Triangle* triangles,
     __constant Model* models,
-    TRIANGLE_GRID triangleGrid,
-    TRIANGLE_GRID_COUNT triangleCountGrid
+    SCENE_SPACE uchar* scene
 ){
 
-    WorldPack pack = {world, vertices, materials, spheres, triangles, models, triangleGrid, triangleCountGrid};
+    STAGE_MATERIALS(materials);
+    STAGE_SPHERES(spheres);
+    WorldPack pack = scene_pack(world, STAGED_MATERIALS(materials), STAGED_SPHERES(spheres), models, scene);
 
-    // These are the global IDs for the current instance of the kernel
-    int idx = get_global_id(0);
-    int idy = get_global_id(1);
+    // Screen coordinates of the pixel of this instance of the kernel
+    int2 pixel = rar_getPixel();
+    int idx = pixel.x;
+    int idy = pixel.y;
+    // Work items in the padding of the Morton blocks on the edges of the image
+    if(idx >= config->width || idy >= config->height) return;
 
-    int offset = (idx + (int)(idy * config->width)) * rar_getNumRays(config->bounces);
+    int offset = rar_getTilePixel() * rar_getNumRays(CONFIG_BOUNCES(config));
     __global TraceResult* baseResult = results + offset;
     baseResult->bounce = 0;
     baseResult->rayType = ROOT_TYPE;
@@ -59,6 +61,8 @@ __kernel void SamplerTrace(
                 softShadowRay.direction = normalize(dist * sx * u + dist * sy * v + r.direction);
 
                 TraceResult shadowResult;
+                shadowResult.rayType = SHADOW_TYPE;
+                shadowResult.bounce = result->bounce;
                 local_trace(config, pack, &softShadowRay, &shadowResult);
                 if(shadowResult.hasIntersect) numHit++;
             }
@@ -66,16 +70,16 @@ __kernel void SamplerTrace(
             result->shadowSoftness = 1.0f - pow((float)numHit / (float)(NUM_SHADOW_RAYS + 1), 8.0f);
         }
 
-        if(result->bounce >= config->bounces) continue;
+        if(result->bounce >= CONFIG_BOUNCES(config)) continue;
 
         // If intersect, add more rays
         if(result->hasIntersect && result->rayType != SHADOW_TYPE){
 
             TraceResult localResult = *result;
-            __constant Material* material = materials + localResult.material;
+            STAGE_SPACE Material* material = pack.materials + localResult.material;
 
             // Add reflective ray
-            if(material->reflectivity > EPSILON){
+            if(REFLECT_SLOT != RAY_SLOT_NONE && material->reflectivity > EPSILON){
                 // Queue reflection ray
                 queueTail++;
                 offsets[queueTail] = rar_getReflectChild(offsets[i]);
@@ -87,9 +91,9 @@ __kernel void SamplerTrace(
             }
             
             // Add refractive ray
-            if(material->opacity < 1.0f - EPSILON){
-                if(result->objectType == SPHERE_TYPE){ // Only trace exit ray if not triangle
-                    __constant Sphere* sphere = spheres + result->objectIndex;
+            if(REFRACT_SLOT != RAY_SLOT_NONE && material->opacity < 1.0f - EPSILON){
+                if(WORLD_HAS_SPHERES && result->objectType == SPHERE_TYPE){ // Only trace exit ray if not triangle
+                    STAGE_SPACE Sphere* sphere = pack.spheres + result->objectIndex;
                     // Calculate internal ray direction
                     float3 internal_direction;
                     local_getRefractDirection(&internal_direction, r.direction, localResult.normal, AIR_REFRACTIVE_INDEX, material->refractiveIndex);
@@ -122,7 +126,7 @@ __kernel void SamplerTrace(
             }
 
             // Add shadow ray
-            if(material->opacity > EPSILON){
+            if(SHADOW_SLOT != RAY_SLOT_NONE && material->opacity > EPSILON){
                 // Queue the ray
                 queueTail++;
                 offsets[queueTail] = rar_getShadowChild(offsets[i]);
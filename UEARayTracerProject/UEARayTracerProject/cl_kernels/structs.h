@@ -40,7 +40,6 @@ typedef struct __attribute__ ((aligned(16))){
 } Sphere;
 
 typedef struct __attribute__ ((aligned(16))) {
-    float3 normal;
 	int3 vertices;
 	uint materialIndex;
 } Triangle;
@@ -48,12 +47,15 @@ typedef struct __attribute__ ((aligned(16))) {
 typedef struct __attribute__ ((aligned(16))){
     float2 bounds[8]; // Only 7 axis but the 8th is for padding (struct alignment)
     uint triangleOffset;
-    uint pad1[3];
+    uint lodCount;
+    uint lodLevel; // Picked on the host per frame from the camera distance
+    float lodDistance;
     uint numTriangles;
     uint pad2[3];
 	uint triangleGridOffset;
-    uint pad3[3];
+    uint lodGridOffset[MODEL_LOD_LEVELS - 1];
     uint triangleCountOffset;
+    uint lodCountOffset[MODEL_LOD_LEVELS - 1];
 } Model;
 
 typedef struct __attribute__ ((aligned(16))) {
@@ -82,7 +84,13 @@ struct __attribute__ ((aligned(16))) TraceResult{
     uint bounce;
 
     uint rayType;
+#ifdef HEATMAP
+    uint intersectTests; // Totals of the whole ray tree, only set on the root ray
+    uint ddaSteps;
+    uint pad1;
+#else
     uint pad1[3];
+#endif
 
     int hasIntersect;
     int hasTraced;
@@ -91,13 +99,27 @@ struct __attribute__ ((aligned(16))) TraceResult{
 
 typedef struct __attribute__ ((aligned(16))) {
     __constant World* world;
-    __constant float3* vertices;
-    __constant Material* materials;
-    __constant Sphere* spheres;
-    __constant Triangle* triangles;
+    SCENE_SPACE float3* vertices;
+    SCENE_SPACE uint* normals; // Octahedral encoded, one per vertex
+    STAGE_SPACE Material* materials;
+    STAGE_SPACE Sphere* spheres;
+    SCENE_SPACE Triangle* triangles;
     __constant Model* models;
     TRIANGLE_GRID grid;
     TRIANGLE_GRID_COUNT triangleCountGrid;
+#ifdef HEATMAP
+    uint intersectTests; // Per pixel cost for the heatmap modes
+    uint ddaSteps;
+#endif
+#ifdef STAGE_LOCAL_CHUNK
+    bool primaryStaged; // The closest sphere of the root ray was found by stage_primary_spheres
+    int primarySphere;
+    float primaryT;
+    float primaryT2;
+#endif
+#ifdef RAY_STATS
+    uint* stats; // Private counters of the work item
+#endif
 } WorldPack;
 
 typedef struct {
@@ -108,4 +130,7 @@ typedef struct {
 typedef struct __attribute__ ((aligned(16))){
     int2 skyboxSize;
     int2 res;
+    int debugMode;
+    float heatmapScale; // Cost shown at the top of the heatmap ramp
+    int pad[2];
 } ImageConfig;
\ No newline at end of file
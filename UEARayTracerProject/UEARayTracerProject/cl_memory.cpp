@@ -0,0 +1,133 @@
+#include "cl_memory.h"
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+// Number of largest allocations listed by printBreakdown
+#define MEMORY_TOP_ALLOCATIONS (8)
+
+struct Allocation {
+	int category;
+	std::string name;
+	size_t size;
+	bool device;
+};
+
+cl_ulong memoryBudget = 0;
+bool memoryFailed = false;
+std::map<cl_mem, Allocation> deviceAllocations;
+std::map<std::string, Allocation> hostAllocations;
+
+std::string _memory_format(cl_ulong bytes) {
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(2);
+	if (bytes >= (1 << 20)) out << bytes / (double)(1 << 20) << " MB";
+	else if (bytes >= (1 << 10)) out << bytes / (double)(1 << 10) << " KB";
+	else out << bytes << " B";
+	return out.str();
+}
+
+namespace cl {
+	namespace memory {
+
+		void setBudget(cl_ulong bytes) {
+			memoryBudget = bytes;
+		}
+
+		cl_ulong getBudget() {
+			return memoryBudget > 0 ? memoryBudget : device_info.global_mem_size;
+		}
+
+		bool canAllocate(const std::string& name, size_t size) {
+			if (size > device_info.max_mem_alloc) {
+				std::cout << "Error: " << name << " needs " << _memory_format(size) << " which exceeds CL_DEVICE_MAX_MEM_ALLOC_SIZE (" << _memory_format(device_info.max_mem_alloc) << ")." << std::endl;
+				memoryFailed = true;
+				return false;
+			}
+			const cl_ulong budget = getBudget();
+			if (budget > 0 && getDeviceTotal() + size > budget) {
+				std::cout << "Error: " << name << " needs " << _memory_format(size) << " but only " << _memory_format(budget - std::min(budget, getDeviceTotal()))
+					<< " of the " << _memory_format(budget) << " device memory budget is left." << std::endl;
+				memoryFailed = true;
+				return false;
+			}
+			return true;
+		}
+
+		cl_mem createBuffer(int category, const std::string& name, cl_mem_flags flags, size_t size, void* host, cl_int* err) {
+			if (!canAllocate(name, size)) {
+				*err = CL_INVALID_BUFFER_SIZE;
+				return NULL;
+			}
+			cl_mem mem = clCreateBuffer(context, flags, size, host, err);
+			if (*err != CL_SUCCESS) {
+				memoryFailed = true;
+				return NULL;
+			}
+			track(category, name, mem, size);
+			return mem;
+		}
+
+		void track(int category, const std::string& name, cl_mem mem, size_t size) {
+			if (mem == NULL) return;
+			deviceAllocations[mem] = { category, name, size, true };
+		}
+
+		void release(cl_mem mem) {
+			if (mem == NULL) return;
+			deviceAllocations.erase(mem);
+			clReleaseMemObject(mem);
+		}
+
+		void trackHost(int category, const std::string& name, size_t size) {
+			if (size == 0) hostAllocations.erase(name);
+			else hostAllocations[name] = { category, name, size, false };
+		}
+
+		cl_ulong getDeviceTotal() {
+			cl_ulong total = 0;
+			for (auto& it : deviceAllocations) total += it.second.size;
+			return total;
+		}
+
+		bool hasFailed() {
+			return memoryFailed;
+		}
+
+		void printBreakdown() {
+			const char* categoryNames[] = MEMORY_CATEGORY_NAMES;
+			cl_ulong device[MEMORY_CATEGORY_COUNT] = {}, host[MEMORY_CATEGORY_COUNT] = {};
+			std::vector<Allocation> all;
+			for (auto& it : deviceAllocations) {
+				device[it.second.category] += it.second.size;
+				all.push_back(it.second);
+			}
+			for (auto& it : hostAllocations) {
+				host[it.second.category] += it.second.size;
+				all.push_back(it.second);
+			}
+
+			std::cout << "Memory usage";
+			if (getBudget() > 0) std::cout << " (device budget " << _memory_format(getBudget()) << ")";
+			std::cout << ":" << std::endl;
+			std::cout << std::left << std::setw(16) << "Category" << std::right << std::setw(14) << "device" << std::setw(14) << "host" << std::endl;
+			cl_ulong deviceTotal = 0, hostTotal = 0;
+			for (int c = 0; c < MEMORY_CATEGORY_COUNT; ++c) {
+				if (device[c] == 0 && host[c] == 0) continue;
+				std::cout << std::left << std::setw(16) << categoryNames[c] << std::right << std::setw(14) << _memory_format(device[c]) << std::setw(14) << _memory_format(host[c]) << std::endl;
+				deviceTotal += device[c];
+				hostTotal += host[c];
+			}
+			std::cout << std::left << std::setw(16) << "total" << std::right << std::setw(14) << _memory_format(deviceTotal) << std::setw(14) << _memory_format(hostTotal) << std::endl;
+
+			std::sort(all.begin(), all.end(), [](const Allocation& a, const Allocation& b) { return a.size > b.size; });
+			if (all.size() > MEMORY_TOP_ALLOCATIONS) all.resize(MEMORY_TOP_ALLOCATIONS);
+			std::cout << "Largest allocations:" << std::endl;
+			for (const Allocation& a : all) {
+				std::cout << "\t" << std::left << std::setw(36) << a.name << std::setw(8) << (a.device ? "device" : "host") << std::right << std::setw(14) << _memory_format(a.size) << std::endl;
+			}
+		}
+	}
+}
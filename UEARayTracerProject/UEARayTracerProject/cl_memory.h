@@ -0,0 +1,55 @@
+#pragma once
+#include "cl_helper.h"
+#include <string>
+
+// Allocation categories
+#define MEMORY_SCENE (0)
+#define MEMORY_RAYS (1)
+#define MEMORY_IMAGE (2)
+#define MEMORY_SKYBOX (3)
+#define MEMORY_CONFIG (4)
+#define MEMORY_DEBUG (5)
+#define MEMORY_CATEGORY_COUNT (6)
+#define MEMORY_CATEGORY_NAMES { "scene", "rays", "image", "skybox", "config", "debug" }
+
+namespace cl {
+	namespace memory {
+
+		/**
+			Limits the total size of the device allocations made through createBuffer.
+			0 uses CL_DEVICE_GLOBAL_MEM_SIZE. Set from memoryBudgetMB in config.ini when cl::init queries the device.
+		*/
+		void setBudget(cl_ulong bytes);
+
+		cl_ulong getBudget();
+
+		/**
+			Checks that an allocation of size bytes fits in CL_DEVICE_MAX_MEM_ALLOC_SIZE and the remaining budget.
+			Prints why it doesn't and marks the registry as failed.
+		*/
+		bool canAllocate(const std::string& name, size_t size);
+
+		/**
+			clCreateBuffer that registers the buffer under category.
+			Returns NULL and sets err to CL_INVALID_BUFFER_SIZE when the request doesn't pass canAllocate.
+		*/
+		cl_mem createBuffer(int category, const std::string& name, cl_mem_flags flags, size_t size, void* host, cl_int* err);
+
+		// Registers a memory object created elsewhere (images, GL textures) with its size in bytes
+		void track(int category, const std::string& name, cl_mem mem, size_t size);
+
+		// Unregisters and releases a memory object
+		void release(cl_mem mem);
+
+		// Records the size of a host allocation. Calling it again with the same name replaces the previous size, 0 removes it.
+		void trackHost(int category, const std::string& name, size_t size);
+
+		cl_ulong getDeviceTotal();
+
+		// True once any allocation was refused or failed
+		bool hasFailed();
+
+		// Device and host bytes per category and the largest allocations
+		void printBreakdown();
+	}
+}
@@ -0,0 +1,186 @@
+#include "cl_profiler.h"
+#include "Timeline.h"
+#include "Benchmark.h"
+#include <deque>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+
+struct PendingCommand {
+	std::string name;
+	cl_event event;
+	uint64_t hostEnqueued;
+};
+
+struct CommandHistory {
+	std::deque<cl::profiler::Sample> window;
+	size_t total = 0;
+};
+
+struct CommandStats {
+	size_t count;
+	double mean, median, p95, max;
+	double queueMean, submitMean;
+	size_t histogram[PROFILER_HISTOGRAM_BUCKETS];
+};
+
+bool profilingEnabled = false;
+std::vector<PendingCommand> pendingCommands;
+std::map<std::string, CommandHistory> commandHistories;
+
+double _profiler_ms(cl_ulong from, cl_ulong to) {
+	return to > from ? (to - from) * 1e-6 : 0.0;
+}
+
+int _profiler_bucket(double ms) {
+	double us = ms * 1000.0;
+	int bucket = 0;
+	while (bucket < PROFILER_HISTOGRAM_BUCKETS - 1 && us >= 1.0) {
+		us *= 0.5;
+		bucket++;
+	}
+	return bucket;
+}
+
+std::string _profiler_bucketLabel(int bucket) {
+	if (bucket == 0) return "<1us";
+	std::string from = std::to_string(1 << (bucket - 1));
+	if (bucket == PROFILER_HISTOGRAM_BUCKETS - 1) return ">=" + from + "us";
+	return from + "-" + std::to_string(1 << bucket) + "us";
+}
+
+CommandStats _profiler_stats(const CommandHistory& history) {
+	CommandStats stats = {};
+	stats.count = history.total;
+
+	std::vector<double> exec;
+	for (const cl::profiler::Sample& s : history.window) {
+		double ms = _profiler_ms(s.start, s.end);
+		exec.push_back(ms);
+		stats.mean += ms;
+		stats.queueMean += _profiler_ms(s.queued, s.submit);
+		stats.submitMean += _profiler_ms(s.submit, s.start);
+		stats.histogram[_profiler_bucket(ms)]++;
+	}
+	if (exec.empty()) return stats;
+
+	// Same median and nearest-rank p95 as the benchmark reports
+	const benchmark::Summary summary = benchmark::summarise(exec);
+	stats.mean /= exec.size();
+	stats.queueMean /= exec.size();
+	stats.submitMean /= exec.size();
+	stats.median = summary.median;
+	stats.p95 = summary.p95;
+	stats.max = summary.max;
+	return stats;
+}
+
+namespace cl {
+	namespace profiler {
+
+		void enable() {
+			profilingEnabled = true;
+		}
+
+		bool isEnabled() {
+			return profilingEnabled;
+		}
+
+		void record(const std::string& name, cl_event event) {
+			if (!profilingEnabled || event == NULL) return;
+			clRetainEvent(event);
+			pendingCommands.push_back({ name, event, timeline::isEnabled() ? timeline::now() : 0 });
+		}
+
+		void collect() {
+			size_t kept = 0;
+			for (size_t i = 0; i < pendingCommands.size(); ++i) {
+				PendingCommand& command = pendingCommands[i];
+
+				cl_int status = CL_COMPLETE;
+				readEventStatus(command.event, &status);
+				if (status > CL_COMPLETE) {
+					pendingCommands[kept++] = command; // Still running, try again next frame
+					continue;
+				}
+
+				// Failed commands have no timestamps
+				Sample s;
+				cl_int err = status == CL_COMPLETE ? CL_SUCCESS : status;
+				if (err == CL_SUCCESS) err = clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &s.queued, NULL);
+				if (err == CL_SUCCESS) err = clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &s.submit, NULL);
+				if (err == CL_SUCCESS) err = clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &s.start, NULL);
+				if (err == CL_SUCCESS) err = clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &s.end, NULL);
+				clReleaseEvent(command.event);
+
+				if (err != CL_SUCCESS) {
+					printErrorMsg("Profiling info of " + command.name, __LINE__, __FILE__, err);
+					continue;
+				}
+
+				if (timeline::isEnabled()) {
+					timeline::calibrateDevice(command.hostEnqueued, s.queued);
+					timeline::addDeviceSpan(command.name.c_str(), s.start, s.end);
+				}
+
+				CommandHistory& history = commandHistories[command.name];
+				history.window.push_back(s);
+				if (history.window.size() > PROFILER_WINDOW_SIZE) history.window.pop_front();
+				history.total++;
+			}
+			pendingCommands.resize(kept);
+		}
+
+		void printSummary() {
+			if (!profilingEnabled) return;
+			std::cout << "Device timings over the last " << PROFILER_WINDOW_SIZE << " commands of each name (ms):" << std::endl;
+			std::cout << std::left << std::setw(32) << "Command" << std::right << std::setw(10) << "count" << std::setw(10) << "mean" << std::setw(10) << "median"
+				<< std::setw(10) << "p95" << std::setw(10) << "max" << std::setw(10) << "queued" << std::setw(10) << "submit" << std::endl;
+
+			for (auto& it : commandHistories) {
+				CommandStats stats = _profiler_stats(it.second);
+				std::cout << std::left << std::setw(32) << it.first << std::right << std::fixed << std::setprecision(3)
+					<< std::setw(10) << stats.count << std::setw(10) << stats.mean << std::setw(10) << stats.median << std::setw(10) << stats.p95
+					<< std::setw(10) << stats.max << std::setw(10) << stats.queueMean << std::setw(10) << stats.submitMean << std::endl;
+
+				// Histogram bars scaled to the fullest bucket
+				size_t fullest = *std::max_element(stats.histogram, stats.histogram + PROFILER_HISTOGRAM_BUCKETS);
+				for (int b = 0; b < PROFILER_HISTOGRAM_BUCKETS; ++b) {
+					if (stats.histogram[b] == 0) continue;
+					std::cout << "\t" << std::left << std::setw(16) << _profiler_bucketLabel(b) << std::right << std::setw(6) << stats.histogram[b] << " "
+						<< std::string((stats.histogram[b] * 40 + fullest - 1) / fullest, '#') << std::endl;
+				}
+			}
+			std::cout.unsetf(std::ios::floatfield);
+			std::cout << std::setprecision(6);
+		}
+
+		bool writeCSV(const std::string& path) {
+			std::ofstream file(path);
+			if (!file) {
+				std::cout << "Could not open " << path << " for writing." << std::endl;
+				return false;
+			}
+
+			file << "command,count,window,mean_ms,median_ms,p95_ms,max_ms,queued_ms,submit_ms";
+			for (int b = 0; b < PROFILER_HISTOGRAM_BUCKETS; ++b) file << "," << _profiler_bucketLabel(b);
+			file << std::endl;
+
+			for (auto& it : commandHistories) {
+				CommandStats stats = _profiler_stats(it.second);
+				file << it.first << "," << stats.count << "," << it.second.window.size() << "," << stats.mean << "," << stats.median << "," << stats.p95 << ","
+					<< stats.max << "," << stats.queueMean << "," << stats.submitMean;
+				for (int b = 0; b < PROFILER_HISTOGRAM_BUCKETS; ++b) file << "," << stats.histogram[b];
+				file << std::endl;
+			}
+			std::cout << "Wrote device timings to " << path << std::endl;
+			return true;
+		}
+
+		void reset() {
+			commandHistories.clear();
+		}
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "cl_helper.h"
+#include <string>
+
+// Number of most recent commands of each name kept for the summary and histogram
+#define PROFILER_WINDOW_SIZE (1024)
+// Log2 histogram of execution time: bucket 0 is below 1us, bucket i is [2^(i-1), 2^i)us and the last bucket is open ended
+#define PROFILER_HISTOGRAM_BUCKETS (20)
+#define PROFILER_CSV_FILE ("profile.csv")
+
+namespace cl {
+	namespace profiler {
+
+		// Device timestamps of one command in nanoseconds
+		struct Sample {
+			cl_ulong queued;
+			cl_ulong submit;
+			cl_ulong start;
+			cl_ulong end;
+		};
+
+		/**
+			Enables profiling on the command queue. Must be called before cl::build creates the queue.
+			Also enabled by enableProfiling=true in config.ini.
+		*/
+		void enable();
+
+		bool isEnabled();
+
+		/**
+			Retains event and reads its QUEUED/SUBMIT/START/END timestamps once it has completed.
+			name groups commands in the summary, so use the kernel name for launches and a fixed label for transfers.
+			Does nothing when profiling is disabled or event is NULL.
+		*/
+		void record(const std::string& name, cl_event event);
+
+		// Moves every completed recorded command into its rolling window and releases it. Call once per frame.
+		void collect();
+
+		void printSummary();
+
+		// One row per command name with the window statistics and histogram bucket counts
+		bool writeCSV(const std::string& path);
+
+		void reset();
+	}
+}
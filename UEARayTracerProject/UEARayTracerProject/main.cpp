@@ -12,6 +12,8 @@
 #include <stddef.h>
 #include <chrono>
 #include <random>
+#include <functional>
+#include <unordered_map>
 #include "cl_helper.h"
 #include "TracerKernel.h"
 #include "RARKernel.h"
@@ -23,6 +25,19 @@
 #include "Model.h"
 #include "TestKernel.h"
 #include "ClearImageKernel.h"
+#include "ImageWriter.h"
+#include "CPUTracer.h"
+#include "Benchmark.h"
+#include "cl_profiler.h"
+#include "cl_memory.h"
+#include "Microbench.h"
+#include "SceneCache.h"
+#include "ProgramCache.h"
+#include "Specialisation.h"
+#include "Autotune.h"
+#include "VertexWeld.h"
+#include "Lod.h"
+#include "Timeline.h"
 
 constexpr float PI = 3.14159265359f;
 constexpr float PI2 = 3.14159265359f * 2;
@@ -30,6 +45,7 @@ constexpr float HPI = 3.14159265359f * 0.5f;
 
 #define WINDOW_WIDTH (1280)
 #define WINDOW_HEIGHT (720)
+#define WINDOW_TITLE ("UEA 3rd Year Project: Real-time Raytracing")
 #define IMAGE_WIDTH (1280)
 #define IMAGE_HEIGHT (720)
 
@@ -37,8 +53,54 @@ constexpr float HPI = 3.14159265359f * 0.5f;
 #define FRAGMENT_SHADER_PATH ("shader/fragmentshader.frag")
 #define SAMPLER_UNIFORM ("textureSampler")
 
+#define HEADLESS_FRAME_TIME (1.0 / 60.0)
+
 GLFWwindow* window;
 
+// Command line options
+bool headless = false;
+int imageWidth = IMAGE_WIDTH;
+int imageHeight = IMAGE_HEIGHT;
+int bounces = 2;
+int frameCount = 1;
+std::string sceneName = "model";
+std::string outputPrefix = "frame";
+bool useCPU = false;
+unsigned int threadCount = 0;
+bool usePackets = false;
+int gridDepth = DEFAULT_GRID_CELL_DEPTH;
+int warmupFrames = 0;
+std::string statsFile;
+std::string sweepFile;
+std::string profileFile = PROFILER_CSV_FILE;
+std::string timelineFile = TIMELINE_FILE;
+std::string kernelReportFile;
+int memoryBudgetMB = 0;
+std::string microbenchFile;
+bool sceneCache = true;
+bool programCache = true;
+bool specialise = true;
+int autotuneFrames = 0;
+bool useTuning = true;
+float weldEpsilon = NAN; // NAN keeps weldEpsilon from config.ini
+bool reorderMeshes = true;
+int lodLevels = 0; // 0 keeps lodLevels from config.ini
+float lodDistance = 0.0f;
+bool checkLod = false;
+bool rayStats = false;
+bool fullRayTree = false;
+bool stageLocal = false;
+bool mortonDispatch = false;
+int debugMode = DEBUG_MODE_SHADED;
+float heatmapScale = 0.0f;
+int tileSize = -1; // -1 keeps tileSize from config.ini
+const char* debugModeNames[] = DEBUG_MODE_NAMES;
+
+// Parameters of the "sweep" scene
+int sweepSpheres = 300;
+std::string sweepMaterial = "refractive";
+int sweepTriangles = 0;
+
 RARKernel rarkernel;
 ImageResolverKernel imagekernel;
 RayTraceKernel raytracekernel;
@@ -49,6 +111,8 @@ CLKernel* kernels[] = {
 	&rarkernel, &imagekernel, &resetkernel, &testkernel, &clearimagekernel
 };
 
+CPUTracer cputracer;
+
 World world;
 RayConfig config;
 
@@ -98,7 +162,7 @@ bool initGL() {
 	}
 
 	// Create window for OpenGL version 4.3
-	window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "UEA 3rd Year Project: Real-time Raytracing", NULL, NULL);
+	window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
 
 	// If window fails to load, terminate.
 	if (!window) {
@@ -127,13 +191,22 @@ bool initGL() {
 	return true;
 }
 
-bool buildCL() {
-	const std::vector<std::string> sources = {
+std::vector<std::string> readKernelSources() {
+	const std::vector<std::string> files = {
 		 "cl_kernels/kernels.cl"
 	};
 
+	std::vector<std::string> sources;
+	for (auto it = files.begin(); it != files.end(); ++it) {
+		sources.push_back(readFile(*it));
+	}
+	return sources;
+}
+
+bool buildCL() {
+	const std::vector<std::string> sources = readKernelSources();
 	for (auto it = sources.begin(); it != sources.end(); ++it) {
-		cl::addSource(readFile(*it));
+		cl::addSource(*it);
 	}
 
 	// Build
@@ -321,6 +394,31 @@ void setupEventHandlers() {
 			benchmark_trace.clear();
 			benchmark_image.clear();
 			break;
+		case GLFW_KEY_P:
+			if (action != GLFW_PRESS || !cl::profiler::isEnabled()) break;
+			cl::profiler::collect();
+			cl::profiler::printSummary();
+			cl::profiler::writeCSV(profileFile);
+			break;
+		case GLFW_KEY_H:
+			if (action != GLFW_PRESS || useCPU) break;
+			if (!cl::getConfigBool("heatmap")) {
+				std::cout << "Heatmaps are not built in, start with --heatmap or heatmap=true in config.ini." << std::endl;
+				break;
+			}
+			imagekernel.setDebugMode((imagekernel.getDebugMode() + 1) % DEBUG_MODE_COUNT);
+			std::cout << "Output mode: " << debugModeNames[imagekernel.getDebugMode()] << std::endl;
+			if (imagekernel.getDebugMode() == DEBUG_MODE_SHADED) glfwSetWindowTitle(window, WINDOW_TITLE);
+			break;
+		case GLFW_KEY_M:
+			if (action != GLFW_PRESS) break;
+			cl::memory::printBreakdown();
+			break;
+		case GLFW_KEY_T:
+			if (action != GLFW_PRESS || !timeline::isEnabled()) break;
+			cl::profiler::collect();
+			timeline::writeJSON(timelineFile);
+			break;
 		}
 	});
 	glfwSetMouseButtonCallback(window, [](GLFWwindow* window, int button, int action, int mods) {
@@ -430,9 +528,17 @@ void save_benchmark() {
 	std::cout << "Saving benchmark." << std::endl;
 	std::ofstream benchmark_file;
 	benchmark_file.open("benchmark.txt");
-	benchmark_file << "trace,image" << std::endl;
-	for (int i = 0; i < benchmark_trace.size(); ++i) {
-		benchmark_file << benchmark_trace[i] << "," << benchmark_image[i] << std::endl;
+	// With several tiles the last trace waits for the earlier resolves, so only the whole frame is meaningful
+	if (rarkernel.getTileCount() > 1) {
+		benchmark_file << "frame" << std::endl;
+		for (int i = 0; i < benchmark_trace.size(); ++i) {
+			benchmark_file << benchmark_trace[i] + benchmark_image[i] << std::endl;
+		}
+	} else {
+		benchmark_file << "trace,image" << std::endl;
+		for (int i = 0; i < benchmark_trace.size(); ++i) {
+			benchmark_file << benchmark_trace[i] << "," << benchmark_image[i] << std::endl;
+		}
 	}
 	benchmark_file.close();
 }
@@ -514,13 +620,10 @@ void benchmark_scene_baseline() {
 
 }
 
-void benchmark_scene_spheres(int spheres) {
+void benchmark_scene_spheres(int spheres, float reflect, float opacity, float refractiveIndex) {
 	std::default_random_engine rng;
 	std::uniform_real_distribution<float> range(0.0f, 1.0f);
 
-	float reflect = 1.0f;
-	float opacity = 0.0f;
-	float refractiveIndex = 1.517f;
 	float rad = 10.0f;
 	for (int i = 0; i < spheres; ++i) {
 		int mat = world.addMaterial({ {range(rng) * 0.4f + 0.4f, range(rng) * 0.4f + 0.4f, range(rng) * 0.4f + 0.4f}, range(rng)*1000.0f + 1.0f, reflect, opacity, refractiveIndex });
@@ -539,66 +642,718 @@ void benchmark_scene_model() {
 	std::cout << "Triangle Count: " << world.getTriangleCount() << std::endl;
 }
 
-int main(void) {
+bool getBenchmarkMaterial(const std::string& type, Material* material) {
+	// Diffuse, specular, reflectivity, opacity, refractive index
+	if (type == "solid") {
+		*material = { { 0.6f, 0.7f, 0.8f }, 100.0f, 0.0f, 1.0f, 1.0f };
+	} else if (type == "reflective") {
+		*material = { { 0.6f, 0.7f, 0.8f }, 100.0f, 1.0f, 1.0f, 1.0f };
+	} else if (type == "refractive") {
+		*material = { { 0.6f, 0.7f, 0.8f }, 100.0f, 1.0f, 0.0f, 1.517f };
+	} else {
+		return false;
+	}
+	return true;
+}
 
-	if (!initGL()) {
-		std::cout << "Failed to initialise OpenGL." << std::endl;
+/**
+	Generates a UV sphere of roughly the given number of triangles (2 * segments^2).
+	Centred 4 units in front of the camera so it is in view once scaled by 10.
+*/
+void generateSphereMesh(int triangles, std::vector<cl_float3>& positions, std::vector<unsigned int>& indices) {
+	const int segments = std::max(2, (int)round(sqrt(triangles / 2.0)));
+	for (int ring = 0; ring <= segments; ++ring) {
+		float theta = PI * ring / segments;
+		for (int segment = 0; segment < segments; ++segment) {
+			float phi = PI2 * segment / segments;
+			positions.push_back({ sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi) + 4.0f });
+		}
+	}
+	for (int ring = 0; ring < segments; ++ring) {
+		for (int segment = 0; segment < segments; ++segment) {
+			unsigned int a = ring * segments + segment;
+			unsigned int b = ring * segments + (segment + 1) % segments;
+			unsigned int c = a + segments;
+			unsigned int d = b + segments;
+			indices.insert(indices.end(), { a, b, c, b, d, c });
+		}
+	}
+}
+
+void benchmark_scene_sweep() {
+	Material material;
+	getBenchmarkMaterial(sweepMaterial, &material);
+
+	benchmark_scene_spheres(sweepSpheres, material.reflectivity, material.opacity, material.refractiveIndex);
+
+	if (sweepTriangles > 0) {
+		std::vector<cl_float3> positions;
+		std::vector<unsigned int> indices;
+		generateSphereMesh(sweepTriangles, positions, indices);
+
+		Model model;
+		model.loadFromMesh("sweep_mesh", positions, indices, &world, 10.0f, world.addMaterial(material));
+	}
+
+	std::cout << "Sweep scene: " << world.getSpheres().size() << " spheres, " << world.getTriangleCount() << " triangles, " << sweepMaterial << " material." << std::endl;
+}
+
+void printUsage() {
+	std::cout << "Usage: UEARayTracerProject [options]" << std::endl;
+	std::cout << "\t--headless\t\tRender without a window and write frames to PNG files" << std::endl;
+	std::cout << "\t--scene <name>\t\tScene to load (test, scene1, scene2, reflection, baseline, spheres, model)" << std::endl;
+	std::cout << "\t--width <pixels>\tImage width" << std::endl;
+	std::cout << "\t--height <pixels>\tImage height" << std::endl;
+	std::cout << "\t--bounces <count>\tMaximum ray bounces, at most " << MAX_BOUNCES << std::endl;
+	std::cout << "\t--frames <count>\tNumber of frames to render in headless mode" << std::endl;
+	std::cout << "\t--output <prefix>\tFilename prefix for headless frames" << std::endl;
+	std::cout << "\t--backend <cl|cpu>\tRender with the OpenCL kernels or the native CPU tracer" << std::endl;
+	std::cout << "\t--threads <count>\tCPU tracer thread count (0 uses all hardware threads)" << std::endl;
+	std::cout << "\t--packets\t\tCPU tracer traces primary rays in SIMD packets" << std::endl;
+	std::cout << "\t--grid-depth <depth>\tModel grid depth (2^depth cells per axis)" << std::endl;
+	std::cout << "\t--warmup <count>\tHeadless frames to render before timing starts" << std::endl;
+	std::cout << "\t--stats <file>\t\tWrite headless frame timings to a CSV file instead of writing PNG files" << std::endl;
+	std::cout << "\t--spheres <count>\tSphere count of the sweep scene" << std::endl;
+	std::cout << "\t--material <type>\tMaterial of the sweep scene (solid, reflective, refractive)" << std::endl;
+	std::cout << "\t--triangles <count>\tApproximate triangle count of the sweep scene mesh" << std::endl;
+	std::cout << "\t--sweep [file]\t\tRun every configuration declared in a sweep file (default " << BENCHMARK_SWEEP_FILE << ")" << std::endl;
+	std::cout << "\t--profile [file]\tRecord device timings of every OpenCL command and write a summary CSV on exit (default " << PROFILER_CSV_FILE << ", P key in windowed mode)" << std::endl;
+	std::cout << "\t--timeline [file]\tRecord host and device activity and write a Chrome trace on exit (default " << TIMELINE_FILE << ", T key in windowed mode). Enables --profile." << std::endl;
+	std::cout << "\t--full-ray-tree\t\tKeep reflect, refract and shadow slots on every ray instead of only those the scene's materials spawn, to compare memory and frame times (fullRayTree in config.ini)" << std::endl;
+	std::cout << "\t--ray-stats\t\tCount rays, intersection tests and DDA steps on the device and report them with the frame time" << std::endl;
+	std::cout << "\t--heatmap <tests|steps>\tColour pixels by the intersection tests or DDA steps of their ray tree. Builds the cost counters into the kernels, which the H key needs to cycle modes in windowed mode (heatmap in config.ini)" << std::endl;
+	std::cout << "\t--heatmap-max <value>\tCost at the top of the heatmap colour ramp (default: largest cost of the previous frame)" << std::endl;
+	std::cout << "\t--kernel-report [file]\tWrite the private/local memory use and estimated occupancy of every kernel as JSON (default " << KERNEL_REPORT_FILE << ")" << std::endl;
+	std::cout << "\t--memory-budget <MB>\tFail when the device buffers would exceed this size (default memoryBudgetMB in config.ini, or all device memory). M key prints usage in windowed mode." << std::endl;
+	std::cout << "\t--microbench [file]\tTime the intersection primitives as isolated kernels and host ports on synthetic rays and write a CSV (default " << MICROBENCH_FILE << "). Implies --headless." << std::endl;
+	std::cout << "\t--no-scene-cache\tAlways parse OBJ files and rebuild their grids instead of loading or writing " << SCENE_CACHE_EXTENSION << " files (disableSceneCache in config.ini)" << std::endl;
+	std::cout << "\t--autotune [frames]\tTime the work-group shapes of RARTrace and ResolveImage and the maths build flags on the scene, median of frames each (default " << AUTOTUNE_FRAMES << "), and write the device's " << TUNING_FILE_PREFIX << "*" << TUNING_FILE_EXTENSION << " file. Implies --headless." << std::endl;
+	std::cout << "\t--no-tuning\t\tIgnore the device's tuning file and use the driver's work-group sizes and the config.ini maths flags (disableTuning in config.ini)" << std::endl;
+	std::cout << "\t--stage-local\t\tCopy the sphere and material tables to local memory once per work-group when they fit, or else test primary rays against the spheres a local chunk at a time, instead of reading them from constant memory (stageLocal in config.ini)" << std::endl;
+	std::cout << "\t--morton-dispatch\tTrace and resolve the pixels of each tile in Z-order blocks of " << MORTON_BLOCK_SIZE << "x" << MORTON_BLOCK_SIZE << " and store their rays in that order, instead of row by row (mortonDispatch in config.ini)" << std::endl;
+	std::cout << "\t--no-specialise\tOnly use the generic kernels instead of building ones with the scene's counts and bounces baked in, in the background (disableSpecialisation in config.ini)" << std::endl;
+	std::cout << "\t--no-program-cache\tAlways build the kernels from source instead of loading or writing " << PROGRAM_CACHE_DIRECTORY << "*" << PROGRAM_CACHE_EXTENSION << " binaries (disableProgramCache in config.ini)" << std::endl;
+	std::cout << "\t--weld-epsilon <value>\tMerge OBJ vertices closer than this in world units, negative disables (default " << DEFAULT_WELD_EPSILON << ", weldEpsilon in config.ini)" << std::endl;
+	std::cout << "\t--no-reorder\t\tKeep the OBJ triangle and vertex order instead of sorting them along a Morton curve (reorderMeshes in config.ini)" << std::endl;
+	std::cout << "\t--lod-levels <count>\tSimplified levels of detail per OBJ model including the full one, 1 disables (default " << MODEL_LOD_LEVELS << ", lodLevels in config.ini)" << std::endl;
+	std::cout << "\t--lod-distance <factor>\tCamera distance at which models switch to their first simplified level, in model diagonals (default " << DEFAULT_LOD_DISTANCE << ", lodDistance in config.ini)" << std::endl;
+	std::cout << "\t--check-lod		With --backend cpu, check that reflection rays leaving a model stay on the level of detail they hit and print how many don't" << std::endl;
+	std::cout << "\t--tile-size <pixels>\tRender the frame in square tiles of this size. 0 only tiles when the rays of a frame don't fit one allocation (default, tileSize in config.ini)" << std::endl;
+}
+
+bool parseArguments(int argc, char** argv) {
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		// std::stoi and std::stof throw on a mistyped value
+		try {
+			if (arg == "--headless") {
+				headless = true;
+			} else if (arg == "--scene" && hasValue) {
+				sceneName = argv[++i];
+			} else if (arg == "--width" && hasValue) {
+				imageWidth = std::stoi(argv[++i]);
+			} else if (arg == "--height" && hasValue) {
+				imageHeight = std::stoi(argv[++i]);
+			} else if (arg == "--bounces" && hasValue) {
+				bounces = std::stoi(argv[++i]);
+			} else if (arg == "--frames" && hasValue) {
+				frameCount = std::stoi(argv[++i]);
+			} else if (arg == "--output" && hasValue) {
+				outputPrefix = argv[++i];
+			} else if (arg == "--backend" && hasValue) {
+				std::string backend = argv[++i];
+				if (backend != "cl" && backend != "cpu") {
+					std::cout << "Unknown backend: " << backend << std::endl;
+					return false;
+				}
+				useCPU = backend == "cpu";
+			} else if (arg == "--threads" && hasValue) {
+				threadCount = std::stoi(argv[++i]);
+			} else if (arg == "--packets") {
+				usePackets = true;
+			} else if (arg == "--grid-depth" && hasValue) {
+				gridDepth = std::stoi(argv[++i]);
+			} else if (arg == "--warmup" && hasValue) {
+				warmupFrames = std::stoi(argv[++i]);
+			} else if (arg == "--stats" && hasValue) {
+				statsFile = argv[++i];
+			} else if (arg == "--spheres" && hasValue) {
+				sweepSpheres = std::stoi(argv[++i]);
+			} else if (arg == "--material" && hasValue) {
+				sweepMaterial = argv[++i];
+			} else if (arg == "--triangles" && hasValue) {
+				sweepTriangles = std::stoi(argv[++i]);
+			} else if (arg == "--sweep") {
+				sweepFile = hasValue && argv[i + 1][0] != '-' ? argv[++i] : BENCHMARK_SWEEP_FILE;
+			} else if (arg == "--profile") {
+				cl::profiler::enable();
+				if (hasValue && argv[i + 1][0] != '-') profileFile = argv[++i];
+			} else if (arg == "--heatmap" && hasValue) {
+				std::string mode = argv[++i];
+				for (int m = 0; m < DEBUG_MODE_COUNT; ++m) {
+					if (mode == debugModeNames[m]) debugMode = m;
+				}
+				if (mode != debugModeNames[debugMode]) {
+					std::cout << "Unknown heatmap mode: " << mode << std::endl;
+					return false;
+				}
+			} else if (arg == "--heatmap-max" && hasValue) {
+				heatmapScale = std::stof(argv[++i]);
+			} else if (arg == "--kernel-report") {
+				kernelReportFile = hasValue && argv[i + 1][0] != '-' ? argv[++i] : KERNEL_REPORT_FILE;
+			} else if (arg == "--memory-budget" && hasValue) {
+				memoryBudgetMB = std::stoi(argv[++i]);
+			} else if (arg == "--microbench") {
+				headless = true;
+				microbenchFile = hasValue && argv[i + 1][0] != '-' ? argv[++i] : MICROBENCH_FILE;
+			} else if (arg == "--no-scene-cache") {
+				sceneCache = false;
+			} else if (arg == "--autotune") {
+				headless = true;
+				autotuneFrames = hasValue && argv[i + 1][0] != '-' ? std::stoi(argv[++i]) : AUTOTUNE_FRAMES;
+			} else if (arg == "--no-tuning") {
+				useTuning = false;
+			} else if (arg == "--stage-local") {
+				stageLocal = true;
+			} else if (arg == "--morton-dispatch") {
+				mortonDispatch = true;
+			} else if (arg == "--no-specialise") {
+				specialise = false;
+			} else if (arg == "--no-program-cache") {
+				programCache = false;
+			} else if (arg == "--weld-epsilon" && hasValue) {
+				weldEpsilon = std::stof(argv[++i]);
+			} else if (arg == "--no-reorder") {
+				reorderMeshes = false;
+			} else if (arg == "--lod-levels" && hasValue) {
+				lodLevels = std::stoi(argv[++i]);
+			} else if (arg == "--lod-distance" && hasValue) {
+				lodDistance = std::stof(argv[++i]);
+			} else if (arg == "--check-lod") {
+				checkLod = true;
+			} else if (arg == "--tile-size" && hasValue) {
+				tileSize = std::stoi(argv[++i]);
+			} else if (arg == "--full-ray-tree") {
+				fullRayTree = true;
+			} else if (arg == "--ray-stats") {
+				rayStats = true;
+			} else if (arg == "--timeline") {
+				// Device spans come from the profiling events
+				timeline::enable();
+				cl::profiler::enable();
+				if (hasValue && argv[i + 1][0] != '-') timelineFile = argv[++i];
+			} else {
+				std::cout << "Unknown or incomplete argument: " << arg << std::endl;
+				printUsage();
+				return false;
+			}
+		} catch (const std::exception&) {
+			std::cout << "Invalid value for argument: " << arg << std::endl;
+			printUsage();
+			return false;
+		}
+	}
+
+	if (imageWidth <= 0 || imageHeight <= 0 || bounces < 0 || frameCount <= 0) {
+		std::cout << "Resolution, bounces and frame count must be positive." << std::endl;
+		return false;
+	}
+
+	if (bounces > MAX_BOUNCES) {
+		std::cout << "Bounces clamped to " << MAX_BOUNCES << ", the deepest ray tree the image resolver walks." << std::endl;
+		bounces = MAX_BOUNCES;
+	}
+
+	if (warmupFrames < 0 || warmupFrames >= frameCount) {
+		std::cout << "Warm-up frames must be fewer than the frame count." << std::endl;
+		return false;
+	}
+
+	if (useCPU && !microbenchFile.empty()) {
+		std::cout << "The microbenchmarks run both backends and need OpenCL, so they can't be combined with --backend cpu." << std::endl;
+		return false;
+	}
+
+	if (useCPU && autotuneFrames > 0) {
+		std::cout << "The auto-tuner times OpenCL kernels, so it can't be combined with --backend cpu." << std::endl;
+		return false;
+	}
+
+	if (useCPU && debugMode != DEBUG_MODE_SHADED) {
+		std::cout << "Heatmap modes are only available with the OpenCL backend." << std::endl;
+		return false;
+	}
+
+	if (gridDepth < 1 || gridDepth > 8) {
+		std::cout << "Grid depth must be between 1 and 8." << std::endl;
+		return false;
+	}
+
+	Material material;
+	if (!getBenchmarkMaterial(sweepMaterial, &material)) {
+		std::cout << "Unknown material type: " << sweepMaterial << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool loadScene(const std::string& name) {
+	const std::unordered_map<std::string, std::function<void()>> scenes = {
+		{ "test", testscene },
+		{ "scene1", scene1 },
+		{ "scene2", scene2 },
+		{ "reflection", reflection_scene },
+		{ "baseline", benchmark_scene_baseline },
+		{ "spheres", []() { benchmark_scene_spheres(300, 1.0f, 0.0f, 1.517f); } },
+		{ "model", benchmark_scene_model },
+		{ "sweep", benchmark_scene_sweep },
+	};
+
+	auto scene = scenes.find(name);
+	if (scene == scenes.end()) {
+		std::cout << "Unknown scene: " << name << std::endl;
+		return false;
+	}
+	scene->second();
+	return true;
+}
+
+void animateSpheres(double time, const float* rands) {
+	for (int i = 0; i < (int)world.getSpheres().size() - 1; ++i) {
+		world.getSphere(i)->position.y = world.getSphere(i)->radius + abs(sin(time + rands[i])) * 5.0f;
+	}
+}
+
+void finishProfiling() {
+	if (cl::profiler::isEnabled() && !useCPU) {
+		clFinish(cl::queue);
+		cl::profiler::collect();
+		cl::profiler::printSummary();
+		cl::profiler::writeCSV(profileFile);
+	}
+	if (timeline::isEnabled()) timeline::writeJSON(timelineFile);
+}
+
+void printRayStats(const RayStats& stats, double frameMs) {
+	static const char* names[] = RAY_STAT_NAMES;
+	std::cout << "Frame " << frameMs << "ms";
+	for (int i = 0; i < RAY_STAT_COUNT; ++i) std::cout << ", " << stats.counters[i] << " " << names[i];
+	std::cout << std::endl;
+}
+
+void printHeatmapMax() {
+	cl_uint heatmapMax;
+	if (!imagekernel.readHeatmapMax(&heatmapMax)) return;
+	std::cout << "Heatmap max: " << heatmapMax << " " << debugModeNames[imagekernel.getDebugMode()] << " per pixel" << std::endl;
+}
+
+double getMilliseconds(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+	return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Moves the trace and resolve kernels to the scene-specialised program once its background build has finished
+void useSpecialisedKernels() {
+	cl_program program = specialisation::poll();
+	if (program == nullptr) return;
+	rarkernel.setProgram(program);
+	imagekernel.setProgram(program);
+	// The kernels keep the program alive
+	clReleaseProgram(program);
+}
+
+/**
+	Resets, traces and resolves every tile of a frame without waiting on the host. The reset of a tile only waits for the resolve
+	of the last tile that used its ray buffer (see TILE_BUFFER_COUNT).
+	Returns the resolve of the last tile and sets traceEvent to its trace. The caller releases both.
+*/
+cl_event queueFrame(cl_event* traceEvent) {
+	const cl_uint tileCount = rarkernel.getTileCount();
+	std::vector<cl_event> imageEvents(tileCount, NULL);
+	cl_event rarEvent = NULL;
+	for (cl_uint i = 0; i < tileCount; ++i) {
+		rarkernel.setTile(i);
+		cl_event* bufferFree = i >= TILE_BUFFER_COUNT ? &imageEvents[i - TILE_BUFFER_COUNT] : NULL;
+		cl_event resetEvent = resetkernel.queue(bufferFree ? 1 : 0, bufferFree);
+		if (rarEvent != NULL) clReleaseEvent(rarEvent);
+		rarEvent = rarkernel.queue(1, &resetEvent);
+		imageEvents[i] = imagekernel.queue(1, &rarEvent);
+		clReleaseEvent(resetEvent);
+	}
+	for (cl_uint i = 0; i + 1 < tileCount; ++i) clReleaseEvent(imageEvents[i]);
+	*traceEvent = rarEvent;
+	return imageEvents.back();
+}
+
+/**
+	Renders frames synchronously and records the trace, image and total time of every frame after the warm-up frames.
+	Used by the benchmark sweep, so nothing is read back or written to disk.
+*/
+void runHeadlessStats() {
+	// Every timed frame runs the same kernels
+	specialisation::wait();
+	useSpecialisedKernels();
+
+	benchmark::FrameTimes times;
+	for (int frame = 0; frame < frameCount; ++frame) {
+		timeline::Scope frameScope("Frame");
+		auto start = std::chrono::steady_clock::now();
+
+		timeline::Scope step("Upload config");
+		rarkernel.update();
+		cl_event rarEvent;
+		cl_event imageEvent = queueFrame(&rarEvent);
+		clFlush(cl::queue);
+		step.next("Wait trace");
+		clWaitForEvents(1, &rarEvent);
+		auto traced = std::chrono::steady_clock::now();
+
+		step.next("Wait resolve");
+		clWaitForEvents(1, &imageEvent);
+		auto end = std::chrono::steady_clock::now();
+		step.end();
+
+		clReleaseEvent(rarEvent);
+		clReleaseEvent(imageEvent);
+		cl::profiler::collect();
+
+		RayStats stats;
+		if (rarkernel.readRayStats(&stats)) printRayStats(stats, getMilliseconds(start, end));
+		printHeatmapMax();
+
+		if (frame < warmupFrames) continue;
+		times.frame.push_back(getMilliseconds(start, end));
+		// The trace event is the last tile's, which waits for every earlier resolve, so tiled frames only report the frame time
+		if (rarkernel.getTileCount() > 1) continue;
+		times.trace.push_back(getMilliseconds(start, traced));
+		times.image.push_back(getMilliseconds(traced, end));
+	}
+	clFinish(cl::queue);
+
+	benchmark::writeFrameTimes(statsFile, times);
+}
+
+// Tunes the trace and resolve kernels on the loaded scene and writes the tuning file of the device
+bool runAutotune() {
+	auto renderFrame = []() -> double {
+		auto start = std::chrono::steady_clock::now();
+		rarkernel.update();
+		cl_event rarEvent;
+		cl_event imageEvent = queueFrame(&rarEvent);
+		cl_int err = imageEvent != NULL ? clWaitForEvents(1, &imageEvent) : CL_INVALID_EVENT;
+		clFinish(cl::queue);
+		auto end = std::chrono::steady_clock::now();
+		if (rarEvent != NULL) clReleaseEvent(rarEvent);
+		if (imageEvent != NULL) clReleaseEvent(imageEvent);
+		return err == CL_SUCCESS ? getMilliseconds(start, end) : -1.0;
+	};
+
+	autotune::Tuning tuning;
+	if (!autotune::run(readKernelSources(), &rarkernel, &imagekernel, renderFrame, autotuneFrames, &tuning)) return false;
+	return autotune::save(tuning, sceneName);
+}
+
+/**
+	Renders a fixed number of frames without a window.
+	Each frame is read back asynchronously into one of two host buffers so the PNG for the previous frame is written while the device renders the next one.
+*/
+void runHeadless(const float* rands) {
+	const size_t frameSize = (size_t)imageWidth * imageHeight * 4;
+	std::vector<unsigned char> frames[2] = { std::vector<unsigned char>(frameSize), std::vector<unsigned char>(frameSize) };
+	cl::memory::trackHost(MEMORY_IMAGE, "Headless Frames", frameSize * 2);
+	cl_event readEvents[2] = { NULL, NULL };
+
+	auto writeFrame = [&](int frame) {
+		int slot = frame % 2;
+		timeline::Scope step("Wait read back");
+		clWaitForEvents(1, &readEvents[slot]);
+		clReleaseEvent(readEvents[slot]);
+		readEvents[slot] = NULL;
+		step.next("Write PNG");
+		std::string filename = image::getFrameFilename(outputPrefix, frame);
+		if (image::writePNG(filename, imageWidth, imageHeight, &frames[slot][0])) {
+			std::cout << "Wrote " << filename << std::endl;
+		}
+	};
+
+	auto starttime = std::chrono::steady_clock::now();
+	auto lastframe = starttime;
+	for (int frame = 0; frame < frameCount; ++frame) {
+		timeline::Scope frameScope("Frame");
+		timeline::Scope step("Animate spheres");
+		animateSpheres(frame * HEADLESS_FRAME_TIME, rands);
+		useSpecialisedKernels();
+
+		step.next("Upload config");
+		rarkernel.update();
+
+		step.next("Enqueue");
+		cl_event rarEvent;
+		cl_event imageEvent = queueFrame(&rarEvent);
+		readEvents[frame % 2] = imagekernel.readImage(&frames[frame % 2][0], 1, &imageEvent);
+		clFlush(cl::queue);
+		clReleaseEvent(rarEvent);
+		clReleaseEvent(imageEvent);
+		step.end();
+
+		// Encode the previous frame while this one renders
+		if (frame > 0) writeFrame(frame - 1);
+		cl::profiler::collect();
+
+		auto now = std::chrono::steady_clock::now();
+		RayStats stats;
+		if (rarkernel.readRayStats(&stats)) printRayStats(stats, getMilliseconds(lastframe, now));
+		printHeatmapMax();
+		lastframe = now;
+	}
+	writeFrame(frameCount - 1);
+	clFinish(cl::queue);
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+	std::cout << "Rendered " << frameCount << " frames in " << elapsed << "s (" << frameCount / elapsed << " fps)." << std::endl;
+}
+
+/**
+	Renders with the native CPU tracer instead of the OpenCL kernels.
+	Spheres are not animated as the OpenCL path never uploads the animated positions, so both backends render the same scene.
+*/
+int runCPU() {
+	const size_t frameSize = (size_t)imageWidth * imageHeight * 4;
+	std::vector<unsigned char> frame(frameSize);
+
+	cputracer.setWorldPtr(&world);
+	cputracer.setPrimaryConfig(&config);
+	cputracer.setThreadCount(threadCount);
+	cputracer.setPacketTracing(usePackets);
+	cputracer.create();
+	if (checkLod) cputracer.checkLodSelection();
+
+	if (usePackets) cputracer.benchmarkPrimaryRays();
+
+	if (headless && !statsFile.empty()) {
+		benchmark::FrameTimes times;
+		for (int i = 0; i < frameCount; ++i) {
+			cputracer.render(&frame[0]);
+			if (i >= warmupFrames) times.frame.push_back(cputracer.getLastFrameTime() * 1000.0);
+		}
+		cputracer.destroy();
+		return benchmark::writeFrameTimes(statsFile, times) ? 0 : -1;
+	}
+
+	if (headless) {
+		double totalTime = 0.0;
+		for (int i = 0; i < frameCount; ++i) {
+			timeline::Scope step("CPU render");
+			cputracer.render(&frame[0]);
+			totalTime += cputracer.getLastFrameTime();
+			std::cout << "Frame " << i << ": " << cputracer.getLastFrameTime() * 1000.0 << "ms" << std::endl;
+
+			step.next("Write PNG");
+			std::string filename = image::getFrameFilename(outputPrefix, i);
+			if (image::writePNG(filename, imageWidth, imageHeight, &frame[0])) {
+				std::cout << "Wrote " << filename << std::endl;
+			}
+		}
+		std::cout << "Rendered " << frameCount << " frames in " << totalTime << "s (" << frameCount / totalTime << " fps) on " << cputracer.getThreadCount() << " threads." << std::endl;
+		cputracer.destroy();
+		return 0;
+	}
+
+	shaderProgram = createShaderProgram();
+	if (shaderProgram == 0) {
+		std::cout << "Couldn't create shader program." << std::endl;
 		return -1;
 	}
+	GLint samplerUniformLoc = glGetUniformLocation(shaderProgram, SAMPLER_UNIFORM);
+	createRenderQuad();
+	setupEventHandlers();
 
-	if (!cl::init()) {
-		std::cout << "Failed to initialise OpenCL." << std::endl;
-		glfwTerminate();
+	double lastframetime = glfwGetTime();
+	double lastreporttime = lastframetime;
+	while (!glfwWindowShouldClose(window)) {
+		double now = glfwGetTime();
+		float deltaTime = now - lastframetime;
+		lastframetime = now;
+
+		timeline::Scope frameScope("Frame");
+		timeline::Scope step("Camera update");
+		updateCameraMovement(deltaTime);
+
+		step.next("CPU render");
+		cputracer.render(&frame[0]);
+
+		// Report frame time once a second
+		if (now - lastreporttime >= 1.0) {
+			lastreporttime = now;
+			std::cout << "CPU frame: " << cputracer.getLastFrameTime() * 1000.0 << "ms" << std::endl;
+		}
+
+		step.next("Texture upload");
+		glBindTexture(GL_TEXTURE_2D, outputTexture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, imageWidth, imageHeight, GL_RGBA, GL_UNSIGNED_BYTE, &frame[0]);
+
+		// Render
+		step.next("GL draw");
+		glUseProgram(shaderProgram);
+
+		glUniform1i(samplerUniformLoc, 0);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, outputTexture);
+
+		glBindVertexArray(vao);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+
+		step.next("Swap buffers");
+		glfwSwapBuffers(window);
+		step.next("Poll events");
+		glfwPollEvents();
+	}
+
+	cputracer.destroy();
+	return 0;
+}
+
+int main(int argc, char** argv) {
+
+	if (!parseArguments(argc, argv)) {
 		return -1;
 	}
 
-	// Load and build OpenCL kernel sources
-	if (!buildCL()) {
-		std::cout << "Could not build OpenCL program." << std::endl;
+	if (!sweepFile.empty()) {
+		return benchmark::runSweep(argv[0], sweepFile) ? 0 : -1;
+	}
+
+	// Must be set before the kernels are built and any model is loaded
+	setGridCellDepth(gridDepth);
+	timeline::setThreadName("Main");
+
+	if (!headless && !initGL()) {
+		std::cout << "Failed to initialise OpenGL." << std::endl;
+		return -1;
+	}
+
+	// The CPU backend reads config.ini too, so it is loaded before either backend starts
+	loadConfigFromFile(CONFIG_FILE, cl::config);
+
+	if (!useCPU && !cl::init(headless)) {
+		std::cout << "Failed to initialise OpenCL." << std::endl;
 		glfwTerminate();
 		return -1;
 	}
 
+	if (memoryBudgetMB > 0) cl::memory::setBudget((cl_ulong)memoryBudgetMB << 20);
+	scenecache::setEnabled(sceneCache && !cl::getConfigBool("disableSceneCache"));
+	programcache::setEnabled(programCache && !cl::getConfigBool("disableProgramCache"));
+	specialisation::setEnabled(specialise && !cl::getConfigBool("disableSpecialisation"));
+	if (cl::config.find("weldEpsilon") != cl::config.end()) weld::setEpsilon(cl::getConfigFloat("weldEpsilon"));
+	if (!isnan(weldEpsilon)) weld::setEpsilon(weldEpsilon);
+	weld::setReorder(reorderMeshes && (cl::config.find("reorderMeshes") == cl::config.end() || cl::getConfigBool("reorderMeshes")));
+	if (cl::getConfigInt("lodLevels") > 0) lod::setLevels(cl::getConfigInt("lodLevels"));
+	if (lodLevels > 0) lod::setLevels(lodLevels);
+	if (cl::getConfigFloat("lodDistance") > 0.0f) lod::setDistanceFactor(cl::getConfigFloat("lodDistance"));
+	if (lodDistance > 0.0f) lod::setDistanceFactor(lodDistance);
+
+	// Adds a kernel argument, so it has to be known before the build
+	if (rayStats) cl::config["rayStats"] = "true";
+	// The heatmap counters are only compiled into HEATMAP builds, which the H key needs too
+	if (debugMode != DEBUG_MODE_SHADED) cl::config["heatmap"] = "true";
+
 	// Create empty texture for kernel output
-	outputTexture = createEmptyTexture(IMAGE_WIDTH, IMAGE_HEIGHT);
+	if (!headless) outputTexture = createEmptyTexture(imageWidth, imageHeight);
 
 	// Config
 	config.camera = { 0.0f, 0.0f, 0.0f };
 	config.screenDistance = 2.0f;
-	config.aspect = (float)WINDOW_WIDTH / (float)WINDOW_HEIGHT;
-	config.width = WINDOW_WIDTH;
-	config.height = WINDOW_HEIGHT;
-	config.bounces = 2;
-
-	//testscene();
-	//reflection_scene();
-	//scene1();
-	//scene2();
-	//benchmark_scene_baseline();
-	//benchmark_scene_spheres(300);
-	benchmark_scene_model();
+	config.aspect = (float)imageWidth / (float)imageHeight;
+	config.width = imageWidth;
+	config.height = imageHeight;
+	config.bounces = bounces;
+
+	if (!loadScene(sceneName)) {
+		glfwTerminate();
+		return -1;
+	}
+
+	// The ray tree only keeps child slots for the ray types the materials in the scene spawn
+	if (fullRayTree || cl::getConfigBool("fullRayTree")) {
+		setRayTree(FULL_RAY_TREE);
+	} else {
+		setRayTree(chooseRayTree(&world));
+	}
+	reportRayTree(bounces, (size_t)imageWidth * imageHeight);
+
+	if (useCPU) {
+		int result = runCPU();
+		finishProfiling();
+		glfwTerminate();
+		return result;
+	}
+
+	// The geometry moves to global memory when the scene doesn't fit the constant memory of the device. sceneGlobal in config.ini forces either.
+	if (cl::config.find("sceneGlobal") == cl::config.end()) cl::config["sceneGlobal"] = world.sceneFitsConstantMemory() ? "false" : "true";
+	if (cl::getConfigBool("sceneGlobal")) std::cout << "Scene geometry is in global memory" << std::endl;
+
+	setMortonDispatch(mortonDispatch || cl::getConfigBool("mortonDispatch"));
+	if (getMortonDispatch()) std::cout << "Dispatching pixels in " << MORTON_BLOCK_SIZE << "x" << MORTON_BLOCK_SIZE << " Z-order blocks" << std::endl;
+
+	if (stageLocal || cl::getConfigBool("stageLocal")) {
+		if (world.fitsLocalStaging()) {
+			setLocalStaging({ true, (cl_uint)world.getSpheres().size(), (cl_uint)world.getMaterialBuffer().size(), 0 });
+			std::cout << "Staging " << world.getSpheres().size() << " spheres and " << world.getMaterialBuffer().size() << " materials in local memory ("
+				<< world.getLocalStagingSize() << " of " << cl::device_info.local_mem_size << " bytes)" << std::endl;
+		} else if (world.getLocalStagingChunk() > 0) {
+			setLocalStaging({ false, 0, 0, world.getLocalStagingChunk() });
+			std::cout << "The sphere and material tables need " << world.getLocalStagingSize() << " bytes, more than half the "
+				<< cl::device_info.local_mem_size << " bytes of local memory, so primary rays stage the spheres " << world.getLocalStagingChunk() << " at a time" << std::endl;
+		} else {
+			std::cout << "Not even one sphere fits half the " << cl::device_info.local_mem_size << " bytes of local memory, so the tables stay in constant memory" << std::endl;
+		}
+	}
+
+	// The device's tuning file replaces the maths flags of config.ini. Its work-group shapes are set on the kernels below.
+	autotune::setEnabled(useTuning && autotuneFrames == 0 && !cl::getConfigBool("disableTuning"));
+	autotune::Tuning tuning;
+	const bool tuned = autotune::isEnabled() && autotune::load(&tuning);
+	if (tuned) {
+		std::cout << "Using tuning file " << autotune::getPath() << std::endl;
+		autotune::setMathFlags(tuning.mathFlags);
+	}
+
+	// Load and build OpenCL kernel sources
+	if (!buildCL()) {
+		std::cout << "Could not build OpenCL program." << std::endl;
+		glfwTerminate();
+		return -1;
+	}
 
 	world.create();
 
 	rarkernel.setWorldPtr(&world);
 	rarkernel.setPrimaryConfig(&config);
-	rarkernel.setVertexBuffer(world.getVertexBufferPtr());
 	rarkernel.setMaterialBuffer(world.getMaterialBufferPtr());
 	rarkernel.setSphereBuffer(world.getSphereBufferPtr());
-	rarkernel.setTriangleBuffer(world.getTriangleBufferPtr());
 	rarkernel.setModelBuffer(world.getModelBufferPtr());
-	rarkernel.setTriangleGridBuffer(world.getTriangleGridPtr());
-	rarkernel.setTrianlgeCountGridBuffer(world.getTriangleCountPtr());
+	rarkernel.setSceneBuffer(world.getSceneBufferPtr());
+	rarkernel.setRayStats(cl::getConfigBool("rayStats"));
+	if (cl::getConfigInt("tileSize") > 0) rarkernel.setTileSize(cl::getConfigInt("tileSize"));
+	if (tileSize >= 0) rarkernel.setTileSize(tileSize);
+	if (tuned) rarkernel.setLocalSize(tuning.trace.x, tuning.trace.y);
 
 	imagekernel.setRayBuffer(rarkernel.getRayBuffer());
-	imagekernel.setResolution(IMAGE_WIDTH, IMAGE_HEIGHT);
+	imagekernel.setTile(rarkernel.getActiveTile());
+	imagekernel.setResolution(imageWidth, imageHeight);
 	imagekernel.setTexture(outputTexture);
+	imagekernel.setHeadless(headless);
 	imagekernel.setRayConfig(rarkernel.getConfigBuffer());
 	imagekernel.setMaterialBuffer(world.getMaterialBufferPtr());
+	imagekernel.setDebugMode(debugMode);
+	imagekernel.setHeatmapScale(heatmapScale);
+	if (tuned) imagekernel.setLocalSize(tuning.resolve.x, tuning.resolve.y);
 
 	resetkernel.setConfig(&config);
 	resetkernel.setConfigBuffer(rarkernel.getConfigBuffer());
 	resetkernel.setRayBuffer(rarkernel.getRayBuffer());
+	resetkernel.setTile(rarkernel.getActiveTile());
 
 	clearimagekernel.setImage(imagekernel.getImageBufferPtr());
 	clearimagekernel.setImageConfig(imagekernel.getImageConfig());
@@ -619,15 +1374,62 @@ int main(void) {
 		kernels[i]->update(); // Update once to upload data to buffers
 	}
 
+	if (cl::memory::hasFailed()) {
+		std::cout << "Could not allocate the device buffers within the memory limits. Aborting." << std::endl;
+		cl::memory::printBreakdown();
+		return -1;
+	}
+	cl::memory::printBreakdown();
+
+	if (!kernelReportFile.empty()) writeKernelReport(kernelReportFile, kernels, sizeof(kernels) / sizeof(CLKernel*));
+
+	if (!microbenchFile.empty()) {
+		bool ok = microbench::run(&world, microbenchFile);
+		finishProfiling();
+		glfwTerminate();
+		return ok ? 0 : -1;
+	}
+
+	if (autotuneFrames > 0) {
+		bool ok = runAutotune();
+		finishProfiling();
+		glfwTerminate();
+		return ok ? 0 : -1;
+	}
+
+	// The generic kernels render until the specialised ones are built
+	if (specialisation::isEnabled()) specialisation::start(readKernelSources(), &world, &config);
+
 	// Run kernel struct test
 	runStructChecks();
 	runKernelTest(nullptr, nullptr);
 
+	std::default_random_engine reng;
+	std::uniform_real_distribution<float> sphere_dist(0.0f, 1.0f);
+	float* rands = new float[world.getSpheres().size()];
+	for (int i = 0; i < world.getSpheres().size(); ++i) {
+		rands[i] = sphere_dist(reng);
+	}
+
+	if (headless) {
+		if (statsFile.empty()) {
+			runHeadless(rands);
+		} else {
+			runHeadlessStats();
+		}
+		specialisation::wait();
+		finishProfiling();
+		delete[] rands;
+		glfwTerminate();
+		return 0;
+	}
+
 	// Setup OpenGL for rendering
 	// Create shader program
 	shaderProgram = createShaderProgram();
 	if (shaderProgram == 0) {
 		std::cout << "Couldn't create shader program." << std::endl;
+		specialisation::wait();
 		return -1;
 	}
 
@@ -642,17 +1444,12 @@ int main(void) {
 	// Time
 	double starttime = glfwGetTime();
 	double lastframetime = starttime;
+	double lastreporttime = starttime;
+	RayStats latestRayStats = {};
 
 	cl_event worldUpdateEvent = NULL, rarEvent = NULL, imageEvent = NULL, resetEvent = NULL, clearimgEvent = NULL;
 	cl_int worldUpdateStatus = -1, rarStatus = -1, imageStatus = -1;
 
-	std::default_random_engine reng;
-	std::uniform_real_distribution<float> sphere_dist(0.0f, 1.0f);
-	float* rands = new float[world.getSpheres().size()];
-	for (int i = 0; i < world.getSpheres().size(); ++i) {
-		rands[i] = sphere_dist(reng);
-	}
-
 	// Init benchmark stuff
 	constexpr size_t benchmark_reserve_size = 10 ^ 6;
 	benchmark_trace.reserve(benchmark_reserve_size);
@@ -665,30 +1462,53 @@ int main(void) {
 		float deltaTime = now - lastframetime;
 		lastframetime = now;
 
-		for (int i = 0; i < (int)world.getSpheres().size() - 1; ++i) {
-			world.getSphere(i)->position.y = world.getSphere(i)->radius + abs(sin(now + rands[i])) * 5.0f;
-		}
+		timeline::Scope frameScope("Frame");
+		timeline::Scope step("Animate spheres");
+		animateSpheres(now, rands);
+		useSpecialisedKernels();
 
 		//worldUpdateEvent = world.updateSpheres(0, world.getSpheres().size());
 
+		step.next("Camera update");
 		if(!benchmark_running) updateCameraMovement(deltaTime);
 
+		step.next("Upload config");
 		rarkernel.update();
 
 		//clearimgEvent = clearimagekernel.queue(0, NULL);
-		resetEvent = resetkernel.queue(0, NULL);
 
+		step.next("Wait trace");
 		if (benchmark_running) benchmark_trace_time = glfwGetTime();
-		rarEvent = rarkernel.queue(1, &resetEvent);
+		imageEvent = queueFrame(&rarEvent);
+		clFlush(cl::queue);
 		clWaitForEvents(1, &rarEvent);
 		if (benchmark_running) benchmark_trace.push_back(glfwGetTime() - benchmark_trace_time);
 
+		step.next("Wait resolve");
 		if (benchmark_running) benchmark_image_time = glfwGetTime();
-		imageEvent = imagekernel.queue(1, &rarEvent);
 		clWaitForEvents(1, &imageEvent);
 		if (benchmark_running) benchmark_image.push_back(glfwGetTime() - benchmark_image_time);
 
+		step.next("Finish");
 		clFinish(cl::queue);
+		clReleaseEvent(rarEvent);
+		clReleaseEvent(imageEvent);
+		cl::profiler::collect();
+
+		// Report ray stats once a second
+		rarkernel.readRayStats(&latestRayStats);
+		if (rarkernel.getRayStats() && now - lastreporttime >= 1.0) {
+			lastreporttime = now;
+			printRayStats(latestRayStats, deltaTime * 1000.0);
+		}
+
+		// Show the heatmap range in the title bar
+		cl_uint heatmapMax;
+		if (imagekernel.readHeatmapMax(&heatmapMax) && imagekernel.getDebugMode() != DEBUG_MODE_SHADED) {
+			std::ostringstream title;
+			title << WINDOW_TITLE << " - " << debugModeNames[imagekernel.getDebugMode()] << " heatmap, max " << heatmapMax << " per pixel, ramp top " << imagekernel.getHeatmapScale();
+			glfwSetWindowTitle(window, title.str().c_str());
+		}
 
 		if (benchmark_running) {
 			if (glfwGetTime() - benchmark_start_time >= BENCHMARK_TIME) {
@@ -698,6 +1518,7 @@ int main(void) {
 		}
 
 		// Render
+		step.next("GL draw");
 		glUseProgram(shaderProgram);
 
 		glUniform1i(samplerUniformLoc, 0);
@@ -707,9 +1528,14 @@ int main(void) {
 		glBindVertexArray(vao);
 		glDrawArrays(GL_TRIANGLES, 0, 6);
 
+		step.next("Swap buffers");
 		glfwSwapBuffers(window);
+		step.next("Poll events");
 		glfwPollEvents();
 	}
 
+	// The background build can't be left running while the program exits
+	specialisation::wait();
+	finishProfiling();
 	return 0;
 }
\ No newline at end of file